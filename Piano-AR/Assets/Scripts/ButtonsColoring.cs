@@ -116,7 +116,7 @@ public class ButtonsColoring : MonoBehaviour
 
     void HandlePress(int pressed)
     {
-        if (expected < 0) return;
+        if (expected < 0 || deviceDriven) return;
 
         if (pressed == expected)
         {
@@ -205,6 +205,21 @@ public class ButtonsColoring : MonoBehaviour
     
     private bool acceptInput = true;
 
+    // the ESP32 follows the melody (AR link frames): it says what's next and what was wrong
+    private bool deviceDriven = false;
+
+    public void FollowDevice(int next)
+    {
+        deviceDriven = true;
+        expected = (next >= 0 && next <= 11) ? next : -1;
+        RepaintAll();
+    }
+
+    public void ShowWrong(int index)
+    {
+        if (deviceDriven && ValidKey(index)) StartCoroutine(FlashWrong(index));
+    }
+
     public void OnTargetFoundEvent()
     {
         acceptInput = true;
@@ -2,6 +2,12 @@
 using System;
 using System.IO.Ports;
 
+// Reads key presses from the ESP32.
+// Line mode: note names printed on the USB console, mixed with the firmware's debug output.
+// Framed: the AR link UART of the firmware (components/ar_link) through a USB-serial adapter on its
+// TX pin, COBS frames with a CRC-16, one per note on/off; set portName to the adapter's port.
+// In framed mode the firmware also sends the guided melody's next note and wrong keys, and the
+// piano shows those instead of following its own song.
 [DisallowMultipleComponent]
 public class EspSerialReader : MonoBehaviour
 {
@@ -11,20 +17,38 @@ public class EspSerialReader : MonoBehaviour
     [SerializeField] int readTimeoutMs = 25;
     [SerializeField] bool logLines = false;
 
+    [Header("AR link")]
+    [Tooltip("COBS/CRC frames from the AR link UART; off = note names, one per line")]
+    [SerializeField] bool framed = false;
+    [SerializeField] int linkBaudRate = 921600;
+
+    const byte NoteOn = 1, NoteOff = 2, Hello = 3, MelodyNext = 4, MelodyWrong = 5;
+    const int PayloadSize = 8;                  // type, note, seq u16, time_us u32
+    const int FrameMax = PayloadSize + 2 + 2;   // + CRC, + COBS code byte and delimiter
+
     SerialPort serial;
     ButtonsColoring piano;
 
+    readonly byte[] readBuffer = new byte[4096];
+    readonly byte[] frame = new byte[FrameMax];
+    readonly byte[] payload = new byte[FrameMax];
+    int frameLength;
+    bool frameOverflow;
+    int lastSeq = -1;
+    int crcErrors, badFrames, gaps;
+
     void Awake()
     {
         piano = GetComponent<ButtonsColoring>();
-        serial = new SerialPort(portName, baudRate)
+        int baud = framed ? linkBaudRate : baudRate;
+        serial = new SerialPort(portName, baud)
         {
             NewLine = "\n",
             ReadTimeout = readTimeoutMs,
             DtrEnable = false,
             RtsEnable = false
         };
-        try { serial.Open(); Debug.Log($"[ESP] Opening serial port {portName} at {baudRate} baud."); }
+        try { serial.Open(); Debug.Log($"[ESP] Opening serial port {portName} at {baud} baud{(framed ? ", framed" : "")}."); }
         catch (Exception e) { Debug.LogWarning($"[ESP] Open({portName}) failed: {e.Message}"); }
     }
 
@@ -34,18 +58,108 @@ public class EspSerialReader : MonoBehaviour
 
         try
         {
-            while (serial.BytesToRead > 0)
+            if (framed) ReadFrames();
+            else ReadLines();
+        }
+        catch (TimeoutException) { /* non-blocking */ }
+        catch (Exception ex) { Debug.LogWarning($"[ESP] Read error: {ex.Message}"); }
+    }
+
+    void ReadLines()
+    {
+        while (serial.BytesToRead > 0)
+        {
+            string raw = serial.ReadLine();
+            string note = Normalize(raw);
+            if (string.IsNullOrEmpty(note)) continue;
+
+            if (logLines) Debug.Log("[ESP] " + note);
+            piano.SimulatePressByName(note);
+        }
+    }
+
+    // everything that arrived since the last frame, split at the 0x00 delimiters
+    void ReadFrames()
+    {
+        while (serial.BytesToRead > 0)
+        {
+            int n = serial.Read(readBuffer, 0, Math.Min(readBuffer.Length, serial.BytesToRead));
+            for (int i = 0; i < n; i++)
             {
-                string raw = serial.ReadLine();
-                string note = Normalize(raw);
-                if (string.IsNullOrEmpty(note)) continue;
+                byte b = readBuffer[i];
+                if (b == 0)
+                {
+                    if (frameOverflow) badFrames++;
+                    else if (frameLength > 0) HandleFrame();
+                    frameLength = 0;
+                    frameOverflow = false;
+                }
+                else if (frameLength < FrameMax) frame[frameLength++] = b;
+                else frameOverflow = true;   // noise, resync on the next delimiter
+            }
+        }
+    }
+
+    void HandleFrame()
+    {
+        int length = CobsDecode(frame, frameLength, payload);
+        if (length != PayloadSize + 2) { badFrames++; return; }
+        if (Crc16(payload, PayloadSize) != (payload[8] | payload[9] << 8)) { crcErrors++; return; }
+
+        byte type = payload[0];
+        int note = payload[1];
+        int seq = payload[2] | payload[3] << 8;
+        if (type == Hello)
+        {
+            Debug.Log($"[ESP] AR link protocol {note} (crc errors {crcErrors}, bad frames {badFrames}, missed {gaps})");
+        }
+        else if (lastSeq >= 0 && ((seq - lastSeq - 1) & 0xFFFF) != 0)
+        {
+            gaps += (seq - lastSeq - 1) & 0xFFFF;
+            Debug.LogWarning($"[ESP] {(seq - lastSeq - 1) & 0xFFFF} note events lost");
+        }
+        lastSeq = seq;
+
+        if (logLines) Debug.Log($"[ESP] #{seq} type {type} {note}");
+        if (type == NoteOn) piano.SimulatePress(note);
+        else if (type == MelodyNext) piano.FollowDevice(note == 0xFF ? -1 : note);
+        else if (type == MelodyWrong) piano.ShowWrong(note);
+    }
 
-                if (logLines) Debug.Log("[ESP] " + note);
-                piano.SimulatePressByName(note); 
+    // returns the decoded length, -1 if the frame isn't valid COBS
+    static int CobsDecode(byte[] input, int length, byte[] output)
+    {
+        int o = 0;
+        for (int i = 0; i < length;)
+        {
+            int code = input[i];
+            if (code == 0 || i + code > length) return -1;
+            for (int j = 1; j < code; j++)
+            {
+                if (o >= output.Length) return -1;
+                output[o++] = input[i + j];
+            }
+            i += code;
+            if (code < 0xFF && i < length)
+            {
+                if (o >= output.Length) return -1;
+                output[o++] = 0;
             }
         }
-        catch (TimeoutException) { /* non-blocking */ }
-        catch (Exception ex) { Debug.LogWarning($"[ESP] Read error: {ex.Message}"); }
+        return o;
+    }
+
+    // CRC-16/CCITT-FALSE, same as the firmware
+    static int Crc16(byte[] data, int length)
+    {
+        int crc = 0xFFFF;
+        for (int i = 0; i < length; i++)
+        {
+            crc ^= data[i] << 8;
+            for (int b = 0; b < 8; b++)
+                crc = (crc & 0x8000) != 0 ? ((crc << 1) ^ 0x1021) & 0xFFFF : (crc << 1) & 0xFFFF;
+        }
+        return crc;
     }
 
     void OnApplicationQuit()
@@ -74,6 +74,7 @@ public class AIAssistantController : ControllerBase
     [HttpPost("esp-message")]
     [ProducesResponseType(typeof(object), 200)]
     [ProducesResponseType(typeof(ErrorResponseDTO), 400)]
+    [ProducesResponseType(typeof(ErrorResponseDTO), 503)]
     public async Task<ActionResult> PostEspMessage([FromBody] EspMessageRequestDTO request)
     {
         if (!_parametricFunctions.ObjectExistsAndHasNoNullPublicProperties(request))
@@ -106,7 +107,8 @@ public class AIAssistantController : ControllerBase
         }
         catch (Exception ex)
         {
-            return BadRequest(new ErrorResponseDTO()
+            // 503 so the ESP32 keeps the recording queued and retries later
+            return StatusCode(503, new ErrorResponseDTO()
             {
                 TextErrorTitle = "AIAssistantError",
                 TextErrorMessage = ex.Message,
@@ -114,4 +116,62 @@ public class AIAssistantController : ControllerBase
             });
         }
     }
+
+    [HttpPost("esp-message-batch")]
+    [ProducesResponseType(typeof(object), 200)]
+    [ProducesResponseType(typeof(ErrorResponseDTO), 400)]
+    [ProducesResponseType(typeof(ErrorResponseDTO), 503)]
+    public async Task<ActionResult> PostEspMessageBatch([FromBody] EspMessageBatchRequestDTO request)
+    {
+        if (!_parametricFunctions.ObjectExistsAndHasNoNullPublicProperties(request) ||
+            request.Messages.Count == 0 ||
+            request.Messages.Any(message => !_parametricFunctions.ObjectExistsAndHasNoNullPublicProperties(message)))
+        {
+            return BadRequest(
+                new ErrorResponseDTO()
+                {
+                    TextErrorTitle = "AtLeastOneNullParameter",
+                    TextErrorMessage = "Some parameters are null/missing.",
+                    TextErrorTrace = _parametricFunctions.GetCallerTrace()
+                }
+            );
+        }
+
+        // One answer per recording, in the order they were sent (queued offline on the ESP32).
+        // Stops at the first failed AI call: the answers before it are returned, the ESP32 removes
+        // that many from its queue and retries only the rest, so no recording is asked twice.
+        var responses = new List<string>();
+        foreach (var message in request.Messages)
+        {
+            string messageToSendToAssistant = $"Device {message.DeviceId} reports: {message.Message}. " +
+                                             _appConfigurationsService.Instruction;
+            try
+            {
+                responses.Add(await _aIAssistantService.SendMessageAndGetResponseAsync(messageToSendToAssistant));
+            }
+            catch (Exception ex)
+            {
+                if (responses.Count > 0)
+                {
+                    break;
+                }
+
+                // 503 so the ESP32 keeps the recordings queued and retries later
+                return StatusCode(503, new ErrorResponseDTO()
+                {
+                    TextErrorTitle = "AIAssistantError",
+                    TextErrorMessage = ex.Message,
+                    TextErrorTrace = _parametricFunctions.GetCallerTrace()
+                });
+            }
+        }
+
+        return Ok(new {
+            success = true,
+            complete = responses.Count == request.Messages.Count,
+            responses,
+            timestamp = DateTime.UtcNow,
+            deviceId = request.DeviceId
+        });
+    }
 }
\ No newline at end of file
@@ -0,0 +1,7 @@
+namespace HCI.AIAssistant.API.Models.DTOs.IAssistantController;
+
+public class EspMessageBatchRequestDTO
+{
+    public string DeviceId { get; set; } = string.Empty;
+    public List<EspMessageRequestDTO> Messages { get; set; } = new();
+}
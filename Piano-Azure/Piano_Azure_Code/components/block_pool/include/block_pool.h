@@ -0,0 +1,59 @@
+#pragma once
+#include "esp_err.h"
+#include "prom_sink.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// Fixed-size block pools in static RAM, for buffers the hot paths would otherwise put on the
+// stack or the heap. Alloc and free are one compare-and-swap on the free list head (no mutex,
+// no critical section), so they are safe from any task on either core and from ISRs.
+// A CAS only retries when another alloc/free got in between; the retries and the slowest
+// alloc seen are counted, so the worst case is measured instead of guessed.
+
+#define BLOCK_POOL_ALIGN  8    // every block starts on this boundary
+#define BLOCK_POOL_MAX    8    // registered pools
+
+typedef struct {
+    const char *name;           // Prometheus label, e.g. "sse_frames"
+    uint64_t *storage;          // count blocks of block_size bytes
+    atomic_uint_least16_t *links;  // next free block + 1 per block, 0 = end of list
+    uint16_t block_size;
+    uint16_t count;
+    atomic_uint_least32_t head;    // generation << 16 | first free block + 1, 0 = pool empty
+    atomic_uint_least32_t in_use;
+    atomic_uint_least32_t peak;
+    atomic_uint_least32_t allocs;
+    atomic_uint_least32_t failures;    // alloc found the pool empty
+    atomic_uint_least32_t retries;     // CAS lost to another core / task
+    atomic_uint_least32_t max_cycles;  // slowest alloc, CPU cycles
+} block_pool_t;
+
+#define BLOCK_POOL_WORDS(size) (((size) + BLOCK_POOL_ALIGN - 1) / BLOCK_POOL_ALIGN)
+
+// static pool of n blocks of at least size bytes, call block_pool_init() before use
+#define BLOCK_POOL_DEFINE(var, label, size, n) \
+    _Static_assert((n) > 0 && (n) < 0xFFFF && BLOCK_POOL_WORDS(size) * BLOCK_POOL_ALIGN <= 0xFFFF, \
+                   "block pool " label " is too big"); \
+    static uint64_t var##_storage[(n) * BLOCK_POOL_WORDS(size)]; \
+    static atomic_uint_least16_t var##_links[(n)]; \
+    static block_pool_t var = { .name = (label), .storage = var##_storage, .links = var##_links, \
+                                .block_size = BLOCK_POOL_WORDS(size) * BLOCK_POOL_ALIGN, .count = (n) }
+
+// chain all blocks into the free list and add the pool to the export, pool must stay valid (static)
+esp_err_t block_pool_init(block_pool_t *pool);
+
+// a free block, NULL if all are in use (never waits)
+void *block_pool_alloc(block_pool_t *pool);
+
+// give a block back, ESP_ERR_INVALID_ARG if it doesn't belong to the pool
+esp_err_t block_pool_free(block_pool_t *pool, void *block);
+
+// heap allocations since boot (all tasks, WiFi and lwIP included), 0 without CONFIG_HEAP_USE_HOOKS
+uint32_t block_pool_heap_allocs(void);
+
+// usage counters of all registered pools, and the heap allocation count, as Prometheus metrics
+esp_err_t block_pool_write_prometheus(prom_sink_t sink, void *ctx);
+
+// one line per registered pool
+void block_pool_print(void);
@@ -1,7 +1,20 @@
 #include "buttons.h"
+#include "trace.h"
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_sleep.h"
 
 static const char *TAG = "buttons";
 
+// buttons_wait(): the pins that wake it, the task waiting and when a key woke it
+static int wake_pins[6];
+static int wake_pin_count = 0;
+static int wake_key_pins = 0;   // the keys and INT, buttons_wake_add() pins after them
+static TaskHandle_t waiter = NULL;
+static volatile int64_t woke_us = 0;
+
 esp_err_t buttons_init(void)
 {
     // init GPIO buttons
@@ -61,6 +74,7 @@ esp_err_t buttons_init(void)
 
 uint16_t buttons_read(void)
 {
+    static uint8_t last_pcf = 0xFF;   // all open
     uint16_t state = 0;
 
     // read GPIO buttons 
@@ -73,12 +87,15 @@ uint16_t buttons_read(void)
 
     // read PCF8574 buttons 
     uint8_t pcf_data= 0;
+    TRACE_BEGIN("i2c read");
     esp_err_t ret  = i2c_master_read_from_device(I2C_NUM, PCF8574_ADDR, &pcf_data, 1, pdMS_TO_TICKS(I2C_TIMEOUT_MS));
+    TRACE_END("i2c read");
     if (ret != ESP_OK) 
     {
         ESP_LOGW(TAG, "PCF8574 read failed: %d", ret);
-        return state;
+        pcf_data = last_pcf;
     }
+    last_pcf = pcf_data;
 
     for(int i=0;i<8;i++)
     {
@@ -114,4 +131,151 @@ void buttons_print(void)
             printf("Button %d pressed (PCF P%d)\n", button_num, pcf_pin);
     }
 }
-        
\ No newline at end of file
+        
+
+void buttons_trace(void)
+{
+    int64_t start = esp_timer_get_time();
+    uint16_t last = buttons_read();
+    int changes = 0;
+
+    printf("keytrace 0 %03x\n", last);
+    for (int ms = 0; ms < BUTTONS_TRACE_MS; ms++)
+    {
+        vTaskDelay(1);
+        uint16_t state = buttons_read();
+        if (state != last)
+        {
+            printf("keytrace %lld %03x\n", (long long)(esp_timer_get_time() - start), state);
+            last = state;
+            changes++;
+        }
+    }
+    printf("keytrace end %d\n", changes);
+}
+
+// a wake pin went low: level interrupts fire for as long as it stays low, so all of them are
+// off until the next wait
+static void on_wake_pin(void *arg)
+{
+    for (int i = 0; i < wake_pin_count; i++)
+        gpio_intr_disable(wake_pins[i]);
+    if (woke_us == 0)
+        woke_us = esp_timer_get_time();
+
+    BaseType_t woken = pdFALSE;
+    if (waiter != NULL)
+        vTaskNotifyGiveFromISR(waiter, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+esp_err_t buttons_wake_init(int int_gpio)
+{
+    if (int_gpio >= 0)
+    {
+        gpio_config_t int_conf =
+        {
+            .pin_bit_mask = 1ULL << int_gpio,
+            .mode = GPIO_MODE_INPUT,
+            .pull_up_en = GPIO_PULLUP_ENABLE,   // INT is open drain
+            .pull_down_en = GPIO_PULLDOWN_DISABLE,
+            .intr_type = GPIO_INTR_DISABLE
+        };
+        esp_err_t ret = gpio_config(&int_conf);
+        if (ret != ESP_OK)
+            return ret;
+    }
+
+    esp_err_t ret = gpio_install_isr_service(0);
+    if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE)   // already installed is fine
+    {
+        ESP_LOGE(TAG, "gpio_install_isr_service failed: %d", ret);
+        return ret;
+    }
+
+    wake_pin_count = 0;
+    for (int i = 0; i < 4; i++)
+        wake_pins[wake_pin_count++] = gpio_buttons[i];
+    if (int_gpio >= 0)
+        wake_pins[wake_pin_count++] = int_gpio;
+
+    for (int i = 0; i < wake_pin_count; i++)
+    {
+        gpio_set_intr_type(wake_pins[i], GPIO_INTR_LOW_LEVEL);
+        gpio_intr_disable(wake_pins[i]);
+        ret = gpio_isr_handler_add(wake_pins[i], on_wake_pin, NULL);
+        if (ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "gpio_isr_handler_add(%d) failed: %d", wake_pins[i], ret);
+            return ret;
+        }
+    }
+
+    wake_key_pins = wake_pin_count;
+
+    ret = esp_sleep_enable_gpio_wakeup();
+    if (ret == ESP_OK)
+        ESP_LOGI(TAG, "Keys wake from sleep (expander INT %s)", int_gpio >= 0 ? "wired" : "not wired");
+    return ret;
+}
+
+esp_err_t buttons_wake_add(int gpio)
+{
+    if (wake_pin_count >= (int)(sizeof(wake_pins) / sizeof(wake_pins[0])))
+        return ESP_ERR_NO_MEM;
+
+    gpio_config_t conf =
+    {
+        .pin_bit_mask = 1ULL << gpio,
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_ENABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_DISABLE
+    };
+    esp_err_t ret = gpio_config(&conf);
+    if (ret != ESP_OK)
+        return ret;
+
+    gpio_set_intr_type(gpio, GPIO_INTR_LOW_LEVEL);
+    gpio_intr_disable(gpio);
+    ret = gpio_isr_handler_add(gpio, on_wake_pin, NULL);
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "gpio_isr_handler_add(%d) failed: %d", gpio, ret);
+        return ret;
+    }
+    wake_pins[wake_pin_count++] = gpio;
+    return ESP_OK;
+}
+
+int64_t buttons_wait(TickType_t timeout)
+{
+    waiter = xTaskGetCurrentTaskHandle();
+    ulTaskNotifyTake(pdTRUE, 0);   // a buttons_wake() from before
+    woke_us = 0;
+
+    // a pin already low fires right away; only now can it wake the chip, a held key would keep
+    // light sleep from ever starting
+    for (int i = 0; i < wake_pin_count; i++)
+    {
+        if (i >= wake_key_pins && !gpio_get_level(wake_pins[i]))
+            continue;   // an added button still down, its task polls it meanwhile
+        gpio_wakeup_enable(wake_pins[i], GPIO_INTR_LOW_LEVEL);
+        gpio_intr_enable(wake_pins[i]);
+    }
+
+    ulTaskNotifyTake(pdTRUE, timeout);
+
+    for (int i = 0; i < wake_pin_count; i++)
+    {
+        gpio_intr_disable(wake_pins[i]);
+        gpio_wakeup_disable(wake_pins[i]);
+    }
+    return woke_us;
+}
+
+void buttons_wake(void)
+{
+    if (waiter != NULL)
+        xTaskNotifyGive(waiter);
+}
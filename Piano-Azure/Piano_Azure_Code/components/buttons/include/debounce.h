@@ -0,0 +1,33 @@
+#pragma once
+#include <stdint.h>
+
+// Per-key debouncer for all 12 keys at once, fed one raw sample per scan.
+// A press counts on its first closed sample (no added latency); a release only after the key has
+// read open for its hold-off, and for one more hold-off after a release the key can't be pressed
+// again, so bounce on either edge never makes a second note. A real re-press inside that window
+// sounds when it ends.
+// The per-key counters are vertical: bit b of every key's count lives in count[b], so one update
+// is a handful of AND/XOR on 16 bit words whatever the number of keys changing.
+// No ESP-IDF headers: tools/debounce_replay.py builds this file on the host.
+
+#define DEBOUNCE_BITS       4
+#define DEBOUNCE_MAX_SCANS  ((1 << DEBOUNCE_BITS) - 1)   // longest hold-off, in scans
+
+typedef struct {
+    uint16_t state;                  // debounced keys, 1 = down
+    uint16_t locked;                 // released less than a hold-off ago, presses ignored
+    uint16_t count[DEBOUNCE_BITS];   // scans the raw input has disagreed with state, or since release
+    uint16_t limit[DEBOUNCE_BITS];   // per-key release hold-off in scans, same layout
+} debounce_t;
+
+// all keys up, every key with the same hold-off
+void debounce_init(debounce_t *d, int holdoff_scans);
+
+// hold-off of one key, clamped to 1..DEBOUNCE_MAX_SCANS
+void debounce_set_holdoff(debounce_t *d, int key, int scans);
+
+// "key:ms,key:ms" (e.g. "3:30,7:25") on top of the defaults; returns the keys set, -1 on a bad entry
+int debounce_parse_holdoffs(debounce_t *d, const char *spec, int scan_ms);
+
+// one scan, raw bit i = key i closed; returns the keys whose debounced state changed
+uint16_t debounce_update(debounce_t *d, uint16_t raw);
@@ -1,7 +1,230 @@
 #include "buzzer.h"
+#include "driver/gptimer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_cpu.h"
+#include "esp_attr.h"
+#include "esp_pm.h"
+#include "sys_stats.h"
 
 static const char *TAG = "buzzer";
 
+#define TIMER_HZ        1000000
+#define LEVEL_ONE       32768          // Q15 envelope level
+#define NOTIFY_TICK     (1 << 0)       // the control timer
+#define NOTIFY_CHANGE   (1 << 1)       // a call below
+#define SINE_STEPS      64
+#define CENT_Q26        38763          // ln(2)/1200 << 26, the frequency change of one cent
+
+// a quarter of a sine is enough, the rest is mirrored; Q15
+static const int16_t sine_quarter[SINE_STEPS / 4 + 1] = {
+    0, 3212, 6393, 9512, 12539, 15446, 18204, 20787, 23170, 25330, 27245, 28898, 30273, 31356, 32137, 32609, 32767
+};
+
+static gptimer_handle_t timer;
+#if CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t pm_lock;   // the LEDC runs from the APB clock: held while a note sounds
+#endif
+static TaskHandle_t task;
+static volatile int64_t tick_us = 0;   // when the last alarm fired
+
+// what the calls ask for, taken by the control task
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t want_mhz = 0;
+static bool want_gate = false;
+static bool want_jump = false;
+static bool want_new = false;          // a play/stop/tone not taken yet (vibrato changes wake the task too)
+static int glide_ticks = 0, attack_ticks = 0, release_ticks = 0;
+static int vibrato_cents = 0;
+static uint32_t vibrato_step = 0;      // sine phase per tick, 32 bit turn
+
+static buzzer_stats_t stats;
+
+// LEDC divider for a frequency: APB 80 MHz / 1024 duty steps, 8 fraction bits
+static uint32_t divider_for(uint32_t mhz)
+{
+    return (uint32_t)(20000000000ULL / mhz);
+}
+
+static int32_t sine(uint32_t phase)
+{
+    uint32_t i = phase >> (32 - 6);   // 0..63
+    uint32_t q = i & (SINE_STEPS / 4 - 1);
+    int32_t v;
+    switch (i / (SINE_STEPS / 4))
+    {
+    case 0: v = sine_quarter[q]; break;
+    case 1: v = sine_quarter[SINE_STEPS / 4 - q]; break;
+    case 2: v = -sine_quarter[q]; break;
+    default: v = -sine_quarter[SINE_STEPS / 4 - q]; break;
+    }
+    return v;
+}
+
+static bool IRAM_ATTR on_tick(gptimer_handle_t t, const gptimer_alarm_event_data_t *edata, void *ctx)
+{
+    BaseType_t woken = pdFALSE;
+    tick_us = esp_timer_get_time();
+    xTaskNotifyFromISR(task, NOTIFY_TICK, eSetBits, &woken);
+    return woken == pdTRUE;
+}
+
+static void control_task(void *arg)
+{
+    uint32_t cur_mhz = BUZZER_MIN_HZ * 1000;
+    uint32_t target_mhz = cur_mhz;
+    int32_t glide_step = 0;            // mHz per tick
+    int glide_left = 0;
+    int32_t level = 0;                 // Q15
+    int32_t level_step = 0;            // per tick, + attack, - release
+    bool gate = false;
+    int depth = 0;                     // vibrato cents
+    uint32_t phase = 0, phase_step = 0;
+    uint32_t written_divider = 0;
+    uint32_t written_duty = 0;
+    bool running = false;
+#if CONFIG_PM_ENABLE
+    bool sounding = false;             // pm_lock held
+#endif
+
+    while (1)
+    {
+        uint32_t bits;
+        xTaskNotifyWait(0, NOTIFY_TICK | NOTIFY_CHANGE, &bits, portMAX_DELAY);
+        esp_cpu_cycle_count_t start = esp_cpu_get_cycle_count();
+
+        if (bits & NOTIFY_CHANGE)
+        {
+            portENTER_CRITICAL(&lock);
+            bool fresh = want_new;
+            uint32_t want = want_mhz;
+            bool gate_on = want_gate;
+            bool jump = want_jump;
+            int glide = glide_ticks, attack = attack_ticks, release = release_ticks;
+            depth = vibrato_cents;
+            phase_step = vibrato_step;
+            want_jump = false;
+            want_new = false;
+            portEXIT_CRITICAL(&lock);
+
+            if (!fresh)
+                ;   // only the vibrato changed
+            else if (jump)
+            {
+                // the click: no envelope, no glide, and silence means silence now
+                glide_left = 0;
+                level_step = 0;
+                gate = want != 0;
+                level = gate ? LEVEL_ONE : 0;
+                if (gate)
+                    cur_mhz = target_mhz = want;
+            }
+            else if (gate_on)
+            {
+                target_mhz = want;
+                glide_left = level > 0 ? glide : 0;
+                if (glide_left > 0)
+                    glide_step = ((int32_t)target_mhz - (int32_t)cur_mhz) / glide_left;
+                else
+                    cur_mhz = target_mhz;   // from silence a note starts on its pitch
+                level_step = attack > 0 ? LEVEL_ONE / attack : LEVEL_ONE;
+                if (level == 0)
+                    level = level_step < LEVEL_ONE ? level_step : LEVEL_ONE;   // heard now, not a tick later
+                gate = true;
+            }
+            else if (gate)
+            {
+                level_step = -(release > 0 ? LEVEL_ONE / release : LEVEL_ONE);
+                gate = false;
+            }
+        }
+
+        if (bits & NOTIFY_TICK)
+        {
+            int64_t late = esp_timer_get_time() - tick_us;
+            if (late > stats.late_us_max)
+                stats.late_us_max = late;
+
+            if (glide_left > 0)
+                cur_mhz = --glide_left > 0 ? cur_mhz + glide_step : target_mhz;   // lands exactly
+            level += level_step;
+            if (level >= LEVEL_ONE)
+            {
+                level = LEVEL_ONE;
+                level_step = 0;
+            }
+            else if (level <= 0)
+            {
+                level = 0;
+                level_step = 0;
+            }
+            phase += phase_step;
+        }
+
+        // vibrato on top of the glide, in Q8 cents
+        uint32_t out_mhz = cur_mhz;
+        if (depth != 0)
+        {
+            int32_t cents_q8 = (depth * sine(phase)) >> 7;
+            out_mhz += (int32_t)(((int64_t)cur_mhz * cents_q8 * CENT_Q26) >> 34);
+        }
+
+#if CONFIG_PM_ENABLE
+        if (level > 0 && !sounding)
+            esp_pm_lock_acquire(pm_lock);
+#endif
+
+        uint32_t divider = divider_for(out_mhz);
+        if (level > 0 && divider != written_divider)
+        {
+            ledc_timer_set(BUZZER_LEDC_MODE, BUZZER_LEDC_TIMER, divider, BUZZER_DUTY_RESOLUTION, LEDC_APB_CLK);
+            written_divider = divider;
+            stats.freq_writes++;
+        }
+        uint32_t duty = (uint32_t)level * (BUZZER_MAX_DUTY / 2) / LEVEL_ONE;   // 50% is the loudest
+        if (duty != written_duty)
+        {
+            ledc_set_duty(BUZZER_LEDC_MODE, BUZZER_LEDC_CHANNEL, duty);
+            ledc_update_duty(BUZZER_LEDC_MODE, BUZZER_LEDC_CHANNEL);
+            written_duty = duty;
+            stats.duty_writes++;
+        }
+
+#if CONFIG_PM_ENABLE
+        if (level == 0 && sounding)
+            esp_pm_lock_release(pm_lock);   // the duty is 0 now, the clock may slow or stop
+        sounding = level > 0;
+#endif
+
+        // ticks only while something moves
+        bool moving = level_step != 0 || glide_left > 0 || (level > 0 && depth != 0);
+        // enabled only while it ticks, an enabled GPTimer holds its own power management lock
+        if (moving && !running)
+        {
+            gptimer_set_raw_count(timer, 0);
+            gptimer_enable(timer);
+            gptimer_start(timer);
+            running = true;
+        }
+        else if (!moving && running)
+        {
+            gptimer_stop(timer);
+            gptimer_disable(timer);
+            running = false;
+        }
+
+        if (bits & NOTIFY_TICK)
+        {
+            uint32_t cycles = esp_cpu_get_cycle_count() - start;
+            stats.ticks++;
+            stats.cycles_total += cycles;
+            if (cycles > stats.cycles_max)
+                stats.cycles_max = cycles;
+        }
+    }
+}
+
 esp_err_t buzzer_init(void) 
 {
     ledc_timer_config_t timer_conf = 
@@ -10,7 +233,7 @@ esp_err_t buzzer_init(void)
         .timer_num = BUZZER_LEDC_TIMER,
         .duty_resolution = BUZZER_DUTY_RESOLUTION,
         .freq_hz = 262,
-        .clk_cfg = LEDC_AUTO_CLK
+        .clk_cfg = LEDC_USE_APB_CLK   // the tick computes the divider from it
     };
     ledc_timer_config(&timer_conf);
 
@@ -26,24 +249,108 @@ esp_err_t buzzer_init(void)
     };
     ledc_channel_config(&channel_conf);
 
+    static StackType_t stack[BUZZER_CTRL_STACK_SIZE];
+    static StaticTask_t tcb;
+    task = xTaskCreateStaticPinnedToCore(control_task, "Tone Task", BUZZER_CTRL_STACK_SIZE, NULL,
+                                         BUZZER_CTRL_PRIORITY, stack, &tcb, xPortGetCoreID());
+    if (task == NULL)
+        return ESP_ERR_NO_MEM;
+    sys_stats_watch_stack(task, "Tone Task", BUZZER_CTRL_STACK_SIZE);
+
+    gptimer_config_t config = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = TIMER_HZ,
+    };
+    gptimer_event_callbacks_t callbacks = { .on_alarm = on_tick };
+    gptimer_alarm_config_t alarm = {
+        .alarm_count = BUZZER_TICK_US,
+        .reload_count = 0,
+        .flags.auto_reload_on_alarm = true,
+    };
+    esp_err_t err = gptimer_new_timer(&config, &timer);
+    if (err == ESP_OK)
+        err = gptimer_register_event_callbacks(timer, &callbacks, NULL);
+    if (err == ESP_OK)
+        err = gptimer_set_alarm_action(timer, &alarm);
+#if CONFIG_PM_ENABLE
+    if (err == ESP_OK)
+        err = esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "buzzer", &pm_lock);
+#endif
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "control timer setup failed: %d", err);
+        return err;
+    }
+
     ESP_LOGI(TAG, "Buzzer initialized on GPIO %d", BUZZER_GPIO);
     return ESP_OK;
 }
-// to play between 262 and 684 for the sound to not be distorted or weaker
-esp_err_t buzzer_play(uint32_t freq_hz) 
+
+static uint32_t clamp_mhz(uint32_t freq_hz)
 {
-    if(freq_hz < 262) freq_hz = 262;
-    if(freq_hz > 694) freq_hz = 694;
+    if (freq_hz < BUZZER_MIN_HZ) freq_hz = BUZZER_MIN_HZ;
+    if (freq_hz > BUZZER_MAX_HZ) freq_hz = BUZZER_MAX_HZ;
+    return freq_hz * 1000;
+}
 
-    ledc_set_freq(BUZZER_LEDC_MODE, BUZZER_LEDC_TIMER, freq_hz);
-    ledc_set_duty(BUZZER_LEDC_MODE, BUZZER_LEDC_CHANNEL, BUZZER_MAX_DUTY / 2); // half of 10-bit
-    ledc_update_duty(BUZZER_LEDC_MODE, BUZZER_LEDC_CHANNEL);
+static esp_err_t post(uint32_t mhz, bool gate, bool jump)
+{
+    if (task == NULL)
+        return ESP_ERR_INVALID_STATE;
+    portENTER_CRITICAL(&lock);
+    if (gate || jump)
+        want_mhz = mhz;
+    want_gate = gate;
+    want_jump = jump;
+    want_new = true;
+    portEXIT_CRITICAL(&lock);
+    xTaskNotify(task, NOTIFY_CHANGE, eSetBits);
     return ESP_OK;
 }
 
+// to play between 262 and 694 for the sound to not be distorted or weaker
+esp_err_t buzzer_play(uint32_t freq_hz) 
+{
+    return post(clamp_mhz(freq_hz), true, false);
+}
+
 esp_err_t buzzer_stop(void) 
 {
-    ledc_set_duty(BUZZER_LEDC_MODE, BUZZER_LEDC_CHANNEL, 0);
-    ledc_update_duty(BUZZER_LEDC_MODE, BUZZER_LEDC_CHANNEL);
+    return post(0, false, false);
+}
+
+esp_err_t buzzer_tone(uint32_t freq_hz)
+{
+    return post(freq_hz ? clamp_mhz(freq_hz) : 0, freq_hz != 0, true);
+}
+
+esp_err_t buzzer_shape(int glide_ms, int attack_ms, int release_ms)
+{
+    if (glide_ms < 0 || attack_ms < 0 || release_ms < 0)
+        return ESP_ERR_INVALID_ARG;
+    portENTER_CRITICAL(&lock);
+    glide_ticks = glide_ms * 1000 / BUZZER_TICK_US;
+    attack_ticks = attack_ms * 1000 / BUZZER_TICK_US;
+    release_ticks = release_ms * 1000 / BUZZER_TICK_US;
+    portEXIT_CRITICAL(&lock);
     return ESP_OK;
 }
+
+esp_err_t buzzer_vibrato(int depth_cents, int rate_hz)
+{
+    if (depth_cents < 0 || depth_cents > 100 || rate_hz < 0 || rate_hz > 20)
+        return ESP_ERR_INVALID_ARG;
+    portENTER_CRITICAL(&lock);
+    vibrato_cents = depth_cents;
+    vibrato_step = (uint32_t)(((uint64_t)rate_hz << 32) * BUZZER_TICK_US / 1000000);
+    portEXIT_CRITICAL(&lock);
+    if (task != NULL)
+        xTaskNotify(task, NOTIFY_CHANGE, eSetBits);   // starts the ticks under a held note
+    return ESP_OK;
+}
+
+void buzzer_get_stats(buzzer_stats_t *out)
+{
+    *out = stats;
+}
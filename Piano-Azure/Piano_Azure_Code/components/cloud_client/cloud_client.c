@@ -0,0 +1,288 @@
+#include "cloud_client.h"
+#include "esp_crt_bundle.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include <string.h>
+
+static const char *TAG = "cloud";
+
+static esp_http_client_handle_t client = NULL;
+static cloud_client_stats_t stats = {0};
+
+static bool connection_open = false;    // updated from the client events
+static bool new_session = false;        // a connect happened during the current request
+static bool reused = false;             // the current request went out on a kept-alive connection
+static bool stale = false;              // ... and failed before any response
+static int64_t request_start_us = 0;
+
+// chunked body: "<hex size>\r\n" is written in front of the data, "\r\n" after it
+#define CHUNK_HEAD_MAX 6
+static char chunk_buf[CHUNK_HEAD_MAX + CLOUD_CLIENT_CHUNK_SIZE + 2];
+static int chunk_used = 0;
+static bool chunked = false;
+static uint32_t body_bytes = 0;
+
+static esp_err_t cloud_event_handler(esp_http_client_event_t *evt)
+{
+    switch (evt->event_id)
+    {
+        case HTTP_EVENT_ON_CONNECTED:
+        {
+            // only dispatched when a new TCP + TLS session had to be set up
+            uint32_t ms = (uint32_t)((esp_timer_get_time() - request_start_us) / 1000);
+            connection_open = true;
+            new_session = true;
+            stats.handshakes++;
+            stats.last_handshake_ms = ms;
+            if (ms > stats.max_handshake_ms)
+                stats.max_handshake_ms = ms;
+            break;
+        }
+        case HTTP_EVENT_DISCONNECTED:
+            connection_open = false;
+            break;
+        default:
+            break;
+    }
+    return ESP_OK;
+}
+
+esp_err_t cloud_client_init(const cloud_client_config_t *config)
+{
+    if (client != NULL)
+        return ESP_OK;
+
+    esp_http_client_config_t http_conf =
+    {
+        .url = config->url,
+        .method = HTTP_METHOD_POST,
+        .timeout_ms = config->timeout_ms > 0 ? config->timeout_ms : CLOUD_CLIENT_TIMEOUT_MS,
+        .event_handler = cloud_event_handler,
+        .disable_auto_redirect = false,
+        .max_redirection_count = 3,
+        .is_async = false,
+        .keep_alive_enable = true,  // TCP keep-alive probes so a dead link is noticed
+        .cert_pem = config->cert_pem,
+        .crt_bundle_attach = config->cert_pem ? NULL : esp_crt_bundle_attach,
+#if CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+        .save_client_session = true, // resume the TLS session when the server closed the socket
+#endif
+    };
+
+    client = esp_http_client_init(&http_conf);
+    if (client == NULL)
+    {
+        ESP_LOGE(TAG, "esp_http_client_init failed");
+        return ESP_FAIL;
+    }
+    esp_http_client_set_header(client, "Content-Type", "application/json");
+
+    ESP_LOGI(TAG, "Cloud client ready for %s", config->url);
+    return ESP_OK;
+}
+
+esp_err_t cloud_client_set_url(const char *url)
+{
+    if (client == NULL)
+        return ESP_ERR_INVALID_STATE;
+    return esp_http_client_set_url(client, url);
+}
+
+esp_err_t cloud_client_begin(int content_length)
+{
+    if (client == NULL)
+        return ESP_ERR_INVALID_STATE;
+
+    request_start_us = esp_timer_get_time();
+    new_session = false;
+    stale = false;
+    bool was_open = connection_open;
+
+    // the client keeps headers between requests, only one of the two may be sent
+    chunked = content_length < 0;
+    chunk_used = 0;
+    body_bytes = 0;
+    esp_http_client_delete_header(client, chunked ? "Content-Length" : "Transfer-Encoding");
+
+    esp_err_t err = esp_http_client_open(client, content_length);
+    if (err != ESP_OK && was_open)
+    {
+        // the server closed the idle connection, try again on a new one
+        ESP_LOGW(TAG, "Kept-alive connection lost (%s), reconnecting", esp_err_to_name(err));
+        esp_http_client_close(client);
+        connection_open = false;
+        request_start_us = esp_timer_get_time();
+        err = esp_http_client_open(client, content_length);
+    }
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Open failed: %s", esp_err_to_name(err));
+        cloud_client_close();
+        stats.failures++;
+    }
+    reused = err == ESP_OK && !new_session;
+    return err;
+}
+
+static esp_err_t write_all(const char *data, int len)
+{
+    while (len > 0)
+    {
+        int written = esp_http_client_write(client, data, len);
+        if (written <= 0)
+        {
+            ESP_LOGE(TAG, "Write failed%s", reused ? " on a reused connection" : "");
+            stale = reused;
+            cloud_client_close();
+            stats.failures++;
+            return ESP_FAIL;
+        }
+        data += written;
+        len -= written;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t flush_chunk(void)
+{
+    if (chunk_used == 0)
+        return ESP_OK;
+
+    char head[CHUNK_HEAD_MAX + 1];
+    int head_len = snprintf(head, sizeof(head), "%x\r\n", chunk_used);
+    char *start = chunk_buf + CHUNK_HEAD_MAX - head_len;
+    memcpy(start, head, head_len);
+    memcpy(chunk_buf + CHUNK_HEAD_MAX + chunk_used, "\r\n", 2);
+
+    esp_err_t err = write_all(start, head_len + chunk_used + 2);
+    chunk_used = 0;
+    return err;
+}
+
+esp_err_t cloud_client_write(const char *data, int len)
+{
+    body_bytes += len;
+    if (!chunked)
+        return write_all(data, len);
+
+    while (len > 0)
+    {
+        int n = CLOUD_CLIENT_CHUNK_SIZE - chunk_used;
+        if (n > len)
+            n = len;
+        memcpy(chunk_buf + CHUNK_HEAD_MAX + chunk_used, data, n);
+        chunk_used += n;
+        data += n;
+        len -= n;
+
+        if (chunk_used == CLOUD_CLIENT_CHUNK_SIZE && flush_chunk() != ESP_OK)
+            return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+int cloud_client_finish(void)
+{
+    if (chunked)
+    {
+        chunked = false;
+        if (flush_chunk() != ESP_OK || write_all("0\r\n\r\n", 5) != ESP_OK)
+            return -1;
+    }
+    stats.last_body_bytes = body_bytes;
+
+    if (esp_http_client_fetch_headers(client) < 0)
+    {
+        ESP_LOGE(TAG, "Reading response headers failed%s", reused ? " on a reused connection" : "");
+        stale = reused;
+        cloud_client_close();
+        stats.failures++;
+        return -1;
+    }
+    stats.requests++;
+    return esp_http_client_get_status_code(client);
+}
+
+int cloud_client_read(char *buf, int len)
+{
+    return esp_http_client_read(client, buf, len);
+}
+
+void cloud_client_end(void)
+{
+    int flushed = 0;
+    if (connection_open && esp_http_client_flush_response(client, &flushed) != ESP_OK)
+        cloud_client_close();
+
+    uint32_t ms = (uint32_t)((esp_timer_get_time() - request_start_us) / 1000);
+    stats.last_request_ms = ms;
+    if (ms > stats.max_request_ms)
+        stats.max_request_ms = ms;
+    stats.last_reused = !new_session;
+
+    if (new_session)
+        printf("HTTP request took %lums, %lu B body (new TLS session, handshake %lums)\n", ms, stats.last_body_bytes, stats.last_handshake_ms);
+    else
+        printf("HTTP request took %lums, %lu B body (connection reused)\n", ms, stats.last_body_bytes);
+}
+
+bool cloud_client_stale(void)
+{
+    return stale;
+}
+
+esp_err_t cloud_client_post(const char *body, int len, char *response, int response_size, int *status)
+{
+    response[0] = '\0';
+    *status = -1;
+
+    // the body is in memory, a stale connection costs one resend and no backoff
+    for (int attempt = 0; attempt < 2 && *status < 0; attempt++)
+    {
+        esp_err_t err = cloud_client_begin(len);
+        if (err != ESP_OK)
+            return err;
+
+        err = cloud_client_write(body, len);
+        if (err == ESP_OK)
+            *status = cloud_client_finish();
+        if (*status < 0 && !stale)
+            return ESP_FAIL;
+    }
+    if (*status < 0)
+        return ESP_FAIL;
+
+    int total = 0;
+    while (total < response_size - 1)
+    {
+        int n = cloud_client_read(response + total, response_size - 1 - total);
+        if (n <= 0)
+            break;
+        total += n;
+    }
+    response[total] = '\0';
+
+    cloud_client_end();
+    return ESP_OK;
+}
+
+void cloud_client_close(void)
+{
+    if (client != NULL)
+        esp_http_client_close(client);
+    connection_open = false;
+}
+
+void cloud_client_get_stats(cloud_client_stats_t *out)
+{
+    *out = stats;
+}
+
+void cloud_client_print_stats(void)
+{
+    printf("Cloud: %lu requests, %lu failures, %lu TLS sessions (last %lums, max %lums), last request %lums, max %lums\n",
+           stats.requests, stats.failures, stats.handshakes,
+           stats.last_handshake_ms, stats.max_handshake_ms,
+           stats.last_request_ms, stats.max_request_ms);
+}
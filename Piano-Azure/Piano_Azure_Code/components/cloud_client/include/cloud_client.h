@@ -0,0 +1,69 @@
+#pragma once
+#include "esp_err.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_http_client.h"
+#include "esp_log.h"
+
+#define CLOUD_CLIENT_TIMEOUT_MS 15000
+// body bytes per chunk when the length is not known up front
+#define CLOUD_CLIENT_CHUNK_SIZE 256
+
+typedef struct {
+    const char *url;        // full endpoint URL (https://...)
+    const char *cert_pem;   // CA to trust, NULL = ESP-IDF certificate bundle
+    int timeout_ms;         // 0 = CLOUD_CLIENT_TIMEOUT_MS
+} cloud_client_config_t;
+
+typedef struct {
+    uint32_t requests;           // requests that got an HTTP status back
+    uint32_t failures;           // requests that failed at transport level
+    uint32_t handshakes;         // new TCP + TLS sessions (first connect and reconnects)
+    uint32_t last_handshake_ms;  // connect + TLS handshake time of the last new session
+    uint32_t max_handshake_ms;
+    uint32_t last_body_bytes;    // request body size of the last request
+    uint32_t last_request_ms;    // open -> response body fully read
+    uint32_t max_request_ms;
+    bool last_reused;            // last request went over an already open connection
+} cloud_client_stats_t;
+
+// create the long-lived client (no connection is made yet)
+esp_err_t cloud_client_init(const cloud_client_config_t *config);
+
+// change the endpoint, the connection is kept when the host stays the same
+esp_err_t cloud_client_set_url(const char *url);
+
+// start a POST with a body of content_length bytes, -1 = chunked body of any length
+// reuses the kept-alive connection, reconnects once if the server dropped it
+esp_err_t cloud_client_begin(int content_length);
+
+// write part of the request body
+// chunked bodies are collected in CLOUD_CLIENT_CHUNK_SIZE pieces, one socket write per chunk
+esp_err_t cloud_client_write(const char *data, int len);
+
+// request body done, wait for the response headers
+// returns the HTTP status code or -1 on error
+int cloud_client_finish(void);
+
+// read the response body, returns bytes read, 0 at the end, -1 on error
+int cloud_client_read(char *buf, int len);
+
+// discard what is left of the response and keep the connection for the next request
+void cloud_client_end(void);
+
+// true when the last request failed on a reused connection before any response came back:
+// the server had closed the idle socket, the write or the header read only found out then.
+// Nothing was processed, send the request again at once (begin opens a new connection).
+bool cloud_client_stale(void);
+
+// begin + write + finish + read into response (null terminated) + end
+// resends once on a new connection when the kept-alive one turns out to be stale
+esp_err_t cloud_client_post(const char *body, int len, char *response, int response_size, int *status);
+
+// drop the connection (the next request reconnects, with TLS session resumption if enabled)
+void cloud_client_close(void);
+
+void cloud_client_get_stats(cloud_client_stats_t *out);
+
+// print stats on console
+void cloud_client_print_stats(void);
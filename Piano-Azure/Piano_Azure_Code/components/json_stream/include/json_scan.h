@@ -0,0 +1,36 @@
+#pragma once
+#include "esp_err.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define JSON_SCAN_MAX_DEPTH  8
+#define JSON_SCAN_KEY_MAX    24   // longer keys are cut (and won't match)
+#define JSON_SCAN_VALUE_MAX  96   // longer string values are cut
+
+// called for every string value
+// key: member of the top-level object the value sits under ("" at the top level itself)
+// depth: 1 = directly in the top-level object, 2 = one array/object deeper, ...
+typedef void (*json_scan_cb_t)(void *ctx, const char *key, int depth, const char *value);
+
+// incremental JSON reader: feed the body in pieces of any size as it arrives,
+// no heap and no copy of the whole document
+typedef struct {
+    json_scan_cb_t on_string;
+    void *ctx;
+    esp_err_t err;             // ESP_ERR_INVALID_STATE on malformed input, rest is ignored
+    uint8_t state;
+    uint8_t depth;
+    uint8_t is_object;         // bit n: container at depth n is an object (else array)
+    bool expect_key;           // next string in the current object is a key
+    uint8_t hex_left;          // \uXXXX digits still to read
+    uint16_t code;             // \uXXXX value being read
+    uint16_t len;
+    char key[JSON_SCAN_KEY_MAX];
+    char str[JSON_SCAN_VALUE_MAX];
+} json_scan_t;
+
+void json_scan_init(json_scan_t *scan, json_scan_cb_t on_string, void *ctx);
+
+// parse the next piece of the document
+esp_err_t json_scan_feed(json_scan_t *scan, const char *data, int len);
@@ -0,0 +1,41 @@
+#pragma once
+#include "esp_err.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// deepest object/array nesting
+#define JSON_STREAM_MAX_DEPTH 8
+
+// receives the encoded text piece by piece (no terminating null)
+typedef esp_err_t (*json_stream_sink_t)(void *ctx, const char *data, int len);
+
+// JSON writer without buffers or heap: every token goes straight to the sink
+typedef struct {
+    json_stream_sink_t sink;   // NULL = only count the bytes
+    void *ctx;
+    size_t length;             // bytes produced so far
+    esp_err_t err;             // first error, nothing is written after it
+    uint8_t depth;
+    uint8_t has_items;         // bit n: the container at depth n already has an element
+    bool after_key;            // next value belongs to a key, no comma
+} json_stream_t;
+
+void json_stream_init(json_stream_t *js, json_stream_sink_t sink, void *ctx);
+
+void json_stream_begin_object(json_stream_t *js);
+void json_stream_end_object(json_stream_t *js);
+void json_stream_begin_array(json_stream_t *js);
+void json_stream_end_array(json_stream_t *js);
+
+// object key, the next call writes its value
+void json_stream_key(json_stream_t *js, const char *key);
+
+void json_stream_string(json_stream_t *js, const char *value);
+void json_stream_int(json_stream_t *js, int32_t value);
+
+// string value written in several pieces: begin, append..., end
+void json_stream_begin_string(json_stream_t *js);
+void json_stream_append(json_stream_t *js, const char *text);
+void json_stream_append_uint(json_stream_t *js, uint32_t value);
+void json_stream_end_string(json_stream_t *js);
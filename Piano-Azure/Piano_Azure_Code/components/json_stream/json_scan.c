@@ -0,0 +1,175 @@
+#include "json_scan.h"
+#include <string.h>
+
+enum {
+    SCAN_VALUE,     // between tokens
+    SCAN_STRING,    // inside "..."
+    SCAN_ESCAPE,    // after a backslash
+    SCAN_UNICODE,   // inside \uXXXX
+};
+
+static void add_char(json_scan_t *scan, char c)
+{
+    if (scan->len < JSON_SCAN_VALUE_MAX - 1)
+        scan->str[scan->len++] = c;
+}
+
+// code point from \uXXXX as UTF-8, surrogate pairs are not joined
+static void add_code_point(json_scan_t *scan, uint16_t cp)
+{
+    if (cp < 0x80)
+    {
+        add_char(scan, (char)cp);
+    }
+    else if (cp < 0x800)
+    {
+        add_char(scan, (char)(0xC0 | (cp >> 6)));
+        add_char(scan, (char)(0x80 | (cp & 0x3F)));
+    }
+    else if (cp >= 0xD800 && cp <= 0xDFFF)
+    {
+        add_char(scan, '?');
+    }
+    else
+    {
+        add_char(scan, (char)(0xE0 | (cp >> 12)));
+        add_char(scan, (char)(0x80 | ((cp >> 6) & 0x3F)));
+        add_char(scan, (char)(0x80 | (cp & 0x3F)));
+    }
+}
+
+static void string_done(json_scan_t *scan)
+{
+    scan->str[scan->len] = '\0';
+    bool in_object = scan->is_object & (1u << scan->depth);
+
+    if (in_object && scan->expect_key)
+    {
+        // top-level member names are kept to tell the values apart
+        if (scan->depth == 1)
+        {
+            strncpy(scan->key, scan->str, JSON_SCAN_KEY_MAX - 1);
+            scan->key[JSON_SCAN_KEY_MAX - 1] = '\0';
+        }
+        scan->expect_key = false;
+    }
+    else if (scan->on_string)
+    {
+        scan->on_string(scan->ctx, scan->depth >= 1 ? scan->key : "", scan->depth, scan->str);
+    }
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+void json_scan_init(json_scan_t *scan, json_scan_cb_t on_string, void *ctx)
+{
+    memset(scan, 0, sizeof(*scan));
+    scan->on_string = on_string;
+    scan->ctx = ctx;
+    scan->state = SCAN_VALUE;
+}
+
+esp_err_t json_scan_feed(json_scan_t *scan, const char *data, int len)
+{
+    for (int i = 0; i < len && scan->err == ESP_OK; i++)
+    {
+        char c = data[i];
+
+        switch (scan->state)
+        {
+            case SCAN_STRING:
+                if (c == '"')
+                {
+                    scan->state = SCAN_VALUE;
+                    string_done(scan);
+                }
+                else if (c == '\\')
+                {
+                    scan->state = SCAN_ESCAPE;
+                }
+                else
+                {
+                    add_char(scan, c);
+                }
+                break;
+
+            case SCAN_ESCAPE:
+                scan->state = SCAN_STRING;
+                switch (c)
+                {
+                    case 'n': add_char(scan, '\n'); break;
+                    case 't': add_char(scan, '\t'); break;
+                    case 'r': add_char(scan, '\r'); break;
+                    case 'b': add_char(scan, '\b'); break;
+                    case 'f': add_char(scan, '\f'); break;
+                    case 'u':
+                        scan->state = SCAN_UNICODE;
+                        scan->hex_left = 4;
+                        scan->code = 0;
+                        break;
+                    default: add_char(scan, c); break;  // \" \\ \/
+                }
+                break;
+
+            case SCAN_UNICODE:
+            {
+                int v = hex_value(c);
+                if (v < 0)
+                {
+                    scan->err = ESP_ERR_INVALID_STATE;
+                    break;
+                }
+                scan->code = (scan->code << 4) | v;
+                if (--scan->hex_left == 0)
+                {
+                    add_code_point(scan, scan->code);
+                    scan->state = SCAN_STRING;
+                }
+                break;
+            }
+
+            default:  // SCAN_VALUE: structure, numbers and literals are skipped
+                if (c == '"')
+                {
+                    scan->state = SCAN_STRING;
+                    scan->len = 0;
+                }
+                else if (c == '{' || c == '[')
+                {
+                    if (scan->depth + 1 >= JSON_SCAN_MAX_DEPTH)
+                    {
+                        scan->err = ESP_ERR_INVALID_STATE;
+                        break;
+                    }
+                    scan->depth++;
+                    if (c == '{')
+                        scan->is_object |= 1u << scan->depth;
+                    else
+                        scan->is_object &= ~(1u << scan->depth);
+                    scan->expect_key = (c == '{');
+                }
+                else if (c == '}' || c == ']')
+                {
+                    if (scan->depth == 0)
+                    {
+                        scan->err = ESP_ERR_INVALID_STATE;
+                        break;
+                    }
+                    scan->depth--;
+                    scan->expect_key = false;
+                }
+                else if (c == ',')
+                {
+                    scan->expect_key = scan->is_object & (1u << scan->depth);
+                }
+                break;
+        }
+    }
+    return scan->err;
+}
@@ -0,0 +1,151 @@
+#include "json_stream.h"
+#include <stdio.h>
+#include <string.h>
+
+static void emit(json_stream_t *js, const char *data, int len)
+{
+    if (js->err != ESP_OK || len <= 0)
+        return;
+    js->length += len;
+    if (js->sink)
+        js->err = js->sink(js->ctx, data, len);
+}
+
+// comma before every element except the first one, nothing right after a key
+static void separator(json_stream_t *js)
+{
+    if (js->after_key)
+    {
+        js->after_key = false;
+        return;
+    }
+    uint8_t bit = 1u << js->depth;
+    if (js->has_items & bit)
+        emit(js, ",", 1);
+    js->has_items |= bit;
+}
+
+static void open_container(json_stream_t *js, char c)
+{
+    separator(js);
+    if (js->depth + 1 >= JSON_STREAM_MAX_DEPTH)
+    {
+        js->err = ESP_ERR_INVALID_STATE;
+        return;
+    }
+    emit(js, &c, 1);
+    js->depth++;
+    js->has_items &= ~(1u << js->depth);
+}
+
+static void close_container(json_stream_t *js, char c)
+{
+    if (js->depth == 0)
+    {
+        js->err = ESP_ERR_INVALID_STATE;
+        return;
+    }
+    js->depth--;
+    emit(js, &c, 1);
+}
+
+// string body with escapes, runs of plain characters go out in one piece
+static void emit_escaped(json_stream_t *js, const char *text)
+{
+    const char *run = text;
+    for (const char *p = text; *p; p++)
+    {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        emit(js, run, (int)(p - run));
+        char esc[7];
+        int len;
+        if (c == '"' || c == '\\')
+            len = snprintf(esc, sizeof(esc), "\\%c", c);
+        else if (c == '\n')
+            len = snprintf(esc, sizeof(esc), "\\n");
+        else
+            len = snprintf(esc, sizeof(esc), "\\u%04x", c);
+        emit(js, esc, len);
+        run = p + 1;
+    }
+    emit(js, run, (int)strlen(run));
+}
+
+void json_stream_init(json_stream_t *js, json_stream_sink_t sink, void *ctx)
+{
+    js->sink = sink;
+    js->ctx = ctx;
+    js->length = 0;
+    js->err = ESP_OK;
+    js->depth = 0;
+    js->has_items = 0;
+    js->after_key = false;
+}
+
+void json_stream_begin_object(json_stream_t *js)
+{
+    open_container(js, '{');
+}
+
+void json_stream_end_object(json_stream_t *js)
+{
+    close_container(js, '}');
+}
+
+void json_stream_begin_array(json_stream_t *js)
+{
+    open_container(js, '[');
+}
+
+void json_stream_end_array(json_stream_t *js)
+{
+    close_container(js, ']');
+}
+
+void json_stream_key(json_stream_t *js, const char *key)
+{
+    separator(js);
+    emit(js, "\"", 1);
+    emit_escaped(js, key);
+    emit(js, "\":", 2);
+    js->after_key = true;
+}
+
+void json_stream_string(json_stream_t *js, const char *value)
+{
+    json_stream_begin_string(js);
+    emit_escaped(js, value);
+    json_stream_end_string(js);
+}
+
+void json_stream_int(json_stream_t *js, int32_t value)
+{
+    char num[12];
+    separator(js);
+    emit(js, num, snprintf(num, sizeof(num), "%ld", (long)value));
+}
+
+void json_stream_begin_string(json_stream_t *js)
+{
+    separator(js);
+    emit(js, "\"", 1);
+}
+
+void json_stream_append(json_stream_t *js, const char *text)
+{
+    emit_escaped(js, text);
+}
+
+void json_stream_append_uint(json_stream_t *js, uint32_t value)
+{
+    char num[11];
+    emit(js, num, snprintf(num, sizeof(num), "%lu", (unsigned long)value));
+}
+
+void json_stream_end_string(json_stream_t *js)
+{
+    emit(js, "\"", 1);
+}
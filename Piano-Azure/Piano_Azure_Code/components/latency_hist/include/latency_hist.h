@@ -0,0 +1,41 @@
+#pragma once
+#include "esp_err.h"
+#include "prom_sink.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// Fixed-bucket latency histograms, exported in Prometheus text format.
+// Recording is a few atomic adds, no mutex, so it can sit in the key -> tone path.
+
+#define LATENCY_HIST_BUCKETS  16   // 15 upper bounds (100us .. 5s) + "+Inf"
+#define LATENCY_HIST_MAX      8    // registered histograms
+
+typedef struct {
+    const char *name;   // Prometheus metric name, e.g. "piano_key_to_tone_seconds"
+    const char *help;
+    atomic_uint_least32_t buckets[LATENCY_HIST_BUCKETS];  // per bucket, not cumulative
+    atomic_uint_least64_t sum_us;
+    atomic_uint_least32_t max_us;
+} latency_hist_t;
+
+#define LATENCY_HIST_INIT(metric, text) { .name = (metric), .help = (text) }
+
+// add to the export, hist must stay valid (static)
+void latency_hist_register(latency_hist_t *hist);
+
+void latency_hist_record(latency_hist_t *hist, uint32_t us);
+
+// record the time since start_us (esp_timer_get_time()), nothing if start_us is 0
+void latency_hist_since(latency_hist_t *hist, int64_t start_us);
+
+uint32_t latency_hist_count(const latency_hist_t *hist);
+
+// upper bound of the bucket holding the given percentile (max for the last bucket), 0 if empty
+uint32_t latency_hist_percentile(const latency_hist_t *hist, int percent);
+
+// all registered histograms as Prometheus histograms (_bucket, _sum, _count)
+esp_err_t latency_hist_write_prometheus(prom_sink_t sink, void *ctx);
+
+// one line per registered histogram: count, average, p50, p99, max
+void latency_hist_print(void);
@@ -0,0 +1,143 @@
+#include "latency_hist.h"
+#include <stdio.h>
+#include "esp_timer.h"
+
+// bucket upper bounds, the last bucket has none ("+Inf")
+static const uint32_t bounds_us[LATENCY_HIST_BUCKETS - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000
+};
+
+static latency_hist_t *histograms[LATENCY_HIST_MAX];
+static atomic_int histogram_count = 0;
+
+void latency_hist_register(latency_hist_t *hist)
+{
+    int n = atomic_load(&histogram_count);
+    if (n >= LATENCY_HIST_MAX)
+        return;
+    histograms[n] = hist;
+    atomic_store(&histogram_count, n + 1);
+}
+
+void latency_hist_record(latency_hist_t *hist, uint32_t us)
+{
+    int b = 0;
+    while (b < LATENCY_HIST_BUCKETS - 1 && us > bounds_us[b])
+        b++;
+    atomic_fetch_add_explicit(&hist->buckets[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->sum_us, us, memory_order_relaxed);
+
+    uint32_t max = atomic_load_explicit(&hist->max_us, memory_order_relaxed);
+    while (us > max && !atomic_compare_exchange_weak_explicit(&hist->max_us, &max, us,
+                                                              memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+void latency_hist_since(latency_hist_t *hist, int64_t start_us)
+{
+    if (start_us == 0)
+        return;
+    int64_t us = esp_timer_get_time() - start_us;
+    latency_hist_record(hist, us < 0 ? 0 : us > UINT32_MAX ? UINT32_MAX : (uint32_t)us);
+}
+
+// a consistent copy: the count is the sum of the copied buckets, never out of step with them
+static uint32_t snapshot(const latency_hist_t *hist, uint32_t *buckets)
+{
+    uint32_t count = 0;
+    for (int b = 0; b < LATENCY_HIST_BUCKETS; b++)
+    {
+        buckets[b] = atomic_load_explicit(&hist->buckets[b], memory_order_relaxed);
+        count += buckets[b];
+    }
+    return count;
+}
+
+uint32_t latency_hist_count(const latency_hist_t *hist)
+{
+    uint32_t buckets[LATENCY_HIST_BUCKETS];
+    return snapshot(hist, buckets);
+}
+
+uint32_t latency_hist_percentile(const latency_hist_t *hist, int percent)
+{
+    uint32_t buckets[LATENCY_HIST_BUCKETS];
+    uint32_t count = snapshot(hist, buckets);
+    if (count == 0)
+        return 0;
+
+    uint32_t rank = (uint32_t)(((uint64_t)count * percent + 99) / 100);
+    uint32_t seen = 0;
+    for (int b = 0; b < LATENCY_HIST_BUCKETS - 1; b++)
+    {
+        seen += buckets[b];
+        if (seen >= rank)
+            return bounds_us[b];
+    }
+    return atomic_load_explicit(&hist->max_us, memory_order_relaxed);
+}
+
+// seconds with microsecond precision, as Prometheus expects
+static int format_seconds(char *buf, size_t size, uint64_t us)
+{
+    return snprintf(buf, size, "%llu.%06llu", (unsigned long long)(us / 1000000), (unsigned long long)(us % 1000000));
+}
+
+static esp_err_t write_histogram(const latency_hist_t *hist, prom_sink_t sink, void *ctx)
+{
+    uint32_t buckets[LATENCY_HIST_BUCKETS];
+    uint32_t count = snapshot(hist, buckets);
+    char line[160];
+    char le[24];
+    esp_err_t err;
+    int len;
+
+    len = snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n", hist->name, hist->help, hist->name);
+    if ((err = sink(ctx, line, len)) != ESP_OK)
+        return err;
+
+    uint32_t cumulative = 0;
+    for (int b = 0; b < LATENCY_HIST_BUCKETS; b++)
+    {
+        cumulative += buckets[b];
+        if (b < LATENCY_HIST_BUCKETS - 1)
+            format_seconds(le, sizeof(le), bounds_us[b]);
+        else
+            snprintf(le, sizeof(le), "+Inf");
+        len = snprintf(line, sizeof(line), "%s_bucket{le=\"%s\"} %lu\n", hist->name, le, (unsigned long)cumulative);
+        if ((err = sink(ctx, line, len)) != ESP_OK)
+            return err;
+    }
+
+    format_seconds(le, sizeof(le), atomic_load_explicit(&hist->sum_us, memory_order_relaxed));
+    len = snprintf(line, sizeof(line), "%s_sum %s\n%s_count %lu\n", hist->name, le, hist->name, (unsigned long)count);
+    return sink(ctx, line, len);
+}
+
+esp_err_t latency_hist_write_prometheus(prom_sink_t sink, void *ctx)
+{
+    int n = atomic_load(&histogram_count);
+    for (int i = 0; i < n; i++)
+    {
+        esp_err_t err = write_histogram(histograms[i], sink, ctx);
+        if (err != ESP_OK)
+            return err;
+    }
+    return ESP_OK;
+}
+
+void latency_hist_print(void)
+{
+    int n = atomic_load(&histogram_count);
+    for (int i = 0; i < n; i++)
+    {
+        const latency_hist_t *hist = histograms[i];
+        uint32_t count = latency_hist_count(hist);
+        uint64_t sum = atomic_load_explicit(&hist->sum_us, memory_order_relaxed);
+        printf("%s: n=%lu avg=%lluus p50<=%luus p99<=%luus max=%luus\n", hist->name, (unsigned long)count,
+               count ? (unsigned long long)(sum / count) : 0ULL,
+               (unsigned long)latency_hist_percentile(hist, 50), (unsigned long)latency_hist_percentile(hist, 99),
+               (unsigned long)atomic_load_explicit(&hist->max_us, memory_order_relaxed));
+    }
+}
@@ -1,7 +1,16 @@
 #include "lcd.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 static const char *TAG = "lcd";
 
+// the millisecond waits sleep instead of spinning: the CPU idles (or light sleeps) meanwhile.
+// One tick more, a delay of n ticks can end just after the (n-1)th
+static void lcd_wait_ms(int ms)
+{
+    vTaskDelay(pdMS_TO_TICKS(ms) + 1);
+}
+
 // send 4 bits
 static void lcd_send_nibble(uint8_t nibble) 
 {
@@ -37,13 +46,13 @@ esp_err_t lcd_init(void)
     };
     gpio_config(&io_conf);
 
-    esp_rom_delay_us(40000); // wait 40ms after power on
+    lcd_wait_ms(40); // wait 40ms after power on
 
     // init LCD 4-bit
     lcd_send_nibble(LCD_CMD_FUNCTION_RESET);
-    esp_rom_delay_us(4500);
+    lcd_wait_ms(5);
     lcd_send_nibble(LCD_CMD_FUNCTION_RESET);
-    esp_rom_delay_us(4500);
+    lcd_wait_ms(5);
     lcd_send_nibble(LCD_CMD_FUNCTION_RESET);
         esp_rom_delay_us(150);
     lcd_send_nibble(LCD_CMD_FUNCTION_4BIT); // 4-bit mode
@@ -61,7 +70,7 @@ esp_err_t lcd_init(void)
 esp_err_t lcd_clear(void) 
 {
     lcd_send_byte(LCD_CMD_CLEAR_DISPLAY, 0);
-    esp_rom_delay_us(2000); 
+    lcd_wait_ms(2);
     return ESP_OK;
 }
 
@@ -0,0 +1,80 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Loop recorder: one fixed-length loop, a layer per pass (the first take sets the length, every
+// overdub adds a layer on top), each layer muted or undone on its own.
+// A layer is one flat array of 32 bit events sorted by time, so playing it is a walk through
+// consecutive words. Playback merges the layers as it reads them: every layer keeps a cursor, and
+// the earliest pending event of all of them is cached, so a tick with nothing due is one compare
+// whatever the number of layers; only an event that fires looks at the other layers' heads.
+// No ESP-IDF headers, the caller locks.
+
+#define LOOPER_LAYERS        4
+#define LOOPER_LAYER_EVENTS  128     // note on + note off each, so 64 notes per layer
+#define LOOPER_MAX_MS        0xFFFFF // 17 minutes, the 20 bit time field
+
+// event: time ms (20 bits) | pot offset / 2 (7 bits) | on (1 bit) | note (4 bits)
+// the time is the top field, so sorting events sorts them by time
+typedef uint32_t looper_event_t;
+
+#define LOOPER_EVENT(at_ms, note, on, offset) \
+    ((looper_event_t)(at_ms) << 12 | (looper_event_t)((offset) / 2 & 0x7F) << 5 | (looper_event_t)((on) ? 1 : 0) << 4 | ((note) & 0x0F))
+#define LOOPER_AT(e)      ((e) >> 12)
+#define LOOPER_OFFSET(e)  ((uint16_t)(((e) >> 5 & 0x7F) * 2))
+#define LOOPER_ON(e)      (((e) >> 4 & 1) != 0)
+#define LOOPER_NOTE(e)    ((int)((e) & 0x0F))
+
+typedef struct {
+    looper_event_t events[LOOPER_LAYER_EVENTS];
+    uint16_t count;
+    uint16_t cursor;      // next event to play
+    uint16_t sounding;    // notes of this layer on right now
+    bool muted;
+} looper_layer_t;
+
+typedef struct {
+    looper_layer_t layers[LOOPER_LAYERS];
+    int layer_count;      // finished layers, played back
+    int recording;        // layer being recorded (= layer_count), -1 = none
+    uint32_t length_ms;   // 0 until the first take is closed
+    uint32_t record_from; // loop position the recording started at
+    uint16_t record_held; // notes on in the recording layer
+    int record_split;     // events recorded before the loop went round, -1 = it hasn't yet
+    uint32_t position;    // last position played up to
+    uint32_t next_at;     // earliest pending event of all playing layers, UINT32_MAX = none
+    int next_layer;
+    uint16_t note_offset[12]; // pot offset of every note's last note on
+} looper_t;
+
+// empty, no loop
+void looper_init(looper_t *l);
+
+// start a layer at loop position from (0 for the first take); -1 when all layers are used
+int looper_record(looper_t *l, uint32_t from);
+
+// a key on the recording layer at loop position at (clamped to keep the layer sorted);
+// false when the layer is full
+bool looper_note(looper_t *l, uint32_t at, int note, bool on, uint16_t offset);
+
+// finish the recording layer at loop position at; the first take's length is at itself.
+// Notes still held are released there. Returns the layer, -1 if nothing was recording
+int looper_close(looper_t *l, uint32_t at);
+
+// drop the newest layer (or the one being recorded); returns its index, -1 when there is none
+int looper_undo(looper_t *l);
+
+// mute or unmute a finished layer, its notes stop at once; -1 for a bad layer
+int looper_mute(looper_t *l, int layer, bool muted);
+
+// play every event up to position (ms into the loop); returns the notes sounding, all layers
+uint16_t looper_advance(looper_t *l, uint32_t position);
+
+// the loop went round: play what's left of the pass and go back to the start; returns the notes sounding
+uint16_t looper_wrap(looper_t *l);
+
+// the pot offset of a sounding note's last note on, for the buzzer
+uint16_t looper_offset(const looper_t *l, int note);
+
+// events in a layer, 0 for a bad layer
+int looper_layer_events(const looper_t *l, int layer);
@@ -0,0 +1,241 @@
+#include "looper.h"
+#include <string.h>
+
+#define NOTES 12
+
+// earliest pending event of the playing layers; called only when one fired or a layer changed
+static void find_next(looper_t *l)
+{
+    l->next_at = UINT32_MAX;
+    l->next_layer = -1;
+    for (int i = 0; i < l->layer_count; i++)
+    {
+        const looper_layer_t *layer = &l->layers[i];
+        if (layer->muted || layer->cursor >= layer->count)
+            continue;
+        uint32_t at = LOOPER_AT(layer->events[layer->cursor]);
+        if (at < l->next_at)
+        {
+            l->next_at = at;
+            l->next_layer = i;
+        }
+    }
+}
+
+// first event after position
+static uint16_t seek(const looper_layer_t *layer, uint32_t position)
+{
+    uint16_t lo = 0, hi = layer->count;
+    while (lo < hi)
+    {
+        uint16_t mid = (lo + hi) / 2;
+        if (LOOPER_AT(layer->events[mid]) <= position)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static uint16_t sounding(const looper_t *l)
+{
+    uint16_t notes = 0;
+    for (int i = 0; i < l->layer_count; i++)
+        if (!l->layers[i].muted)
+            notes |= l->layers[i].sounding;
+    return notes;
+}
+
+static void reverse(looper_event_t *events, int from, int to)
+{
+    for (to--; from < to; from++, to--)
+    {
+        looper_event_t e = events[from];
+        events[from] = events[to];
+        events[to] = e;
+    }
+}
+
+void looper_init(looper_t *l)
+{
+    memset(l, 0, sizeof(*l));
+    l->recording = -1;
+    l->next_at = UINT32_MAX;
+    l->next_layer = -1;
+}
+
+int looper_record(looper_t *l, uint32_t from)
+{
+    if (l->recording >= 0 || l->layer_count >= LOOPER_LAYERS)
+        return -1;
+
+    looper_layer_t *layer = &l->layers[l->layer_count];
+    layer->count = 0;
+    layer->cursor = 0;
+    layer->sounding = 0;
+    layer->muted = false;
+    l->recording = l->layer_count;
+    l->record_from = from;
+    l->record_held = 0;
+    l->record_split = -1;
+    return l->recording;
+}
+
+bool looper_note(looper_t *l, uint32_t at, int note, bool on, uint16_t offset)
+{
+    if (l->recording < 0 || note < 0 || note >= NOTES)
+        return false;
+
+    looper_layer_t *layer = &l->layers[l->recording];
+    uint16_t bit = 1 << note;
+    if (on == ((l->record_held & bit) != 0))
+        return true;    // released a key pressed before the recording started
+
+    // every note on keeps room for its note off
+    if (on && layer->count + __builtin_popcount(l->record_held) + 2 > LOOPER_LAYER_EVENTS)
+        return false;
+
+    // keep the layer in order whatever the caller's rounding did: an overdub's first run is
+    // [from, end of loop), its second [0, from), and time never goes back within a run
+    if (l->length_ms > 0 && l->record_split < 0)
+    {
+        if (at < l->record_from)
+            at = l->record_from;
+        if (at >= l->length_ms)
+            at = l->length_ms - 1;
+    }
+    else if (l->length_ms > 0 && at >= l->record_from)
+    {
+        at = l->record_from > 0 ? l->record_from - 1 : 0;
+    }
+    int run = l->record_split > 0 ? l->record_split : 0;
+    if (layer->count > run && at < LOOPER_AT(layer->events[layer->count - 1]))
+        at = LOOPER_AT(layer->events[layer->count - 1]);
+    if (at > LOOPER_MAX_MS)
+        at = LOOPER_MAX_MS;
+    layer->events[layer->count++] = LOOPER_EVENT(at, note, on, on ? offset : 0);
+    l->record_held ^= bit;
+    return true;
+}
+
+int looper_close(looper_t *l, uint32_t at)
+{
+    if (l->recording < 0)
+        return -1;
+
+    looper_layer_t *layer = &l->layers[l->recording];
+    bool wrapped = l->record_split >= 0;
+    if (wrapped && at >= l->record_from)
+        at = l->record_from > 0 ? l->record_from - 1 : 0;   // a whole pass, no further
+    for (int note = 0; note < NOTES; note++)
+        if (l->record_held & (1 << note))
+            layer->events[layer->count++] = LOOPER_EVENT(at, note, false, 0);
+    l->record_held = 0;
+
+    if (l->length_ms == 0)
+    {
+        // the first take sets the loop length, playback picks up from its end
+        l->length_ms = at > 0 ? at : 1;
+        l->position = at;
+    }
+    else if (wrapped)
+    {
+        // [from, end of loop) then [0, from): two sorted runs, one rotation makes them one
+        reverse(layer->events, 0, l->record_split);
+        reverse(layer->events, l->record_split, layer->count);
+        reverse(layer->events, 0, layer->count);
+    }
+
+    // plays from the next pass on, or from where the loop is now for the events still ahead
+    layer->cursor = seek(layer, l->position);
+    layer->sounding = 0;
+    int closed = l->recording;
+    l->layer_count++;
+    l->recording = -1;
+    find_next(l);
+    return closed;
+}
+
+int looper_undo(looper_t *l)
+{
+    if (l->recording >= 0)
+    {
+        l->recording = -1;
+        l->record_held = 0;
+        return l->layer_count;
+    }
+    if (l->layer_count == 0)
+        return -1;
+
+    int layer = --l->layer_count;
+    l->layers[layer].count = 0;
+    l->layers[layer].sounding = 0;
+    if (l->layer_count == 0)
+    {
+        l->length_ms = 0;
+        l->position = 0;
+    }
+    find_next(l);
+    return layer;
+}
+
+int looper_mute(looper_t *l, int layer, bool muted)
+{
+    if (layer < 0 || layer >= l->layer_count)
+        return -1;
+
+    looper_layer_t *ly = &l->layers[layer];
+    ly->muted = muted;
+    ly->sounding = 0;
+    if (!muted)
+        ly->cursor = seek(ly, l->position);   // skip what it missed while muted
+    find_next(l);
+    return layer;
+}
+
+uint16_t looper_advance(looper_t *l, uint32_t position)
+{
+    while (l->next_at <= position)
+    {
+        looper_layer_t *layer = &l->layers[l->next_layer];
+        looper_event_t e = layer->events[layer->cursor++];
+        uint16_t bit = 1 << LOOPER_NOTE(e);
+        if (LOOPER_ON(e))
+        {
+            layer->sounding |= bit;
+            l->note_offset[LOOPER_NOTE(e)] = LOOPER_OFFSET(e);
+        }
+        else
+        {
+            layer->sounding &= ~bit;
+        }
+        find_next(l);
+    }
+    l->position = position;
+    return sounding(l);
+}
+
+uint16_t looper_wrap(looper_t *l)
+{
+    looper_advance(l, LOOPER_MAX_MS);
+
+    // an overdub going round: what it recorded so far sorts after what comes next
+    if (l->recording >= 0 && l->record_split < 0)
+        l->record_split = l->layers[l->recording].count;
+
+    for (int i = 0; i < l->layer_count; i++)
+        l->layers[i].cursor = 0;
+    l->position = 0;
+    find_next(l);
+    return sounding(l);
+}
+
+uint16_t looper_offset(const looper_t *l, int note)
+{
+    return note >= 0 && note < NOTES ? l->note_offset[note] : 0;
+}
+
+int looper_layer_events(const looper_t *l, int layer)
+{
+    return layer >= 0 && layer < l->layer_count ? l->layers[layer].count : 0;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define MELODY_MAX_EVENTS 100
+#define MELODY_NOTE_COUNT 12
+
+// one recorded key press (12 bytes)
+typedef struct {
+    uint32_t start_time;   // ms from the start of the recording
+    uint16_t duration;     // ms the key was held, saturated at 65535
+    uint16_t frequency;    // Hz, potentiometer offset included
+    uint8_t note;          // 0-11 (C4..B4)
+} melody_event_t;
+
+// a finished recording, only the first count events are valid
+typedef struct {
+    uint32_t id;           // assigned by the upload queue
+    uint16_t count;
+    melody_event_t events[MELODY_MAX_EVENTS];
+} melody_t;
+
+// bytes actually used by a melody with count events (header + events)
+static inline size_t melody_size(uint16_t count)
+{
+    return offsetof(melody_t, events) + (size_t)count * sizeof(melody_event_t);
+}
+
+// note name, "?" for an invalid index
+const char *melody_note_name(uint8_t note);
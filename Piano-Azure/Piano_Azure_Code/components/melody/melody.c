@@ -0,0 +1,12 @@
+#include "melody.h"
+
+static const char *note_names[MELODY_NOTE_COUNT] = {
+    "C4","C#4","D4","D#4","E4","F4","F#4","G4","G#4","A4","A#4","B4"
+};
+
+const char *melody_note_name(uint8_t note)
+{
+    if (note >= MELODY_NOTE_COUNT)
+        return "?";
+    return note_names[note];
+}
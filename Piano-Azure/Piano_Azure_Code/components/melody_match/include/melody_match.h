@@ -0,0 +1,98 @@
+#pragma once
+#include <stdint.h>
+
+// Plain C (no ESP-IDF includes) so it also builds on the host, see tools/melody_match_bench.c.
+//
+// Melodies are compared as intervals between consecutive notes folded to one octave (-5..+6),
+// so the key and the octave the song is played in don't matter, and as the ratio between
+// consecutive note lengths, so the tempo doesn't matter either.
+// Every 3 consecutive intervals (4 notes) are a trigram; the index keeps, for each trigram,
+// the songs containing it. A query votes for songs through its trigrams and the best
+// candidates are ranked with an edit distance on intervals and durations, the played
+// melody may be any part of the song.
+
+// sizes can be overridden at compile time (the host benchmark indexes thousands of songs)
+#ifndef MELODY_MATCH_MAX_SONGS
+#define MELODY_MATCH_MAX_SONGS      32
+#endif
+#ifndef MELODY_MATCH_BUCKETS
+#define MELODY_MATCH_BUCKETS        256     // trigram hash table, 1728 = one bucket per trigram
+#endif
+#ifndef MELODY_MATCH_CANDIDATES
+#define MELODY_MATCH_CANDIDATES     16      // songs ranked with the edit distance per query
+#endif
+#define MELODY_MATCH_MAX_NOTES      48      // longer songs and queries are cut
+#define MELODY_MATCH_MIN_NOTES      4       // one trigram
+
+#define MELODY_MATCH_MAX_INTERVALS  (MELODY_MATCH_MAX_NOTES - 1)
+#define MELODY_MATCH_MAX_POSTINGS   (MELODY_MATCH_MAX_SONGS * (MELODY_MATCH_MAX_INTERVALS - 2))
+
+#if MELODY_MATCH_MAX_POSTINGS >= 0xFFFF
+typedef uint32_t melody_match_link_t;
+#else
+typedef uint16_t melody_match_link_t;
+#endif
+#define MELODY_MATCH_NO_LINK        ((melody_match_link_t)-1)
+
+// a known song, pitches in semitones (any octave), lengths in any unit (0 = unknown)
+typedef struct {
+    const char *name;
+    const uint8_t *notes;
+    const uint8_t *lengths;     // may be NULL
+    uint8_t count;
+} melody_song_t;
+
+typedef struct {
+    uint16_t song;              // id returned by melody_match_add()
+    uint16_t distance;          // edit distance, 2 per wrong/missing/extra note
+    uint8_t score;              // 0-100, 100 = exact
+    uint8_t votes;              // trigrams in common
+} melody_match_result_t;
+
+typedef struct {
+    const char *name;
+    uint32_t offset;            // first interval in intervals[]
+    uint8_t length;             // number of intervals
+} melody_match_entry_t;
+
+typedef struct {
+    melody_match_link_t next;   // next posting in the same bucket
+    uint16_t song;
+} melody_match_posting_t;
+
+// everything lives in this struct, no heap; a query uses the votes scratch array so
+// one index must not be queried from two tasks at the same time
+typedef struct {
+    uint16_t song_count;
+    uint32_t interval_count;
+    uint32_t posting_count;
+    melody_match_entry_t songs[MELODY_MATCH_MAX_SONGS];
+    int8_t intervals[MELODY_MATCH_MAX_SONGS * MELODY_MATCH_MAX_INTERVALS];
+    int8_t rhythm[MELODY_MATCH_MAX_SONGS * MELODY_MATCH_MAX_INTERVALS];
+    melody_match_link_t buckets[MELODY_MATCH_BUCKETS];
+    melody_match_posting_t postings[MELODY_MATCH_MAX_POSTINGS];
+    uint8_t votes[MELODY_MATCH_MAX_SONGS];
+} melody_match_index_t;
+
+// songs shipped with the firmware (the Piano-Web melodies and a few more)
+extern const melody_song_t melody_known_songs[];
+extern const int melody_known_song_count;
+
+void melody_match_init(melody_match_index_t *index);
+
+// add a song, the name is not copied; returns its id or -1 when the index is full
+// or the song is shorter than MELODY_MATCH_MIN_NOTES
+int melody_match_add(melody_match_index_t *index, const melody_song_t *song);
+
+// add melody_known_songs, returns how many were added
+int melody_match_add_known(melody_match_index_t *index);
+
+// rank the songs for a played melody, notes in semitones and lengths in any unit
+// (lengths may be NULL); best first, returns the number of results written
+int melody_match_query(melody_match_index_t *index, const uint8_t *notes, const uint16_t *lengths,
+                       int count, melody_match_result_t *results, int max_results);
+
+static inline const char *melody_match_name(const melody_match_index_t *index, uint16_t song)
+{
+    return song < index->song_count ? index->songs[song].name : "?";
+}
@@ -0,0 +1,217 @@
+#include "melody_match.h"
+#include <string.h>
+
+#define RHYTHM_UNKNOWN  127
+#define COST_NOTE       4       // wrong, missing or extra note
+#define TRIGRAM_COUNT   (12 * 12 * 12)
+
+// interval folded to one octave, -5..+6
+static int8_t fold_interval(int from, int to)
+{
+    int d = ((to - from) % 12 + 12) % 12;
+    return (int8_t)(d > 6 ? d - 12 : d);
+}
+
+// length of the next note relative to this one, -2 (much shorter) .. +2 (much longer)
+static int8_t rhythm_class(uint32_t cur, uint32_t next)
+{
+    if (cur == 0 || next == 0)
+        return RHYTHM_UNKNOWN;
+    if (next * 100 < cur * 35)
+        return -2;
+    if (next * 100 < cur * 75)
+        return -1;
+    if (next * 100 <= cur * 133)
+        return 0;
+    if (next * 100 <= cur * 280)
+        return 1;
+    return 2;
+}
+
+static uint32_t trigram_bucket(const int8_t *iv)
+{
+    uint32_t t = (uint32_t)(iv[0] + 5) * 144 + (uint32_t)(iv[1] + 5) * 12 + (uint32_t)(iv[2] + 5);
+#if MELODY_MATCH_BUCKETS >= TRIGRAM_COUNT
+    return t;
+#else
+    // spread neighbouring trigrams over the smaller table
+    return (t * 2654435761u) % MELODY_MATCH_BUCKETS;
+#endif
+}
+
+void melody_match_init(melody_match_index_t *index)
+{
+    index->song_count = 0;
+    index->interval_count = 0;
+    index->posting_count = 0;
+    for (int i = 0; i < MELODY_MATCH_BUCKETS; i++)
+        index->buckets[i] = MELODY_MATCH_NO_LINK;
+    memset(index->votes, 0, sizeof(index->votes));
+}
+
+int melody_match_add(melody_match_index_t *index, const melody_song_t *song)
+{
+    int count = song->count > MELODY_MATCH_MAX_NOTES ? MELODY_MATCH_MAX_NOTES : song->count;
+    if (count < MELODY_MATCH_MIN_NOTES || index->song_count >= MELODY_MATCH_MAX_SONGS)
+        return -1;
+
+    uint16_t id = index->song_count++;
+    melody_match_entry_t *entry = &index->songs[id];
+    entry->name = song->name;
+    entry->offset = index->interval_count;
+    entry->length = count - 1;
+
+    int8_t *iv = &index->intervals[entry->offset];
+    int8_t *rh = &index->rhythm[entry->offset];
+    for (int i = 0; i < entry->length; i++)
+    {
+        iv[i] = fold_interval(song->notes[i], song->notes[i + 1]);
+        rh[i] = song->lengths ? rhythm_class(song->lengths[i], song->lengths[i + 1]) : RHYTHM_UNKNOWN;
+    }
+    index->interval_count += entry->length;
+
+    for (int i = 0; i + 3 <= entry->length; i++)
+    {
+        uint32_t b = trigram_bucket(&iv[i]);
+        // this song is the newest one, if it is already in the bucket it is the head
+        if (index->buckets[b] != MELODY_MATCH_NO_LINK && index->postings[index->buckets[b]].song == id)
+            continue;
+        melody_match_link_t p = (melody_match_link_t)index->posting_count++;
+        index->postings[p].song = id;
+        index->postings[p].next = index->buckets[b];
+        index->buckets[b] = p;
+    }
+    return id;
+}
+
+int melody_match_add_known(melody_match_index_t *index)
+{
+    int added = 0;
+    for (int i = 0; i < melody_known_song_count; i++)
+    {
+        if (melody_match_add(index, &melody_known_songs[i]) >= 0)
+            added++;
+    }
+    return added;
+}
+
+// query (anywhere inside the song) against song, free start and end in the song
+static int edit_distance(const int8_t *qiv, const int8_t *qrh, int nq,
+                         const int8_t *siv, const int8_t *srh, int ns)
+{
+    uint16_t rows[2][MELODY_MATCH_MAX_INTERVALS + 1];
+    uint16_t *prev = rows[0], *cur = rows[1];
+
+    for (int j = 0; j <= ns; j++)
+        prev[j] = 0;
+
+    for (int i = 1; i <= nq; i++)
+    {
+        cur[0] = i * COST_NOTE;
+        for (int j = 1; j <= ns; j++)
+        {
+            int diff = qiv[i - 1] - siv[j - 1];
+            int sub = diff == 0 ? 0 : (diff == 1 || diff == -1) ? COST_NOTE / 2 : COST_NOTE;
+            // right note with the wrong rhythm costs a quarter of a wrong one: beginners play
+            // evenly, and in a short recording each would cost more than the score can spare
+            if (sub < COST_NOTE && qrh[i - 1] != RHYTHM_UNKNOWN && srh[j - 1] != RHYTHM_UNKNOWN
+                && qrh[i - 1] != srh[j - 1])
+                sub++;
+
+            int best = prev[j - 1] + sub;
+            if (prev[j] + COST_NOTE < best)
+                best = prev[j] + COST_NOTE;         // extra note played
+            if (cur[j - 1] + COST_NOTE < best)
+                best = cur[j - 1] + COST_NOTE;      // song note skipped
+            cur[j] = best;
+        }
+        uint16_t *t = prev;
+        prev = cur;
+        cur = t;
+    }
+
+    int best = prev[0];
+    for (int j = 1; j <= ns; j++)
+    {
+        if (prev[j] < best)
+            best = prev[j];
+    }
+    return best;
+}
+
+int melody_match_query(melody_match_index_t *index, const uint8_t *notes, const uint16_t *lengths,
+                       int count, melody_match_result_t *results, int max_results)
+{
+    if (count > MELODY_MATCH_MAX_NOTES)
+        count = MELODY_MATCH_MAX_NOTES;
+    if (count < MELODY_MATCH_MIN_NOTES || max_results <= 0)
+        return 0;
+
+    int nq = count - 1;
+    int8_t qiv[MELODY_MATCH_MAX_INTERVALS];
+    int8_t qrh[MELODY_MATCH_MAX_INTERVALS];
+    for (int i = 0; i < nq; i++)
+    {
+        qiv[i] = fold_interval(notes[i], notes[i + 1]);
+        qrh[i] = lengths ? rhythm_class(lengths[i], lengths[i + 1]) : RHYTHM_UNKNOWN;
+    }
+
+    // candidates: songs sharing trigrams with the query
+    for (int i = 0; i + 3 <= nq; i++)
+    {
+        melody_match_link_t p = index->buckets[trigram_bucket(&qiv[i])];
+        while (p != MELODY_MATCH_NO_LINK)
+        {
+            uint16_t song = index->postings[p].song;
+            if (index->votes[song] < 255)
+                index->votes[song]++;
+            p = index->postings[p].next;
+        }
+    }
+
+    melody_match_result_t cand[MELODY_MATCH_CANDIDATES];
+    int n = 0;
+    for (int s = 0; s < index->song_count; s++)
+    {
+        uint8_t v = index->votes[s];
+        if (v == 0)
+            continue;
+        index->votes[s] = 0;
+        if (n == MELODY_MATCH_CANDIDATES && v <= cand[n - 1].votes)
+            continue;
+        // keep the best voted ones, sorted by votes
+        int k = n < MELODY_MATCH_CANDIDATES ? n++ : n - 1;
+        while (k > 0 && cand[k - 1].votes < v)
+        {
+            cand[k] = cand[k - 1];
+            k--;
+        }
+        cand[k].song = s;
+        cand[k].votes = v;
+    }
+
+    // rank the candidates by edit distance, more votes first on a tie
+    for (int c = 0; c < n; c++)
+    {
+        const melody_match_entry_t *e = &index->songs[cand[c].song];
+        int d = edit_distance(qiv, qrh, nq, &index->intervals[e->offset], &index->rhythm[e->offset], e->length);
+        int score = 100 - d * 100 / (nq * COST_NOTE);
+        cand[c].distance = d;
+        cand[c].score = score < 0 ? 0 : score;
+
+        int k = c;
+        melody_match_result_t r = cand[c];
+        while (k > 0 && (cand[k - 1].distance > r.distance
+                         || (cand[k - 1].distance == r.distance && cand[k - 1].votes < r.votes)))
+        {
+            cand[k] = cand[k - 1];
+            k--;
+        }
+        cand[k] = r;
+    }
+
+    if (n > max_results)
+        n = max_results;
+    memcpy(results, cand, n * sizeof(*results));
+    return n;
+}
@@ -0,0 +1,75 @@
+#include "melody_match.h"
+
+// The first five are the melodies of the Piano-Web guide (piano.ts), with the rest of the phrase.
+// Pitches in semitones with C = 0 (or 12 when the tune goes below its tonic), lengths in eighths
+// (sixteenths for Happy Birthday), only the ratio between neighbours is used.
+
+#define SONG(n, notes_, lengths_) { n, notes_, lengths_, sizeof(notes_) }
+
+static const uint8_t twinkle_notes[]   = { 0, 0, 7, 7, 9, 9, 7, 5, 5, 4, 4, 2, 2, 0 };
+static const uint8_t twinkle_lengths[] = { 2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 4 };
+
+static const uint8_t mary_notes[]   = { 4, 2, 0, 2, 4, 4, 4, 2, 2, 2, 4, 7, 7,
+                                        4, 2, 0, 2, 4, 4, 4, 4, 2, 2, 4, 2, 0 };
+static const uint8_t mary_lengths[] = { 2, 2, 2, 2, 2, 2, 4, 2, 2, 4, 2, 2, 4,
+                                        2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 8 };
+
+static const uint8_t ode_notes[]   = { 4, 4, 5, 7, 7, 5, 4, 2, 0, 0, 2, 4, 4, 2, 2,
+                                       4, 4, 5, 7, 7, 5, 4, 2, 0, 0, 2, 4, 2, 0, 0 };
+static const uint8_t ode_lengths[] = { 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 1, 4,
+                                       2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 1, 4 };
+
+static const uint8_t birthday_notes[]   = { 0, 0, 2, 0, 5, 4, 0, 0, 2, 0, 7, 5,
+                                            0, 0, 12, 9, 5, 4, 2, 10, 10, 9, 5, 7, 5 };
+static const uint8_t birthday_lengths[] = { 3, 1, 4, 4, 4, 8, 3, 1, 4, 4, 4, 8,
+                                            3, 1, 4, 4, 4, 4, 8, 3, 1, 4, 4, 4, 8 };
+
+static const uint8_t jingle_notes[]   = { 4, 4, 4, 4, 4, 4, 4, 7, 0, 2, 4,
+                                          5, 5, 5, 5, 5, 4, 4, 4, 4, 2, 2, 4, 2, 7 };
+static const uint8_t jingle_lengths[] = { 2, 2, 4, 2, 2, 4, 2, 2, 3, 1, 8,
+                                          2, 2, 3, 1, 2, 2, 2, 1, 1, 2, 2, 2, 4, 4 };
+
+// the Piano-Web guide teaches Jingle Bells with this ending, recognize both
+static const uint8_t jingle_guide_notes[] = { 4, 4, 4, 4, 4, 4, 4, 0, 2, 4, 5, 4 };
+static const uint8_t jingle_guide_lengths[] = { 2, 2, 4, 2, 2, 4, 2, 2, 2, 2, 2, 4 };
+
+static const uint8_t jacques_notes[]   = { 12, 14, 16, 12, 12, 14, 16, 12, 16, 17, 19, 16, 17, 19,
+                                           19, 21, 19, 17, 16, 12, 19, 21, 19, 17, 16, 12, 12, 7, 12 };
+static const uint8_t jacques_lengths[] = { 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 4, 2, 2, 4,
+                                           1, 1, 1, 1, 2, 2, 1, 1, 1, 1, 2, 2, 2, 2, 4 };
+
+static const uint8_t london_notes[]   = { 7, 9, 7, 5, 4, 5, 7, 2, 4, 5, 4, 5, 7,
+                                          7, 9, 7, 5, 4, 5, 7, 2, 7, 4, 0 };
+static const uint8_t london_lengths[] = { 3, 1, 2, 2, 2, 2, 4, 2, 2, 4, 2, 2, 4,
+                                          3, 1, 2, 2, 2, 2, 4, 4, 4, 2, 6 };
+
+static const uint8_t row_notes[]   = { 0, 0, 0, 2, 4, 4, 2, 4, 5, 7,
+                                       12, 12, 12, 7, 7, 7, 4, 4, 4, 0, 0, 0, 7, 5, 4, 2, 0 };
+static const uint8_t row_lengths[] = { 3, 3, 2, 1, 3, 2, 1, 2, 1, 6,
+                                       1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 1, 2, 1, 6 };
+
+static const uint8_t macdonald_notes[]   = { 12, 12, 12, 7, 9, 9, 7, 16, 16, 14, 14, 12 };
+static const uint8_t macdonald_lengths[] = { 2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 4 };
+
+static const uint8_t lune_notes[]   = { 0, 0, 0, 2, 4, 2, 0, 4, 2, 2, 0 };
+static const uint8_t lune_lengths[] = { 2, 2, 2, 2, 4, 4, 2, 2, 2, 2, 8 };
+
+static const uint8_t saints_notes[]   = { 0, 4, 5, 7, 0, 4, 5, 7, 0, 4, 5, 7, 4, 0, 4, 2 };
+static const uint8_t saints_lengths[] = { 2, 2, 2, 10, 2, 2, 2, 10, 2, 2, 2, 4, 4, 4, 4, 12 };
+
+const melody_song_t melody_known_songs[] = {
+    SONG("Twinkle Twinkle", twinkle_notes, twinkle_lengths),
+    SONG("Mary Had a Little Lamb", mary_notes, mary_lengths),
+    SONG("Ode to Joy", ode_notes, ode_lengths),
+    SONG("Happy Birthday", birthday_notes, birthday_lengths),
+    SONG("Jingle Bells", jingle_notes, jingle_lengths),
+    SONG("Jingle Bells", jingle_guide_notes, jingle_guide_lengths),
+    SONG("Frere Jacques", jacques_notes, jacques_lengths),
+    SONG("London Bridge", london_notes, london_lengths),
+    SONG("Row Row Row Your Boat", row_notes, row_lengths),
+    SONG("Old MacDonald", macdonald_notes, macdonald_lengths),
+    SONG("Au Clair de la Lune", lune_notes, lune_lengths),
+    SONG("When the Saints", saints_notes, saints_lengths),
+};
+
+const int melody_known_song_count = sizeof(melody_known_songs) / sizeof(melody_known_songs[0]);
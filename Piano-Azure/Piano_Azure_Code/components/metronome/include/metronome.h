@@ -0,0 +1,34 @@
+#pragma once
+#include "esp_err.h"
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// Metronome on a hardware timer (GPTimer, 1 MHz). The alarm reloads the counter in hardware every
+// beat, so the period is exact to the microsecond and never drifts, however late the tasks run.
+// The alarm ISR only notifies one task, with the beat number as the notification value; beat n is
+// at metronome_beat_time(n) on the esp_timer clock (same crystal, no drift between the two).
+// metronome_quantize() snaps a timestamp to the same grid, for recordings as the notes arrive.
+
+#define METRONOME_MIN_BPM 30
+#define METRONOME_MAX_BPM 300
+
+// the task that gets every beat (xTaskNotifyWait), before any other call
+esp_err_t metronome_init(TaskHandle_t beat_task);
+
+// (re)start at bpm, beat 0 is notified right away; METRONOME_MIN_BPM..METRONOME_MAX_BPM
+esp_err_t metronome_start(int bpm);
+
+esp_err_t metronome_stop(void);
+
+// tempo, 0 when stopped
+int metronome_bpm(void);
+
+// esp_timer time (us) of a notified beat
+int64_t metronome_beat_time(uint32_t beat);
+
+// t_us moved to the nearest 1/division of a beat; unchanged when stopped or division is 0
+int64_t metronome_quantize(int64_t t_us, int division);
+
+// length of 1/division of a beat in us, 0 when stopped or division is 0
+int64_t metronome_grid_us(int division);
@@ -0,0 +1,140 @@
+#include "metronome.h"
+#include <stdio.h>
+#include "driver/gptimer.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+
+static const char *TAG = "metronome";
+
+#define TIMER_HZ 1000000   // one count per microsecond, same unit as esp_timer
+
+static gptimer_handle_t timer;
+static TaskHandle_t task;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;   // start_us, period_us and bpm go together
+static int64_t start_us = 0;
+static int64_t period_us = 0;    // 0 = stopped
+static int bpm = 0;
+static volatile uint32_t beat = 0;
+
+static bool IRAM_ATTR on_beat(gptimer_handle_t t, const gptimer_alarm_event_data_t *edata, void *ctx)
+{
+    BaseType_t woken = pdFALSE;
+    xTaskNotifyFromISR(task, ++beat, eSetValueWithOverwrite, &woken);
+    return woken == pdTRUE;
+}
+
+esp_err_t metronome_init(TaskHandle_t beat_task)
+{
+    gptimer_config_t config = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = TIMER_HZ,
+    };
+    gptimer_event_callbacks_t callbacks = { .on_alarm = on_beat };
+
+    task = beat_task;
+    esp_err_t err = gptimer_new_timer(&config, &timer);
+    if (err == ESP_OK)
+        err = gptimer_register_event_callbacks(timer, &callbacks, NULL);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "timer setup failed: %d", err);
+        timer = NULL;
+    }
+    return err;
+}
+
+esp_err_t metronome_start(int new_bpm)
+{
+    if (timer == NULL)
+        return ESP_ERR_INVALID_STATE;
+    if (new_bpm < METRONOME_MIN_BPM || new_bpm > METRONOME_MAX_BPM)
+        return ESP_ERR_INVALID_ARG;
+
+    metronome_stop();
+
+    // the hardware reloads to 0 on every alarm: the beat is period counts long, exactly
+    gptimer_alarm_config_t alarm = {
+        .alarm_count = (uint64_t)TIMER_HZ * 60 / new_bpm,
+        .reload_count = 0,
+        .flags.auto_reload_on_alarm = true,
+    };
+    esp_err_t err = gptimer_set_raw_count(timer, 0);
+    if (err == ESP_OK)
+        err = gptimer_set_alarm_action(timer, &alarm);
+    // enabled only while it runs: with power management on it holds the APB clock (and keeps
+    // the chip out of light sleep) meanwhile
+    if (err == ESP_OK)
+        err = gptimer_enable(timer);
+    if (err != ESP_OK)
+        return err;
+
+    // beat 0 is now; the counter starts a few us later, the same few us for every beat
+    portENTER_CRITICAL(&lock);
+    beat = 0;
+    bpm = new_bpm;
+    period_us = alarm.alarm_count;
+    start_us = esp_timer_get_time();
+    portEXIT_CRITICAL(&lock);
+    err = gptimer_start(timer);
+    if (err != ESP_OK)
+    {
+        metronome_stop();
+        return err;
+    }
+
+    xTaskNotify(task, 0, eSetValueWithOverwrite);
+    printf("Metronome: %d bpm\n", new_bpm);
+    return ESP_OK;
+}
+
+esp_err_t metronome_stop(void)
+{
+    if (timer == NULL)
+        return ESP_ERR_INVALID_STATE;
+
+    portENTER_CRITICAL(&lock);
+    bool running = period_us != 0;
+    period_us = 0;
+    bpm = 0;
+    portEXIT_CRITICAL(&lock);
+    if (!running)
+        return ESP_OK;
+    gptimer_stop(timer);
+    return gptimer_disable(timer);
+}
+
+int metronome_bpm(void)
+{
+    return bpm;
+}
+
+int64_t metronome_beat_time(uint32_t n)
+{
+    portENTER_CRITICAL(&lock);
+    int64_t t = start_us + (int64_t)n * period_us;
+    portEXIT_CRITICAL(&lock);
+    return t;
+}
+
+int64_t metronome_quantize(int64_t t_us, int division)
+{
+    portENTER_CRITICAL(&lock);
+    int64_t start = start_us;
+    int64_t period = period_us;
+    portEXIT_CRITICAL(&lock);
+
+    if (period == 0 || division <= 0 || t_us <= start)
+        return t_us;
+
+    // grid point k is at start + k * period / division: exact, no rounding error piles up
+    int64_t k = ((t_us - start) * division + period / 2) / period;
+    return start + k * period / division;
+}
+
+int64_t metronome_grid_us(int division)
+{
+    int64_t period = period_us;
+    return division > 0 ? period / division : 0;
+}
@@ -0,0 +1,161 @@
+#include "midi_out.h"
+#include <stdio.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "driver/uart.h"
+#include "esp_log.h"
+
+static const char *TAG = "midi_out";
+
+#define NOTE_ON    0x90
+#define PITCH_BEND 0xE0
+#define TEST_BURSTS 8
+
+static int midi_uart = -1;
+static uint8_t midi_channel = 0;
+static uint8_t running_status = 0;     // last status byte on the wire, 0 = none yet
+static SemaphoreHandle_t midi_mutex;   // Buttons_task (notes) and Pot_task (bend) both send
+
+static atomic_uint_least32_t messages = 0;
+static atomic_uint_least32_t bytes = 0;
+static atomic_uint_least32_t saved = 0;    // status bytes left out thanks to running status
+static atomic_uint_least32_t dropped = 0;
+
+// one channel message into out, the status byte only when it differs from the previous one
+static size_t encode(uint8_t *out, uint8_t status, uint8_t data1, uint8_t data2)
+{
+    size_t n = 0;
+    if (status != running_status)
+    {
+        out[n++] = status;
+        running_status = status;
+    }
+    out[n++] = data1 & 0x7F;
+    out[n++] = data2 & 0x7F;
+    return n;
+}
+
+static void send(uint8_t status, uint8_t data1, uint8_t data2)
+{
+    if (midi_uart < 0)
+        return;
+
+    xSemaphoreTake(midi_mutex, portMAX_DELAY);
+    uint8_t previous = running_status;
+    uint8_t msg[3];
+    size_t len = encode(msg, status, data1, data2);
+
+    // uart_write_bytes() would block on a full buffer, the key scan must not
+    size_t space = 0;
+    if (uart_get_tx_buffer_free_size(midi_uart, &space) != ESP_OK || space < len)
+    {
+        running_status = previous;   // nothing went out, the next message needs its status
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    }
+    else
+    {
+        uart_write_bytes(midi_uart, msg, len);
+        atomic_fetch_add_explicit(&messages, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&bytes, len, memory_order_relaxed);
+        if (len == 2)
+            atomic_fetch_add_explicit(&saved, 1, memory_order_relaxed);
+    }
+    xSemaphoreGive(midi_mutex);
+}
+
+esp_err_t midi_out_init(int uart, int tx_gpio, int baud, int channel)
+{
+    static StaticSemaphore_t midi_mutex_buffer;
+    uart_config_t config = {
+        .baud_rate = baud,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .source_clk = UART_SCLK_DEFAULT,
+    };
+
+    if (channel < 1 || channel > 16)
+        return ESP_ERR_INVALID_ARG;
+
+    // the driver wants an RX buffer larger than the 128 byte FIFO even though nothing is read
+    esp_err_t err = uart_driver_install(uart, 256, MIDI_OUT_TX_BUFFER, 0, NULL, 0);
+    if (err == ESP_OK)
+        err = uart_param_config(uart, &config);
+    if (err == ESP_OK)
+        err = uart_set_pin(uart, tx_gpio, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "UART%d setup failed: %d", uart, err);
+        return err;
+    }
+
+    midi_mutex = xSemaphoreCreateMutexStatic(&midi_mutex_buffer);
+    midi_channel = channel - 1;
+    midi_uart = uart;
+    printf("MIDI out on UART%d TX GPIO%d, %d baud, channel %d\n", uart, tx_gpio, baud, channel);
+    return ESP_OK;
+}
+
+void midi_out_note(int key, bool on)
+{
+    send(NOTE_ON | midi_channel, MIDI_OUT_FIRST_NOTE + key, on ? MIDI_OUT_VELOCITY : 0);
+}
+
+void midi_out_bend(uint16_t value)
+{
+    if (value > 0x3FFF)
+        value = 0x3FFF;
+    send(PITCH_BEND | midi_channel, value & 0x7F, value >> 7);
+}
+
+void midi_out_test(void)
+{
+    if (midi_uart < 0)
+    {
+        printf("MIDI out is off (PIANO_MIDI_OUT)\n");
+        return;
+    }
+
+    uint8_t burst[2 * (1 + 12 * 2) + 2 * 3];
+    uint8_t on = NOTE_ON | midi_channel;
+    uint8_t bend = PITCH_BEND | midi_channel;
+
+    xSemaphoreTake(midi_mutex, portMAX_DELAY);
+    running_status = 0;   // the expected bytes start with a status
+    for (int b = 0; b < TEST_BURSTS; b++)
+    {
+        size_t n = 0;
+        for (int key = 0; key < 12; key++)
+            n += encode(burst + n, on, MIDI_OUT_FIRST_NOTE + key, MIDI_OUT_VELOCITY);
+        n += encode(burst + n, bend, 0x7F, 0x7F);
+        for (int key = 0; key < 12; key++)
+            n += encode(burst + n, on, MIDI_OUT_FIRST_NOTE + key, 0);
+        n += encode(burst + n, bend, MIDI_OUT_BEND_CENTER & 0x7F, MIDI_OUT_BEND_CENTER >> 7);
+
+        // the console task may wait here, the bursts stay whole
+        uart_write_bytes(midi_uart, burst, n);
+        uart_wait_tx_done(midi_uart, pdMS_TO_TICKS(100));
+        atomic_fetch_add_explicit(&messages, 2 * 12 + 2, memory_order_relaxed);
+        atomic_fetch_add_explicit(&bytes, n, memory_order_relaxed);
+        atomic_fetch_add_explicit(&saved, 2 * 12 + 2 - 4, memory_order_relaxed);
+    }
+    xSemaphoreGive(midi_mutex);
+    printf("MIDI test: %d bursts of %u bytes sent\n", TEST_BURSTS, (unsigned)sizeof(burst));
+}
+
+esp_err_t midi_out_write_prometheus(prom_sink_t sink, void *ctx)
+{
+    char line[384];
+    int len = snprintf(line, sizeof(line),
+                       "# TYPE piano_midi_messages_total counter\npiano_midi_messages_total %lu\n"
+                       "# TYPE piano_midi_bytes_total counter\npiano_midi_bytes_total %lu\n"
+                       "# TYPE piano_midi_running_status_saved_bytes_total counter\npiano_midi_running_status_saved_bytes_total %lu\n"
+                       "# TYPE piano_midi_dropped_total counter\npiano_midi_dropped_total %lu\n",
+                       (unsigned long)atomic_load_explicit(&messages, memory_order_relaxed),
+                       (unsigned long)atomic_load_explicit(&bytes, memory_order_relaxed),
+                       (unsigned long)atomic_load_explicit(&saved, memory_order_relaxed),
+                       (unsigned long)atomic_load_explicit(&dropped, memory_order_relaxed));
+    return sink(ctx, line, len);
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+// Power management (PIANO_POWER_SAVE): esp_pm runs the CPU at max_mhz only while something holds
+// a lock for it and at min_mhz otherwise, and with light_sleep the idle task puts the chip to
+// light sleep whenever no task is due for a few ticks (tickless idle). The drivers that need their
+// clock while they run hold a lock meanwhile: the buzzer's LEDC while a note sounds, GPTimers while
+// enabled, the DAC's DMA, I2C during a transfer, WiFi between beacons.
+// What wakes it: any task timeout, the keys (buttons_wait()) and the console, whose first
+// character only wakes the chip and is lost.
+
+#define POWER_CONSOLE_WAKE_CHARS 3   // UART0 RX edges that wake the chip
+
+esp_err_t power_init(int max_mhz, int min_mhz, bool light_sleep);
+
+// esp_pm's locks with their holders and, with CONFIG_PM_PROFILING, the time spent in every mode
+// since boot; the "SLEEP" line is the light sleep residency
+void power_print(FILE *out);
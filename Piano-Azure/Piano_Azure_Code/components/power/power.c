@@ -0,0 +1,49 @@
+#include "power.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "driver/uart.h"
+#include "esp_log.h"
+
+static const char *TAG = "power";
+
+esp_err_t power_init(int max_mhz, int min_mhz, bool light_sleep)
+{
+#if CONFIG_PM_ENABLE
+    esp_pm_config_t config = {
+        .max_freq_mhz = max_mhz,
+        .min_freq_mhz = min_mhz,
+        .light_sleep_enable = light_sleep,
+    };
+    esp_err_t err = esp_pm_configure(&config);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "esp_pm_configure failed: %d", err);
+        return err;
+    }
+
+    if (light_sleep)
+    {
+        // typing on the console wakes it too
+        err = uart_set_wakeup_threshold(UART_NUM_0, POWER_CONSOLE_WAKE_CHARS);
+        if (err == ESP_OK)
+            err = esp_sleep_enable_uart_wakeup(UART_NUM_0);
+        if (err != ESP_OK)
+            ESP_LOGW(TAG, "no console wake-up: %d", err);
+    }
+
+    ESP_LOGI(TAG, "CPU %d-%d MHz, light sleep %s", min_mhz, max_mhz, light_sleep ? "on" : "off");
+    return ESP_OK;
+#else
+    ESP_LOGW(TAG, "CONFIG_PM_ENABLE is off, running at full speed");
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+void power_print(FILE *out)
+{
+#if CONFIG_PM_ENABLE
+    esp_pm_dump_locks(out);
+#else
+    fprintf(out, "power management off\n");
+#endif
+}
@@ -0,0 +1,7 @@
+#pragma once
+#include "esp_err.h"
+#include <stddef.h>
+
+// receives Prometheus text piece by piece (HTTP chunk, console...), for every component's
+// *_write_prometheus()
+typedef esp_err_t (*prom_sink_t)(void *ctx, const char *data, size_t len);
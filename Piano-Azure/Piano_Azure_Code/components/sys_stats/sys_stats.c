@@ -0,0 +1,300 @@
+#include "sys_stats.h"
+#include <stdio.h>
+#include <string.h>
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "driver/uart.h"
+
+static const char *TAG = "sys_stats";
+
+#define CONSOLE_UART        UART_NUM_0
+#define CONSOLE_STACK_SIZE  3328    // the report line is on its stack
+#define CONSOLE_LINE_MAX    32
+
+typedef struct {
+    TaskHandle_t task;
+    const char *name;
+    uint32_t stack_size;
+} watched_task_t;
+
+typedef struct {
+    const char *command;
+    void (*handler)(void);
+    void (*handler_arg)(const char *arg);   // instead of handler for "command <arg>"
+} console_command_t;
+
+static SemaphoreHandle_t stats_mutex;
+static sys_stats_extra_t extra_fields;
+static watched_task_t watched[SYS_STATS_MAX_WATCHED];
+static int watched_count = 0;
+static console_command_t commands[SYS_STATS_MAX_COMMANDS];
+static int command_count = 0;
+
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+#define HAVE_RUN_TIME_STATS 1
+static TaskStatus_t task_status[SYS_STATS_MAX_TASKS];
+// counters of the previous report, for CPU use since then
+static struct {
+    TaskHandle_t task;
+    uint32_t run_time;
+} previous[SYS_STATS_MAX_TASKS];
+static int previous_count = 0;
+static uint32_t previous_total = 0;
+#endif
+
+void sys_stats_init(sys_stats_extra_t extra)
+{
+    static StaticSemaphore_t stats_mutex_buffer;
+    if (stats_mutex == NULL)
+        stats_mutex = xSemaphoreCreateMutexStatic(&stats_mutex_buffer);
+    extra_fields = extra;
+}
+
+void sys_stats_watch_stack(TaskHandle_t task, const char *name, uint32_t stack_size)
+{
+    if (task == NULL || watched_count >= SYS_STATS_MAX_WATCHED)
+        return;
+    watched[watched_count].task = task;
+    watched[watched_count].name = name;
+    watched[watched_count].stack_size = stack_size;
+    watched_count++;
+}
+
+static uint32_t watched_stack_size(TaskHandle_t task)
+{
+    for (int i = 0; i < watched_count; i++)
+    {
+        if (watched[i].task == task)
+            return watched[i].stack_size;
+    }
+    return 0;
+}
+
+// ",\"stack_size\":N,\"stack_used_max\":N" for watched tasks, nothing for the others
+static int stack_fields(char *buf, size_t size, TaskHandle_t task, uint32_t free_min)
+{
+    uint32_t stack_size = watched_stack_size(task);
+    if (stack_size == 0)
+        return snprintf(buf, size, ",\"stack_free_min\":%lu}", (unsigned long)free_min);
+    return snprintf(buf, size, ",\"stack_free_min\":%lu,\"stack_size\":%lu,\"stack_used_max\":%lu}",
+                    (unsigned long)free_min, (unsigned long)stack_size, (unsigned long)(stack_size - free_min));
+}
+
+#if HAVE_RUN_TIME_STATS
+static char state_char(eTaskState state)
+{
+    switch (state)
+    {
+    case eRunning:   return 'X';
+    case eReady:     return 'R';
+    case eBlocked:   return 'B';
+    case eSuspended: return 'S';
+    case eDeleted:   return 'D';
+    default:         return '?';
+    }
+}
+
+static uint32_t previous_run_time(TaskHandle_t task)
+{
+    for (int i = 0; i < previous_count; i++)
+    {
+        if (previous[i].task == task)
+            return previous[i].run_time;
+    }
+    return 0;
+}
+#endif
+
+esp_err_t sys_stats_write(sys_stats_sink_t sink, void *ctx)
+{
+    char line[SYS_STATS_LINE_MAX];
+    esp_err_t err = ESP_OK;
+    int len;
+
+    if (stats_mutex == NULL)
+        return ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(stats_mutex, portMAX_DELAY);
+
+    len = snprintf(line, sizeof(line),
+                   "{\"uptime_ms\":%llu,\"heap\":{\"free\":%u,\"min_free\":%u,\"largest_block\":%u,\"internal_free\":%u},\"tasks\":[",
+                   (unsigned long long)(esp_timer_get_time() / 1000),
+                   (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT),
+                   (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+                   (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT),
+                   (unsigned)heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    err = sink(ctx, line, len);
+
+#if HAVE_RUN_TIME_STATS
+    uint32_t total = 0;
+    int count = uxTaskGetSystemState(task_status, SYS_STATS_MAX_TASKS, &total);
+    uint32_t elapsed = total - previous_total;
+
+    for (int i = 0; i < count && err == ESP_OK; i++)
+    {
+        const TaskStatus_t *t = &task_status[i];
+        BaseType_t core = xTaskGetCoreID(t->xHandle);
+        // percent of one core, since the previous report (since boot for the first one)
+        uint32_t used = t->ulRunTimeCounter - previous_run_time(t->xHandle);
+        uint32_t cpu_x10 = elapsed ? (uint32_t)((uint64_t)used * 1000 / elapsed) : 0;
+
+        len = snprintf(line, sizeof(line), "%s{\"name\":\"%s\",\"core\":%d,\"prio\":%u,\"state\":\"%c\",\"cpu\":%lu.%lu",
+                       i ? "," : "", t->pcTaskName, core == tskNO_AFFINITY ? -1 : (int)core,
+                       (unsigned)t->uxCurrentPriority, state_char(t->eCurrentState),
+                       (unsigned long)(cpu_x10 / 10), (unsigned long)(cpu_x10 % 10));
+        len += stack_fields(line + len, sizeof(line) - len, t->xHandle, t->usStackHighWaterMark);
+        err = sink(ctx, line, len);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        previous[i].task = task_status[i].xHandle;
+        previous[i].run_time = task_status[i].ulRunTimeCounter;
+    }
+    previous_count = count;
+    previous_total = total;
+#else
+    for (int i = 0; i < watched_count && err == ESP_OK; i++)
+    {
+        len = snprintf(line, sizeof(line), "%s{\"name\":\"%s\"", i ? "," : "", watched[i].name);
+        len += stack_fields(line + len, sizeof(line) - len, watched[i].task,
+                            uxTaskGetStackHighWaterMark(watched[i].task));
+        err = sink(ctx, line, len);
+    }
+#endif
+
+    if (err == ESP_OK)
+    {
+        len = snprintf(line, sizeof(line), "]");
+        if (extra_fields != NULL)
+        {
+            int extra = extra_fields(line + len + 1, sizeof(line) - len - 2);
+            // drop the app fields rather than send cut JSON
+            if (extra > 0 && extra < (int)sizeof(line) - len - 2)
+            {
+                line[len++] = ',';
+                len += extra;
+            }
+        }
+        line[len++] = '}';
+        err = sink(ctx, line, len);
+    }
+
+    xSemaphoreGive(stats_mutex);
+    return err;
+}
+
+static esp_err_t stdout_sink(void *ctx, const char *data, size_t len)
+{
+    fwrite(data, 1, len, stdout);
+    return ESP_OK;
+}
+
+void sys_stats_print(void)
+{
+    if (sys_stats_write(stdout_sink, NULL) == ESP_OK)
+        printf("\n");
+}
+
+static void console_task(void *pvParameters)
+{
+    char line[CONSOLE_LINE_MAX];
+    int len = 0;
+
+    while (1)
+    {
+        char c;
+        if (uart_read_bytes(CONSOLE_UART, &c, 1, portMAX_DELAY) != 1)
+            continue;
+
+        if (c != '\r' && c != '\n')
+        {
+            if (len < CONSOLE_LINE_MAX - 1)
+                line[len++] = c;
+            continue;
+        }
+        line[len] = '\0';
+        len = 0;
+        if (line[0] == '\0')
+            continue;
+        if (strcmp(line, "stats") == 0)
+        {
+            sys_stats_print();
+            continue;
+        }
+
+        // "mute 2": the command, then everything after the first space
+        char *arg = strchr(line, ' ');
+        if (arg != NULL)
+            *arg++ = '\0';
+
+        int i = 0;
+        while (i < command_count && strcmp(line, commands[i].command) != 0)
+            i++;
+        if (i < command_count && commands[i].handler_arg != NULL)
+        {
+            commands[i].handler_arg(arg != NULL ? arg : "");
+            continue;
+        }
+        if (i < command_count && arg == NULL)
+        {
+            commands[i].handler();
+            continue;
+        }
+
+        printf("commands: stats");
+        for (i = 0; i < command_count; i++)
+            printf(" %s", commands[i].command);
+        printf("\n");
+    }
+}
+
+esp_err_t sys_stats_console_add(const char *command, void (*handler)(void))
+{
+    if (command_count >= SYS_STATS_MAX_COMMANDS)
+        return ESP_ERR_NO_MEM;
+    commands[command_count].command = command;
+    commands[command_count].handler = handler;
+    commands[command_count].handler_arg = NULL;
+    command_count++;
+    return ESP_OK;
+}
+
+esp_err_t sys_stats_console_add_arg(const char *command, void (*handler)(const char *arg))
+{
+    if (command_count >= SYS_STATS_MAX_COMMANDS)
+        return ESP_ERR_NO_MEM;
+    commands[command_count].command = command;
+    commands[command_count].handler = NULL;
+    commands[command_count].handler_arg = handler;
+    command_count++;
+    return ESP_OK;
+}
+
+esp_err_t sys_stats_console_start(UBaseType_t priority, BaseType_t core)
+{
+    static TaskHandle_t task = NULL;
+    if (task != NULL)
+        return ESP_ERR_INVALID_STATE;  // one console, its stack is static
+
+    if (!uart_is_driver_installed(CONSOLE_UART))
+    {
+        // RX only, printf keeps writing to the console as before
+        esp_err_t err = uart_driver_install(CONSOLE_UART, 256, 0, 0, NULL, 0);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "uart_driver_install failed: %d", err);
+            return err;
+        }
+    }
+
+    static StackType_t stack[CONSOLE_STACK_SIZE];
+    static StaticTask_t tcb;
+    task = xTaskCreateStaticPinnedToCore(console_task, "Console Task", CONSOLE_STACK_SIZE, NULL,
+                                         priority, stack, &tcb, core);
+    if (task == NULL)
+        return ESP_ERR_INVALID_STATE;
+    sys_stats_watch_stack(task, "Console Task", CONSOLE_STACK_SIZE);
+    return ESP_OK;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "esp_err.h"
+#include "sdkconfig.h"
+#include <stdint.h>
+#include <stddef.h>
+
+// Timeline of task loops, mutex waits, I2C reads and HTTP sends (menuconfig: PIANO_TRACE).
+// Every core has its own ring of CONFIG_PIANO_TRACE_EVENTS records, the newest overwrite the
+// oldest. Recording is one atomic add and a 16 byte store, no lock; with PIANO_TRACE off the
+// macros compile to nothing. tools/trace_to_chrome.py turns a dump into a Perfetto trace.
+
+#define TRACE_EVENT_BEGIN    'B'
+#define TRACE_EVENT_END      'E'
+#define TRACE_EVENT_INSTANT  'i'
+
+#define TRACE_MAGIC          0x43525450   // "PTRC" in a little endian dump
+#define TRACE_VERSION        1
+
+// one record, also the dump format (little endian)
+typedef struct {
+    uint32_t ts_us;      // esp_timer_get_time(), low 32 bits
+    uint32_t name;       // address of a string literal, resolved by the string table of the dump
+    uint32_t task;       // TaskHandle_t that recorded it
+    uint8_t type;        // TRACE_EVENT_*
+    uint8_t core;
+    uint16_t arg;
+} trace_record_t;
+
+// receives the dump piece by piece (HTTP chunk, console...)
+typedef esp_err_t (*trace_sink_t)(void *ctx, const void *data, size_t len);
+
+#if CONFIG_PIANO_TRACE
+#define TRACE_BEGIN(name)          trace_record(TRACE_EVENT_BEGIN, (name), 0)
+#define TRACE_END(name)            trace_record(TRACE_EVENT_END, (name), 0)
+#define TRACE_INSTANT(name, arg)   trace_record(TRACE_EVENT_INSTANT, (name), (arg))
+#else
+#define TRACE_BEGIN(name)          ((void)0)
+#define TRACE_END(name)            ((void)0)
+#define TRACE_INSTANT(name, arg)   ((void)(arg))
+#endif
+
+// measure the cost of one record and start recording
+void trace_init(void);
+
+// name must be a string literal (only its address is stored)
+void trace_record(uint8_t type, const char *name, uint16_t arg);
+
+// cost of one record measured by trace_init(), in ns
+uint32_t trace_overhead_ns(void);
+
+// binary dump of both rings, their names and the task names; recording pauses meanwhile
+esp_err_t trace_dump(trace_sink_t sink, void *ctx);
+
+// the dump on the console as base64 lines between "TRACE BEGIN" and "TRACE END"
+void trace_print(void);
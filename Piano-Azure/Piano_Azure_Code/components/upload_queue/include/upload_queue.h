@@ -0,0 +1,59 @@
+#pragma once
+#include "esp_err.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_log.h"
+#include "melody.h"
+
+// recordings kept in NVS (oldest is dropped when full), ~1.2KB each at most
+#define UPLOAD_QUEUE_SLOTS      6
+// recordings sent together in one request
+#define UPLOAD_BATCH_MAX        3
+// retry backoff, doubled after every failed attempt (+ up to 25% jitter)
+#define UPLOAD_RETRY_MIN_MS     2000
+#define UPLOAD_RETRY_MAX_MS     120000
+
+typedef struct {
+    uint32_t depth;            // recordings waiting
+    uint32_t enqueued;
+    uint32_t delivered;
+    uint32_t dropped;          // oldest recording overwritten because the queue was full
+    uint32_t rejected;         // refused by the server (400/413/422) or unreadable, not retried
+    uint32_t retries;          // failed attempts that were rescheduled
+    uint32_t backoff_ms;       // current retry delay, 0 = no failure pending
+    uint32_t last_latency_ms;  // enqueue -> delivered (recordings queued in this boot only)
+    uint32_t max_latency_ms;
+} upload_queue_stats_t;
+
+// open the NVS namespace and pick up recordings left from the previous run
+// nvs_flash_init() must have been called before
+esp_err_t upload_queue_init(void);
+
+// store a copy of the recording in flash, sets melody->id
+esp_err_t upload_queue_push(melody_t *melody);
+
+// number of recordings waiting
+int upload_queue_depth(void);
+
+// true when something is waiting and the retry backoff has elapsed
+bool upload_queue_due(void);
+
+// ms until upload_queue_due() becomes true, 0 when due now, UINT32_MAX when empty
+uint32_t upload_queue_wait_ms(void);
+
+// read the index-th oldest recording (0 = oldest)
+esp_err_t upload_queue_read(int index, melody_t *out);
+
+// the n oldest recordings were delivered, removes them and resets the backoff
+void upload_queue_delivered(int n);
+
+// the n oldest recordings can never be delivered, removes them
+void upload_queue_discard(int n);
+
+// the last attempt failed, returns the delay until the next one (ms)
+uint32_t upload_queue_failed(void);
+
+void upload_queue_get_stats(upload_queue_stats_t *out);
+
+// print stats on console
+void upload_queue_print_stats(void);
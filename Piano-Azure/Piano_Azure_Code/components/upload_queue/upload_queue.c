@@ -0,0 +1,218 @@
+#include "upload_queue.h"
+#include "nvs.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "upload_q";
+
+#define UPLOAD_NVS_NAMESPACE "upload_q"
+
+static nvs_handle_t nvs;
+static SemaphoreHandle_t queue_mutex;
+
+// sequence numbers, recording n lives in slot n % UPLOAD_QUEUE_SLOTS
+static uint32_t head = 0;   // oldest stored recording
+static uint32_t tail = 0;   // next recording to store
+
+// esp_timer time of the push, 0 = stored during a previous boot
+static int64_t enqueued_us[UPLOAD_QUEUE_SLOTS] = {0};
+static int64_t next_attempt_us = 0;
+static upload_queue_stats_t stats = {0};
+
+static void slot_key(uint32_t seq, char *key, size_t len)
+{
+    snprintf(key, len, "m%lu", seq % UPLOAD_QUEUE_SLOTS);
+}
+
+// caller holds queue_mutex
+static void save_indexes(void)
+{
+    nvs_set_u32(nvs, "head", head);
+    nvs_set_u32(nvs, "tail", tail);
+    nvs_commit(nvs);
+}
+
+// caller holds queue_mutex
+static void remove_oldest(int n)
+{
+    char key[8];
+    while (n-- > 0 && head != tail)
+    {
+        slot_key(head, key, sizeof(key));
+        nvs_erase_key(nvs, key);
+        enqueued_us[head % UPLOAD_QUEUE_SLOTS] = 0;
+        head++;
+    }
+    save_indexes();
+}
+
+esp_err_t upload_queue_init(void)
+{
+    static StaticSemaphore_t queue_mutex_buffer;
+    queue_mutex = xSemaphoreCreateMutexStatic(&queue_mutex_buffer);
+
+    esp_err_t err = nvs_open(UPLOAD_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "nvs_open failed: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    // missing keys (first boot) leave the indexes at 0
+    nvs_get_u32(nvs, "head", &head);
+    nvs_get_u32(nvs, "tail", &tail);
+    if (tail - head > UPLOAD_QUEUE_SLOTS)
+    {
+        ESP_LOGW(TAG, "Queue indexes corrupted (%lu..%lu), starting empty", head, tail);
+        head = tail;
+        save_indexes();
+    }
+
+    ESP_LOGI(TAG, "Upload queue ready, %lu recordings waiting", tail - head);
+    return ESP_OK;
+}
+
+esp_err_t upload_queue_push(melody_t *melody)
+{
+    if (melody->count > MELODY_MAX_EVENTS)
+        return ESP_ERR_INVALID_SIZE;
+
+    xSemaphoreTake(queue_mutex, portMAX_DELAY);
+
+    if (tail - head >= UPLOAD_QUEUE_SLOTS)
+    {
+        ESP_LOGW(TAG, "Queue full, dropping recording %lu", head);
+        remove_oldest(1);
+        stats.dropped++;
+    }
+
+    char key[8];
+    slot_key(tail, key, sizeof(key));
+    melody->id = tail;
+
+    esp_err_t err = nvs_set_blob(nvs, key, melody, melody_size(melody->count));
+    if (err == ESP_OK)
+    {
+        enqueued_us[tail % UPLOAD_QUEUE_SLOTS] = esp_timer_get_time();
+        tail++;
+        save_indexes();
+        stats.enqueued++;
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Saving recording failed: %s", esp_err_to_name(err));
+    }
+
+    xSemaphoreGive(queue_mutex);
+    return err;
+}
+
+int upload_queue_depth(void)
+{
+    xSemaphoreTake(queue_mutex, portMAX_DELAY);
+    int depth = (int)(tail - head);
+    xSemaphoreGive(queue_mutex);
+    return depth;
+}
+
+bool upload_queue_due(void)
+{
+    return upload_queue_depth() > 0 && esp_timer_get_time() >= next_attempt_us;
+}
+
+uint32_t upload_queue_wait_ms(void)
+{
+    if (upload_queue_depth() == 0)
+        return UINT32_MAX;
+    int64_t wait_us = next_attempt_us - esp_timer_get_time();
+    return wait_us <= 0 ? 0 : (uint32_t)((wait_us + 999) / 1000);
+}
+
+esp_err_t upload_queue_read(int index, melody_t *out)
+{
+    xSemaphoreTake(queue_mutex, portMAX_DELAY);
+
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    if (index >= 0 && (uint32_t)index < tail - head)
+    {
+        char key[8];
+        slot_key(head + index, key, sizeof(key));
+        size_t len = sizeof(melody_t);
+        err = nvs_get_blob(nvs, key, out, &len);
+        if (err == ESP_OK && (len < melody_size(0) || out->count > MELODY_MAX_EVENTS || len != melody_size(out->count)))
+            err = ESP_ERR_INVALID_SIZE;
+    }
+
+    xSemaphoreGive(queue_mutex);
+    return err;
+}
+
+void upload_queue_delivered(int n)
+{
+    int64_t now = esp_timer_get_time();
+
+    xSemaphoreTake(queue_mutex, portMAX_DELAY);
+    for (int i = 0; i < n && head + i != tail; i++)
+    {
+        int64_t queued_at = enqueued_us[(head + i) % UPLOAD_QUEUE_SLOTS];
+        if (queued_at != 0)
+        {
+            uint32_t ms = (uint32_t)((now - queued_at) / 1000);
+            stats.last_latency_ms = ms;
+            if (ms > stats.max_latency_ms)
+                stats.max_latency_ms = ms;
+        }
+        stats.delivered++;
+    }
+    remove_oldest(n);
+    stats.backoff_ms = 0;
+    next_attempt_us = 0;
+    xSemaphoreGive(queue_mutex);
+}
+
+void upload_queue_discard(int n)
+{
+    xSemaphoreTake(queue_mutex, portMAX_DELAY);
+    stats.rejected += n;
+    remove_oldest(n);
+    xSemaphoreGive(queue_mutex);
+}
+
+uint32_t upload_queue_failed(void)
+{
+    xSemaphoreTake(queue_mutex, portMAX_DELAY);
+
+    if (stats.backoff_ms == 0)
+        stats.backoff_ms = UPLOAD_RETRY_MIN_MS;
+    else if (stats.backoff_ms < UPLOAD_RETRY_MAX_MS / 2)
+        stats.backoff_ms *= 2;
+    else
+        stats.backoff_ms = UPLOAD_RETRY_MAX_MS;
+
+    // jitter so several pianos behind the same access point don't retry in lockstep
+    uint32_t delay = stats.backoff_ms + esp_random() % (stats.backoff_ms / 4 + 1);
+    next_attempt_us = esp_timer_get_time() + (int64_t)delay * 1000;
+    stats.retries++;
+
+    xSemaphoreGive(queue_mutex);
+    return delay;
+}
+
+void upload_queue_get_stats(upload_queue_stats_t *out)
+{
+    xSemaphoreTake(queue_mutex, portMAX_DELAY);
+    *out = stats;
+    out->depth = tail - head;
+    xSemaphoreGive(queue_mutex);
+}
+
+void upload_queue_print_stats(void)
+{
+    upload_queue_stats_t s;
+    upload_queue_get_stats(&s);
+    printf("Upload queue: depth %lu/%d, delivered %lu, dropped %lu, rejected %lu, retries %lu, backoff %lums, latency last %lums max %lums\n",
+           s.depth, UPLOAD_QUEUE_SLOTS, s.delivered, s.dropped, s.rejected, s.retries,
+           s.backoff_ms, s.last_latency_ms, s.max_latency_ms);
+}
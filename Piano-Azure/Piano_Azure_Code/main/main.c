@@ -1,8 +1,10 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
+#include "freertos/queue.h"
 #include "driver/i2c.h"
 #include "driver/ledc.h"
 #include "driver/gpio.h"
@@ -11,38 +13,140 @@
 #include "buzzer.h"
 #include "potentiometer.h"
 #include "buttons.h"
+#include "debounce.h"
 #include "esp_wifi.h"
 #include "esp_http_client.h"
 #include "nvs_flash.h"
 #include "esp_netif.h"
 #include "esp_event.h"
-#include "esp_tls.h"
 #include "cJSON.h"
+#include "cloud_client.h"
+#include "upload_queue.h"
+#include "json_stream.h"
+#include "json_scan.h"
+#include "melody_match.h"
+#include "sys_stats.h"
+#include "latency_hist.h"
+#include "trace.h"
+#include "block_pool.h"
+#include "ar_link.h"
+#include "midi_out.h"
+#include "chord.h"
+#include "metronome.h"
+#include "looper.h"
+#include "power.h"
+#include "esp_app_desc.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 
 static SemaphoreHandle_t synth_mutex;
 
 // Function declarations
 void wifi_init(void);
-esp_err_t send_melody_to_ai(void);
+esp_err_t send_melody_to_ai(int64_t *request_start_us);
 
-#define LCD_TASK_STACK_SIZE    4096  // Mărit de la 2048
-#define LCD_TASK_PRIORITY      3
+// Task layout: keys, sound and playback own APP_CPU at high priority, so WiFi, lwIP and TLS
+// (all on PRO_CPU) never get between a key press and the buzzer.
+// Display and potentiometer are low priority, a late redraw or pitch bend is not audible.
+#define INPUT_CORE             1  // APP_CPU
+#define NET_CORE               0  // PRO_CPU, WiFi (prio 23) and lwIP (18) are pinned here too
 
-#define BUZZER_TASK_STACK_SIZE 2048
-#define BUZZER_TASK_PRIORITY   3
+// Stacks are static (START_TASK). Size = worst case from tools/stack_estimate.py (the "est." next
+// to each define) + 25%, at least 512 bytes of margin, rounded up to 256. Once a soak has run
+// (tools/soak_monitor.py, stack_used_max in "stats"), keep the larger of the two suggestions.
 
-#define POT_TASK_STACK_SIZE    2048
-#define POT_TASK_PRIORITY      2
+#define LCD_TASK_STACK_SIZE    3328  // est. 2640 B
+#define LCD_TASK_PRIORITY      2
+#define LCD_TASK_CORE          NET_CORE
 
-#define BUTTONS_TASK_STACK_SIZE    2048
-#define BUTTONS_TASK_PRIORITY      2
+#define BUZZER_TASK_STACK_SIZE 3072  // est. 2432 B
+#define BUZZER_TASK_PRIORITY   12    // above Buttons/Loop, starts the tone as soon as it is woken
+#define BUZZER_TASK_CORE       INPUT_CORE
 
-#define RECORD_TASK_STACK_SIZE    4096  // Record task normal
-#define RECORD_TASK_PRIORITY      2
+#define POT_TASK_STACK_SIZE    3072  // est. 2400 B
+#define POT_TASK_PRIORITY      5
+#define POT_TASK_CORE          INPUT_CORE
 
-// Azure HTTP task (separat pentru stack mai mare)
-#define AZURE_TASK_STACK_SIZE     8192  // Stack mare pentru HTTPS/SSL
-#define AZURE_TASK_PRIORITY       1
+#define BUTTONS_TASK_STACK_SIZE    3072  // est. 2448 B
+#define BUTTONS_TASK_PRIORITY      11
+#define BUTTONS_TASK_CORE          INPUT_CORE
+
+#define RECORD_TASK_STACK_SIZE    3072  // est. 2304 B
+#define RECORD_TASK_PRIORITY      10
+#define RECORD_TASK_CORE          INPUT_CORE
+
+#define LOOP_TASK_STACK_SIZE      3072  // est. 2384 B
+#define LOOP_TASK_PRIORITY        11
+#define LOOP_TASK_CORE            INPUT_CORE
+
+#define METRONOME_TASK_STACK_SIZE 3072  // est. 2336 B
+#define METRONOME_TASK_PRIORITY   13    // above Buzzer, only marks the click and wakes it
+#define METRONOME_TASK_CORE       INPUT_CORE
+
+// Azure HTTP task, esp_http_client + mbedTLS need the biggest stack
+#define AZURE_TASK_STACK_SIZE     9472  // est. 7536 B, TLS handshake
+#define AZURE_TASK_PRIORITY       4
+#define AZURE_TASK_CORE           NET_CORE
+
+#define CONSOLE_TASK_PRIORITY     1     // "stats" on the serial console
+
+#define LATENCY_TASK_STACK_SIZE   2816  // est. 2224 B, PIANO_LATENCY_TEST only
+#define POWER_TASK_STACK_SIZE     2816  // est. 2160 B, PIANO_POWER_TEST only
+
+static TaskHandle_t buzzer_task_handle;
+static TaskHandle_t loop_task_handle;
+static TaskHandle_t lcd_task_handle;
+static TaskHandle_t record_task_handle;
+static TaskHandle_t pot_task_handle;
+
+// Latency histograms, "metrics" on the serial console prints them in Prometheus text format
+static latency_hist_t key_to_tone_hist = LATENCY_HIST_INIT("piano_key_to_tone_seconds", "Key change to buzzer_play()/buzzer_stop() returning");
+static latency_hist_t stop_to_upload_hist = LATENCY_HIST_INIT("piano_stop_to_upload_seconds", "Recording stopped to its request going out");
+static latency_hist_t upload_hist = LATENCY_HIST_INIT("piano_upload_seconds", "HTTPS upload, connect to response body read");
+static latency_hist_t beat_to_click_hist = LATENCY_HIST_INIT("piano_beat_to_click_seconds", "Metronome beat to the buzzer clicking");
+static int64_t key_event_us = 0;   // key change not heard yet, under synth_mutex (0 = none)
+
+#if CONFIG_PIANO_LATENCY_TEST
+#define LATENCY_TEST_KEY_MS    300   // simulated keys: one key down for half of this, then the next one
+#endif
+
+#if CONFIG_PIANO_POWER_SAVE
+// A key that wakes the chip sounds within a scan period of its interrupt, like a key pressed
+// right after a scan when awake; the interrupt is taken after the chip's own wake-up
+#define POWER_WAKE_BUDGET_US   (CONFIG_PIANO_KEY_SCAN_MS * 1000)
+#define POWER_IDLE_SCAN_MS     50     // idle key scans when the expander's INT isn't wired
+#define POWER_POT_IDLE_MS      1000   // pot reads while no note sounds, a key reads it at once
+#define POWER_TEST_PERIOD_MS   10000
+static latency_hist_t wake_to_tone_hist = LATENCY_HIST_INIT("piano_wake_to_tone_seconds", "Key interrupt out of sleep to the tone starting");
+static int64_t wake_event_us = 0;       // interrupt of the key that woke Buttons_task, under synth_mutex
+static uint32_t key_wakes = 0;          // presses that woke it
+static uint32_t wake_to_tone_max_us = 0;
+static uint32_t wakes_over_budget = 0;
+#endif
+
+// API endpoints (menuconfig -> Piano Azure)
+#define API_URL CONFIG_PIANO_API_URL
+#define API_BATCH_URL CONFIG_PIANO_API_BATCH_URL
+#define DEVICE_ID "piano_esp32"
+
+// Song names from the AI, shown on the LCD
+#define LCD_COLS               16
+#define SONG_NAME_MAX          64
+#define SONG_QUEUE_LENGTH      4
+#define SONG_SHOW_MS           8000  // how long a detected song stays on screen
+#define MARQUEE_STEP_REFRESHES 3     // LCD refreshes (100ms) per scroll step
+#define MARQUEE_GAP            4     // blanks between the end and the start of a scrolling name
+
+typedef struct {
+    char name[SONG_NAME_MAX];  // ASCII only, the LCD has no UTF-8
+} song_msg_t;
+
+static QueueHandle_t song_queue;
+
+#if CONFIG_PIANO_LOCAL_MATCH
+// known songs, recognized without asking the cloud
+static melody_match_index_t match_index;
+#endif
 
 // Record button pin
 #define RECORD_BUTTON_GPIO 26
@@ -60,11 +164,37 @@ static recorded_note_t recorded_melody[MAX_RECORDED_NOTES];
 static int recorded_count = 0;
 static bool is_recording = false;
 static bool is_playing_back = false;
-static bool send_to_azure = false;  // Flag pentru Azure task
-static uint32_t record_start_time = 0;
-static uint32_t current_note_start_time = 0;
+static volatile bool wifi_connected = false;
+static int64_t record_start_us = 0;
+static int64_t current_note_start_us = 0;   // quantized like the recorded start time
 static int currently_recording_note = -1;
 
+// Loop recorder: the first recording becomes a loop, every Rec/Play press while it plays records
+// one more layer over it (an overdub), one pass long. Keys play live over the loop.
+#define LOOP_TICK_MS          2      // Loop_task period, the timing of played back notes
+#define LOOP_STOP_HOLD_MS     1000   // Rec/Play held this long stops the loop
+static looper_t loop;
+static int64_t loop_start_us = 0;     // start of the loop's first pass
+static int64_t loop_synced_us = 0;    // the loop has been played up to here
+static uint32_t loop_pass = 0;
+static uint32_t overdub_pass = 0;     // pass the recording layer started in
+static uint16_t loop_notes = 0;       // notes the loop is sounding
+static int64_t loop_down_us[12];      // when the loop started each of them
+static uint32_t loop_key_at[12];      // where each key's note on went in the recording layer
+
+// Finished recordings go from Record_task to Azure_task as immutable buffers,
+// a buffer belongs to whoever holds its pointer
+#define RECORDING_BUFFERS 2
+
+typedef struct {
+    melody_t *melody;    // NULL = no recording, only wakes the Azure task (WiFi is up)
+    int64_t stopped_us;  // when the record button stopped the recording
+} recording_msg_t;
+
+// free buffers, Record_task takes one without a lock while Azure_task may be giving another back
+BLOCK_POOL_DEFINE(recording_pool, "recordings", sizeof(melody_t), RECORDING_BUFFERS);
+static QueueHandle_t recording_queue;   // recording_msg_t, Record_task -> Azure_task
+
 static const char *note_names[12] = {
     "C4","C#4","D4","D#4","E4","F4","F#4","G4","G#4","A4","A#4","B4"
 };
@@ -81,255 +211,872 @@ static const uint32_t note_upper[12] = {
     269, 285, 302, 320, 339, 359, 380, 403, 428, 453, 480, 523      
 };
 
-static volatile int current_note = -1;  
+// pitch of a key with the pot at offset (0 - 200): up to the next semitone, or its own pitch when
+// the pot is the vibrato depth
+static uint32_t key_freq(int note, uint16_t offset)
+{
+#if CONFIG_PIANO_POT_VIBRATO
+    (void)offset;
+    return note_freqs[note];
+#else
+    float percent = (float)offset / 200.0f * 100.0f;
+    return note_lower[note] + (uint32_t)((note_upper[note] - note_lower[note]) * (percent / 100.0f));
+#endif
+}
+
+static volatile uint16_t held_keys = 0;   // bit i = key i down
+static volatile int current_note = -1;    // the buzzer is monophonic: the last pressed of the held keys
 static volatile uint16_t pot_offset = 0;
 static volatile bool note_changed = false;
+static volatile int playback_offset = -1; // pot offset current_note was recorded with, -1 = a key, the pot now
 
-void Record_task(void *pvParameters)
+// metronome click, mixed over the note by Buzzer_task
+#define METRONOME_CLICK_MS    15
+#define METRONOME_ACCENT_HZ   2000   // first beat of the bar
+#define METRONOME_CLICK_HZ    1500
+static volatile bool click_pending = false;
+static volatile uint32_t click_freq = 0;
+static int64_t click_beat_us = 0;
+static volatile int beat_in_bar = 0;     // 1..beats per bar for the LCD, 0 = metronome stopped
+
+// synth_mutex, with the wait and the hold on the trace timeline
+static BaseType_t synth_lock(void)
+{
+    TRACE_BEGIN("synth_mutex wait");
+    BaseType_t taken = xSemaphoreTake(synth_mutex, portMAX_DELAY);
+    TRACE_END("synth_mutex wait");
+    TRACE_BEGIN("synth_mutex held");
+    return taken;
+}
+
+static void synth_unlock(void)
+{
+    TRACE_END("synth_mutex held");
+    xSemaphoreGive(synth_mutex);
+}
+
+// Wake Buzzer_task, it only runs when woken or to end a click (call after giving synth_mutex)
+static void wake_buzzer(void)
+{
+    if (buzzer_task_handle != NULL)
+        xTaskNotifyGive(buzzer_task_handle);
+}
+
+// Loop_task sleeps while no loop plays, wake it when one starts
+static void wake_loop(void)
+{
+    if (loop_task_handle != NULL)
+        xTaskNotifyGive(loop_task_handle);
+}
+
+// Power save: LCD_task only runs when something it shows changed (call after giving synth_mutex)
+static void wake_lcd(void)
+{
+#if CONFIG_PIANO_POWER_SAVE
+    if (lcd_task_handle != NULL)
+        xTaskNotifyGive(lcd_task_handle);
+#endif
+}
+
+#if CONFIG_PIANO_POWER_SAVE
+// Record_task sleeps while the Rec/Play button is up, Buttons_task sees it go down
+static void wake_record(void)
+{
+    if (record_task_handle != NULL)
+        xTaskNotifyGive(record_task_handle);
+}
+
+// Pot_task reads rarely while no note sounds, a key press has it read at once
+static void wake_pot(void)
+{
+    if (pot_task_handle != NULL)
+        xTaskNotifyGive(pot_task_handle);
+}
+#endif
+
+// pinned task with its stack and TCB in .bss, whose stack shows up in the "stats" report
+static void start_task(TaskFunction_t fn, const char *name, StackType_t *stack, uint32_t stack_size,
+                       StaticTask_t *tcb, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+    TaskHandle_t task = xTaskCreateStaticPinnedToCore(fn, name, stack_size, NULL, priority, stack, tcb, core);
+    if (task == NULL)
+    {
+        printf("Failed to create %s\n", name);
+        return;
+    }
+    sys_stats_watch_stack(task, name, stack_size);
+    if (handle != NULL)
+        *handle = task;
+}
+
+// every task gets its own static stack, sized in bytes (ESP-IDF StackType_t is a byte)
+#define START_TASK(fn, name, stack_size, priority, handle, core) do { \
+        static StackType_t stack[stack_size]; \
+        static StaticTask_t tcb; \
+        start_task(fn, name, stack, stack_size, &tcb, priority, handle, core); \
+    } while (0)
+
+static esp_err_t stdout_sink(void *ctx, const char *data, size_t len)
+{
+    fwrite(data, 1, len, stdout);
+    return ESP_OK;
+}
+
+// "metrics" on the serial console: latency histograms in Prometheus text format
+static void print_metrics(void)
+{
+    // the version label lets a scraper compare firmware builds
+    const esp_app_desc_t *app = esp_app_get_description();
+    printf("# TYPE piano_build_info gauge\npiano_build_info{version=\"%s\",idf=\"%s\"} 1\n", app->version, app->idf_ver);
+    latency_hist_write_prometheus(stdout_sink, NULL);
+    block_pool_write_prometheus(stdout_sink, NULL);
+    ar_link_write_prometheus(stdout_sink, NULL);
+    midi_out_write_prometheus(stdout_sink, NULL);
+}
+
+// upload queue and cloud connection fields of the "stats" report
+static int stats_extra(char *buf, size_t size)
+{
+    upload_queue_stats_t queue;
+    cloud_client_stats_t cloud;
+    upload_queue_get_stats(&queue);
+    cloud_client_get_stats(&cloud);
+    buzzer_stats_t tone;   // cost of a buzzer control tick
+    buzzer_get_stats(&tone);
+
+    int len = snprintf(buf, size,
+                    "\"upload\":{\"depth\":%lu,\"delivered\":%lu,\"dropped\":%lu,\"retries\":%lu,\"backoff_ms\":%lu},"
+                    "\"cloud\":{\"requests\":%lu,\"failures\":%lu,\"handshakes\":%lu,\"max_request_ms\":%lu},"
+                    "\"buzzer\":{\"ticks\":%lu,\"tick_cycles_mean\":%lu,\"tick_cycles_max\":%lu,\"late_us_max\":%lu,"
+                    "\"freq_writes\":%lu,\"duty_writes\":%lu}",
+                    (unsigned long)queue.depth, (unsigned long)queue.delivered, (unsigned long)queue.dropped,
+                    (unsigned long)queue.retries, (unsigned long)queue.backoff_ms,
+                    (unsigned long)cloud.requests, (unsigned long)cloud.failures, (unsigned long)cloud.handshakes,
+                    (unsigned long)cloud.max_request_ms,
+                    (unsigned long)tone.ticks, (unsigned long)(tone.ticks ? tone.cycles_total / tone.ticks : 0),
+                    (unsigned long)tone.cycles_max, (unsigned long)tone.late_us_max,
+                    (unsigned long)tone.freq_writes, (unsigned long)tone.duty_writes);
+#if CONFIG_PIANO_POWER_SAVE
+    if (len > 0 && len < (int)size)
+        len += snprintf(buf + len, size - len, ",\"power\":{\"key_wakes\":%lu,\"wake_to_tone_max_us\":%lu,\"wakes_over_budget\":%lu}",
+                        (unsigned long)key_wakes, (unsigned long)wake_to_tone_max_us, (unsigned long)wakes_over_budget);
+#endif
+    return len;
+}
+
+#if CONFIG_PIANO_LATENCY_TEST
+// Simulated key presses, the same every run so measurements are comparable
+static bool latency_test_key(int key)
+{
+    uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+    return (now / LATENCY_TEST_KEY_MS) % 12 == (uint32_t)key && now % LATENCY_TEST_KEY_MS < LATENCY_TEST_KEY_MS / 2;
+}
+
+// Prints the latencies every 5 s while the load test runs
+void Latency_task(void *pvParameters)
 {
-    // Initialize record button
-    gpio_config_t record_btn_conf = {
-        .pin_bit_mask = (1ULL << RECORD_BUTTON_GPIO),
-        .mode = GPIO_MODE_INPUT,
-        .pull_up_en = GPIO_PULLUP_ENABLE,
-        .pull_down_en = GPIO_PULLDOWN_DISABLE,
-        .intr_type = GPIO_INTR_DISABLE
-    };
-    gpio_config(&record_btn_conf);
-    
-    bool prev_record_state = false;
-    
     while (1)
     {
-        bool cur_record_state = !gpio_get_level(RECORD_BUTTON_GPIO); // Active low due to pullup
-        
-        // Detect button press (rising edge)
-        if (cur_record_state && !prev_record_state)
-        {
-            if (xSemaphoreTake(synth_mutex, portMAX_DELAY))
-            {
-                if (!is_recording && !is_playing_back)
-                {
-                    // Start recording
-                    is_recording = true;
-                    recorded_count = 0;
-                    currently_recording_note = -1;
-                    record_start_time = xTaskGetTickCount() * portTICK_PERIOD_MS;
-                    printf("Recording started...\\n");
-                }
-                else if (is_recording)
-                {
-                    // Stop recording and start playback
-                    is_recording = false;
-                    is_playing_back = true;
-                    send_to_azure = true;  // Semnalizează Azure task să trimită
-                    printf("Recording stopped. Playing back %d notes...\n", recorded_count);
-                }
-                else if (is_playing_back)
-                {
-                    // Stop playback
-                    is_playing_back = false;
-                    printf("Playback stopped.\n");
-                }
-                xSemaphoreGive(synth_mutex);
-            }
-        }
-        
-        prev_record_state = cur_record_state;
-        vTaskDelay(pdMS_TO_TICKS(50));
+        vTaskDelay(pdMS_TO_TICKS(5000));
+        latency_hist_print();
     }
 }
+#endif
 
-void Playback_task(void *pvParameters)
+#if CONFIG_PIANO_POWER_TEST
+// Sleep residency and the key wakes every 10 s
+void Power_task(void *pvParameters)
 {
-    int playback_index = 0;
-    uint32_t playback_start_time = 0;
-    uint32_t current_note_start = 0;
-    bool note_playing = false;
-    
     while (1)
     {
-        if (xSemaphoreTake(synth_mutex, portMAX_DELAY))
-        {
-            if (is_playing_back)
-            {
-                if (playback_index == 0 && playback_start_time == 0)
-                {
-                    playback_start_time = xTaskGetTickCount() * portTICK_PERIOD_MS;
-                }
-                
-                uint32_t current_time = xTaskGetTickCount() * portTICK_PERIOD_MS;
-                uint32_t elapsed = current_time - playback_start_time;
-                
-                // Check if we need to start a new note
-                if (!note_playing && playback_index < recorded_count)
-                {
-                    if (elapsed >= recorded_melody[playback_index].start_time)
-                    {
-                        current_note = recorded_melody[playback_index].note;
-                        note_changed = true;
-                        current_note_start = current_time;
-                        note_playing = true;
-                        printf("Playing: %s at %luHz for %lums\n", 
-                               note_names[recorded_melody[playback_index].note], 
-                               recorded_melody[playback_index].frequency,
-                               recorded_melody[playback_index].duration);
-                    }
-                }
-                
-                // Check if we need to stop the current note
-                if (note_playing && playback_index < recorded_count)
-                {
-                    uint32_t note_elapsed = current_time - current_note_start;
-                    if (note_elapsed >= recorded_melody[playback_index].duration)
-                    {
-                        current_note = -1;
-                        note_changed = true;
-                        note_playing = false;
-                        playback_index++;
-                    }
-                }
-                
-                // Check if playback finished
-                if (playback_index >= recorded_count && !note_playing)
-                {
-                    is_playing_back = false;
-                    current_note = -1;
-                    note_changed = true;
-                    playback_index = 0;
-                    playback_start_time = 0;
-                    printf("Playback finished.\n");
-                }
-            }
-            else
-            {
-                playback_index = 0;
-                playback_start_time = 0;
-                note_playing = false;
-            }
-            xSemaphoreGive(synth_mutex);
-        }
-        
-        vTaskDelay(pdMS_TO_TICKS(10));
+        vTaskDelay(pdMS_TO_TICKS(POWER_TEST_PERIOD_MS));
+        power_print(stdout);
+        printf("Key wakes: %lu, wake to tone p99 %luus max %luus, %lu over the %dus budget\n",
+               (unsigned long)key_wakes, (unsigned long)latency_hist_percentile(&wake_to_tone_hist, 99),
+               (unsigned long)wake_to_tone_max_us, (unsigned long)wakes_over_budget, POWER_WAKE_BUDGET_US);
+    }
+}
+#endif
+
+// Queue a song name for LCD_task without waiting, UTF-8 sequences become one '?'
+static void show_song(const char *name)
+{
+    song_msg_t msg;
+    int len = 0;
+    for (const unsigned char *p = (const unsigned char *)name; *p && len < SONG_NAME_MAX - 1; p++)
+    {
+        if (*p >= 0x80 && *p < 0xC0) continue;  // continuation byte
+        msg.name[len++] = (*p < 0x20 || *p >= 0x80) ? '?' : (char)*p;
+    }
+    msg.name[len] = '\0';
+
+    if (xQueueSend(song_queue, &msg, 0) != pdTRUE)
+    {
+        printf("Song queue full, not shown on LCD\n");
+    }
+    wake_lcd();
+}
+
+#if CONFIG_PIANO_LOCAL_MATCH
+// Look the recording up in the on-device index, shows the song and returns true on a good match
+static bool recognize_locally(const melody_t *melody)
+{
+    uint8_t notes[MELODY_MATCH_MAX_NOTES];
+    uint16_t lengths[MELODY_MATCH_MAX_NOTES];
+    int count = melody->count > MELODY_MATCH_MAX_NOTES ? MELODY_MATCH_MAX_NOTES : melody->count;
+    for (int i = 0; i < count; i++)
+    {
+        // time until the next key press, how long the last key was held
+        const melody_event_t *e = &melody->events[i];
+        uint32_t len = i + 1 < melody->count ? melody->events[i + 1].start_time - e->start_time : e->duration;
+        notes[i] = e->note;
+        lengths[i] = len > UINT16_MAX ? UINT16_MAX : len;
+    }
+
+    melody_match_result_t results[3];
+    int64_t t0 = esp_timer_get_time();
+    int n = melody_match_query(&match_index, notes, lengths, count, results, 3);
+    printf("Local match (%lldus):", esp_timer_get_time() - t0);
+    for (int i = 0; i < n; i++)
+    {
+        printf(" %s (%d)", melody_match_name(&match_index, results[i].song), results[i].score);
+    }
+    printf(n ? "\n" : " none\n");
+
+    if (n == 0 || results[0].score < CONFIG_PIANO_LOCAL_MATCH_MIN_SCORE)
+        return false;
+
+    printf("Detected song: %s\n", melody_match_name(&match_index, results[0].song));
+    show_song(melody_match_name(&match_index, results[0].song));
+    return true;
+}
+#endif
+
+// Copy the recorded notes into a recording buffer (synth_mutex held)
+static void snapshot_recording(melody_t *out)
+{
+    out->count = recorded_count;
+    for (int i = 0; i < recorded_count; i++)
+    {
+        out->events[i].note = recorded_melody[i].note;
+        out->events[i].frequency = recorded_melody[i].frequency;
+        out->events[i].start_time = recorded_melody[i].start_time;
+        out->events[i].duration = recorded_melody[i].duration > UINT16_MAX ? UINT16_MAX : recorded_melody[i].duration;
+    }
+}
+
+// debouncer with the hold-offs from menuconfig, in scans
+static void keys_init(debounce_t *keys)
+{
+    debounce_init(keys, (CONFIG_PIANO_DEBOUNCE_RELEASE_MS + CONFIG_PIANO_KEY_SCAN_MS - 1) / CONFIG_PIANO_KEY_SCAN_MS);
+    if (debounce_parse_holdoffs(keys, CONFIG_PIANO_DEBOUNCE_KEY_MS, CONFIG_PIANO_KEY_SCAN_MS) < 0)
+        printf("PIANO_DEBOUNCE_KEY_MS \"%s\" is not key:ms,key:ms\n", CONFIG_PIANO_DEBOUNCE_KEY_MS);
+}
+
+// the most recently pressed of the held keys, -1 if none: the buzzer goes back to it on a release
+static int last_pressed(uint16_t held, const int64_t *down_us)
+{
+    int note = -1;
+    for (int i = 0; i < 12; i++)
+        if ((held & (1 << i)) && (note < 0 || down_us[i] > down_us[note]))
+            note = i;
+    return note;
+}
+
+// ms from the start of the recording to t_us (already quantized), 0 before it
+static uint32_t record_time_ms(int64_t t_us)
+{
+    return t_us > record_start_us ? (uint32_t)((t_us - record_start_us) / 1000) : 0;
+}
+
+// play the loop up to t_us, into the next pass when it gets there; an overdub closes itself after
+// one whole pass (synth_mutex held)
+static void loop_sync(int64_t t_us)
+{
+    if (loop.length_ms == 0)
+        return;
+    if (t_us < loop_synced_us)
+        t_us = loop_synced_us;   // the other task got further already, the loop never goes back
+    loop_synced_us = t_us;
+
+    int64_t elapsed_ms = (t_us - loop_start_us) / 1000;
+    uint32_t pass = elapsed_ms / loop.length_ms;
+    uint32_t position = elapsed_ms % loop.length_ms;
+    if (pass > loop_pass)
+    {
+        looper_wrap(&loop);
+        loop_pass = pass;
+    }
+    if (loop.recording >= 0 && loop_pass > overdub_pass && position >= loop.record_from)
+    {
+        int layer = looper_close(&loop, position);
+        printf("Overdub L%d done, %d events\n", layer + 1, looper_layer_events(&loop, layer));
+    }
+    loop_notes = looper_advance(&loop, position);
+}
+
+// where a key at t_us goes in the recording layer, on the grid like the melody: ms from the start
+// of the first take, or the loop position in this pass for an overdub (synth_mutex held)
+static uint32_t loop_key_time(int64_t t_us)
+{
+    int64_t at_us = metronome_quantize(t_us, CONFIG_PIANO_QUANTIZE_DIV);
+    if (loop.length_ms == 0)
+        return record_time_ms(at_us);
+
+    loop_sync(t_us);
+    int64_t at_ms = (at_us - loop_start_us) / 1000 - (int64_t)loop_pass * loop.length_ms;
+    return at_ms > 0 ? (uint32_t)at_ms : 0;   // the looper keeps it inside the pass
+}
+
+// no key held: the buzzer plays the loop's latest note, with the pot offset it was recorded with
+// (synth_mutex held)
+static void play_loop_note(void)
+{
+    int note = last_pressed(loop_notes, loop_down_us);
+    int offset = note >= 0 ? looper_offset(&loop, note) : -1;
+    if (note != current_note || offset != playback_offset)
+    {
+        current_note = note;
+        playback_offset = offset;
+        note_changed = true;
     }
 }
 
 void Buttons_task(void *pvParameters)
 {
+    static debounce_t keys;
+    static int64_t down_us[12];
+    uint8_t last_chord = CHORD_NONE;
     buttons_init();
-    static bool prev_button_state[12] = {0};
+#if CONFIG_PIANO_POWER_SAVE
+    buttons_wake_init(CONFIG_PIANO_PCF_INT_GPIO);
+    buttons_wake_add(RECORD_BUTTON_GPIO);
+#endif
+    keys_init(&keys);
+    TickType_t last_wake = xTaskGetTickCount();
 
     while (1)
     {
-        // Skip button processing during playback
-        if (is_playing_back)
+#if CONFIG_PIANO_POWER_SAVE
+        int64_t woke_us = 0;   // the interrupt that ended an idle wait
+        if (keys.state == 0 && keys.locked == 0)
         {
-            vTaskDelay(pdMS_TO_TICKS(50));
-            continue;
+            // nothing held or settling: no scans until a key's interrupt, the chip can sleep meanwhile
+            TickType_t idle = CONFIG_PIANO_PCF_INT_GPIO >= 0 ? portMAX_DELAY : pdMS_TO_TICKS(POWER_IDLE_SCAN_MS);
+            woke_us = buttons_wait(idle);
+            last_wake = xTaskGetTickCount();
+        }
+        else
+        {
+            xTaskDelayUntil(&last_wake, pdMS_TO_TICKS(CONFIG_PIANO_KEY_SCAN_MS));
         }
-        
-        bool any_pressed = false;
-        uint32_t current_time = xTaskGetTickCount() * portTICK_PERIOD_MS;
+
+        // the Rec/Play button ends the wait too, Record_task polls it while it's down
+        if (!gpio_get_level(RECORD_BUTTON_GPIO))
+            wake_record();
+#else
+        // a fixed period, the hold-offs are counted in scans
+        xTaskDelayUntil(&last_wake, pdMS_TO_TICKS(CONFIG_PIANO_KEY_SCAN_MS));
+#endif
+
+        TRACE_BEGIN("key scan");
+        uint16_t raw = buttons_read();
+#if CONFIG_PIANO_LATENCY_TEST
+        for (int i = 0; i < 12; i++)
+            if (latency_test_key(i))
+                raw |= 1 << i;
+#endif
+        uint16_t changed = debounce_update(&keys, raw);
 
         for (int i = 0; i < 12; i++)
         {
-            bool cur = button_pressed(i);
+            if (!(changed & (1 << i)))
+                continue;
 
-            if (cur && !prev_button_state[i])
+            if (keys.state & (1 << i))
             {
-                if (xSemaphoreTake(synth_mutex, portMAX_DELAY))
+                int64_t now_us = esp_timer_get_time();
+                TRACE_INSTANT("key down", i);
+                down_us[i] = now_us;
+                if (synth_lock())
                 {
+                    held_keys |= 1 << i;
                     current_note = i;
+                    playback_offset = -1;
                     note_changed = true;
+                    key_event_us = now_us;
+#if CONFIG_PIANO_POWER_SAVE
+                    wake_event_us = woke_us;
+#endif
+#if !CONFIG_PIANO_LATENCY_TEST
                     printf("%s\n", note_names[i]);
+#endif
                     
                     // Record note start if recording
                     if (is_recording && recorded_count < MAX_RECORDED_NOTES)
                     {
-                        float percent = (float)pot_offset / 200.0f * 100.0f;
-                        uint32_t freq = note_lower[i] + 
-                                        (uint32_t)((note_upper[i] - note_lower[i]) * (percent / 100.0f));
+                        uint32_t freq = key_freq(i, pot_offset);
                         
+                        current_note_start_us = metronome_quantize(now_us, CONFIG_PIANO_QUANTIZE_DIV);
                         recorded_melody[recorded_count].note = i;
                         recorded_melody[recorded_count].frequency = freq;
-                        recorded_melody[recorded_count].start_time = current_time - record_start_time;
+                        recorded_melody[recorded_count].start_time = record_time_ms(current_note_start_us);
                         recorded_melody[recorded_count].duration = 0; // will be set when released
                         
                         currently_recording_note = i;
-                        current_note_start_time = current_time;
                         printf("Started recording note %d: %s at %luHz\n", recorded_count + 1, note_names[i], freq);
                     }
+                    if (loop.recording >= 0)
+                    {
+                        loop_key_at[i] = loop_key_time(now_us);
+                        // (the overdub may have just closed itself, a pass long)
+                        if (!looper_note(&loop, loop_key_at[i], i, true, pot_offset) && loop.recording >= 0)
+                            printf("Layer full, %s not recorded\n", note_names[i]);
+                    }
                     
-                    xSemaphoreGive(synth_mutex);
+                    synth_unlock();
                 }
+                wake_buzzer();
+                wake_lcd();
+#if CONFIG_PIANO_POWER_SAVE
+                wake_pot();
+#endif
+                ar_link_send(AR_LINK_NOTE_ON, i, now_us);
+                midi_out_note(i, true);
             }
-            else if (!cur && prev_button_state[i])
+            else
             {
+                int64_t now_us = esp_timer_get_time();
+                TRACE_INSTANT("key up", i);
                 // Note released
-                if (xSemaphoreTake(synth_mutex, portMAX_DELAY))
+                if (synth_lock())
                 {
+                    held_keys &= ~(1 << i);
+                    if (current_note == i)
+                    {
+                        // back to a key still held, to the loop or silence when none is
+                        current_note = last_pressed(held_keys, down_us);
+                        note_changed = true;
+                        key_event_us = now_us;
+                        if (current_note == -1)
+                            play_loop_note();
+                    }
                     if (is_recording && currently_recording_note == i && recorded_count < MAX_RECORDED_NOTES)
                     {
-                        uint32_t note_duration = current_time - current_note_start_time;
+                        // on the grid too, and never shorter than one step of it
+                        int64_t end_us = metronome_quantize(now_us, CONFIG_PIANO_QUANTIZE_DIV);
+                        int64_t grid_us = metronome_grid_us(CONFIG_PIANO_QUANTIZE_DIV);
+                        if (end_us - current_note_start_us < grid_us)
+                            end_us = current_note_start_us + grid_us;
+                        uint32_t note_duration = (uint32_t)((end_us - current_note_start_us) / 1000);
                         recorded_melody[recorded_count].duration = note_duration;
                         recorded_count++;
                         currently_recording_note = -1;
                         printf("Finished recording note: %s, duration: %lums\n", note_names[i], note_duration);
                     }
+                    if (loop.recording >= 0)
+                    {
+                        // at least one grid step long, or the note never sounds in the loop
+                        uint32_t at = loop_key_time(now_us);
+                        uint32_t min_at = loop_key_at[i] + metronome_grid_us(CONFIG_PIANO_QUANTIZE_DIV) / 1000;
+                        if (at >= loop_key_at[i] && at < min_at)
+                            at = min_at;
+                        looper_note(&loop, at, i, false, 0);
+                    }
                     
-                    xSemaphoreGive(synth_mutex);
+                    synth_unlock();
                 }
+                wake_buzzer();
+                wake_lcd();
+                ar_link_send(AR_LINK_NOTE_OFF, i, now_us);
+                midi_out_note(i, false);
             }
-            
-            prev_button_state[i] = cur;
-            if (cur) any_pressed = true;
         }
 
-        if (!any_pressed && current_note != -1)
+        uint8_t chord = chord_lookup(keys.state);
+        if (changed && chord != last_chord)
         {
-            if (xSemaphoreTake(synth_mutex, portMAX_DELAY))
+#if !CONFIG_PIANO_LATENCY_TEST
+            if (chord != CHORD_NONE)
             {
-                current_note = -1;
-                note_changed = true;
-                xSemaphoreGive(synth_mutex);
+                char name[CHORD_NAME_MAX];
+                chord_format(chord, name, sizeof(name));
+                printf("Chord: %s\n", name);
             }
+#endif
+            last_chord = chord;
         }
+        TRACE_END("key scan");
+    }
+}
+
+// first take done (synth_mutex held): it becomes the loop, in whole bars when the metronome runs
+static void loop_begin(int64_t now_us)
+{
+    int64_t length_us = now_us - record_start_us;
+    int bpm = metronome_bpm();
+    if (bpm > 0)
+    {
+        int64_t bar_us = 60000000LL / bpm * CONFIG_PIANO_METRONOME_BEATS;
+        int64_t bars = (length_us + bar_us / 2) / bar_us;
+        length_us = (bars > 0 ? bars : 1) * bar_us;
+    }
+    looper_close(&loop, length_us / 1000);
+    loop_start_us = record_start_us;
+    loop_synced_us = record_start_us;
+    loop_pass = 0;
+    is_playing_back = true;
+    wake_loop();
+}
 
+void Record_task(void *pvParameters)
+{
+    // Initialize record button
+    gpio_config_t record_btn_conf = {
+        .pin_bit_mask = (1ULL << RECORD_BUTTON_GPIO),
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_ENABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_DISABLE
+    };
+    gpio_config(&record_btn_conf);
+    
+    bool prev_record_state = false;
+    int64_t pressed_us = 0;
+    bool hold_done = false;
+    
+    while (1)
+    {
+        bool cur_record_state = !gpio_get_level(RECORD_BUTTON_GPIO); // Active low due to pullup
+        recording_msg_t msg = { .melody = NULL };
+        int64_t now_us = esp_timer_get_time();
+        
+        // Detect button press (rising edge)
+        if (cur_record_state && !prev_record_state)
+        {
+            pressed_us = now_us;
+            hold_done = false;
+            if (synth_lock())
+            {
+                if (is_recording)
+                {
+                    // Stop recording and start looping it
+                    is_recording = false;
+                    loop_begin(now_us);
+                    msg.stopped_us = now_us;
+                    msg.melody = block_pool_alloc(&recording_pool);
+                    if (msg.melody != NULL)
+                    {
+                        snapshot_recording(msg.melody);
+                    }
+                    else
+                    {
+                        printf("No free recording buffer, this recording is not uploaded\n");
+                    }
+                    printf("Recording stopped. Looping %d notes every %lums, press again to overdub\n",
+                           recorded_count, loop.length_ms);
+                }
+                else if (!is_playing_back)
+                {
+                    // Start recording, a new loop
+                    is_recording = true;
+                    recorded_count = 0;
+                    currently_recording_note = -1;
+                    record_start_us = esp_timer_get_time();
+                    looper_init(&loop);
+                    looper_record(&loop, 0);
+                    printf("Recording started...\n");
+                }
+                else if (loop.recording >= 0)
+                {
+                    // overdub stopped early
+                    loop_sync(now_us);
+                    int layer = looper_close(&loop, loop.position);
+                    printf("Overdub L%d done, %d events\n", layer + 1, looper_layer_events(&loop, layer));
+                }
+                else
+                {
+                    loop_sync(now_us);
+                    overdub_pass = loop_pass;
+                    int layer = looper_record(&loop, loop.position);
+                    if (layer < 0)
+                        printf("All %d layers used, \"undo\" frees one\n", LOOPER_LAYERS);
+                    else
+                        printf("Overdub L%d from %lums\n", layer + 1, loop.position);
+                }
+                synth_unlock();
+            }
+            wake_lcd();
+        }
+        else if (cur_record_state && !hold_done && now_us - pressed_us >= LOOP_STOP_HOLD_MS * 1000LL)
+        {
+            // held: stop the loop, the overdub this press started goes too
+            hold_done = true;
+            if (synth_lock())
+            {
+                if (is_playing_back)
+                {
+                    if (loop.recording >= 0)
+                        looper_undo(&loop);
+                    is_playing_back = false;
+                    printf("Loop stopped, \"loop\" plays it again\n");
+                }
+                synth_unlock();
+            }
+            wake_lcd();
+        }
+        
+        // hand the copy over, from here on only the Azure task touches it
+        if (msg.melody != NULL)
+        {
+            if (msg.melody->count > 0)
+                xQueueSend(recording_queue, &msg, portMAX_DELAY);
+            else
+                block_pool_free(&recording_pool, msg.melody);
+        }
+        
+#if CONFIG_PIANO_POWER_SAVE
+        // up since the last poll (bounces settled): asleep until Buttons_task sees it go down
+        if (!cur_record_state && !prev_record_state)
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+#endif
+        prev_record_state = cur_record_state;
         vTaskDelay(pdMS_TO_TICKS(50));
     }
 }
 
+// Plays the loop: every tick the looper gives the notes sounding (merged over all its layers),
+// changes go to MIDI out and, when no key is held, to the buzzer
+void Loop_task(void *pvParameters)
+{
+    uint16_t last_notes = 0;
+
+    while (1)
+    {
+        uint16_t notes = 0;
+        bool wake = false;
+        bool overdub_done = false;
+        if (synth_lock())
+        {
+            int64_t now_us = esp_timer_get_time();   // under the lock: Buttons_task moves the loop too
+            int recording = loop.recording;
+            if (is_playing_back)
+                loop_sync(now_us);
+            else
+                loop_notes = 0;
+            notes = loop_notes;
+
+            for (int i = 0; i < 12; i++)
+                if (notes & ~last_notes & (1 << i))
+                    loop_down_us[i] = now_us;
+            if (notes != last_notes && held_keys == 0)
+            {
+                play_loop_note();
+                wake = note_changed;
+            }
+            overdub_done = loop.recording != recording;   // closed itself after a pass
+            synth_unlock();
+        }
+        if (wake) wake_buzzer();
+        if (wake || overdub_done) wake_lcd();
+
+        for (int i = 0; i < 12; i++)
+            if ((notes ^ last_notes) & (1 << i))
+                midi_out_note(i, (notes & (1 << i)) != 0);
+        last_notes = notes;
+
+        // no loop playing and its notes off: nothing to do until one starts
+        if (!is_playing_back && notes == 0)
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        else
+            vTaskDelay(pdMS_TO_TICKS(LOOP_TICK_MS));
+    }
+}
+
+// "loop" on the serial console: stops the loop, or plays the last one again from its start
+static void loop_console(void)
+{
+    if (!synth_lock())
+        return;
+    if (is_playing_back)
+    {
+        if (loop.recording >= 0)
+            looper_close(&loop, loop.position);
+        is_playing_back = false;
+        printf("Loop stopped\n");
+    }
+    else if (!is_recording && loop.layer_count > 0)
+    {
+        looper_wrap(&loop);
+        loop_start_us = esp_timer_get_time();
+        loop_synced_us = loop_start_us;
+        loop_pass = 0;
+        is_playing_back = true;
+        wake_loop();
+        printf("Loop: %d layers, %lums\n", loop.layer_count, loop.length_ms);
+    }
+    else
+    {
+        printf("No loop, record one with the Rec/Play button\n");
+    }
+    synth_unlock();
+    wake_lcd();
+}
+
+// "undo" on the serial console: drops the newest layer (or the overdub going on)
+static void loop_undo_console(void)
+{
+    if (!synth_lock())
+        return;
+    int layer = is_recording ? -1 : looper_undo(&loop);
+    if (layer < 0)
+    {
+        printf("Nothing to undo\n");
+    }
+    else
+    {
+        printf("L%d undone\n", layer + 1);
+        if (loop.layer_count == 0)
+            is_playing_back = false;   // that was the first take, no loop left
+    }
+    synth_unlock();
+    wake_lcd();
+}
+
+// "mute <n>" on the serial console: mutes layer n, or plays it again
+static void loop_mute_console(const char *arg)
+{
+    int layer = atoi(arg) - 1;
+    if (!synth_lock())
+        return;
+    bool muted = layer >= 0 && layer < loop.layer_count && !loop.layers[layer].muted;
+    if (looper_mute(&loop, layer, muted) < 0)
+        printf("mute <1..%d>\n", loop.layer_count);
+    else
+        printf("L%d %s\n", layer + 1, muted ? "muted" : "on");
+    synth_unlock();
+}
+
+// Every beat of the hardware timer: the click for Buzzer_task and the beat for the LCD
+void Metronome_task(void *pvParameters)
+{
+    metronome_init(xTaskGetCurrentTaskHandle());
+
+    while (1)
+    {
+        uint32_t beat;
+        xTaskNotifyWait(0, 0, &beat, portMAX_DELAY);
+        if (metronome_bpm() == 0)
+            continue;   // a beat notified just before the stop
+        TRACE_INSTANT("beat", beat);
+
+        if (synth_lock())
+        {
+#if CONFIG_PIANO_METRONOME_CLICK
+            click_freq = beat % CONFIG_PIANO_METRONOME_BEATS == 0 ? METRONOME_ACCENT_HZ : METRONOME_CLICK_HZ;
+            click_beat_us = metronome_beat_time(beat);
+            click_pending = true;
+#endif
+            beat_in_bar = beat % CONFIG_PIANO_METRONOME_BEATS + 1;
+            synth_unlock();
+        }
+        wake_buzzer();
+        wake_lcd();
+    }
+}
+
+// "metro" on the serial console: metronome on at PIANO_METRONOME_BPM, or off;
+// recordings made while it runs are quantized (PIANO_QUANTIZE_DIV)
+static void metronome_console(void)
+{
+    if (metronome_bpm() == 0)
+    {
+        metronome_start(CONFIG_PIANO_METRONOME_BPM);
+        return;
+    }
+    metronome_stop();
+    if (synth_lock())
+    {
+        beat_in_bar = 0;
+        synth_unlock();
+    }
+    wake_lcd();
+    printf("Metronome off\n");
+}
+
+// the pot sweeps a key up to the next semitone; with the receiver's default +-2 semitone bend range
+// one semitone is a quarter of the 14 bit span
+#define MIDI_BEND_PER_SEMITONE 4096
+
 void Pot_task(void *pvParameters)
 {
+#if !CONFIG_PIANO_POT_VIBRATO
+    uint16_t last_bend_offset = 0;   // the receiver starts unbent
+#endif
+
     pot_init();
 
     while (1)
     {
         uint16_t new_offset = pot_read_mapped(); // 0 - 200
 
-        if (xSemaphoreTake(synth_mutex, portMAX_DELAY))
+        bool moved = false;
+        if (synth_lock())
         {
+            moved = pot_offset != new_offset;
             pot_offset = new_offset;
-            xSemaphoreGive(synth_mutex);
+            synth_unlock();
         }
+        if (moved)
+        {
+            wake_buzzer();
+            wake_lcd();
+        }
+#if !CONFIG_PIANO_POT_VIBRATO
+        if (new_offset != last_bend_offset)
+        {
+            midi_out_bend(MIDI_OUT_BEND_CENTER + new_offset * MIDI_BEND_PER_SEMITONE / 200);
+            last_bend_offset = new_offset;
+        }
+#endif
 
+#if CONFIG_PIANO_POWER_SAVE
+        // no note to bend: rarely, until a key press wakes it
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(current_note == -1 ? POWER_POT_IDLE_MS : 200));
+#else
         vTaskDelay(pdMS_TO_TICKS(200));
+#endif
     }
 }
 
 void Buzzer_task(void *pvParameters)
 {
     buzzer_init();
+    buzzer_shape(CONFIG_PIANO_GLIDE_MS, CONFIG_PIANO_ATTACK_MS, CONFIG_PIANO_RELEASE_MS);
     uint16_t last_offset = 0;
-    static int playback_note_index = 0;
+    uint32_t note_freq = 0;      // tone of current_note, comes back after a click
+    int64_t click_end_us = 0;    // a metronome click sounds until then, 0 = none
 
     while (1)
     {
-        if (xSemaphoreTake(synth_mutex, portMAX_DELAY))
+        if (synth_lock())
         {
+            if (click_pending)
+            {
+                click_pending = false;
+                buzzer_tone(click_freq);
+                latency_hist_since(&beat_to_click_hist, click_beat_us);
+                click_end_us = esp_timer_get_time() + METRONOME_CLICK_MS * 1000;
+            }
+
             if (note_changed)
             {
                 note_changed = false;
+                click_end_us = 0;   // a key or a played note cuts the click short
+                TRACE_BEGIN("tone change");
 
                 if (current_note == -1)
                 {
@@ -337,43 +1084,121 @@ void Buzzer_task(void *pvParameters)
                 }
                 else
                 {
-                    uint32_t freq;
-                    if (is_playing_back && playback_note_index < recorded_count)
-                    {
-                        // Use recorded frequency during playback
-                        freq = recorded_melody[playback_note_index].frequency;
-                        playback_note_index++;
-                    }
-                    else
-                    {
-                        // Normal play mode - use potentiometer
-                        float percent = (float)pot_offset / 200.0f * 100.0f;
-                        freq = note_lower[current_note] + 
-                                    (uint32_t)((note_upper[current_note] - note_lower[current_note]) * (percent / 100.0f));
-                    }
-                    buzzer_play(freq);
+                    // a loop note keeps the pot offset it was recorded with, a key follows the pot
+                    uint16_t offset = playback_offset >= 0 ? (uint16_t)playback_offset : pot_offset;
+                    note_freq = key_freq(current_note, offset);
+                    buzzer_play(note_freq);
+                }
+                TRACE_END("tone change");
+                // playback changes have no key behind them
+                latency_hist_since(&key_to_tone_hist, key_event_us);
+                key_event_us = 0;
+#if CONFIG_PIANO_POWER_SAVE
+                if (wake_event_us != 0)
+                {
+                    // the first note after sleeping, against its budget
+                    uint32_t us = (uint32_t)(esp_timer_get_time() - wake_event_us);
+                    latency_hist_record(&wake_to_tone_hist, us);
+                    key_wakes++;
+                    if (us > wake_to_tone_max_us)
+                        wake_to_tone_max_us = us;
+                    if (us > POWER_WAKE_BUDGET_US)
+                        wakes_over_budget++;
+                    wake_event_us = 0;
                 }
+#endif
             }
-            else if (current_note != -1 && pot_offset != last_offset && !is_playing_back)
+            else if (click_end_us != 0 && esp_timer_get_time() >= click_end_us)
             {
-                float percent = (float)pot_offset / 200.0f * 100.0f;
-                uint32_t freq = note_lower[current_note] + 
-                                (uint32_t)((note_upper[current_note] - note_lower[current_note]) * (percent / 100.0f));
-                buzzer_play(freq);
+                // back to the note under the click
+                click_end_us = 0;
+                buzzer_tone(current_note == -1 ? 0 : note_freq);
             }
-
-            // Reset playback index when playback stops
-            if (!is_playing_back)
+#if CONFIG_PIANO_POT_VIBRATO
+            else if (pot_offset != last_offset)
+            {
+                buzzer_vibrato(pot_offset * CONFIG_PIANO_VIBRATO_CENTS / 200, CONFIG_PIANO_VIBRATO_HZ);
+            }
+#else
+            else if (current_note != -1 && pot_offset != last_offset && playback_offset < 0 && click_end_us == 0)
             {
-                playback_note_index = 0;
+                note_freq = key_freq(current_note, pot_offset);
+                buzzer_play(note_freq);
             }
+#endif
 
-            last_offset = pot_offset;
-            xSemaphoreGive(synth_mutex);
+            if (click_end_us == 0)
+                last_offset = pot_offset;
+            synth_unlock();
         }
 
-        vTaskDelay(pdMS_TO_TICKS(50));
+        // woken right away on a key / playback change, a beat or the potentiometer moving, on its
+        // own only to end a click
+        ulTaskNotifyTake(pdTRUE, click_end_us != 0 ? pdMS_TO_TICKS(METRONOME_CLICK_MS) : portMAX_DELAY);
+    }
+}
+
+// Second LCD line: 16 characters of text from pos, long text wraps around with a gap
+static void lcd_print_marquee(const char *text, int pos)
+{
+    char window[LCD_COLS + 1];
+    int len = strlen(text);
+    if (len <= LCD_COLS)
+    {
+        snprintf(window, sizeof(window), "%-16s", text);
     }
+    else
+    {
+        int period = len + MARQUEE_GAP;
+        for (int i = 0; i < LCD_COLS; i++)
+        {
+            int k = (pos + i) % period;
+            window[i] = k < len ? text[k] : ' ';
+        }
+        window[LCD_COLS] = '\0';
+    }
+    lcd_set_cursor(0, 1);
+    lcd_print(window);
+}
+
+// first LCD line for the held keys: the chord name, or the notes themselves (as many as fit)
+static void lcd_keys_line(uint16_t held, char *line, size_t size)
+{
+    uint8_t chord = chord_lookup(held);
+    if (chord != CHORD_NONE)
+    {
+        char name[CHORD_NAME_MAX];
+        chord_format(chord, name, sizeof(name));
+        snprintf(line, size, "Chord: %s", name);
+        return;
+    }
+    if ((held & (held - 1)) == 0)
+    {
+        snprintf(line, size, "Note: %s", note_names[__builtin_ctz(held)]);
+        return;
+    }
+
+    size_t len = 0;
+    line[0] = '\0';
+    for (int i = 0; i < 12; i++)
+    {
+        if (!(held & (1 << i)))
+            continue;
+        size_t need = strlen(note_names[i]) + (len > 0);
+        if (len + need >= size)
+            break;
+        len += snprintf(line + len, size - len, "%s%s", len > 0 ? " " : "", note_names[i]);
+    }
+}
+
+// metronome beat in the bar in the top right corner, blank when it is off
+static void lcd_beat_mark(int beat)
+{
+#if CONFIG_PIANO_METRONOME_FLASH
+    char mark[2] = { beat > 0 ? '0' + beat : ' ', '\0' };
+    lcd_set_cursor(15, 0);
+    lcd_print(mark);
+#endif
 }
 
 void LCD_task(void *pvParameters)
@@ -381,17 +1206,66 @@ void LCD_task(void *pvParameters)
     lcd_init();
     lcd_clear();
 
+    uint16_t last_held = 0;
     int last_note = -1;
     uint16_t last_offset = 0;
     bool last_recording = false;
     bool last_playing = false;
+    int last_loop = 0;
+    int last_beat = 0;
+
+    song_msg_t song;
+    bool showing_song = false;
+    uint32_t song_until = 0;
+    int marquee_pos = 0;
+    int marquee_tick = 0;
 
     while (1)
     {
-        if (xSemaphoreTake(synth_mutex, portMAX_DELAY))
+        uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+
+        // a new answer from the Azure task, never waits
+        if (xQueueReceive(song_queue, &song, 0) == pdTRUE)
         {
-            if (current_note != last_note || pot_offset != last_offset || 
-                is_recording != last_recording || is_playing_back != last_playing)
+            showing_song = true;
+            song_until = now + SONG_SHOW_MS;
+            marquee_pos = 0;
+            marquee_tick = 0;
+            lcd_clear();
+            lcd_set_cursor(0, 0);
+            lcd_print("Detected song:");
+            lcd_print_marquee(song.name, marquee_pos);
+        }
+
+        if (showing_song)
+        {
+            bool interrupted = false;
+            if (synth_lock())
+            {
+                interrupted = current_note != -1 || is_recording;
+                synth_unlock();
+            }
+
+            if (interrupted || (int32_t)(now - song_until) >= 0)
+            {
+                // playing or recording takes the display back
+                showing_song = false;
+                last_note = -2;  // force a redraw below
+            }
+            else if (strlen(song.name) > LCD_COLS && ++marquee_tick >= MARQUEE_STEP_REFRESHES)
+            {
+                // scrolling is paced by the refresh loop, one step every few refreshes
+                marquee_tick = 0;
+                marquee_pos = (marquee_pos + 1) % (strlen(song.name) + MARQUEE_GAP);
+                lcd_print_marquee(song.name, marquee_pos);
+            }
+        }
+
+        if (!showing_song && synth_lock())
+        {
+            int loop_state = loop.layer_count * 2 + (loop.recording >= 0);
+            if (held_keys != last_held || current_note != last_note || pot_offset != last_offset ||
+                is_recording != last_recording || is_playing_back != last_playing || loop_state != last_loop)
             {
                 lcd_clear();
                 lcd_set_cursor(0, 0);
@@ -403,10 +1277,17 @@ void LCD_task(void *pvParameters)
                     snprintf(buf, sizeof(buf), "REC %d notes", recorded_count);
                     lcd_print(buf);
                 }
+                else if (is_playing_back && loop.recording >= 0)
+                {
+                    char buf[20];
+                    snprintf(buf, sizeof(buf), "OVERDUB L%d", loop.recording + 1);
+                    lcd_print(buf);
+                }
                 else if (is_playing_back)
                 {
                     char buf[20];
-                    snprintf(buf, sizeof(buf), "PLAY %d notes", recorded_count);
+                    snprintf(buf, sizeof(buf), "LOOP %dL %lu.%lus", loop.layer_count,
+                             loop.length_ms / 1000, loop.length_ms % 1000 / 100);
                     lcd_print(buf);
                 }
                 else if (current_note == -1)
@@ -422,19 +1303,23 @@ void LCD_task(void *pvParameters)
                         lcd_print("Piano Ready");
                     }
                 }
-                else
+                else if (held_keys == 0)
                 {
                     lcd_print("Note: ");
                     lcd_print(note_names[current_note]);
                 }
+                else
+                {
+                    char keys_line[LCD_COLS + 1];
+                    lcd_keys_line(held_keys, keys_line, sizeof(keys_line));
+                    lcd_print(keys_line);
+                }
 
                 // Second line
                 lcd_set_cursor(0, 1);
-                if (current_note != -1 && !is_recording && !is_playing_back)
+                if (current_note != -1 && !is_recording && playback_offset < 0)
                 {
-                    float percent = (float)pot_offset / 200.0f * 100.0f;
-                    uint32_t freq = note_lower[current_note] +
-                                    (uint32_t)((note_upper[current_note] - note_lower[current_note]) * (percent / 100.0f));
+                    uint32_t freq = key_freq(current_note, pot_offset);
                     char buf[20];
                     snprintf(buf, sizeof(buf), "%luHz %+ld", note_freqs[current_note], (long)(freq - note_freqs[current_note]));
                     lcd_print(buf);
@@ -444,75 +1329,213 @@ void LCD_task(void *pvParameters)
                     lcd_print("GPIO26=Rec/Play");
                 }
 
+                last_held = held_keys;
                 last_note = current_note;
                 last_offset = pot_offset;
                 last_recording = is_recording;
                 last_playing = is_playing_back;
+                last_loop = loop_state;
+                lcd_beat_mark(beat_in_bar);
+                last_beat = beat_in_bar;
+            }
+            else if (beat_in_bar != last_beat)
+            {
+                lcd_beat_mark(beat_in_bar);
+                last_beat = beat_in_bar;
             }
-            xSemaphoreGive(synth_mutex);
+            synth_unlock();
         }
 
+#if CONFIG_PIANO_POWER_SAVE
+        // asleep until something shown changes; a song keeps the refreshes its marquee and
+        // timeout count
+        if (!showing_song)
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+#endif
         vTaskDelay(pdMS_TO_TICKS(100));
     }
 }
 
+#ifdef CONFIG_PIANO_API_LOCAL_CA
+extern const char local_ca_pem_start[] asm("_binary_local_ca_pem_start");
+#endif
+
 // Azure HTTP Task - stack mare pentru HTTPS/SSL
 void Azure_task(void *pvParameters)
 {
+    // one client for the whole lifetime of the task, the TLS connection is kept alive between uploads
+    cloud_client_config_t cloud_conf = {
+        .url = API_URL,
+#ifdef CONFIG_PIANO_API_LOCAL_CA
+        .cert_pem = local_ca_pem_start,
+#else
+        .cert_pem = NULL,   // certificate bundle
+#endif
+        .timeout_ms = CLOUD_CLIENT_TIMEOUT_MS,
+    };
+    cloud_client_init(&cloud_conf);
+
+    int64_t pending_stop_us = 0;  // newest recording not on the wire yet
+    
     while (1) {
-        if (send_to_azure) {
-            if (xSemaphoreTake(synth_mutex, portMAX_DELAY)) {
-                send_to_azure = false;  // Reset flag
-                xSemaphoreGive(synth_mutex);
-                
-                // Send melody to AI Assistant
-                printf("Sending melody to AI Assistant...\n");
-                if (send_melody_to_ai() == ESP_OK) {
-                    printf("Melody sent successfully!\n");
-                } else {
-                    printf("Failed to send melody to AI\n");
-                }
+        // sleep until a recording arrives, WiFi comes up or the retry backoff has passed
+        uint32_t wait_ms = wifi_connected ? upload_queue_wait_ms() : UINT32_MAX;
+#if CONFIG_PIANO_LATENCY_TEST
+        // HTTPS load for the key -> tone measurement, one small request every 200ms
+        if (wifi_connected && wait_ms == UINT32_MAX) {
+            static const char body[] = "{\"deviceId\":\"" DEVICE_ID "\",\"message\":\"latency test\","
+                                       "\"sensorType\":\"melody\",\"value\":0,\"unit\":\"notes\"}";
+            char response[128];
+            int status;
+            cloud_client_set_url(API_URL);
+            TRACE_BEGIN("latency test post");
+            cloud_client_post(body, sizeof(body) - 1, response, sizeof(response), &status);
+            TRACE_END("latency test post");
+            wait_ms = 200;
+        }
+#endif
+        TickType_t wait = wait_ms == UINT32_MAX ? portMAX_DELAY : wait_ms == 0 ? 0 : pdMS_TO_TICKS(wait_ms) + 1;
+        
+        recording_msg_t msg;
+        if (xQueueReceive(recording_queue, &msg, wait) == pdTRUE && msg.melody != NULL) {
+            printf("Recording handed over after %lldus\n", esp_timer_get_time() - msg.stopped_us);
+            bool recognized = false;
+#if CONFIG_PIANO_LOCAL_MATCH
+            // the cloud is only asked when no known song matches well enough
+            TRACE_BEGIN("local match");
+            recognized = recognize_locally(msg.melody);
+            TRACE_END("local match");
+#endif
+            if (!recognized) {
+                // saved in flash first so it survives a reset while uploading
+                TRACE_BEGIN("nvs push");
+                upload_queue_push(msg.melody);
+                TRACE_END("nvs push");
+                pending_stop_us = msg.stopped_us;
+            }
+            // give the buffer back to Record_task
+            block_pool_free(&recording_pool, msg.melody);
+        }
+        
+        if (wifi_connected && upload_queue_due()) {
+            printf("Sending melody to AI Assistant...\n");
+            int64_t request_start_us = 0;
+            if (send_melody_to_ai(&request_start_us) == ESP_OK) {
+                printf("Melody sent successfully!\n");
+            } else {
+                printf("Failed to send melody to AI\n");
             }
+            if (pending_stop_us && request_start_us) {
+                printf("Stop recording to first byte: %lldms\n", (request_start_us - pending_stop_us) / 1000);
+                latency_hist_record(&stop_to_upload_hist, request_start_us - pending_stop_us);
+                pending_stop_us = 0;
+            }
+            upload_queue_print_stats();
+            cloud_client_print_stats();
         }
-        vTaskDelay(pdMS_TO_TICKS(500));  // Check every 500ms
     }
 }
 
 void app_main(void)
 {
-    synth_mutex = xSemaphoreCreateMutex();
+    // long-lived objects are static, the heap is left to WiFi, lwIP and TLS
+    static StaticSemaphore_t synth_mutex_buffer;
+    static StaticQueue_t song_queue_buffer;
+    static uint8_t song_queue_storage[SONG_QUEUE_LENGTH * sizeof(song_msg_t)];
+    static StaticQueue_t recording_queue_buffer;
+    static uint8_t recording_queue_storage[(RECORDING_BUFFERS + 1) * sizeof(recording_msg_t)];
+
+    synth_mutex = xSemaphoreCreateMutexStatic(&synth_mutex_buffer);
+    song_queue = xQueueCreateStatic(SONG_QUEUE_LENGTH, sizeof(song_msg_t), song_queue_storage, &song_queue_buffer);
     
-    // Initialize certificates for HTTPS
-    esp_tls_init_global_ca_store();
+    // every buffer is either free in the pool, queued or held by one task; +1 slot for the WiFi wake-up
+    block_pool_init(&recording_pool);
+    recording_queue = xQueueCreateStatic(RECORDING_BUFFERS + 1, sizeof(recording_msg_t), recording_queue_storage,
+                                         &recording_queue_buffer);
     
+#if CONFIG_PIANO_POWER_SAVE
+    power_init(CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ, CONFIG_PIANO_POWER_MIN_MHZ, true);
+#endif
+
     // Initialize WiFi
     wifi_init();
     
-    xTaskCreate(Buttons_task, "Buttons Task", BUTTONS_TASK_STACK_SIZE, NULL, BUTTONS_TASK_PRIORITY, NULL);
-    xTaskCreate(Pot_task, "Potentiometer Task", POT_TASK_STACK_SIZE, NULL, POT_TASK_PRIORITY, NULL);
-    xTaskCreate(Buzzer_task, "Buzzer Task", BUZZER_TASK_STACK_SIZE, NULL, BUZZER_TASK_PRIORITY, NULL);
-    xTaskCreate(LCD_task, "LCD Task", LCD_TASK_STACK_SIZE, NULL, LCD_TASK_PRIORITY, NULL);
-    xTaskCreate(Record_task, "Record Task", RECORD_TASK_STACK_SIZE, NULL, RECORD_TASK_PRIORITY, NULL);
-    xTaskCreate(Playback_task, "Playback Task", RECORD_TASK_STACK_SIZE, NULL, RECORD_TASK_PRIORITY, NULL);
-    xTaskCreate(Azure_task, "Azure Task", AZURE_TASK_STACK_SIZE, NULL, AZURE_TASK_PRIORITY, NULL);
+    // Recordings not delivered before the last reset are picked up from NVS
+    upload_queue_init();
+
+#if CONFIG_PIANO_LOCAL_MATCH
+    melody_match_init(&match_index);
+    printf("%d songs in the local index\n", melody_match_add_known(&match_index));
+#endif
+    
+    trace_init();
+    chord_init();
+    sys_stats_init(stats_extra);
+    latency_hist_register(&key_to_tone_hist);
+    latency_hist_register(&stop_to_upload_hist);
+    latency_hist_register(&upload_hist);
+    latency_hist_register(&beat_to_click_hist);
+#if CONFIG_PIANO_POWER_SAVE
+    latency_hist_register(&wake_to_tone_hist);
+#endif
+#if CONFIG_PIANO_AR_LINK
+    ar_link_init(CONFIG_PIANO_AR_LINK_UART, CONFIG_PIANO_AR_LINK_TX_GPIO, CONFIG_PIANO_AR_LINK_BAUD);
+#endif
+#if CONFIG_PIANO_MIDI_OUT
+    midi_out_init(CONFIG_PIANO_MIDI_OUT_UART, CONFIG_PIANO_MIDI_OUT_TX_GPIO, CONFIG_PIANO_MIDI_OUT_BAUD,
+                  CONFIG_PIANO_MIDI_OUT_CHANNEL);
+#endif
+
+    // buzzer first, the others wake it through its handle
+    START_TASK(Buzzer_task, "Buzzer Task", BUZZER_TASK_STACK_SIZE, BUZZER_TASK_PRIORITY, &buzzer_task_handle, BUZZER_TASK_CORE);
+    START_TASK(Buttons_task, "Buttons Task", BUTTONS_TASK_STACK_SIZE, BUTTONS_TASK_PRIORITY, NULL, BUTTONS_TASK_CORE);
+    START_TASK(Metronome_task, "Metronome Task", METRONOME_TASK_STACK_SIZE, METRONOME_TASK_PRIORITY, NULL, METRONOME_TASK_CORE);
+    START_TASK(Pot_task, "Potentiometer Task", POT_TASK_STACK_SIZE, POT_TASK_PRIORITY, &pot_task_handle, POT_TASK_CORE);
+    START_TASK(LCD_task, "LCD Task", LCD_TASK_STACK_SIZE, LCD_TASK_PRIORITY, &lcd_task_handle, LCD_TASK_CORE);
+    START_TASK(Record_task, "Record Task", RECORD_TASK_STACK_SIZE, RECORD_TASK_PRIORITY, &record_task_handle, RECORD_TASK_CORE);
+    START_TASK(Loop_task, "Loop Task", LOOP_TASK_STACK_SIZE, LOOP_TASK_PRIORITY, &loop_task_handle, LOOP_TASK_CORE);
+    START_TASK(Azure_task, "Azure Task", AZURE_TASK_STACK_SIZE, AZURE_TASK_PRIORITY, NULL, AZURE_TASK_CORE);
+#if CONFIG_PIANO_LATENCY_TEST
+    START_TASK(Latency_task, "Latency Task", LATENCY_TASK_STACK_SIZE, 1, NULL, NET_CORE);
+#endif
+#if CONFIG_PIANO_POWER_TEST
+    START_TASK(Power_task, "Power Task", POWER_TASK_STACK_SIZE, 1, NULL, NET_CORE);
+#endif
+
+    sys_stats_console_add("metrics", print_metrics);
+    sys_stats_console_add("trace", trace_print);
+    sys_stats_console_add("midi", midi_out_test);
+    sys_stats_console_add("keytrace", buttons_trace);
+    sys_stats_console_add("metro", metronome_console);
+    sys_stats_console_add("loop", loop_console);
+    sys_stats_console_add("undo", loop_undo_console);
+    sys_stats_console_add_arg("mute", loop_mute_console);
+    sys_stats_console_start(CONSOLE_TASK_PRIORITY, NET_CORE);
 }
 
 // WiFi credentials - COMPLETEAZĂ CU DATELE TALE!
 #define WIFI_SSID "Nicole"      // Pune aici numele rețelei tale WiFi
 #define WIFI_PASS "20042005"          // Pune aici parola rețelei tale WiFi
 
-// API endpoint
-#define API_URL "https://hciaznicollab7-c5geawdqd4csdzf4.germanywestcentral-01.azurewebsites.net/api"
-
 // WiFi event handler
 static void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
     if (event_id == WIFI_EVENT_STA_START) {
         esp_wifi_connect();
     } else if (event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        wifi_connected = false;
         esp_wifi_connect();
         printf("Reconnecting to WiFi...\n");
     } else if (event_id == IP_EVENT_STA_GOT_IP) {
+        wifi_connected = true;
+        // wake the Azure task, recordings may be waiting (one wake-up is enough, keep room for recordings)
+        recording_msg_t wake = { .melody = NULL };
+        if (uxQueueMessagesWaiting(recording_queue) == 0) {
+            xQueueSend(recording_queue, &wake, 0);
+        }
         printf("WiFi connected successfully!\n");
     }
 }
@@ -547,84 +1570,274 @@ void wifi_init(void)
     printf("WiFi initialization completed.\n");
 }
 
-// Send recorded melody to AI Assistant
-esp_err_t send_melody_to_ai(void)
+// json_scan callback: the song name is "response" (single upload) or an item of "responses" (batch)
+// ctx counts the answers, a batch answered in part has fewer than it sent
+static void on_response_string(void *ctx, const char *key, int depth, const char *value)
 {
-    if (recorded_count == 0) return ESP_FAIL;
+    bool single = depth == 1 && strcmp(key, "response") == 0;
+    bool batch = depth == 2 && strcmp(key, "responses") == 0;
+    if (!single && !batch) return;
     
-    // Create JSON with note sequence
-    cJSON *json = cJSON_CreateObject();
-    cJSON *deviceId = cJSON_CreateString("piano_esp32");
+    (*(int *)ctx)++;
+    printf("Detected song: %s\n", value);
     
-    // Create notes sequence string
-    char notes_sequence[256] = "";
-    for (int i = 0; i < recorded_count && i < 20; i++) { // Limit to 20 notes
-        strcat(notes_sequence, note_names[recorded_melody[i].note]);
-        if (i < recorded_count - 1) strcat(notes_sequence, "-");
+    // handed to LCD_task, the network task never waits for the display
+    show_song(value);
+}
+
+// json_stream sink: the payload goes straight into the HTTP request body
+static esp_err_t cloud_sink(void *ctx, const char *data, int len)
+{
+    return cloud_client_write(data, len);
+}
+
+// EspMessageRequestDTO for one recording, every note with its timing
+// "events" holds [note, start ms, duration ms, frequency Hz] per key press
+static void encode_melody(json_stream_t *js, const melody_t *melody)
+{
+    json_stream_begin_object(js);
+    json_stream_key(js, "deviceId");
+    json_stream_string(js, DEVICE_ID);
+    
+    json_stream_key(js, "message");
+    json_stream_begin_string(js);
+    json_stream_append(js, "Melody recorded: ");
+    for (int i = 0; i < melody->count; i++) {
+        if (i > 0) json_stream_append(js, "-");
+        json_stream_append(js, melody_note_name(melody->events[i].note));
     }
+    json_stream_append(js, " (Total ");
+    json_stream_append_uint(js, melody->count);
+    json_stream_append(js, " notes). Timing ms (start+duration):");
+    for (int i = 0; i < melody->count; i++) {
+        json_stream_append(js, " ");
+        json_stream_append_uint(js, melody->events[i].start_time);
+        json_stream_append(js, "+");
+        json_stream_append_uint(js, melody->events[i].duration);
+    }
+    json_stream_end_string(js);
     
-    char message[512];
-    snprintf(message, sizeof(message), "Melody recorded: %s (Total %d notes)", notes_sequence, recorded_count);
+    json_stream_key(js, "sensorType");
+    json_stream_string(js, "melody");
+    json_stream_key(js, "value");
+    json_stream_int(js, melody->count);
+    json_stream_key(js, "unit");
+    json_stream_string(js, "notes");
     
-    cJSON *messageJson = cJSON_CreateString(message);
-    cJSON *sensorType = cJSON_CreateString("melody");
-    cJSON *value = cJSON_CreateNumber(recorded_count);
-    cJSON *unit = cJSON_CreateString("notes");
+    json_stream_key(js, "events");
+    json_stream_begin_array(js);
+    for (int i = 0; i < melody->count; i++) {
+        const melody_event_t *ev = &melody->events[i];
+        json_stream_begin_array(js);
+        json_stream_int(js, ev->note);
+        json_stream_int(js, ev->start_time);
+        json_stream_int(js, ev->duration);
+        json_stream_int(js, ev->frequency);
+        json_stream_end_array(js);
+    }
+    json_stream_end_array(js);
     
-    cJSON_AddItemToObject(json, "deviceId", deviceId);
-    cJSON_AddItemToObject(json, "message", messageJson);
-    cJSON_AddItemToObject(json, "sensorType", sensorType);
-    cJSON_AddItemToObject(json, "value", value);
-    cJSON_AddItemToObject(json, "unit", unit);
+    json_stream_end_object(js);
+}
+
+// Whole request body: one recording, or {"deviceId", "messages": [...]} for a batch
+// reads the recordings from the queue one at a time into melody
+static esp_err_t encode_payload(json_stream_t *js, melody_t *melody, int count, bool batch)
+{
+    if (batch) {
+        json_stream_begin_object(js);
+        json_stream_key(js, "deviceId");
+        json_stream_string(js, DEVICE_ID);
+        json_stream_key(js, "messages");
+        json_stream_begin_array(js);
+    }
+    for (int i = 0; i < count; i++) {
+        esp_err_t err = upload_queue_read(i, melody);
+        if (err != ESP_OK) return err;
+        encode_melody(js, melody);
+    }
+    if (batch) {
+        json_stream_end_array(js);
+        json_stream_end_object(js);
+    }
+    return js->err;
+}
+
+#if CONFIG_PIANO_JSON_COMPARE_CJSON
+// Same payload built as a cJSON tree, only to compare heap and time with json_stream
+static cJSON *melody_to_cjson(const melody_t *melody)
+{
+    static char message[64 + MELODY_MAX_EVENTS * 20];
+    int len = snprintf(message, sizeof(message), "Melody recorded: ");
+    for (int i = 0; i < melody->count; i++) {
+        len += snprintf(message + len, sizeof(message) - len, "%s%s", i > 0 ? "-" : "", melody_note_name(melody->events[i].note));
+    }
+    len += snprintf(message + len, sizeof(message) - len, " (Total %d notes). Timing ms (start+duration):", melody->count);
+    for (int i = 0; i < melody->count; i++) {
+        len += snprintf(message + len, sizeof(message) - len, " %lu+%u", melody->events[i].start_time, melody->events[i].duration);
+    }
+    
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddItemToObject(json, "deviceId", cJSON_CreateString(DEVICE_ID));
+    cJSON_AddItemToObject(json, "message", cJSON_CreateString(message));
+    cJSON_AddItemToObject(json, "sensorType", cJSON_CreateString("melody"));
+    cJSON_AddItemToObject(json, "value", cJSON_CreateNumber(melody->count));
+    cJSON_AddItemToObject(json, "unit", cJSON_CreateString("notes"));
+    cJSON *events = cJSON_CreateArray();
+    for (int i = 0; i < melody->count; i++) {
+        cJSON *ev = cJSON_CreateArray();
+        cJSON_AddItemToArray(ev, cJSON_CreateNumber(melody->events[i].note));
+        cJSON_AddItemToArray(ev, cJSON_CreateNumber(melody->events[i].start_time));
+        cJSON_AddItemToArray(ev, cJSON_CreateNumber(melody->events[i].duration));
+        cJSON_AddItemToArray(ev, cJSON_CreateNumber(melody->events[i].frequency));
+        cJSON_AddItemToArray(events, ev);
+    }
+    cJSON_AddItemToObject(json, "events", events);
+    return json;
+}
+
+static void compare_json_encoders(melody_t *melody, int count, bool batch)
+{
+    // json_stream into a byte counter: no heap at all, the sink decides where bytes go
+    json_stream_t js;
+    json_stream_init(&js, NULL, NULL);
+    int64_t t0 = esp_timer_get_time();
+    encode_payload(&js, melody, count, batch);
+    int64_t stream_us = esp_timer_get_time() - t0;
     
+    // cJSON: tree + printed copy are both alive right after cJSON_Print, that is the peak
+    size_t heap_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    t0 = esp_timer_get_time();
+    cJSON *json = batch ? cJSON_CreateObject() : NULL;
+    cJSON *messages = NULL;
+    if (batch) {
+        messages = cJSON_CreateArray();
+        cJSON_AddItemToObject(json, "deviceId", cJSON_CreateString(DEVICE_ID));
+        cJSON_AddItemToObject(json, "messages", messages);
+    }
+    for (int i = 0; i < count && upload_queue_read(i, melody) == ESP_OK; i++) {
+        if (batch) cJSON_AddItemToArray(messages, melody_to_cjson(melody));
+        else json = melody_to_cjson(melody);
+    }
     char *json_string = cJSON_Print(json);
+    int64_t cjson_us = esp_timer_get_time() - t0;
+    size_t heap_peak = heap_before - heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t cjson_len = json_string ? strlen(json_string) : 0;
+    free(json_string);
+    cJSON_Delete(json);
     
-    // HTTP request
-    esp_http_client_config_t config = {
-        .url = API_URL,
-        .method = HTTP_METHOD_POST,
-        .timeout_ms = 15000,
-        .transport_type = HTTP_TRANSPORT_OVER_SSL,
-        .skip_cert_common_name_check = true,
-        .disable_auto_redirect = false,
-        .max_redirection_count = 3,
-        .is_async = false,
-        .cert_pem = NULL,
-    };
+    printf("JSON encode: json_stream %u B in %lldus, heap 0 B | cJSON %u B in %lldus, heap peak %u B\n",
+           (unsigned)js.length, stream_us, (unsigned)cjson_len, cjson_us, (unsigned)heap_peak);
+}
+#endif
+
+// Send the oldest queued recordings to AI Assistant
+// one recording goes to the esp-message endpoint, several to esp-message-batch
+// request_start_us is set when the request headers go out, left alone if no request was made
+esp_err_t send_melody_to_ai(int64_t *request_start_us)
+{
+    static melody_t melody;  // one recording in RAM at a time, the rest stays in flash
     
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    esp_http_client_set_header(client, "Content-Type", "application/json");
-    esp_http_client_set_post_field(client, json_string, strlen(json_string));
+    int count = upload_queue_depth();
+    if (count == 0) return ESP_OK;
+    if (count > UPLOAD_BATCH_MAX) count = UPLOAD_BATCH_MAX;
     
-    esp_err_t err = esp_http_client_perform(client);
+    // check the entries before the request starts, a broken one can't be skipped mid-body
+    for (int i = 0; i < count; i++) {
+        if (upload_queue_read(i, &melody) != ESP_OK) {
+            if (i == 0) {
+                // unreadable entry at the head would block the queue forever
+                printf("Dropping unreadable queued recording\n");
+                upload_queue_discard(1);
+                return ESP_ERR_INVALID_SIZE;
+            }
+            count = i;  // send the ones read so far, the bad one is at the head next time
+            break;
+        }
+    }
+    bool batch = count > 1;
+    
+#if CONFIG_PIANO_JSON_COMPARE_CJSON
+    compare_json_encoders(&melody, count, batch);
+#endif
     
-    if (err == ESP_OK) {
-        int status = esp_http_client_get_status_code(client);
-        printf("HTTP POST Status = %d\n", status);
+    // HTTP request over the persistent client, the body is encoded while it is sent (chunked)
+    cloud_client_set_url(batch ? API_BATCH_URL : API_URL);
+    int64_t upload_start_us = esp_timer_get_time();
+    TRACE_BEGIN("http upload");
+    int status = -1;
+    // a kept-alive connection the server closed only fails on the write or the header read;
+    // nothing reached the server, so encode and send again on a new connection, no backoff
+    for (int attempt = 0; attempt < 2 && status < 0; attempt++) {
+        if (attempt > 0) printf("Kept-alive connection was stale, sending again\n");
+        TRACE_BEGIN("http connect");
+        esp_err_t err = cloud_client_begin(-1);
+        TRACE_END("http connect");
+        if (err != ESP_OK) break;
         
-        // Read response
-        char response_buffer[512];
-        int content_length = esp_http_client_read(client, response_buffer, sizeof(response_buffer) - 1);
-        if (content_length > 0) {
-            response_buffer[content_length] = '\0';
-            printf("AI Response: %s\n", response_buffer);
-            
-            // Parse and display song name on LCD
-            cJSON *response_json = cJSON_Parse(response_buffer);
-            if (response_json) {
-                cJSON *ai_response = cJSON_GetObjectItem(response_json, "response");
-                if (ai_response && cJSON_IsString(ai_response)) {
-                    // Display on LCD (you'll need to modify LCD task to show this)
-                    printf("Detected song: %s\n", ai_response->valuestring);
-                }
-                cJSON_Delete(response_json);
-            }
+        *request_start_us = esp_timer_get_time();
+        json_stream_t js;
+        json_stream_init(&js, cloud_sink, NULL);
+        int64_t t0 = esp_timer_get_time();
+        TRACE_BEGIN("http send");
+        err = encode_payload(&js, &melody, count, batch);
+        if (err == ESP_OK) {
+            status = cloud_client_finish();
+            TRACE_END("http send");
+            printf("Payload %u B for %d recordings encoded and sent in %lldus\n",
+                   (unsigned)js.length, count, esp_timer_get_time() - t0);
+        } else {
+            TRACE_END("http send");
+            cloud_client_close();
         }
+        if (status < 0 && !cloud_client_stale()) break;
     }
     
-    esp_http_client_cleanup(client);
-    free(json_string);
-    cJSON_Delete(json);
+    if (status < 0) {
+        TRACE_END("http upload");
+        printf("Upload failed, retry in %lums\n", upload_queue_failed());
+        return ESP_FAIL;
+    }
+    
+    // the body is parsed while it is read, chunked or not and of any length
+    int total = 0;
+    int answered = 0;
+    json_scan_t scan;
+    if (status >= 200 && status < 300) {
+        char chunk[128];
+        int n;
+        json_scan_init(&scan, on_response_string, &answered);
+        while ((n = cloud_client_read(chunk, sizeof(chunk))) > 0) {
+            json_scan_feed(&scan, chunk, n);
+            total += n;
+        }
+    }
+    cloud_client_end();
+    latency_hist_since(&upload_hist, upload_start_us);
+    TRACE_END("http upload");
     
-    return err;
-}
\ No newline at end of file
+    printf("HTTP POST Status = %d\n", status);
+    
+    if (status == 400 || status == 413 || status == 422) {
+        // the server refuses this payload, sending it again won't help
+        // (401/403/404 are the URL or credentials, fixed on the server side: retried)
+        printf("Upload rejected, dropping %d recordings\n", count);
+        upload_queue_discard(count);
+        return ESP_FAIL;
+    }
+    if (status < 200 || status >= 300) {
+        printf("Upload failed, retry in %lums\n", upload_queue_failed());
+        return ESP_FAIL;
+    }
+    
+    printf("AI response: %d B%s\n", total, scan.err != ESP_OK ? " (malformed JSON)" : "");
+    if (batch && scan.err == ESP_OK && answered < count) {
+        // the batch endpoint stops at the first failed AI call and answers the ones before it
+        if (answered > 0) upload_queue_delivered(answered);
+        printf("%d of %d recordings answered, retry in %lums\n", answered, count, upload_queue_failed());
+        return ESP_FAIL;
+    }
+    upload_queue_delivered(count);
+    
+    return ESP_OK;
+}
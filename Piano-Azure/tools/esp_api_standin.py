@@ -0,0 +1,259 @@
+#!/usr/bin/env python3
+"""Local stand-in for the AIAssistant ESP32 endpoints (no Azure, no OpenAI).
+
+Same contract as AIAssistantController:
+  POST /api/AIAssistant/esp-message        {deviceId, message, sensorType, value, unit}
+       -> 200 {success, response, timestamp, deviceId}
+       -> 400 {textErrorTitle, textErrorMessage, textErrorTrace} on missing fields
+       -> 503 on AI error
+  POST /api/AIAssistant/esp-message-batch  {deviceId, messages: [...]}
+       -> 200 {success, complete, responses, timestamp, deviceId}, the answers up to the first AI error
+       -> 400 on missing fields, 503 when the first AI call fails
+  GET  /stats                              counters and service time percentiles
+
+Any other path is 404, as on the real API.
+Request bodies may use Content-Length or chunked transfer encoding, connections are kept alive.
+
+  python3 esp_api_standin.py --port 8443 --cert server.pem --key server.key \\
+      --latency-ms 800 --jitter-ms 400 --ai-error-rate 0.05 --unavailable-rate 0.02
+"""
+
+import argparse
+import hashlib
+import json
+import random
+import ssl
+import threading
+import time
+from datetime import datetime, timezone
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+DEFAULT_SONGS = [
+    "Twinkle Twinkle Little Star",
+    "Mary Had a Little Lamb",
+    "Ode to Joy",
+    "Happy Birthday",
+    "Jingle Bells",
+    "Unknown melody",
+]
+
+REQUIRED_FIELDS = ("deviceId", "message", "sensorType", "value", "unit")
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.started = time.monotonic()
+        self.counters = {}
+        self.service_ms = []
+        self.connections = 0
+
+    def count(self, name, n=1):
+        with self.lock:
+            self.counters[name] = self.counters.get(name, 0) + n
+
+    def add_time(self, ms):
+        with self.lock:
+            self.service_ms.append(ms)
+
+    def snapshot(self):
+        with self.lock:
+            times = sorted(self.service_ms)
+            counters = dict(self.counters)
+            connections = self.connections
+
+        def pct(p):
+            return round(times[min(len(times) - 1, int(p / 100 * len(times)))], 1) if times else 0
+
+        return {
+            "uptimeS": round(time.monotonic() - self.started, 1),
+            "connections": connections,
+            "counters": counters,
+            "serviceMs": {"p50": pct(50), "p90": pct(90), "p99": pct(99), "max": pct(100)},
+        }
+
+
+def field(obj, name):
+    # ASP.NET binds JSON properties case-insensitively
+    if not isinstance(obj, dict):
+        return None
+    for key, value in obj.items():
+        if key.lower() == name.lower():
+            return value
+    return None
+
+
+def has_all_fields(obj):
+    return isinstance(obj, dict) and all(field(obj, f) is not None for f in REQUIRED_FIELDS)
+
+
+def error_body(title, message):
+    return {"textErrorTitle": title, "textErrorMessage": message, "textErrorTrace": "esp_api_standin"}
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"  # keep-alive, like Kestrel
+    server_version = "esp-api-standin"
+
+    def setup(self):
+        super().setup()
+        with self.server.stats.lock:
+            self.server.stats.connections += 1
+        if isinstance(self.connection, ssl.SSLSocket):
+            # handshake here, in the connection thread, so a slow client doesn't stall accept()
+            self.connection.do_handshake()
+            self.server.stats.count("tlsResumed" if self.connection.session_reused else "tlsFullHandshakes")
+
+    def log_message(self, fmt, *args):
+        if self.server.args.verbose:
+            super().log_message(fmt, *args)
+
+    def read_body(self):
+        if "chunked" in self.headers.get("Transfer-Encoding", "").lower():
+            self.server.stats.count("chunkedRequests")
+            body = bytearray()
+            while True:
+                size = int(self.rfile.readline().split(b";")[0].strip(), 16)
+                if size == 0:
+                    # trailers end with an empty line
+                    while self.rfile.readline() not in (b"\r\n", b"\n", b""):
+                        pass
+                    return bytes(body)
+                body += self.rfile.read(size)
+                self.rfile.readline()
+        return self.rfile.read(int(self.headers.get("Content-Length", 0)))
+
+    def send_json(self, status, obj):
+        data = json.dumps(obj).encode()
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json; charset=utf-8")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+        self.server.stats.count("status%d" % status)
+
+    def song_for(self, message):
+        # same recording -> same answer, so repeated runs are comparable
+        songs = self.server.songs
+        return songs[int(hashlib.sha1(message.encode()).hexdigest(), 16) % len(songs)]
+
+    def ai_call(self):
+        # one assistant round trip per recording, like SendMessageAndGetResponseAsync
+        args = self.server.args
+        time.sleep(max(0.0, args.latency_ms + random.uniform(-args.jitter_ms, args.jitter_ms)) / 1000)
+        return random.random() >= args.ai_error_rate
+
+    def do_GET(self):
+        if self.path.rstrip("/") == "/stats":
+            self.send_json(200, self.server.stats.snapshot())
+        else:
+            self.send_json(404, error_body("NotFound", self.path))
+
+    def do_POST(self):
+        start = time.monotonic()
+        args = self.server.args
+        stats = self.server.stats
+        path = self.path.rstrip("/").lower()
+        body = self.read_body()
+        stats.count("requests")
+        stats.count("bodyBytes", len(body))
+
+        if path == "/api/aiassistant/esp-message":
+            batch = False
+        elif path == "/api/aiassistant/esp-message-batch":
+            batch = True
+        else:
+            self.send_json(404, error_body("NotFound", self.path))
+            return
+
+        if random.random() < args.unavailable_rate:
+            # front end overloaded / app restarting, nothing reaches the controller
+            self.send_json(503, error_body("ServiceUnavailable", "injected"))
+            return
+
+        try:
+            request = json.loads(body)
+        except ValueError as e:
+            stats.count("badJson")
+            self.send_json(400, error_body("InvalidJson", str(e)))
+            return
+
+        if batch:
+            messages = field(request, "messages")
+            valid = (isinstance(request, dict) and field(request, "deviceId") is not None
+                     and isinstance(messages, list) and messages and all(has_all_fields(m) for m in messages))
+        else:
+            messages = [request]
+            valid = has_all_fields(request)
+        if not valid:
+            self.send_json(400, error_body("AtLeastOneNullParameter", "Some parameters are null/missing."))
+            return
+
+        responses = []
+        for message in messages:
+            if not self.ai_call():
+                stats.count("aiErrors")
+                if responses:
+                    break       # the batch endpoint returns the answers before the failed call
+                self.send_json(503, error_body("AIAssistantError", "injected"))
+                return
+            responses.append(self.song_for(str(field(message, "message"))))
+        stats.count("recordings", len(responses))
+
+        answer = {"success": True, "timestamp": datetime.now(timezone.utc).isoformat(),
+                  "deviceId": field(request, "deviceId")}
+        if batch:
+            answer["complete"] = len(responses) == len(messages)
+            answer["responses"] = responses
+        else:
+            answer["response"] = responses[0]
+        self.send_json(200, answer)
+        stats.add_time((time.monotonic() - start) * 1000)
+
+
+class StandinServer(ThreadingHTTPServer):
+    daemon_threads = True
+    ssl_context = None
+
+    def get_request(self):
+        sock, addr = super().get_request()
+        if self.ssl_context:
+            sock = self.ssl_context.wrap_socket(sock, server_side=True, do_handshake_on_connect=False)
+        return sock, addr
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--cert", help="PEM certificate, enables HTTPS")
+    parser.add_argument("--key", help="PEM private key for --cert")
+    parser.add_argument("--latency-ms", type=float, default=0, help="AI latency per recording")
+    parser.add_argument("--jitter-ms", type=float, default=0, help="+/- uniform jitter on the AI latency")
+    parser.add_argument("--ai-error-rate", type=float, default=0, help="probability an AI call fails")
+    parser.add_argument("--unavailable-rate", type=float, default=0, help="probability of a bare 503")
+    parser.add_argument("--songs", help="comma separated canned answers")
+    parser.add_argument("--verbose", action="store_true", help="log every request")
+    args = parser.parse_args()
+
+    server = StandinServer((args.host, args.port), Handler)
+    server.args = args
+    server.stats = Stats()
+    server.songs = [s.strip() for s in args.songs.split(",")] if args.songs else DEFAULT_SONGS
+
+    scheme = "http"
+    if args.cert:
+        server.ssl_context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        server.ssl_context.load_cert_chain(args.cert, args.key)
+        scheme = "https"
+
+    print("Listening on %s://%s:%d/api/AIAssistant/esp-message" % (scheme, args.host, args.port))
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    print(json.dumps(server.stats.snapshot(), indent=2))
+
+
+if __name__ == "__main__":
+    main()
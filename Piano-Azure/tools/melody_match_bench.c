@@ -0,0 +1,198 @@
+// Host benchmark for the melody_match component: indexes the known songs plus thousands of
+// synthetic ones and times queries that are excerpts played in another key and tempo, with
+// wrong, extra or missing notes. Exits with 1 when a Piano-Web melody is not recognized, or
+// scores less than GUIDE_MARGIN above the firmware's default PIANO_LOCAL_MATCH_MIN_SCORE.
+//
+//   M=../Piano_Azure_Code/components/melody_match
+//   cc -O2 -DMELODY_MATCH_MAX_SONGS=5100 -DMELODY_MATCH_BUCKETS=1728 -I$M/include
+//      melody_match_bench.c $M/melody_match.c $M/melody_songs.c -o melody_match_bench
+//   ./melody_match_bench [synthetic songs] [queries per error level]
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "melody_match.h"
+
+#define QUERY_MAX 24
+#ifndef MIN_SCORE
+#define MIN_SCORE 70        // default of PIANO_LOCAL_MATCH_MIN_SCORE (main/Kconfig.projbuild)
+#endif
+#define GUIDE_MARGIN 10     // played evenly, like a beginner does, they still clear it by this much
+
+static melody_match_index_t index_;
+static uint8_t song_notes[MELODY_MATCH_MAX_SONGS][MELODY_MATCH_MAX_NOTES];
+static uint8_t song_lengths[MELODY_MATCH_MAX_SONGS][MELODY_MATCH_MAX_NOTES];
+static char song_names[MELODY_MATCH_MAX_SONGS][16];
+static melody_song_t songs[MELODY_MATCH_MAX_SONGS];
+
+static uint32_t rng = 12345;
+static uint32_t rnd(uint32_t n)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng % n;
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// random walk with mostly small steps, like a tune
+static void make_song(int id)
+{
+    static const int8_t steps[] = { 0, 0, 1, -1, 2, -2, 2, -2, 3, -3, 4, -4, 5, -5, 7, -7 };
+    static const uint8_t lengths[] = { 1, 2, 2, 2, 2, 3, 4, 4, 6, 8 };
+    int count = 12 + rnd(MELODY_MATCH_MAX_NOTES - 12 + 1);
+    int pitch = 40;
+    for (int i = 0; i < count; i++)
+    {
+        pitch += steps[rnd(sizeof(steps))];
+        if (pitch < 20 || pitch > 60)
+            pitch = 40;
+        song_notes[id][i] = pitch;
+        song_lengths[id][i] = lengths[rnd(sizeof(lengths))];
+    }
+    snprintf(song_names[id], sizeof(song_names[id]), "synthetic %d", id);
+    songs[id] = (melody_song_t){ song_names[id], song_notes[id], song_lengths[id], count };
+}
+
+// excerpt of song, transposed and played at some tempo (ms), with errors wrong/extra/missing notes
+static int make_query(const melody_song_t *song, int errors, uint8_t *notes, uint16_t *lengths)
+{
+    int len = 6 + rnd(11);
+    if (len > song->count)
+        len = song->count;
+    int start = rnd(song->count - len + 1);
+    int shift = 12 + rnd(12);
+    int tempo = 120 + rnd(180);
+    int n = 0;
+    for (int i = 0; i < len; i++)
+    {
+        notes[n] = song->notes[start + i] + shift;
+        int l = song->lengths ? song->lengths[start + i] : 2;
+        lengths[n] = l * tempo * (85 + rnd(31)) / 100;
+        n++;
+    }
+    for (int e = 0; e < errors; e++)
+    {
+        int at = 1 + rnd(n - 2);
+        switch (rnd(3))
+        {
+        case 0:  // wrong key, usually a neighbour
+            notes[at] += rnd(2) ? 1 : -1;
+            break;
+        case 1:  // extra note
+            if (n == QUERY_MAX)
+                break;
+            memmove(&notes[at + 1], &notes[at], n - at);
+            memmove(&lengths[at + 1], &lengths[at], (n - at) * sizeof(lengths[0]));
+            notes[at] += 2;
+            lengths[at] /= 2;
+            n++;
+            break;
+        default:  // missing note
+            memmove(&notes[at], &notes[at + 1], n - at - 1);
+            memmove(&lengths[at], &lengths[at + 1], (n - at - 1) * sizeof(lengths[0]));
+            n--;
+            break;
+        }
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    int synthetic = argc > 1 ? atoi(argv[1]) : 5000;
+    int queries = argc > 2 ? atoi(argv[2]) : 2000;
+
+    melody_match_init(&index_);
+    int known = melody_match_add_known(&index_);
+    if (synthetic > MELODY_MATCH_MAX_SONGS - known)
+        synthetic = MELODY_MATCH_MAX_SONGS - known;
+
+    // the Piano-Web guide melodies, played evenly in another key, against the firmware index
+    static const uint8_t guide[][12] = {
+        { 0, 0, 7, 7, 9, 9, 7 },
+        { 4, 2, 0, 2, 4, 4, 4 },
+        { 4, 4, 5, 7, 7, 5, 4, 2, 0 },
+        { 0, 0, 2, 0, 5, 4 },
+        { 4, 4, 4, 4, 4, 4, 4, 0, 2, 4, 5, 4 },
+    };
+    static const int guide_count[] = { 7, 7, 9, 6, 12 };
+    int failed = 0;
+    for (int g = 0; g < 5; g++)
+    {
+        uint8_t notes[QUERY_MAX];
+        uint16_t lengths[QUERY_MAX];
+        for (int i = 0; i < guide_count[g]; i++)
+        {
+            notes[i] = guide[g][i] + 3;
+            lengths[i] = 300;
+        }
+        melody_match_result_t r[3];
+        int n = melody_match_query(&index_, notes, lengths, guide_count[g], r, 3);
+        const char *got = n ? melody_match_name(&index_, r[0].song) : "-";
+        bool ok = n && strcmp(got, melody_known_songs[g].name) == 0;
+        bool margin = n && r[0].score >= MIN_SCORE + GUIDE_MARGIN;
+        printf("  %-24s -> %-24s score %3d %s\n", melody_known_songs[g].name, got, n ? r[0].score : 0,
+               !ok ? "WRONG" : margin ? "ok" : "TOO CLOSE");
+        ok = ok && margin;
+        failed += !ok;
+    }
+
+    double t0 = now_us();
+    for (int i = 0; i < synthetic; i++)
+    {
+        make_song(known + i);
+        melody_match_add(&index_, &songs[known + i]);
+    }
+    printf("Indexed %d songs (%d known) in %.1fms, %u postings, %u intervals, index %zu B\n",
+           index_.song_count, known, (now_us() - t0) / 1000, (unsigned)index_.posting_count,
+           (unsigned)index_.interval_count, sizeof(index_));
+    for (int i = 0; i < known; i++)
+        songs[i] = melody_known_songs[i];
+
+    printf("errors  queries  top1    top3    none    avg us  max us\n");
+    for (int errors = 0; errors <= 2; errors++)
+    {
+        int top1 = 0, top3 = 0, none = 0;
+        double total = 0, worst = 0;
+        for (int q = 0; q < queries; q++)
+        {
+            int truth = rnd(index_.song_count);
+            uint8_t notes[QUERY_MAX];
+            uint16_t lengths[QUERY_MAX];
+            int count = make_query(&songs[truth], errors, notes, lengths);
+
+            melody_match_result_t r[3];
+            double t = now_us();
+            int n = melody_match_query(&index_, notes, lengths, count, r, 3);
+            t = now_us() - t;
+            total += t;
+            if (t > worst)
+                worst = t;
+
+            if (n == 0)
+                none++;
+            for (int i = 0; i < n; i++)
+            {
+                if (r[i].song == truth)
+                {
+                    top1 += i == 0;
+                    top3++;
+                    break;
+                }
+            }
+        }
+        printf("%6d  %7d  %5.1f%%  %5.1f%%  %5.1f%%  %6.1f  %6.1f\n", errors, queries,
+               100.0 * top1 / queries, 100.0 * top3 / queries, 100.0 * none / queries,
+               total / queries, worst);
+    }
+    return failed ? 1 : 0;
+}
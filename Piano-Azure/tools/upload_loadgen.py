@@ -0,0 +1,241 @@
+#!/usr/bin/env python3
+"""Replays many simulated pianos' recordings against the esp-message API (or esp_api_standin.py).
+
+Every piano behaves like the firmware upload path (components/upload_queue + send_melody_to_ai):
+  - recordings go into a 6 slot queue, the oldest is dropped when it is full
+  - up to 3 queued recordings are sent in one request (esp-message-batch when more than one)
+  - the body is sent chunked over one kept-alive HTTP(S) connection per piano
+  - 400/413/422 drops the recordings, other failures retry after a backoff that
+    doubles from 2 s to 120 s with up to 25% jitter
+  - a batch answered in part removes the answered recordings and retries the rest after the backoff
+
+  python3 upload_loadgen.py --url https://127.0.0.1:8443/api/AIAssistant/esp-message \\
+      --insecure --pianos 50 --duration 60 --record-every 5
+
+Prints throughput, request and delivery (recorded -> answered) latency percentiles,
+retries, drops and connections opened.
+"""
+
+import argparse
+import collections
+import http.client
+import json
+import random
+import ssl
+import threading
+import time
+from urllib.parse import urlsplit
+
+# firmware constants (upload_queue.h)
+QUEUE_SLOTS = 6
+BATCH_MAX = 3
+RETRY_MIN_MS = 2000
+RETRY_MAX_MS = 120000
+
+NOTE_NAMES = ["C4", "C#4", "D4", "D#4", "E4", "F4", "F#4", "G4", "G#4", "A4", "A#4", "B4"]
+NOTE_FREQS = [261, 277, 293, 311, 329, 349, 369, 392, 415, 440, 466, 493]
+
+
+class Results:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.counters = collections.Counter()
+        self.request_ms = []
+        self.delivery_ms = []
+
+    def count(self, name, n=1):
+        with self.lock:
+            self.counters[name] += n
+
+
+def percentiles(values):
+    values = sorted(values)
+    if not values:
+        return "-"
+    pick = lambda p: values[min(len(values) - 1, int(p / 100 * len(values)))]
+    return "p50 %.0f  p90 %.0f  p99 %.0f  max %.0f ms" % (pick(50), pick(90), pick(99), values[-1])
+
+
+def make_recording(rng):
+    # same shape as encode_melody(): note names, timing and [note, start, duration, freq] events
+    count = rng.randint(4, 40)
+    events = []
+    t = 0
+    for _ in range(count):
+        note = rng.randrange(12)
+        duration = rng.randint(80, 700)
+        events.append([note, t, duration, NOTE_FREQS[note]])
+        t += duration + rng.randint(20, 300)
+    message = "Melody recorded: %s (Total %d notes). Timing ms (start+duration):%s" % (
+        "-".join(NOTE_NAMES[e[0]] for e in events), count,
+        "".join(" %d+%d" % (e[1], e[2]) for e in events))
+    return {"message": message, "sensorType": "melody", "value": count, "unit": "notes", "events": events}
+
+
+class Piano(threading.Thread):
+    def __init__(self, number, args, results):
+        super().__init__(daemon=True)
+        self.args = args
+        self.results = results
+        self.device_id = "piano_sim_%03d" % number
+        self.rng = random.Random(args.seed + number)
+        self.queue = collections.deque()  # (recording, recorded at)
+        self.backoff_ms = 0
+        self.retry_at = 0.0
+        self.conn = None
+        url = urlsplit(args.url)
+        self.host = url.netloc
+        self.https = url.scheme == "https"
+        self.single_path = url.path
+        self.batch_path = urlsplit(args.batch_url).path if args.batch_url else url.path + "-batch"
+
+    def connect(self):
+        if self.https:
+            context = ssl.create_default_context(cafile=self.args.cafile)
+            if self.args.insecure:
+                context.check_hostname = False
+                context.verify_mode = ssl.CERT_NONE
+            self.conn = http.client.HTTPSConnection(self.host, timeout=self.args.timeout, context=context)
+        else:
+            self.conn = http.client.HTTPConnection(self.host, timeout=self.args.timeout)
+        self.conn.connect()
+        self.results.count("connections")
+
+    def record(self, now):
+        if len(self.queue) == QUEUE_SLOTS:
+            self.queue.popleft()
+            self.results.count("dropped")
+        recording = make_recording(self.rng)
+        recording["deviceId"] = self.device_id
+        self.queue.append((recording, now))
+        self.results.count("recorded")
+
+    def failed(self, now):
+        # same growth and jitter as upload_queue_failed()
+        self.backoff_ms = RETRY_MIN_MS if self.backoff_ms == 0 else min(self.backoff_ms * 2, RETRY_MAX_MS)
+        delay = self.backoff_ms + self.rng.randrange(self.backoff_ms // 4 + 1)
+        self.retry_at = now + delay / 1000 * self.args.backoff_scale
+        self.results.count("retries")
+
+    def send(self):
+        items = list(self.queue)[:BATCH_MAX]
+        batch = len(items) > 1
+        payload = {"deviceId": self.device_id, "messages": [r for r, _ in items]} if batch else items[0][0]
+        body = json.dumps(payload).encode()
+        chunks = (body[i:i + 256] for i in range(0, len(body), 256))  # CLOUD_CLIENT_CHUNK_SIZE
+
+        start = time.monotonic()
+        status = -1
+        answer = b""
+        for attempt in range(2):  # a dropped keep-alive connection is retried once, like cloud_client_begin
+            try:
+                if self.conn is None:
+                    self.connect()
+                self.conn.request("POST", self.batch_path if batch else self.single_path, body=chunks,
+                                  headers={"Content-Type": "application/json"}, encode_chunked=True)
+                response = self.conn.getresponse()
+                answer = response.read()
+                status = response.status
+                break
+            except (OSError, http.client.HTTPException):
+                if self.conn:
+                    self.conn.close()
+                self.conn = None
+                chunks = (body[i:i + 256] for i in range(0, len(body), 256))
+        now = time.monotonic()
+
+        with self.results.lock:
+            self.results.request_ms.append((now - start) * 1000)
+            self.results.counters["requests"] += 1
+            self.results.counters["status%d" % status] += 1
+
+        if status in (400, 413, 422):
+            for _ in items:
+                self.queue.popleft()
+            self.results.count("rejected", len(items))
+        elif not 200 <= status < 300:
+            self.failed(now)
+        else:
+            answered = len(items)
+            if batch:
+                try:
+                    responses = json.loads(answer).get("responses")
+                    if isinstance(responses, list):
+                        answered = min(len(responses), len(items))
+                except (ValueError, AttributeError):
+                    pass    # malformed JSON counts as delivered, like the firmware
+            for _, recorded_at in items[:answered]:
+                self.queue.popleft()
+                with self.results.lock:
+                    self.results.delivery_ms.append((now - recorded_at) * 1000)
+            self.results.count("delivered", answered)
+            if answered < len(items):
+                self.results.count("partial")
+                if answered:
+                    self.backoff_ms = 0     # progress, upload_queue_delivered() resets the backoff
+                self.failed(now)
+            else:
+                self.backoff_ms = 0
+                self.retry_at = 0.0
+
+    def run(self):
+        end = time.monotonic() + self.args.duration
+        # pianos don't all start recording at the same moment
+        next_record = time.monotonic() + self.rng.expovariate(1 / self.args.record_every)
+        while True:
+            now = time.monotonic()
+            if now >= end and (not self.queue or not self.args.drain):
+                break
+            if now < end and now >= next_record:
+                self.record(now)
+                next_record = now + self.rng.expovariate(1 / self.args.record_every)
+            if self.queue and now >= self.retry_at:
+                self.send()
+                continue
+            wake = [end, next_record] if now < end else []
+            if self.queue:
+                wake.append(self.retry_at)
+            time.sleep(min(max(min(wake) - now, 0.01), 0.5) if wake else 0.5)
+        if self.conn:
+            self.conn.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--url", default="http://127.0.0.1:8080/api/AIAssistant/esp-message")
+    parser.add_argument("--batch-url", help="default: --url + '-batch'")
+    parser.add_argument("--pianos", type=int, default=10)
+    parser.add_argument("--duration", type=float, default=30, help="seconds of recording")
+    parser.add_argument("--record-every", type=float, default=5, help="mean seconds between recordings per piano")
+    parser.add_argument("--backoff-scale", type=float, default=1.0, help="shrink the firmware retry delays")
+    parser.add_argument("--drain", action="store_true", help="keep sending after --duration until queues are empty")
+    parser.add_argument("--timeout", type=float, default=15, help="CLOUD_CLIENT_TIMEOUT_MS")
+    parser.add_argument("--cafile", help="CA for HTTPS (e.g. the local stand-in certificate)")
+    parser.add_argument("--insecure", action="store_true", help="don't verify the HTTPS certificate")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    results = Results()
+    pianos = [Piano(i, args, results) for i in range(args.pianos)]
+    start = time.monotonic()
+    for piano in pianos:
+        piano.start()
+    for piano in pianos:
+        piano.join()
+    elapsed = time.monotonic() - start
+
+    c = results.counters
+    left = sum(len(p.queue) for p in pianos)
+    print("%d pianos, %.1f s" % (args.pianos, elapsed))
+    print("recordings: %d recorded, %d delivered, %d rejected, %d dropped (queue full), %d still queued"
+          % (c["recorded"], c["delivered"], c["rejected"], c["dropped"], left))
+    print("requests:   %d (%.1f/s, %.1f recordings/s), %d retries scheduled, %d batches answered in part, %d connections"
+          % (c["requests"], c["requests"] / elapsed, c["delivered"] / elapsed, c["retries"], c["partial"],
+             c["connections"]))
+    print("status:     %s" % ", ".join("%s=%d" % (k[6:], v) for k, v in sorted(c.items()) if k.startswith("status")))
+    print("request:    %s" % percentiles(results.request_ms))
+    print("delivery:   %s" % percentiles(results.delivery_ms))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,130 @@
+#include "ar_link.h"
+#include <stdio.h>
+#include <stdatomic.h>
+#include "driver/uart.h"
+#include "esp_log.h"
+
+static const char *TAG = "ar_link";
+
+static int link_uart = -1;
+static atomic_uint_least32_t seq = 0;
+static atomic_uint_least32_t frames = 0;
+static atomic_uint_least32_t dropped = 0;
+
+// CRC-16/CCITT-FALSE: poly 0x1021, init 0xFFFF, no reflection
+static uint16_t crc16(const uint8_t *data, size_t len)
+{
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int b = 0; b < 8; b++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+// COBS: every run of up to 254 non-zero bytes gets a code byte = run length + 1 in front,
+// the zero that ended the run is dropped
+static size_t cobs_encode(const uint8_t *in, size_t len, uint8_t *out)
+{
+    size_t code_at = 0;
+    size_t o = 1;
+    uint8_t code = 1;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (in[i] == 0)
+        {
+            out[code_at] = code;
+            code_at = o++;
+            code = 1;
+            continue;
+        }
+        out[o++] = in[i];
+        if (++code == 0xFF)
+        {
+            out[code_at] = code;
+            code_at = o++;
+            code = 1;
+        }
+    }
+    out[code_at] = code;
+    return o;
+}
+
+size_t ar_link_encode(uint8_t *out, ar_link_type_t type, int note, uint16_t seq_no, uint32_t time_us)
+{
+    uint8_t raw[AR_LINK_PAYLOAD_SIZE + 2] = {
+        (uint8_t)type, (uint8_t)note,
+        (uint8_t)seq_no, (uint8_t)(seq_no >> 8),
+        (uint8_t)time_us, (uint8_t)(time_us >> 8), (uint8_t)(time_us >> 16), (uint8_t)(time_us >> 24),
+    };
+    uint16_t crc = crc16(raw, AR_LINK_PAYLOAD_SIZE);
+    raw[AR_LINK_PAYLOAD_SIZE] = (uint8_t)crc;
+    raw[AR_LINK_PAYLOAD_SIZE + 1] = (uint8_t)(crc >> 8);
+
+    size_t len = cobs_encode(raw, sizeof(raw), out);
+    out[len++] = 0x00;
+    return len;
+}
+
+esp_err_t ar_link_init(int uart, int tx_gpio, int baud)
+{
+    uart_config_t config = {
+        .baud_rate = baud,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .source_clk = UART_SCLK_DEFAULT,
+    };
+
+    // the driver wants an RX buffer larger than the 128 byte FIFO even though nothing is read
+    esp_err_t err = uart_driver_install(uart, 256, AR_LINK_TX_BUFFER, 0, NULL, 0);
+    if (err == ESP_OK)
+        err = uart_param_config(uart, &config);
+    if (err == ESP_OK)
+        err = uart_set_pin(uart, tx_gpio, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "UART%d setup failed: %d", uart, err);
+        return err;
+    }
+
+    link_uart = uart;
+    ar_link_send(AR_LINK_HELLO, AR_LINK_VERSION, 0);
+    printf("AR link on UART%d TX GPIO%d, %d baud\n", uart, tx_gpio, baud);
+    return ESP_OK;
+}
+
+void ar_link_send(ar_link_type_t type, int note, int64_t time_us)
+{
+    if (link_uart < 0)
+        return;
+
+    uint8_t frame[AR_LINK_FRAME_MAX];
+    uint16_t n = (uint16_t)atomic_fetch_add_explicit(&seq, 1, memory_order_relaxed);
+    size_t len = ar_link_encode(frame, type, note, n, (uint32_t)time_us);
+
+    // uart_write_bytes() would block on a full buffer, the key scan must not
+    size_t space = 0;
+    if (uart_get_tx_buffer_free_size(link_uart, &space) != ESP_OK || space < len)
+    {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+    uart_write_bytes(link_uart, frame, len);
+    atomic_fetch_add_explicit(&frames, 1, memory_order_relaxed);
+}
+
+esp_err_t ar_link_write_prometheus(prom_sink_t sink, void *ctx)
+{
+    char line[192];
+    int len = snprintf(line, sizeof(line),
+                       "# TYPE piano_ar_link_frames_total counter\npiano_ar_link_frames_total %lu\n"
+                       "# TYPE piano_ar_link_dropped_total counter\npiano_ar_link_dropped_total %lu\n",
+                       (unsigned long)atomic_load_explicit(&frames, memory_order_relaxed),
+                       (unsigned long)atomic_load_explicit(&dropped, memory_order_relaxed));
+    return sink(ctx, line, len);
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include "esp_err.h"
+#include "prom_sink.h"
+#include <stdint.h>
+#include <stddef.h>
+
+// Note events for the AR app (Piano-AR EspSerialReader) on their own UART, away from the
+// printf console. Every event is one frame:
+//
+//   COBS( type u8 | note u8 | seq u16 | time_us u32 | crc16 u16 ) 0x00
+//
+// little endian, CRC-16/CCITT-FALSE over the 8 payload bytes. COBS removes every 0x00 from the
+// frame, so 0x00 only ever ends a frame and a reader that starts mid-stream or loses bytes
+// resyncs on the next one. 12 bytes on the wire, 130us at 921600 baud.
+// seq counts every frame since boot, a gap on the host means frames were dropped.
+// tools/ar_link.py decodes the stream and measures it.
+
+#define AR_LINK_VERSION       1
+#define AR_LINK_PAYLOAD_SIZE  8
+#define AR_LINK_FRAME_MAX     (AR_LINK_PAYLOAD_SIZE + 2 + 2)   // + CRC, + COBS code byte and delimiter
+#define AR_LINK_TX_BUFFER     512                             // frames waiting for the UART
+
+typedef enum {
+    AR_LINK_NOTE_ON  = 1,   // note = key 0-11 (C4..B4)
+    AR_LINK_NOTE_OFF = 2,
+    AR_LINK_HELLO    = 3,   // sent once at start, note = AR_LINK_VERSION
+    AR_LINK_MELODY_NEXT  = 4,   // guided melody: key to play next, 0xFF when none is loaded
+    AR_LINK_MELODY_WRONG = 5,   // guided melody: note = the wrong key
+} ar_link_type_t;
+
+// UART TX only (no RX pin), 8N1 without flow control
+esp_err_t ar_link_init(int uart, int tx_gpio, int baud);
+
+// queue one frame for the UART, never waits: when the TX buffer is full the frame is dropped
+// does nothing before ar_link_init()
+void ar_link_send(ar_link_type_t type, int note, int64_t time_us);
+
+// the complete frame for one event into out (AR_LINK_FRAME_MAX bytes), returns its length
+size_t ar_link_encode(uint8_t *out, ar_link_type_t type, int note, uint16_t seq, uint32_t time_us);
+
+// frames sent and dropped as Prometheus counters
+esp_err_t ar_link_write_prometheus(prom_sink_t sink, void *ctx);
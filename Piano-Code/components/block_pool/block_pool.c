@@ -0,0 +1,201 @@
+#include "block_pool.h"
+#include <stdio.h>
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+
+static block_pool_t *pools[BLOCK_POOL_MAX];
+static atomic_int pool_count = 0;
+
+#if CONFIG_HEAP_USE_HOOKS
+static atomic_uint_least32_t heap_allocs = 0;
+
+// called by the heap on every successful malloc/calloc/realloc, from any task or ISR
+void IRAM_ATTR esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps)
+{
+    atomic_fetch_add_explicit(&heap_allocs, 1, memory_order_relaxed);
+}
+
+uint32_t block_pool_heap_allocs(void)
+{
+    return atomic_load_explicit(&heap_allocs, memory_order_relaxed);
+}
+#else
+uint32_t block_pool_heap_allocs(void)
+{
+    return 0;
+}
+#endif
+
+esp_err_t block_pool_init(block_pool_t *pool)
+{
+    if (pool->count == 0)
+        return ESP_ERR_INVALID_ARG;
+
+    // block i links to i + 1, the last one ends the list
+    for (int i = 0; i < pool->count; i++)
+        atomic_store_explicit(&pool->links[i], i + 1 < pool->count ? i + 2 : 0, memory_order_relaxed);
+    atomic_store_explicit(&pool->head, 1, memory_order_release);
+
+    int n = atomic_load(&pool_count);
+    if (n >= BLOCK_POOL_MAX)
+        return ESP_ERR_NO_MEM;
+    pools[n] = pool;
+    atomic_store(&pool_count, n + 1);
+    return ESP_OK;
+}
+
+static void update_max(atomic_uint_least32_t *max, uint32_t value)
+{
+    uint32_t old = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > old && !atomic_compare_exchange_weak_explicit(max, &old, value,
+                                                                 memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+void *block_pool_alloc(block_pool_t *pool)
+{
+    uint32_t start = esp_cpu_get_cycle_count();
+    uint32_t retries = 0;
+    uint32_t head = atomic_load_explicit(&pool->head, memory_order_acquire);
+    uint32_t top;
+
+    for (;;)
+    {
+        top = head & 0xFFFF;
+        if (top == 0)
+        {
+            atomic_fetch_add_explicit(&pool->failures, 1, memory_order_relaxed);
+            return NULL;
+        }
+        // the generation changes on every pop and push, so a head that was popped and pushed
+        // back in between (ABA) fails the CAS instead of installing a stale next link
+        uint32_t next = ((head & 0xFFFF0000u) + 0x10000u) |
+                        atomic_load_explicit(&pool->links[top - 1], memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(&pool->head, &head, next,
+                                                  memory_order_acq_rel, memory_order_acquire))
+            break;
+        retries++;
+    }
+
+    uint32_t used = atomic_fetch_add_explicit(&pool->in_use, 1, memory_order_relaxed) + 1;
+    update_max(&pool->peak, used);
+    atomic_fetch_add_explicit(&pool->allocs, 1, memory_order_relaxed);
+    if (retries)
+        atomic_fetch_add_explicit(&pool->retries, retries, memory_order_relaxed);
+    update_max(&pool->max_cycles, esp_cpu_get_cycle_count() - start);
+
+    return (uint8_t *)pool->storage + (size_t)(top - 1) * pool->block_size;
+}
+
+esp_err_t block_pool_free(block_pool_t *pool, void *block)
+{
+    size_t offset = (uint8_t *)block - (uint8_t *)pool->storage;
+    if (block == NULL || (uint8_t *)block < (uint8_t *)pool->storage ||
+        offset % pool->block_size != 0 || offset / pool->block_size >= pool->count)
+        return ESP_ERR_INVALID_ARG;
+
+    uint32_t index = offset / pool->block_size + 1;
+    uint32_t head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+    do
+    {
+        atomic_store_explicit(&pool->links[index - 1], head & 0xFFFF, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, ((head & 0xFFFF0000u) + 0x10000u) | index,
+                                                    memory_order_release, memory_order_relaxed));
+
+    atomic_fetch_sub_explicit(&pool->in_use, 1, memory_order_relaxed);
+    return ESP_OK;
+}
+
+// includes an interrupt or a context switch that hit the alloc, as the caller would see it
+static uint32_t max_alloc_ns(const block_pool_t *pool)
+{
+    uint64_t cycles = atomic_load_explicit(&pool->max_cycles, memory_order_relaxed);
+    return (uint32_t)(cycles * 1000 / esp_rom_get_cpu_ticks_per_us());
+}
+
+esp_err_t block_pool_write_prometheus(prom_sink_t sink, void *ctx)
+{
+    static const struct {
+        const char *name;
+        const char *type;
+        const char *help;
+    } metrics[] = {
+        { "piano_pool_blocks", "gauge", "Blocks in the pool" },
+        { "piano_pool_block_bytes", "gauge", "Size of one block" },
+        { "piano_pool_in_use", "gauge", "Blocks allocated now" },
+        { "piano_pool_peak", "gauge", "Most blocks allocated at once since boot" },
+        { "piano_pool_allocs_total", "counter", "Successful allocations" },
+        { "piano_pool_failures_total", "counter", "Allocations that found the pool empty" },
+        { "piano_pool_retries_total", "counter", "Free list CAS retries caused by a concurrent alloc/free" },
+        { "piano_pool_alloc_max_seconds", "gauge", "Slowest allocation since boot" },
+    };
+    char line[192];
+    esp_err_t err;
+    int len;
+    int n = atomic_load(&pool_count);
+
+    for (int m = 0; m < (int)(sizeof(metrics) / sizeof(metrics[0])); m++)
+    {
+        len = snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n",
+                       metrics[m].name, metrics[m].help, metrics[m].name, metrics[m].type);
+        if ((err = sink(ctx, line, len)) != ESP_OK)
+            return err;
+
+        for (int i = 0; i < n; i++)
+        {
+            block_pool_t *pool = pools[i];
+            uint32_t value = 0;
+            switch (m)
+            {
+                case 0: value = pool->count; break;
+                case 1: value = pool->block_size; break;
+                case 2: value = atomic_load_explicit(&pool->in_use, memory_order_relaxed); break;
+                case 3: value = atomic_load_explicit(&pool->peak, memory_order_relaxed); break;
+                case 4: value = atomic_load_explicit(&pool->allocs, memory_order_relaxed); break;
+                case 5: value = atomic_load_explicit(&pool->failures, memory_order_relaxed); break;
+                case 6: value = atomic_load_explicit(&pool->retries, memory_order_relaxed); break;
+            }
+            if (m == 7)
+                len = snprintf(line, sizeof(line), "%s{pool=\"%s\"} %lu.%09lu\n", metrics[m].name, pool->name,
+                               (unsigned long)(max_alloc_ns(pool) / 1000000000u),
+                               (unsigned long)(max_alloc_ns(pool) % 1000000000u));
+            else
+                len = snprintf(line, sizeof(line), "%s{pool=\"%s\"} %lu\n", metrics[m].name, pool->name,
+                               (unsigned long)value);
+            if ((err = sink(ctx, line, len)) != ESP_OK)
+                return err;
+        }
+    }
+
+#if CONFIG_HEAP_USE_HOOKS
+    len = snprintf(line, sizeof(line),
+                   "# HELP piano_heap_allocs_total Heap allocations since boot, WiFi and lwIP included\n"
+                   "# TYPE piano_heap_allocs_total counter\npiano_heap_allocs_total %lu\n",
+                   (unsigned long)block_pool_heap_allocs());
+    return sink(ctx, line, len);
+#else
+    return ESP_OK;
+#endif
+}
+
+void block_pool_print(void)
+{
+    int n = atomic_load(&pool_count);
+    for (int i = 0; i < n; i++)
+    {
+        block_pool_t *pool = pools[i];
+        printf("pool %s: %u x %u B, in use %lu, peak %lu, allocs %lu, empty %lu, retries %lu, max alloc %luns\n",
+               pool->name, pool->count, pool->block_size,
+               (unsigned long)atomic_load_explicit(&pool->in_use, memory_order_relaxed),
+               (unsigned long)atomic_load_explicit(&pool->peak, memory_order_relaxed),
+               (unsigned long)atomic_load_explicit(&pool->allocs, memory_order_relaxed),
+               (unsigned long)atomic_load_explicit(&pool->failures, memory_order_relaxed),
+               (unsigned long)atomic_load_explicit(&pool->retries, memory_order_relaxed),
+               (unsigned long)max_alloc_ns(pool));
+    }
+#if CONFIG_HEAP_USE_HOOKS
+    printf("heap allocations since boot: %lu\n", (unsigned long)block_pool_heap_allocs());
+#endif
+}
@@ -0,0 +1,79 @@
+#include "debounce.h"
+#include <stdlib.h>
+#include <string.h>
+
+void debounce_init(debounce_t *d, int holdoff_scans)
+{
+    memset(d, 0, sizeof(*d));
+    for (int key = 0; key < 16; key++)
+        debounce_set_holdoff(d, key, holdoff_scans);
+}
+
+void debounce_set_holdoff(debounce_t *d, int key, int scans)
+{
+    if (key < 0 || key > 15)
+        return;
+    if (scans < 1)
+        scans = 1;
+    if (scans > DEBOUNCE_MAX_SCANS)
+        scans = DEBOUNCE_MAX_SCANS;
+
+    for (int b = 0; b < DEBOUNCE_BITS; b++)
+    {
+        if (scans & (1 << b))
+            d->limit[b] |= 1 << key;
+        else
+            d->limit[b] &= ~(1 << key);
+    }
+}
+
+int debounce_parse_holdoffs(debounce_t *d, const char *spec, int scan_ms)
+{
+    int set = 0;
+    while (spec && *spec)
+    {
+        char *end;
+        long key = strtol(spec, &end, 10);
+        if (end == spec || *end != ':' || key < 0 || key > 15)
+            return -1;
+        spec = end + 1;
+        long ms = strtol(spec, &end, 10);
+        if (end == spec || ms < 0 || (*end && *end != ','))
+            return -1;
+        spec = *end ? end + 1 : end;
+
+        // round up: a hold-off shorter than asked lets bounce through
+        debounce_set_holdoff(d, (int)key, (int)((ms + scan_ms - 1) / scan_ms));
+        set++;
+    }
+    return set;
+}
+
+uint16_t debounce_update(debounce_t *d, uint16_t raw)
+{
+    uint16_t diff = raw ^ d->state;
+    uint16_t counting = diff | d->locked;
+    uint16_t carry = counting;
+    uint16_t at_limit = counting;
+
+    // count up where raw disagrees (or the key is locked), back to 0 elsewhere;
+    // ripple carry across the bit planes
+    for (int b = 0; b < DEBOUNCE_BITS; b++)
+    {
+        uint16_t bit = d->count[b];
+        d->count[b] = (bit ^ carry) & counting;
+        carry &= bit;
+        at_limit &= ~(d->count[b] ^ d->limit[b]);
+    }
+
+    // presses at once unless locked, releases once they have lasted the hold-off
+    uint16_t pressed = diff & raw & ~d->locked;
+    uint16_t released = at_limit & d->state & ~raw;
+    uint16_t unlocked = at_limit & d->locked;
+
+    d->state ^= pressed | released;
+    d->locked = (d->locked | released) & ~unlocked;
+    for (int b = 0; b < DEBOUNCE_BITS; b++)
+        d->count[b] &= ~(pressed | released | unlocked);
+    return pressed | released;
+}
@@ -4,6 +4,7 @@
 #include <stdbool.h>         //bool types
 #include "driver/gpio.h"     //GPIO pins control function
 #include "driver/i2c.h"      //I2C communication
+#include "freertos/FreeRTOS.h" //TickType_t
 #include "esp_log.h"         //logging and debug macros
 
 // GPIO button pins
@@ -20,14 +21,37 @@ static const uint8_t gpio_buttons[4] = {13,12,14,27};
 // initialize all buttons (GPIO + expander PCF8574)
 esp_err_t buttons_init(void);
 
-// read button states as 12-bit bitmask
+// read button states as 12-bit bitmask, one I2C transfer for all 8 expander keys
 // bit0-3: GPIO buttons (13,12,14,27)
 // bit4-11: PCF8574 buttons (P0-P7)
+// a failed I2C read repeats the expander's last state instead of releasing its keys
 uint16_t buttons_read(void);
 
-// check if a specific button is pressed (0-11)
+// check if a specific button is pressed (0-11), a whole buttons_read() per call
 bool button_pressed(uint8_t button_id);
 
+// "keytrace" console command: raw key states every 1 ms for BUTTONS_TRACE_MS, one
+// "keytrace <us> <mask>" line per change, for tools/debounce_replay.py
+#define BUTTONS_TRACE_MS 5000
+void buttons_trace(void);
+
 // print on console
 void buttons_print(void);
 
+// Power save: instead of scanning with nothing held, Buttons_task sleeps in buttons_wait() and
+// any key wakes it, also out of light sleep. The 4 GPIO keys wake it directly, the expander's 8
+// through its INT output (open drain, low until the port is read) on int_gpio; -1 = not wired,
+// expander keys are then only seen when the wait times out.
+esp_err_t buttons_wake_init(int int_gpio);
+
+// another button (active low, pulled up here) that ends buttons_wait() and wakes the chip when
+// pressed; not while it is down, whoever reads it polls it then. After buttons_wake_init()
+esp_err_t buttons_wake_add(int gpio);
+
+// block until a key pin or INT is low, buttons_wake() or timeout; returns when a key woke it
+// (esp_timer us, taken in the interrupt), 0 otherwise
+int64_t buttons_wait(TickType_t timeout);
+
+// end a buttons_wait() early (a request for Buttons_task)
+void buttons_wake(void);
+
@@ -11,11 +11,42 @@
 #define BUZZER_DUTY_RESOLUTION LEDC_TIMER_10_BIT
 #define BUZZER_MAX_DUTY        1023
 
-// init buzzer
+// Tone control: a GPTimer alarm wakes the buzzer's own control task every BUZZER_TICK_US while a
+// note sounds, changes. Every tick moves the pitch along a glide (portamento) with vibrato on top
+// and the level along the attack/release envelope (the duty), then writes the LEDC divider and
+// duty only when they changed, both a couple of register writes. A tick is a fixed amount of
+// integer work, buzzer_get_stats() has its measured cost. Silent, the timer is stopped.
+#define BUZZER_TICK_US          1000
+#define BUZZER_CTRL_PRIORITY    14     // above the tasks that call buzzer_play(), it only ever runs briefly
+#define BUZZER_CTRL_STACK_SIZE  2048
+#define BUZZER_MIN_HZ           262    // below and above this the buzzer is distorted or weak
+#define BUZZER_MAX_HZ           694
+
+typedef struct {
+    uint32_t ticks;
+    uint32_t cycles_max;      // CPU cycles of the slowest tick, LEDC writes included
+    uint64_t cycles_total;
+    uint32_t late_us_max;     // timer alarm to the tick running
+    uint32_t freq_writes;     // LEDC divider updates
+    uint32_t duty_writes;
+} buzzer_stats_t;
+
+// init buzzer; its control task runs on the core of the caller
 esp_err_t buzzer_init(void);
 
-// play a tone with specified frequency 
+// a note: from silence it starts at freq_hz with the attack, while one sounds it glides there
 esp_err_t buzzer_play(uint32_t freq_hz);
 
-// stop
-esp_err_t buzzer_stop(void);
\ No newline at end of file
+// release the note, it fades out
+esp_err_t buzzer_stop(void);
+
+// straight to freq_hz at full level with no glide or envelope (the metronome click), 0 = silent at once
+esp_err_t buzzer_tone(uint32_t freq_hz);
+
+// glide between notes, attack and release, each 0 = instant
+esp_err_t buzzer_shape(int glide_ms, int attack_ms, int release_ms);
+
+// vibrato of depth_cents (0 = off) at rate_hz
+esp_err_t buzzer_vibrato(int depth_cents, int rate_hz);
+
+void buzzer_get_stats(buzzer_stats_t *out);
@@ -0,0 +1,65 @@
+#include "chord.h"
+#include <stdio.h>
+
+#define KEYS 12
+
+typedef struct {
+    const char *suffix;
+    uint16_t intervals;   // bit n = n semitones above the root
+} chord_type_t;
+
+// earlier entries win when two shapes give the same mask with the same root
+static const chord_type_t types[] = {
+    { "",     0x091 },   // 0 4 7
+    { "m",    0x089 },   // 0 3 7
+    { "dim",  0x049 },   // 0 3 6
+    { "aug",  0x111 },   // 0 4 8
+    { "sus4", 0x0A1 },   // 0 5 7
+    { "sus2", 0x085 },   // 0 2 7
+    { "7",    0x491 },   // 0 4 7 10
+    { "maj7", 0x891 },   // 0 4 7 11
+    { "m7",   0x489 },   // 0 3 7 10
+    { "m7b5", 0x449 },   // 0 3 6 10
+    { "dim7", 0x249 },   // 0 3 6 9
+    { "6",    0x291 },   // 0 4 7 9
+    { "m6",   0x289 },   // 0 3 7 9
+    { "5",    0x081 },   // 0 7
+};
+
+static const char *root_names[KEYS] = { "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B" };
+
+static uint8_t table[1 << KEYS];
+
+void chord_init(void)
+{
+    for (unsigned t = 0; t < sizeof(types) / sizeof(types[0]); t++)
+    {
+        for (int root = 0; root < KEYS; root++)
+        {
+            uint16_t mask = ((types[t].intervals << root) | (types[t].intervals >> (KEYS - root))) & 0xFFF;
+            uint8_t entry = (uint8_t)((t + 1) << 4 | root);
+            uint8_t current = table[mask];
+
+            // lowest key = bass note: a shape rooted there beats one named from another key
+            int bass = __builtin_ctz(mask);
+            if (current == CHORD_NONE || ((current & 0x0F) != bass && root == bass))
+                table[mask] = entry;
+        }
+    }
+}
+
+uint8_t chord_lookup(uint16_t held)
+{
+    return table[held & 0xFFF];
+}
+
+int chord_format(uint8_t chord, char *buf, size_t size)
+{
+    if (chord == CHORD_NONE)
+    {
+        if (size > 0)
+            buf[0] = '\0';
+        return 0;
+    }
+    return snprintf(buf, size, "%s%s", root_names[chord & 0x0F], types[(chord >> 4) - 1].suffix);
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Chord names for the held keys. The 12 keys are one octave, so the held-key bitmask is the set of
+// pitch classes and every chord shape, inversions included, is one of 4096 masks: chord_init()
+// fills a 4 KB table once and a lookup is one array read.
+// Sets that spell two chords (C6 = Am7, augmented and diminished 7th) are named from the lowest key.
+
+#define CHORD_NONE  0
+#define CHORD_NAME_MAX 8   // "C#m7b5" + NUL, rounded up
+
+// fill the lookup table, before any other call
+void chord_init(void);
+
+// root in the low 4 bits, chord type + 1 in the high 4 bits, CHORD_NONE if the keys aren't a chord
+uint8_t chord_lookup(uint16_t held);
+
+// "Am7" for a chord_lookup() result, "" for CHORD_NONE; returns the length
+int chord_format(uint8_t chord, char *buf, size_t size);
@@ -0,0 +1,151 @@
+#include "clock_est.h"
+#include <string.h>
+#include <math.h>
+
+void clock_est_init(clock_est_t *e)
+{
+    memset(e, 0, sizeof(*e));
+}
+
+// least squares slope through the block minima, x from the newest so the doubles stay small
+static void fit_drift(clock_est_t *e)
+{
+    if (e->block_count < CLOCK_EST_MIN_BLOCKS)
+        return;
+
+    const clock_sample_t *newest = &e->blocks[(e->block_next + CLOCK_EST_BLOCKS - 1) % CLOCK_EST_BLOCKS];
+    double sx = 0, sy = 0;
+    for (int i = 0; i < e->block_count; i++)
+    {
+        sx += (double)(e->blocks[i].local_us - newest->local_us);
+        sy += (double)e->blocks[i].offset_us;
+    }
+    double x_mean = sx / e->block_count, y_mean = sy / e->block_count;
+
+    double sxx = 0, sxy = 0;
+    for (int i = 0; i < e->block_count; i++)
+    {
+        double dx = (double)(e->blocks[i].local_us - newest->local_us) - x_mean;
+        sxx += dx * dx;
+        sxy += dx * ((double)e->blocks[i].offset_us - y_mean);
+    }
+    if (sxx <= 0)
+        return;
+    double drift = sxy / sxx;
+    if (drift > CLOCK_EST_MAX_DRIFT)
+        drift = CLOCK_EST_MAX_DRIFT;
+    if (drift < -CLOCK_EST_MAX_DRIFT)
+        drift = -CLOCK_EST_MAX_DRIFT;
+    e->drift = drift;
+}
+
+// offset: the fast recent exchanges moved along the drift to the newest one, averaged
+static void fit_offset(clock_est_t *e)
+{
+    const clock_sample_t *newest = &e->samples[(e->next + CLOCK_EST_SAMPLES - 1) % CLOCK_EST_SAMPLES];
+    int32_t rtt_min = INT32_MAX;
+    for (int i = 0; i < e->count; i++)
+    {
+        if (e->samples[i].rtt_us < rtt_min)
+            rtt_min = e->samples[i].rtt_us;
+    }
+
+    double sum = 0;
+    int n = 0;
+    for (int i = 0; i < e->count; i++)
+    {
+        const clock_sample_t *s = &e->samples[i];
+        if (s->rtt_us > rtt_min + CLOCK_EST_RTT_SLACK_US)
+            continue;
+        sum += (double)s->offset_us - e->drift * (double)(s->local_us - newest->local_us);
+        n++;
+    }
+    double offset = sum / n;
+
+    double residuals = 0;
+    for (int i = 0; i < e->count; i++)
+    {
+        const clock_sample_t *s = &e->samples[i];
+        if (s->rtt_us > rtt_min + CLOCK_EST_RTT_SLACK_US)
+            continue;
+        double r = (double)s->offset_us - e->drift * (double)(s->local_us - newest->local_us) - offset;
+        residuals += r * r;
+    }
+
+    e->ref_us = newest->local_us;
+    e->offset_us = offset;
+    e->rtt_min_us = rtt_min;
+    e->error_us = (int32_t)sqrt(residuals / n);
+    e->used = n;
+    e->valid = true;
+}
+
+// the fastest exchange of each block goes into the drift fit when the block ends
+static void add_to_block(clock_est_t *e, const clock_sample_t *s)
+{
+    clock_sample_t *current = &e->blocks[e->block_next];
+    if (e->block_start_us == 0)
+    {
+        e->block_start_us = s->local_us;
+        *current = *s;
+        return;
+    }
+    if (s->local_us - e->block_start_us >= CLOCK_EST_BLOCK_US)
+    {
+        e->block_next = (e->block_next + 1) % CLOCK_EST_BLOCKS;
+        if (e->block_count < CLOCK_EST_BLOCKS)
+            e->block_count++;
+        fit_drift(e);
+        e->block_start_us = s->local_us;
+        e->blocks[e->block_next] = *s;
+        return;
+    }
+    if (s->rtt_us < current->rtt_us)
+        *current = *s;
+}
+
+bool clock_est_add(clock_est_t *e, int64_t t1, int64_t t2, int64_t t3, int64_t t4)
+{
+    int64_t rtt = (t4 - t1) - (t3 - t2);
+    if (t4 < t1 || t3 < t2 || rtt < 0 || rtt > CLOCK_EST_RTT_MAX_US)
+        return false;
+
+    clock_sample_t s = {
+        .local_us = t1 + (t4 - t1) / 2,
+        .offset_us = ((t2 - t1) + (t3 - t4)) / 2,
+        .rtt_us = (int32_t)rtt,
+    };
+
+    // farther off the line than its rtt can explain: the leader restarted, the old samples
+    // describe another clock
+    if (e->valid)
+    {
+        int64_t predicted = clock_est_to_shared(e, s.local_us) - s.local_us;
+        int64_t limit = CLOCK_EST_STEP_US + rtt / 2;
+        if (s.offset_us - predicted > limit || predicted - s.offset_us > limit)
+        {
+            // the crystals didn't change, the drift stays
+            e->count = 0;
+            e->next = 0;
+            e->block_count = 0;
+            e->block_next = 0;
+            e->block_start_us = 0;
+            e->steps++;
+        }
+    }
+
+    e->samples[e->next] = s;
+    e->next = (e->next + 1) % CLOCK_EST_SAMPLES;
+    if (e->count < CLOCK_EST_SAMPLES)
+        e->count++;
+    add_to_block(e, &s);
+    fit_offset(e);
+    return true;
+}
+
+int64_t clock_est_to_shared(const clock_est_t *e, int64_t local_us)
+{
+    if (!e->valid)
+        return local_us;
+    return local_us + (int64_t)llround(e->offset_us + e->drift * (double)(local_us - e->ref_us));
+}
@@ -0,0 +1,410 @@
+#include "ensemble.h"
+#include <stdio.h>
+#include <string.h>
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "clock_est.h"
+#include "timeline.h"
+#include "osc_out.h"
+#include "sys_stats.h"
+
+static const char *TAG = "ensemble";
+
+#define SYNC_MAGIC  0x50535943   // "PSYC"
+#define SYNC_PING   1
+#define SYNC_PONG   2
+
+// both ends are ESP32s, the struct goes on the wire as it is (little endian)
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint8_t type;
+    uint8_t node;
+    uint16_t seq;
+    int32_t error_us;    // ping: the follower's fit error and fastest exchange, for the leader's report
+    int32_t rtt_us;
+    int64_t t1;          // ping sent, follower clock
+    int64_t t2;          // ping received, leader clock
+    int64_t t3;          // pong sent, leader clock
+} sync_packet_t;
+
+typedef struct {
+    int64_t seen_us;     // last ping, 0 = never
+    int32_t error_us;
+    int32_t rtt_us;
+    uint32_t events;     // OSC events merged
+} node_info_t;
+
+static int own_node = 0;
+static bool is_leader = false;
+static int sync_socket = -1;
+static int osc_socket = -1;          // leader: the other pianos' OSC
+static struct sockaddr_in group_addr;
+static SemaphoreHandle_t ensemble_mutex;   // the estimate, the timeline and the node table
+
+// follower
+static clock_est_t est;
+static struct sockaddr_in leader_addr;
+static bool leader_known = false;
+static uint32_t pongs = 0;
+static uint32_t lost = 0;
+static int64_t last_pong_us = 0;
+
+// leader
+static timeline_t timeline;
+static node_info_t nodes[ENSEMBLE_MAX_NODES];
+
+bool ensemble_shared_time(int64_t *us)
+{
+    if (is_leader)
+        return own_node != 0;
+    if (own_node == 0)
+        return false;
+
+    xSemaphoreTake(ensemble_mutex, portMAX_DELAY);
+    bool synced = est.valid;
+    if (synced)
+        *us = clock_est_to_shared(&est, *us);
+    xSemaphoreGive(ensemble_mutex);
+    return synced;
+}
+
+static void merge(const char *event, const char *str, int32_t value, int64_t shared_us, int node)
+{
+    timeline_event_t e = { .shared_us = shared_us, .value = value, .node = node, .is_str = str != NULL };
+    snprintf(e.event, sizeof(e.event), "%s", event);
+    if (str != NULL)
+        snprintf(e.str, sizeof(e.str), "%s", str);
+
+    xSemaphoreTake(ensemble_mutex, portMAX_DELAY);
+    timeline_add(&timeline, &e);
+    xSemaphoreGive(ensemble_mutex);
+}
+
+void ensemble_post(const char *event, const char *str, int32_t value, int64_t event_us)
+{
+    if (!is_leader || own_node == 0)
+        return;
+    merge(event, str, value, event_us != 0 ? event_us : esp_timer_get_time(), own_node);
+}
+
+static int open_socket(int port, bool join)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0)
+        return -1;
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY) };
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(sock);
+        return -1;
+    }
+    if (join)
+    {
+        struct ip_mreq mreq = { .imr_multiaddr = group_addr.sin_addr, .imr_interface.s_addr = htonl(INADDR_ANY) };
+        if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0)
+            ESP_LOGW(TAG, "port %d: not a multicast group, only unicast arrives", port);
+    }
+    return sock;
+}
+
+// ping in, pong out at once: t2 as soon as it is read, t3 just before the send
+static void answer_ping(void)
+{
+    sync_packet_t ping;
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    int len = recvfrom(sync_socket, &ping, sizeof(ping), 0, (struct sockaddr *)&from, &from_len);
+    int64_t t2 = esp_timer_get_time();
+    if (len != sizeof(ping) || ping.magic != SYNC_MAGIC || ping.type != SYNC_PING || ping.node >= ENSEMBLE_MAX_NODES)
+        return;
+
+    sync_packet_t pong = ping;
+    pong.type = SYNC_PONG;
+    pong.node = own_node;
+    pong.t2 = t2;
+    pong.t3 = esp_timer_get_time();
+    sendto(sync_socket, &pong, sizeof(pong), 0, (struct sockaddr *)&from, sizeof(from));
+
+    xSemaphoreTake(ensemble_mutex, portMAX_DELAY);
+    nodes[ping.node].seen_us = t2;
+    nodes[ping.node].error_us = ping.error_us;
+    nodes[ping.node].rtt_us = ping.rtt_us;
+    xSemaphoreGive(ensemble_mutex);
+}
+
+// another piano's OSC event into the timeline; its own times are already shared
+static void receive_event(void)
+{
+    uint8_t data[OSC_OUT_PACKET_MAX];
+    osc_out_message_t msg;
+    int len = recv(osc_socket, data, sizeof(data), 0);
+    if (len <= 0 || !osc_out_parse(data, len, &msg))
+        return;
+    // node 0 isn't synchronized yet, "alive" only keeps the sequence going
+    if (msg.node <= 0 || msg.node >= ENSEMBLE_MAX_NODES || msg.node == own_node || strcmp(msg.event, "alive") == 0)
+        return;
+
+    merge(msg.event, msg.is_str ? msg.str : NULL, msg.value, msg.event_us != 0 ? msg.event_us : msg.sent_us, msg.node);
+    xSemaphoreTake(ensemble_mutex, portMAX_DELAY);
+    nodes[msg.node].events++;
+    xSemaphoreGive(ensemble_mutex);
+}
+
+static void leader_loop(void)
+{
+    while (1)
+    {
+        // the next event due out of the window, checked at least every 100 ms
+        xSemaphoreTake(ensemble_mutex, portMAX_DELAY);
+        int64_t wait_us = timeline_next_due(&timeline) - esp_timer_get_time();
+        xSemaphoreGive(ensemble_mutex);
+        if (wait_us > 100000)
+            wait_us = 100000;
+        if (wait_us < 0)
+            wait_us = 0;
+
+        fd_set ready;
+        FD_ZERO(&ready);
+        FD_SET(sync_socket, &ready);
+        FD_SET(osc_socket, &ready);
+        struct timeval timeout = { .tv_sec = 0, .tv_usec = wait_us };
+        int max_fd = sync_socket > osc_socket ? sync_socket : osc_socket;
+        if (select(max_fd + 1, &ready, NULL, NULL, &timeout) > 0)
+        {
+            if (FD_ISSET(sync_socket, &ready))
+                answer_ping();
+            if (FD_ISSET(osc_socket, &ready))
+                receive_event();
+        }
+
+        timeline_event_t e;
+        while (1)
+        {
+            xSemaphoreTake(ensemble_mutex, portMAX_DELAY);
+            bool due = timeline_pop(&timeline, esp_timer_get_time(), &e);
+            xSemaphoreGive(ensemble_mutex);
+            if (!due)
+                break;
+            osc_out_send_merged(e.event, e.is_str ? e.str : NULL, e.value, e.shared_us, e.node);
+        }
+    }
+}
+
+static void follower_loop(void)
+{
+    uint16_t seq = 0;
+    int lost_in_row = 0;
+    TickType_t last_wake = xTaskGetTickCount();
+
+    while (1)
+    {
+        sync_packet_t ping = { .magic = SYNC_MAGIC, .type = SYNC_PING, .node = own_node, .seq = ++seq };
+        xSemaphoreTake(ensemble_mutex, portMAX_DELAY);
+        ping.error_us = est.valid ? est.error_us : -1;
+        ping.rtt_us = est.valid ? est.rtt_min_us : -1;
+        xSemaphoreGive(ensemble_mutex);
+
+        // until the leader answers, ask the whole group
+        const struct sockaddr_in *to = leader_known ? &leader_addr : &group_addr;
+        ping.t1 = esp_timer_get_time();
+        sendto(sync_socket, &ping, sizeof(ping), 0, (const struct sockaddr *)to, sizeof(*to));
+
+        bool answered = false;
+        int64_t give_up_us = ping.t1 + ENSEMBLE_PONG_WAIT_MS * 1000;
+        while (!answered && esp_timer_get_time() < give_up_us)
+        {
+            sync_packet_t pong;
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            int len = recvfrom(sync_socket, &pong, sizeof(pong), 0, (struct sockaddr *)&from, &from_len);
+            int64_t t4 = esp_timer_get_time();
+            // a late pong of an earlier ping has another seq
+            if (len != sizeof(pong) || pong.magic != SYNC_MAGIC || pong.type != SYNC_PONG || pong.seq != seq)
+                continue;
+
+            answered = true;
+            xSemaphoreTake(ensemble_mutex, portMAX_DELAY);
+            bool first = !est.valid;
+            clock_est_add(&est, ping.t1, pong.t2, pong.t3, t4);
+            pongs++;
+            last_pong_us = t4;
+            xSemaphoreGive(ensemble_mutex);
+
+            if (!leader_known)
+                printf("Ensemble: leader is node %d\n", pong.node);
+            if (first)
+                printf("Ensemble: synchronized, rtt %ld us\n", (long)((t4 - ping.t1) - (pong.t3 - pong.t2)));
+            leader_addr = from;
+            leader_known = true;
+            lost_in_row = 0;
+        }
+        if (!answered)
+        {
+            lost++;
+            if (++lost_in_row >= ENSEMBLE_LOST_PONGS)
+                leader_known = false;
+        }
+
+        xTaskDelayUntil(&last_wake, pdMS_TO_TICKS(ENSEMBLE_PERIOD_MS));
+    }
+}
+
+static void ensemble_task(void *arg)
+{
+    if (is_leader)
+        leader_loop();
+    else
+        follower_loop();
+}
+
+esp_err_t ensemble_start(int node, bool leader, const char *group, int osc_port, int window_ms,
+                         UBaseType_t priority, BaseType_t core)
+{
+    static StaticSemaphore_t mutex_buffer;
+    static StackType_t stack[ENSEMBLE_STACK_SIZE];
+    static StaticTask_t tcb;
+
+    if (node < 1 || node >= ENSEMBLE_MAX_NODES)
+        return ESP_ERR_INVALID_ARG;
+    memset(&group_addr, 0, sizeof(group_addr));
+    group_addr.sin_family = AF_INET;
+    group_addr.sin_port = htons(ENSEMBLE_SYNC_PORT);
+    if (inet_pton(AF_INET, group, &group_addr.sin_addr) != 1)
+        return ESP_ERR_INVALID_ARG;
+
+    ensemble_mutex = xSemaphoreCreateMutexStatic(&mutex_buffer);
+    clock_est_init(&est);
+    timeline_init(&timeline, window_ms * 1000LL);
+
+    sync_socket = open_socket(leader ? ENSEMBLE_SYNC_PORT : 0, leader);
+    if (leader)
+        osc_socket = open_socket(osc_port, true);
+    if (sync_socket < 0 || (leader && osc_socket < 0))
+    {
+        ESP_LOGE(TAG, "sockets failed: %d", errno);
+        return ESP_FAIL;
+    }
+    if (!leader)
+    {
+        // recvfrom() returns at least every 10 ms while waiting for a pong
+        struct timeval timeout = { .tv_sec = 0, .tv_usec = 10000 };
+        setsockopt(sync_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    own_node = node;
+    is_leader = leader;
+    TaskHandle_t task = xTaskCreateStaticPinnedToCore(ensemble_task, "Ensemble Task", ENSEMBLE_STACK_SIZE, NULL,
+                                                      priority, stack, &tcb, core);
+    if (task == NULL)
+        return ESP_ERR_NO_MEM;
+    sys_stats_watch_stack(task, "Ensemble Task", ENSEMBLE_STACK_SIZE);
+    osc_out_set_clock(node, ensemble_shared_time);
+
+    printf("Ensemble: node %d, %s, sync on port %d\n", node, leader ? "leader" : "follower", ENSEMBLE_SYNC_PORT);
+    return ESP_OK;
+}
+
+int ensemble_stats_json(char *buf, size_t size)
+{
+    if (own_node == 0)
+        return 0;
+
+    int len;
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(ensemble_mutex, portMAX_DELAY);
+    if (is_leader)
+    {
+        int followers = 0;
+        int32_t worst = 0;
+        for (int i = 1; i < ENSEMBLE_MAX_NODES; i++)
+        {
+            if (nodes[i].seen_us == 0 || now - nodes[i].seen_us > ENSEMBLE_NODE_ACTIVE_MS * 1000LL)
+                continue;
+            followers++;
+            if (nodes[i].error_us > worst)
+                worst = nodes[i].error_us;
+        }
+        len = snprintf(buf, size, "\"ensemble\":{\"node\":%d,\"leader\":true,\"followers\":%d,\"worst_error_us\":%ld,"
+                       "\"merged\":%lu,\"late\":%lu,\"dropped\":%lu}",
+                       own_node, followers, (long)worst, (unsigned long)timeline.merged,
+                       (unsigned long)timeline.late, (unsigned long)timeline.dropped);
+    }
+    else
+    {
+        len = snprintf(buf, size, "\"ensemble\":{\"node\":%d,\"leader\":false,\"synced\":%s,\"offset_us\":%lld,"
+                       "\"drift_ppb\":%ld,\"rtt_min_us\":%ld,\"error_us\":%ld,\"pongs\":%lu,\"lost\":%lu,\"last_pong_ms\":%ld}",
+                       own_node, est.valid ? "true" : "false", (long long)est.offset_us, (long)(est.drift * 1e9),
+                       (long)est.rtt_min_us, (long)est.error_us, (unsigned long)pongs, (unsigned long)lost,
+                       last_pong_us ? (long)((now - last_pong_us) / 1000) : -1L);
+    }
+    xSemaphoreGive(ensemble_mutex);
+    return len;
+}
+
+esp_err_t ensemble_write_prometheus(prom_sink_t sink, void *ctx)
+{
+    if (own_node == 0)
+        return ESP_OK;
+
+    char line[448];
+    int len;
+    esp_err_t err = ESP_OK;
+    if (!is_leader)
+    {
+        xSemaphoreTake(ensemble_mutex, portMAX_DELAY);
+        len = snprintf(line, sizeof(line),
+                       "# TYPE piano_sync_offset_seconds gauge\npiano_sync_offset_seconds %.6f\n"
+                       "# TYPE piano_sync_drift_ppm gauge\npiano_sync_drift_ppm %.3f\n"
+                       "# TYPE piano_sync_rtt_min_seconds gauge\npiano_sync_rtt_min_seconds %.6f\n"
+                       "# TYPE piano_sync_error_seconds gauge\npiano_sync_error_seconds %.6f\n"
+                       "# TYPE piano_sync_pongs_total counter\npiano_sync_pongs_total %lu\n"
+                       "# TYPE piano_sync_lost_total counter\npiano_sync_lost_total %lu\n",
+                       est.offset_us / 1e6, est.drift * 1e6, est.rtt_min_us / 1e6, est.error_us / 1e6,
+                       (unsigned long)pongs, (unsigned long)lost);
+        xSemaphoreGive(ensemble_mutex);
+        return sink(ctx, line, len);
+    }
+
+    xSemaphoreTake(ensemble_mutex, portMAX_DELAY);
+    len = snprintf(line, sizeof(line),
+                   "# TYPE piano_ensemble_merged_total counter\npiano_ensemble_merged_total %lu\n"
+                   "# TYPE piano_ensemble_late_total counter\npiano_ensemble_late_total %lu\n"
+                   "# TYPE piano_ensemble_dropped_total counter\npiano_ensemble_dropped_total %lu\n",
+                   (unsigned long)timeline.merged, (unsigned long)timeline.late, (unsigned long)timeline.dropped);
+    xSemaphoreGive(ensemble_mutex);
+    err = sink(ctx, line, len);
+
+    // every follower that ever pinged: its fit error, fastest exchange and events merged,
+    // one metric after the other as Prometheus wants them grouped
+    static const char *const metrics[] = {
+        "# TYPE piano_ensemble_node_error_seconds gauge\n",
+        "# TYPE piano_ensemble_node_rtt_min_seconds gauge\n",
+        "# TYPE piano_ensemble_node_events_total counter\n",
+    };
+    for (int m = 0; m < 3 && err == ESP_OK; m++)
+    {
+        err = sink(ctx, metrics[m], strlen(metrics[m]));
+        for (int i = 1; i < ENSEMBLE_MAX_NODES && err == ESP_OK; i++)
+        {
+            xSemaphoreTake(ensemble_mutex, portMAX_DELAY);
+            node_info_t n = nodes[i];
+            xSemaphoreGive(ensemble_mutex);
+            if (n.seen_us == 0)
+                continue;
+            if (m == 0)
+                len = snprintf(line, sizeof(line), "piano_ensemble_node_error_seconds{node=\"%d\"} %.6f\n", i, n.error_us / 1e6);
+            else if (m == 1)
+                len = snprintf(line, sizeof(line), "piano_ensemble_node_rtt_min_seconds{node=\"%d\"} %.6f\n", i, n.rtt_us / 1e6);
+            else
+                len = snprintf(line, sizeof(line), "piano_ensemble_node_events_total{node=\"%d\"} %lu\n", i, (unsigned long)n.events);
+            err = sink(ctx, line, len);
+        }
+    }
+    return err;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Offset and drift of the local clock against the leader's, from NTP-style ping-pongs:
+// t1 ping sent (local), t2 ping received and t3 pong sent (leader), t4 pong received (local).
+// Each exchange gives offset = ((t2 - t1) + (t3 - t4)) / 2, exact when both directions took as
+// long, and rtt = (t4 - t1) - (t3 - t2). WiFi delays come in bursts (retries, the AP's queue, a
+// station dozing), so only the fastest exchanges count:
+//  - drift is the slope through the fastest exchange of each CLOCK_EST_BLOCK_US, over the last
+//    CLOCK_EST_BLOCKS of them (least squares); a couple of minutes make the slope steady;
+//  - offset is the mean, along that slope, of the last CLOCK_EST_SAMPLES exchanges within
+//    CLOCK_EST_RTT_SLACK_US of the fastest of them.
+// No ESP-IDF headers: tools/ensemble_sim.py builds this file on the host.
+
+#define CLOCK_EST_SAMPLES       32          // recent exchanges, one per sync period
+#define CLOCK_EST_BLOCKS        16          // fastest exchange of each block, for the drift
+#define CLOCK_EST_BLOCK_US      8000000
+#define CLOCK_EST_RTT_SLACK_US  1000        // slower than the fastest + this = not in the offset
+#define CLOCK_EST_RTT_MAX_US    200000      // an answer later than this is thrown away
+#define CLOCK_EST_MIN_BLOCKS    3           // blocks before there is a drift estimate
+#define CLOCK_EST_MAX_DRIFT     200e-6      // crystals are within 50 ppm, more is a bad fit
+#define CLOCK_EST_STEP_US       50000       // this far off the line, more than rtt / 2 = a clock step
+
+typedef struct {
+    int64_t local_us;      // middle of the exchange, local clock
+    int64_t offset_us;     // leader minus local
+    int32_t rtt_us;
+} clock_sample_t;
+
+typedef struct {
+    clock_sample_t samples[CLOCK_EST_SAMPLES];
+    int count;
+    int next;
+    clock_sample_t blocks[CLOCK_EST_BLOCKS];   // the current block's fastest is at block_next
+    int block_count;                           // finished blocks
+    int block_next;
+    int64_t block_start_us;
+    // shared = local + offset_us + drift * (local - ref_us)
+    int64_t ref_us;
+    double offset_us;
+    double drift;          // s/s, + = the local clock is slow
+    int32_t rtt_min_us;    // fastest recent exchange, rtt_min_us / 2 bounds the offset error
+    int32_t error_us;      // rms distance of the fastest recent exchanges from the line
+    int used;              // exchanges in the offset
+    uint32_t steps;        // times the leader's clock jumped (it restarted) and the fit started over
+    bool valid;
+} clock_est_t;
+
+void clock_est_init(clock_est_t *e);
+
+// one ping-pong; false when the times make no sense and it was thrown away
+bool clock_est_add(clock_est_t *e, int64_t t1, int64_t t2, int64_t t3, int64_t t4);
+
+// local time on the leader's clock; local_us itself until the first exchange
+int64_t clock_est_to_shared(const clock_est_t *e, int64_t local_us);
@@ -0,0 +1,40 @@
+#pragma once
+#include "esp_err.h"
+#include "prom_sink.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+
+// Several pianos in one room on one clock, the leader's esp_timer, so their events can be put in
+// one order. Followers ping the leader every ENSEMBLE_PERIOD_MS over UDP, first on the multicast
+// group and once it has answered straight to its address; clock_est.h turns the exchanges into
+// offset and drift. Every OSC message (components/osc_out) then carries the piano's node number
+// and shared times.
+// The leader listens to the other pianos' OSC too, holds every event in a timeline.h window with
+// its own and sends them on as "/ensemble/<event>" in shared-time order.
+
+#define ENSEMBLE_SYNC_PORT      9001
+#define ENSEMBLE_PERIOD_MS      500
+#define ENSEMBLE_PONG_WAIT_MS   100
+#define ENSEMBLE_LOST_PONGS     6      // in a row: the leader went away, look for it on the group
+#define ENSEMBLE_MAX_NODES      32     // node numbers 1..31, 0 = not in the ensemble
+#define ENSEMBLE_NODE_ACTIVE_MS 5000   // a follower not heard of for this long isn't counted
+#define ENSEMBLE_STACK_SIZE     3584
+
+// node 1..31; group and osc_port are the OSC out's (PIANO_OSC_ADDR, PIANO_OSC_PORT), the leader
+// joins them to hear the other pianos. Call once WiFi has an IP.
+esp_err_t ensemble_start(int node, bool leader, const char *group, int osc_port, int window_ms,
+                         UBaseType_t priority, BaseType_t core);
+
+// a local esp_timer time to the shared clock, in place; false and unchanged until synchronized
+bool ensemble_shared_time(int64_t *us);
+
+// leader: one of this piano's events into the merged timeline, event_us local (0 = now)
+void ensemble_post(const char *event, const char *str, int32_t value, int64_t event_us);
+
+// "ensemble":{...} for the /stats report, returns the length
+int ensemble_stats_json(char *buf, size_t size);
+
+// follower: offset, drift, fit error and its bound; leader: every follower's and the merge counters
+esp_err_t ensemble_write_prometheus(prom_sink_t sink, void *ctx);
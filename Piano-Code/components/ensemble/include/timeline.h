@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// The leader's merge of every piano's events into one timeline, ordered by shared time.
+// An event is held until it is window_us old, so a later event from a piano whose datagrams
+// took longer still goes in before it; one that arrives after its place was released is late
+// and goes out at once, out of order.
+// No ESP-IDF headers: tools/ensemble_sim.py builds this file on the host.
+
+#define TIMELINE_MAX        32   // held events, a few hundred ms of every piano playing chords
+#define TIMELINE_NAME_MAX   12   // "note_off", and the chord name ("C#m7b5")
+
+typedef struct {
+    int64_t shared_us;
+    int32_t value;
+    uint8_t node;
+    bool is_str;
+    char event[TIMELINE_NAME_MAX];
+    char str[TIMELINE_NAME_MAX];
+} timeline_event_t;
+
+typedef struct {
+    timeline_event_t events[TIMELINE_MAX];   // oldest first
+    int count;
+    int64_t window_us;
+    int64_t released_us;   // time of the last event out
+    uint32_t merged;
+    uint32_t late;
+    uint32_t dropped;      // full
+} timeline_t;
+
+void timeline_init(timeline_t *t, int64_t window_us);
+
+// false when it is full and the event was dropped
+bool timeline_add(timeline_t *t, const timeline_event_t *e);
+
+// the oldest event once now_us (shared) is window_us past it; false when none is due
+bool timeline_pop(timeline_t *t, int64_t now_us, timeline_event_t *out);
+
+// shared time the oldest event is due, INT64_MAX when empty
+int64_t timeline_next_due(const timeline_t *t);
@@ -0,0 +1,49 @@
+#include "timeline.h"
+#include <string.h>
+
+void timeline_init(timeline_t *t, int64_t window_us)
+{
+    memset(t, 0, sizeof(*t));
+    t->window_us = window_us;
+    t->released_us = INT64_MIN;
+}
+
+bool timeline_add(timeline_t *t, const timeline_event_t *e)
+{
+    if (t->count == TIMELINE_MAX)
+    {
+        t->dropped++;
+        return false;
+    }
+    if (e->shared_us < t->released_us)
+        t->late++;
+
+    // insertion from the end: events mostly come in order, the loop rarely runs
+    int i = t->count;
+    while (i > 0 && t->events[i - 1].shared_us > e->shared_us)
+    {
+        t->events[i] = t->events[i - 1];
+        i--;
+    }
+    t->events[i] = *e;
+    t->count++;
+    return true;
+}
+
+bool timeline_pop(timeline_t *t, int64_t now_us, timeline_event_t *out)
+{
+    if (t->count == 0 || now_us < t->events[0].shared_us + t->window_us)
+        return false;
+    *out = t->events[0];
+    t->count--;
+    memmove(&t->events[0], &t->events[1], t->count * sizeof(t->events[0]));
+    if (out->shared_us > t->released_us)
+        t->released_us = out->shared_us;
+    t->merged++;
+    return true;
+}
+
+int64_t timeline_next_due(const timeline_t *t)
+{
+    return t->count > 0 ? t->events[0].shared_us + t->window_us : INT64_MAX;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <stdint.h>
+
+// Guided practice: the melodies of the web page's list and the follower that checks every key
+// press against the next note. The firmware owns it, so the LCD, the web page (SSE), the AR app
+// (AR link) and the console all get the same next-note hint in the scan that saw the key.
+// Keys are 0-11 (C4..B4). A wrong key is forgiven up to the tolerance, more in a row start the
+// melody over; pressing the note just played again (a double strike) is never counted.
+
+#define MELODY_GUIDE_NONE   -1   // free play, no melody loaded
+
+typedef enum {
+    MELODY_GUIDE_IGNORED,   // free play, or a repeat of the note just played
+    MELODY_GUIDE_STEP,      // right key, on to the next note
+    MELODY_GUIDE_WRONG,     // wrong key, still within the tolerance
+    MELODY_GUIDE_RESTART,   // too many wrong keys, back to the first note
+    MELODY_GUIDE_DONE,      // last note played, the melody starts over
+} melody_guide_result_t;
+
+typedef struct {
+    int melody;       // index into the list, MELODY_GUIDE_NONE in free play
+    int step;         // next note to play
+    int misses;       // wrong keys since the last right one
+    int tolerance;    // misses forgiven per note
+} melody_guide_t;
+
+// number of built-in melodies
+int melody_guide_count(void);
+
+// "Ode to Joy", NULL for an index out of range
+const char *melody_guide_name(int index);
+
+// notes in a melody, 0 for an index out of range
+int melody_guide_length(int index);
+
+// free play, tolerance = wrong keys forgiven per note
+void melody_guide_init(melody_guide_t *m, int tolerance);
+
+// start a melody from its first note, MELODY_GUIDE_NONE for free play; returns -1 for a bad index
+int melody_guide_load(melody_guide_t *m, int index);
+
+// one key press
+melody_guide_result_t melody_guide_key(melody_guide_t *m, int key);
+
+// the key to play next, -1 in free play
+int melody_guide_next(const melody_guide_t *m);
@@ -0,0 +1,85 @@
+#include "melody_guide.h"
+#include <stddef.h>
+
+#define MELODY_MAX_NOTES 16
+
+typedef struct {
+    const char *name;
+    int length;
+    uint8_t notes[MELODY_MAX_NOTES];
+} melody_def_t;
+
+// same order as the list in Piano-Web's piano.ts, the page selects by index
+static const melody_def_t melodies[] = {
+    { "Twinkle Twinkle",        7,  { 0, 0, 7, 7, 9, 9, 7 } },
+    { "Mary Had a Little Lamb", 7,  { 4, 2, 0, 2, 4, 4, 4 } },
+    { "Ode to Joy",             9,  { 4, 4, 5, 7, 7, 5, 4, 2, 0 } },
+    { "Happy Birthday",         6,  { 0, 0, 2, 0, 5, 4 } },
+    { "Jingle Bells",           12, { 4, 4, 4, 4, 4, 4, 4, 0, 2, 4, 5, 4 } },
+};
+
+#define MELODY_COUNT ((int)(sizeof(melodies) / sizeof(melodies[0])))
+
+int melody_guide_count(void)
+{
+    return MELODY_COUNT;
+}
+
+const char *melody_guide_name(int index)
+{
+    return index >= 0 && index < MELODY_COUNT ? melodies[index].name : NULL;
+}
+
+int melody_guide_length(int index)
+{
+    return index >= 0 && index < MELODY_COUNT ? melodies[index].length : 0;
+}
+
+void melody_guide_init(melody_guide_t *m, int tolerance)
+{
+    m->melody = MELODY_GUIDE_NONE;
+    m->step = 0;
+    m->misses = 0;
+    m->tolerance = tolerance < 0 ? 0 : tolerance;
+}
+
+int melody_guide_load(melody_guide_t *m, int index)
+{
+    if (index != MELODY_GUIDE_NONE && (index < 0 || index >= MELODY_COUNT))
+        return -1;
+    m->melody = index;
+    m->step = 0;
+    m->misses = 0;
+    return 0;
+}
+
+melody_guide_result_t melody_guide_key(melody_guide_t *m, int key)
+{
+    if (m->melody == MELODY_GUIDE_NONE)
+        return MELODY_GUIDE_IGNORED;
+
+    const melody_def_t *def = &melodies[m->melody];
+    if (key == def->notes[m->step])
+    {
+        m->misses = 0;
+        if (++m->step < def->length)
+            return MELODY_GUIDE_STEP;
+        m->step = 0;
+        return MELODY_GUIDE_DONE;
+    }
+
+    // the note just played once more: a double strike or a bouncing finger, not a mistake
+    if (m->step > 0 && key == def->notes[m->step - 1])
+        return MELODY_GUIDE_IGNORED;
+
+    if (++m->misses <= m->tolerance)
+        return MELODY_GUIDE_WRONG;
+    m->step = 0;
+    m->misses = 0;
+    return MELODY_GUIDE_RESTART;
+}
+
+int melody_guide_next(const melody_guide_t *m)
+{
+    return m->melody == MELODY_GUIDE_NONE ? -1 : melodies[m->melody].notes[m->step];
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "esp_err.h"
+#include "prom_sink.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// MIDI out on a spare UART: 31250 baud for a DIN socket (TX -> 220 ohm -> pin 5, pin 4 -> 220 ohm
+// -> 3.3V) or a higher rate for a serial-MIDI bridge on a USB-serial adapter.
+// Note Off is sent as Note On with velocity 0 so a chord stays in running status: 2 bytes per key
+// instead of 3. Every message is queued to the UART TX buffer without waiting, the same work for
+// every event; a full buffer drops the message and counts it.
+
+#define MIDI_OUT_FIRST_NOTE  60    // key 0 = C4
+#define MIDI_OUT_VELOCITY    100   // the keys don't sense velocity
+#define MIDI_OUT_TX_BUFFER   1024
+#define MIDI_OUT_BEND_CENTER 8192
+
+esp_err_t midi_out_init(int uart, int tx_gpio, int baud, int channel);
+
+// key 0-11, does nothing before midi_out_init()
+void midi_out_note(int key, bool on);
+
+// 14 bit pitch bend, 0..16383, MIDI_OUT_BEND_CENTER = no bend
+void midi_out_bend(uint16_t value);
+
+// "midi" console command: 8 bursts of a 12 key chord on, bend up, all off, bend back, each burst
+// sent in one go; tools/midi_check.py compares the bytes with what they must be
+void midi_out_test(void);
+
+// messages, bytes, bytes saved by running status and dropped messages
+esp_err_t midi_out_write_prometheus(prom_sink_t sink, void *ctx);
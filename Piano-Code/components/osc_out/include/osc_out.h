@@ -0,0 +1,56 @@
+#pragma once
+#include "esp_err.h"
+#include "prom_sink.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Note events as OSC 1.0 messages on UDP, one datagram per event to a multicast group: the same
+// work for any number of listeners, where every SSE client is a TCP connection and a write of its
+// own. Nothing is acknowledged or resent, a lost datagram is lost; the sequence number shows it.
+//
+// Every message is "/piano/<event>" with five arguments, big endian as OSC wants:
+//   ,iihhi  value (key, beat, bpm... as in the SSE "event:value"), sequence number,
+//           time of the key change or beat in us (0 = none), time sent, node
+//   ,sihhi  the same with the chord name as a string
+// The times are esp_timer's with node 0; in an ensemble (components/ensemble) node is the piano's
+// number and the times are on the shared clock. The leader sends the merged timeline of every
+// piano as "/ensemble/<event>", with a sequence of its own.
+// tools/osc_listen.py receives them and reports loss and latency.
+
+#define OSC_OUT_PACKET_MAX  80     // "/ensemble/note_off" + ",sihhi" + a chord name fit
+#define OSC_OUT_NAME_MAX    12     // event names and chord names that osc_out_parse() keeps
+#define OSC_OUT_TTL         1      // multicast stays on the local network
+
+// addr is a multicast group ("239.255.42.99") or one host's address; call once WiFi has an IP
+esp_err_t osc_out_init(const char *addr, int port);
+
+// one message, never waits: a full lwIP or WiFi queue drops it and counts it.
+// Does nothing before osc_out_init().
+void osc_out_send(const char *event, int32_t value, int64_t event_us);
+void osc_out_send_str(const char *event, const char *value, int64_t event_us);
+
+// node number and the shared clock for the times sent from now on; to_shared converts a local
+// esp_timer time in place and returns false while the piano isn't synchronized (node 0 is sent)
+void osc_out_set_clock(int node, bool (*to_shared)(int64_t *us));
+
+// one event of the merged timeline as "/ensemble/<event>", shared_us already on the shared clock;
+// str NULL for an int value
+void osc_out_send_merged(const char *event, const char *str, int32_t value, int64_t shared_us, int node);
+
+typedef struct {
+    char event[OSC_OUT_NAME_MAX];   // after "/piano/"
+    char str[OSC_OUT_NAME_MAX];     // chord name when is_str
+    bool is_str;
+    int32_t value;
+    uint32_t seq;
+    int64_t event_us;
+    int64_t sent_us;
+    int node;
+} osc_out_message_t;
+
+// a "/piano/..." message as sent by a piano, false for anything else
+bool osc_out_parse(const uint8_t *data, size_t len, osc_out_message_t *msg);
+
+// datagrams and bytes sent, datagrams dropped
+esp_err_t osc_out_write_prometheus(prom_sink_t sink, void *ctx);
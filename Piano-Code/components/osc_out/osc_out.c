@@ -0,0 +1,216 @@
+#include "osc_out.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+
+static const char *TAG = "osc_out";
+
+static int osc_socket = -1;
+static struct sockaddr_in osc_dest;
+
+static atomic_uint_least32_t sequence = 0;
+static atomic_uint_least32_t merged_sequence = 0;   // "/ensemble/", the leader's timeline
+static int osc_node = 0;
+static bool (*osc_to_shared)(int64_t *us) = NULL;
+static atomic_uint_least32_t packets = 0;
+static atomic_uint_least32_t bytes = 0;
+static atomic_uint_least32_t dropped = 0;
+
+// OSC strings end with a NUL and are padded with NULs to a multiple of 4
+static size_t put_string(uint8_t *out, size_t pos, size_t size, const char *s)
+{
+    size_t len = strlen(s);
+    size_t padded = (len + 4) & ~(size_t)3;
+    if (pos + padded > size)
+        return size + 1;
+    memcpy(out + pos, s, len);
+    memset(out + pos + len, 0, padded - len);
+    return pos + padded;
+}
+
+static size_t put_u32(uint8_t *out, size_t pos, uint32_t v)
+{
+    out[pos] = v >> 24;
+    out[pos + 1] = v >> 16;
+    out[pos + 2] = v >> 8;
+    out[pos + 3] = v;
+    return pos + 4;
+}
+
+static size_t put_i64(uint8_t *out, size_t pos, int64_t v)
+{
+    pos = put_u32(out, pos, (uint64_t)v >> 32);
+    return put_u32(out, pos, (uint32_t)v);
+}
+
+static uint32_t get_u32(const uint8_t *in)
+{
+    return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 8 | in[3];
+}
+
+static int64_t get_i64(const uint8_t *in)
+{
+    return (int64_t)((uint64_t)get_u32(in) << 32 | get_u32(in + 4));
+}
+
+// an OSC string at pos into out (truncated to size), returns the position after its padding or 0
+static size_t get_string(const uint8_t *in, size_t len, size_t pos, char *out, size_t size)
+{
+    const uint8_t *end = memchr(in + pos, 0, len - pos);
+    if (end == NULL)
+        return 0;
+    size_t n = end - (in + pos);
+    snprintf(out, size, "%.*s", (int)n, (const char *)in + pos);
+    size_t next = pos + ((n + 4) & ~(size_t)3);
+    return next <= len ? next : 0;
+}
+
+// the message with either an int or a string as the value; the rest is the same
+static void send_message(const char *prefix, atomic_uint_least32_t *seq, const char *event, const char *str,
+                         int32_t value, int64_t event_us, int64_t sent_us, int node)
+{
+    if (osc_socket < 0)
+        return;
+
+    uint8_t msg[OSC_OUT_PACKET_MAX];
+    char address[32];
+    snprintf(address, sizeof(address), "%s%s", prefix, event);
+
+    size_t pos = put_string(msg, 0, sizeof(msg), address);
+    if (pos <= sizeof(msg))
+        pos = put_string(msg, pos, sizeof(msg), str != NULL ? ",sihhi" : ",iihhi");
+    if (pos <= sizeof(msg))
+        pos = str != NULL ? put_string(msg, pos, sizeof(msg), str) : put_u32(msg, pos, (uint32_t)value);
+    if (pos + 4 + 8 + 8 + 4 > sizeof(msg))
+    {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+    pos = put_u32(msg, pos, atomic_fetch_add_explicit(seq, 1, memory_order_relaxed));
+    pos = put_i64(msg, pos, event_us);
+    pos = put_i64(msg, pos, sent_us);
+    pos = put_u32(msg, pos, (uint32_t)node);
+
+    // MSG_DONTWAIT: with the WiFi TX queue full, lose this event rather than hold up the SSE writes
+    if (sendto(osc_socket, msg, pos, MSG_DONTWAIT, (struct sockaddr *)&osc_dest, sizeof(osc_dest)) != (ssize_t)pos)
+    {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+    atomic_fetch_add_explicit(&packets, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&bytes, pos, memory_order_relaxed);
+}
+
+esp_err_t osc_out_init(const char *addr, int port)
+{
+    memset(&osc_dest, 0, sizeof(osc_dest));
+    osc_dest.sin_family = AF_INET;
+    osc_dest.sin_port = htons(port);
+    if (inet_pton(AF_INET, addr, &osc_dest.sin_addr) != 1 || port <= 0 || port > 65535)
+        return ESP_ERR_INVALID_ARG;
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0)
+    {
+        ESP_LOGE(TAG, "socket failed: %d", errno);
+        return ESP_FAIL;
+    }
+    uint8_t ttl = OSC_OUT_TTL;
+    uint8_t loop = 0;   // the piano doesn't listen to itself
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+
+    osc_socket = sock;
+    printf("OSC out to %s:%d\n", addr, port);
+    return ESP_OK;
+}
+
+// this piano's event: both times on the shared clock once synchronized, with the node number
+static void send_local(const char *event, const char *str, int32_t value, int64_t event_us)
+{
+    int64_t sent_us = esp_timer_get_time();
+    int node = 0;
+    if (osc_to_shared != NULL && osc_to_shared(&sent_us))
+    {
+        if (event_us != 0)
+            osc_to_shared(&event_us);
+        node = osc_node;
+    }
+    send_message("/piano/", &sequence, event, str, value, event_us, sent_us, node);
+}
+
+void osc_out_send(const char *event, int32_t value, int64_t event_us)
+{
+    send_local(event, NULL, value, event_us);
+}
+
+void osc_out_send_str(const char *event, const char *value, int64_t event_us)
+{
+    send_local(event, value, 0, event_us);
+}
+
+void osc_out_set_clock(int node, bool (*to_shared)(int64_t *us))
+{
+    osc_node = node;
+    osc_to_shared = to_shared;
+}
+
+void osc_out_send_merged(const char *event, const char *str, int32_t value, int64_t shared_us, int node)
+{
+    int64_t sent_us = esp_timer_get_time();
+    if (osc_to_shared != NULL)
+        osc_to_shared(&sent_us);
+    send_message("/ensemble/", &merged_sequence, event, str, value, shared_us, sent_us, node);
+}
+
+bool osc_out_parse(const uint8_t *data, size_t len, osc_out_message_t *msg)
+{
+    char address[32], tags[8];
+    size_t pos = get_string(data, len, 0, address, sizeof(address));
+    if (pos == 0 || strncmp(address, "/piano/", 7) != 0)
+        return false;
+    pos = get_string(data, len, pos, tags, sizeof(tags));
+    if (pos == 0 || (strcmp(tags, ",iihhi") != 0 && strcmp(tags, ",sihhi") != 0))
+        return false;
+
+    snprintf(msg->event, sizeof(msg->event), "%s", address + 7);
+    msg->is_str = tags[1] == 's';
+    msg->value = 0;
+    msg->str[0] = '\0';
+    if (msg->is_str)
+    {
+        pos = get_string(data, len, pos, msg->str, sizeof(msg->str));
+    }
+    else if (pos + 4 <= len)
+    {
+        msg->value = (int32_t)get_u32(data + pos);
+        pos += 4;
+    }
+    else
+    {
+        pos = 0;
+    }
+    if (pos == 0 || pos + 4 + 8 + 8 + 4 > len)
+        return false;
+    msg->seq = get_u32(data + pos);
+    msg->event_us = get_i64(data + pos + 4);
+    msg->sent_us = get_i64(data + pos + 12);
+    msg->node = (int32_t)get_u32(data + pos + 20);
+    return true;
+}
+
+esp_err_t osc_out_write_prometheus(prom_sink_t sink, void *ctx)
+{
+    char line[320];
+    int len = snprintf(line, sizeof(line),
+                       "# TYPE piano_osc_packets_total counter\npiano_osc_packets_total %lu\n"
+                       "# TYPE piano_osc_bytes_total counter\npiano_osc_bytes_total %lu\n"
+                       "# TYPE piano_osc_dropped_total counter\npiano_osc_dropped_total %lu\n",
+                       (unsigned long)atomic_load_explicit(&packets, memory_order_relaxed),
+                       (unsigned long)atomic_load_explicit(&bytes, memory_order_relaxed),
+                       (unsigned long)atomic_load_explicit(&dropped, memory_order_relaxed));
+    return sink(ctx, line, len);
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Sample pack: the image tools/sample_pack.py builds from WAV files and the "samples" partition
+// holds. A header, a table of samples, then each sample's IMA-ADPCM data (4 bits a frame, low
+// nibble first), all little endian. The firmware reads it in place from flash (memory-mapped).
+// A voice decodes its sample as it plays and resamples it to the key's frequency with linear
+// interpolation: no decoded copy of anything in RAM.
+// No ESP-IDF headers: tools/sample_pack.py builds this file on the host.
+
+#define SAMPLE_PACK_MAGIC    0x504D5350   // "PSMP"
+#define SAMPLE_PACK_VERSION  1
+#define SAMPLE_PACK_MAX      12           // samples, at most one per key
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;       // entries in the table after the header
+    uint32_t rate_hz;     // every sample is at this rate, the DAC runs at it
+    uint32_t size;        // whole image in bytes
+} sample_pack_header_t;
+
+typedef struct {
+    uint8_t first_key;    // keys (0 = C4 .. 11 = B4) that play this sample, repitched
+    uint8_t last_key;
+    uint8_t loop_index;   // ADPCM step index at loop_start
+    uint8_t reserved;
+    uint32_t root_mhz;    // pitch of the recording in mHz
+    uint32_t offset;      // of the ADPCM data, from the start of the image
+    uint32_t frames;
+    uint32_t loop_start;  // frame the sustain loop goes back to, = frames for none
+    int16_t loop_predictor;
+    uint16_t reserved2;
+} sample_pack_entry_t;
+
+#define SAMPLE_GAIN_ONE  32768   // Q15 envelope
+
+typedef struct {
+    const uint8_t *data;               // ADPCM of the sample playing, NULL = silent
+    const sample_pack_entry_t *entry;
+    uint32_t frame;                    // next frame to decode
+    int32_t predictor;
+    int32_t index;
+    int32_t prev, cur;                 // the two frames the output falls between
+    uint32_t phase;                    // 16.16 position from prev towards cur
+    uint32_t step;                     // 16.16 sample frames per output frame
+    int32_t gain;                      // 0..SAMPLE_GAIN_ONE
+    int32_t gain_step;                 // added every output frame: attack up, release down
+} sample_voice_t;
+
+// the header and every entry lie inside size bytes; false for anything else (blank flash too)
+bool sample_pack_check(const void *image, size_t size);
+
+// the entry that plays key, NULL if none does
+const sample_pack_entry_t *sample_pack_find(const void *image, int key);
+
+// start entry from its first frame at freq_hz, with an attack of attack_frames
+void sample_voice_start(sample_voice_t *v, const void *image, const sample_pack_entry_t *entry,
+                        uint32_t freq_hz, int attack_frames);
+
+// repitch what's playing, the pot's bend
+void sample_voice_pitch(sample_voice_t *v, uint32_t freq_hz);
+
+// fade out over frames, then silent
+void sample_voice_release(sample_voice_t *v, int frames);
+
+// next n output frames into out (silence once the voice ended); returns false when silent
+bool sample_voice_render(sample_voice_t *v, int16_t *out, int n);
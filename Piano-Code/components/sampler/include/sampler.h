@@ -0,0 +1,45 @@
+#pragma once
+#include "esp_err.h"
+#include <stdint.h>
+#include "sample_voice.h"
+
+// Piano samples on the DAC (GPIO25, the buzzer pin): the sample pack in the "samples" data
+// partition is memory-mapped and played from flash in place. sampler_pump() renders one block and
+// blocks until the DMA takes it, so a task calling it in a loop is paced by the DAC; the calls
+// below only leave a command the next block picks up.
+
+#define SAMPLER_PARTITION_LABEL   "samples"
+#define SAMPLER_PARTITION_SUBTYPE 0x40     // custom data subtype, see partitions.csv
+#define SAMPLER_BLOCK             64       // frames rendered at a time
+#define SAMPLER_DMA_BUFFERS       4        // blocks queued ahead: a key is heard within 5 blocks
+#define SAMPLER_ATTACK_MS         2        // ramps that keep a note start / stop from clicking
+#define SAMPLER_RELEASE_MS        30
+#define SAMPLER_BIAS_RAMP_MS      10       // the DAC's resting level to 0 V and back, see sampler_sleep_after()
+
+// map the pack and start the DAC; ESP_ERR_NOT_FOUND without the partition,
+// ESP_ERR_INVALID_VERSION when it holds no valid pack (nothing flashed to it yet)
+esp_err_t sampler_init(void);
+
+// the key's sample at freq_hz, from its start
+esp_err_t sampler_play(int key, uint32_t freq_hz);
+
+// repitch the note playing
+esp_err_t sampler_pitch(uint32_t freq_hz);
+
+// release the note playing
+esp_err_t sampler_stop(void);
+
+// a square wave click of ms mixed over the note, the metronome
+esp_err_t sampler_click(uint32_t freq_hz, int ms);
+
+// Power save: with ms > 0 the DAC goes off after ms of silence, its DMA would keep the APB clock
+// up and the chip out of light sleep. Its output is ramped to 0 V first and back to the middle
+// with the next note (SAMPLER_BIAS_RAMP_MS), so it doesn't pop; the note isn't delayed by it
+esp_err_t sampler_sleep_after(int ms);
+
+// render the next block and queue it to the DAC, blocks while the DMA buffers are full
+// (or, with the DAC off, until the next note or click)
+void sampler_pump(void);
+
+// the pack's header, NULL before sampler_init() succeeded
+const sample_pack_header_t *sampler_pack(void);
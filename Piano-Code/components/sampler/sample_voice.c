@@ -0,0 +1,136 @@
+#include "sample_voice.h"
+#include <string.h>
+
+static const int16_t step_table[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t index_table[16] = { -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8 };
+
+bool sample_pack_check(const void *image, size_t size)
+{
+    const sample_pack_header_t *h = image;
+    if (size < sizeof(*h) || h->magic != SAMPLE_PACK_MAGIC || h->version != SAMPLE_PACK_VERSION ||
+        h->count == 0 || h->count > SAMPLE_PACK_MAX || h->size > size || h->rate_hz == 0 ||
+        sizeof(*h) + h->count * sizeof(sample_pack_entry_t) > h->size)
+        return false;
+
+    const sample_pack_entry_t *e = (const sample_pack_entry_t *)(h + 1);
+    for (int i = 0; i < h->count; i++, e++)
+    {
+        if (e->first_key > e->last_key || e->last_key > 11 || e->root_mhz == 0 || e->frames == 0 ||
+            e->offset > h->size || (e->frames + 1) / 2 > h->size - e->offset ||
+            e->loop_start > e->frames || e->loop_index > 88)
+            return false;
+    }
+    return true;
+}
+
+const sample_pack_entry_t *sample_pack_find(const void *image, int key)
+{
+    const sample_pack_header_t *h = image;
+    const sample_pack_entry_t *e = (const sample_pack_entry_t *)(h + 1);
+    for (int i = 0; i < h->count; i++, e++)
+        if (key >= e->first_key && key <= e->last_key)
+            return e;
+    return NULL;
+}
+
+// one IMA-ADPCM frame
+static inline int32_t decode(sample_voice_t *v)
+{
+    uint8_t byte = v->data[v->frame >> 1];
+    uint8_t nibble = v->frame & 1 ? byte >> 4 : byte & 0x0F;
+    int32_t step = step_table[v->index];
+    int32_t diff = step >> 3;
+    if (nibble & 4)
+        diff += step;
+    if (nibble & 2)
+        diff += step >> 1;
+    if (nibble & 1)
+        diff += step >> 2;
+    int32_t p = nibble & 8 ? v->predictor - diff : v->predictor + diff;
+    v->predictor = p < -32768 ? -32768 : p > 32767 ? 32767 : p;
+    int32_t index = v->index + index_table[nibble];
+    v->index = index < 0 ? 0 : index > 88 ? 88 : index;
+    v->frame++;
+    return v->predictor;
+}
+
+void sample_voice_start(sample_voice_t *v, const void *image, const sample_pack_entry_t *entry,
+                        uint32_t freq_hz, int attack_frames)
+{
+    memset(v, 0, sizeof(*v));
+    v->data = (const uint8_t *)image + entry->offset;
+    v->entry = entry;
+    v->phase = 0x10000;   // the first render decodes frame 0 into cur
+    v->gain_step = attack_frames > 0 ? SAMPLE_GAIN_ONE / attack_frames : SAMPLE_GAIN_ONE;
+    sample_voice_pitch(v, freq_hz);
+}
+
+void sample_voice_pitch(sample_voice_t *v, uint32_t freq_hz)
+{
+    if (v->entry != NULL)
+        v->step = (uint32_t)(((uint64_t)freq_hz * 1000 << 16) / v->entry->root_mhz);
+}
+
+void sample_voice_release(sample_voice_t *v, int frames)
+{
+    if (v->data != NULL)
+        v->gain_step = -(v->gain / (frames > 0 ? frames : 1) + 1);
+}
+
+bool sample_voice_render(sample_voice_t *v, int16_t *out, int n)
+{
+    if (v->data == NULL)
+    {
+        memset(out, 0, n * sizeof(*out));
+        return false;
+    }
+
+    const sample_pack_entry_t *e = v->entry;
+    for (int i = 0; i < n; i++)
+    {
+        // decode as far as the output position went, the sustain loop rewinds the decoder
+        while (v->phase >= 0x10000)
+        {
+            v->phase -= 0x10000;
+            if (v->frame >= e->frames)
+            {
+                if (e->loop_start >= e->frames)
+                {
+                    v->data = NULL;   // sample over
+                    memset(out + i, 0, (n - i) * sizeof(*out));
+                    return i > 0;
+                }
+                v->frame = e->loop_start;
+                v->predictor = e->loop_predictor;
+                v->index = e->loop_index;
+            }
+            v->prev = v->cur;
+            v->cur = decode(v);
+        }
+
+        int32_t s = v->prev + (int32_t)(((int64_t)(v->cur - v->prev) * v->phase) >> 16);
+        out[i] = (int16_t)((s * v->gain) >> 15);
+        v->phase += v->step;
+
+        v->gain += v->gain_step;
+        if (v->gain >= SAMPLE_GAIN_ONE)
+        {
+            v->gain = SAMPLE_GAIN_ONE;
+            v->gain_step = 0;
+        }
+        else if (v->gain <= 0 && v->gain_step < 0)
+        {
+            v->data = NULL;   // released
+            memset(out + i + 1, 0, (n - i - 1) * sizeof(*out));
+            return true;
+        }
+    }
+    return true;
+}
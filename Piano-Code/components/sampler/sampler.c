@@ -0,0 +1,248 @@
+#include "sampler.h"
+#include "esp_partition.h"
+#include "driver/dac_continuous.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+static const char *TAG = "sampler";
+
+#define CLICK_LEVEL 8192   // square wave amplitude of a click, a quarter of full scale
+
+typedef enum { CMD_NONE, CMD_PLAY, CMD_PITCH, CMD_STOP } command_t;
+
+static const void *image;     // the mapped pack
+static esp_partition_mmap_handle_t map;
+static dac_continuous_handle_t dac;
+static uint32_t rate_hz;
+
+// left by the play/stop calls, taken by sampler_pump() at the start of a block
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static command_t command = CMD_NONE;
+static int command_key;
+static uint32_t command_freq;
+static uint32_t click_period = 0;     // click frames per square wave cycle
+static uint32_t click_frames = 0;     // click frames still to play
+static bool parked = false;           // DAC off, the pump waits for a command
+static TaskHandle_t pump_task;
+
+static int sleep_blocks = 0;          // silent blocks before the DAC goes off, 0 = never
+
+static sample_voice_t voice;   // sampler_pump()'s only
+static uint32_t click_phase = 0;
+static int silent_blocks = 0;
+static int zero_blocks = 0;           // written all at 0 V: once the DMA holds only those, the DAC can go
+static int32_t bias = 128 << 8;       // DAC resting level, Q8, ramped down before it goes off
+
+esp_err_t sampler_init(void)
+{
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, SAMPLER_PARTITION_SUBTYPE,
+                                                           SAMPLER_PARTITION_LABEL);
+    if (part == NULL)
+    {
+        ESP_LOGW(TAG, "no \"%s\" partition", SAMPLER_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    // the whole partition goes into the data address space, reads hit flash through the cache
+    const void *mapped;
+    esp_err_t err = esp_partition_mmap(part, 0, part->size, ESP_PARTITION_MMAP_DATA, &mapped, &map);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "mmap failed: %d", err);
+        return err;
+    }
+    if (!sample_pack_check(mapped, part->size))
+    {
+        ESP_LOGW(TAG, "no sample pack in \"%s\", flash one built by tools/sample_pack.py", SAMPLER_PARTITION_LABEL);
+        esp_partition_munmap(map);
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    const sample_pack_header_t *header = mapped;
+    dac_continuous_config_t config = {
+        .chan_mask = DAC_CHANNEL_MASK_CH0,     // GPIO25
+        .desc_num = SAMPLER_DMA_BUFFERS,
+        .buf_size = SAMPLER_BLOCK * 2,         // the ESP32 DAC DMA takes 16 bits per 8 bit sample
+        .freq_hz = header->rate_hz,
+        .offset = 0,
+        .clk_src = DAC_DIGI_CLK_SRC_APLL,      // the default clock can't go below ~20 kHz
+        .chan_mode = DAC_CHANNEL_MODE_SIMUL,
+    };
+    err = dac_continuous_new_channels(&config, &dac);
+    if (err == ESP_OK)
+        err = dac_continuous_enable(dac);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "DAC setup failed: %d", err);
+        esp_partition_munmap(map);
+        return err;
+    }
+
+    image = mapped;
+    rate_hz = header->rate_hz;
+    ESP_LOGI(TAG, "%d samples at %lu Hz, %lu bytes mapped from flash", header->count, rate_hz, header->size);
+    return ESP_OK;
+}
+
+// a parked pump goes on with the next block (lock held)
+static bool unpark(void)
+{
+    bool was = parked;
+    parked = false;
+    return was;
+}
+
+static esp_err_t post(command_t cmd, int key, uint32_t freq_hz)
+{
+    if (image == NULL)
+        return ESP_ERR_INVALID_STATE;
+    portENTER_CRITICAL(&lock);
+    if (cmd != CMD_PITCH || command == CMD_NONE || command == CMD_PITCH)
+    {
+        command = cmd;
+        command_key = key;
+        command_freq = freq_hz;
+    }
+    else if (command == CMD_PLAY)
+    {
+        command_freq = freq_hz;   // a bend doesn't replace a note start the pump hasn't seen yet
+    }
+    bool wake = cmd != CMD_PITCH && unpark();   // bending silence doesn't need the DAC
+    portEXIT_CRITICAL(&lock);
+    if (wake)
+        xTaskNotifyGive(pump_task);
+    return ESP_OK;
+}
+
+esp_err_t sampler_play(int key, uint32_t freq_hz)
+{
+    if (key < 0 || key > 11)
+        return ESP_ERR_INVALID_ARG;
+    return post(CMD_PLAY, key, freq_hz);
+}
+
+esp_err_t sampler_pitch(uint32_t freq_hz)
+{
+    return post(CMD_PITCH, 0, freq_hz);
+}
+
+esp_err_t sampler_stop(void)
+{
+    return post(CMD_STOP, 0, 0);
+}
+
+esp_err_t sampler_click(uint32_t freq_hz, int ms)
+{
+    if (image == NULL)
+        return ESP_ERR_INVALID_STATE;
+    if (freq_hz == 0)
+        return ESP_ERR_INVALID_ARG;
+    portENTER_CRITICAL(&lock);
+    click_period = rate_hz / freq_hz;
+    click_frames = rate_hz * ms / 1000;
+    bool wake = unpark();
+    portEXIT_CRITICAL(&lock);
+    if (wake)
+        xTaskNotifyGive(pump_task);
+    return ESP_OK;
+}
+
+esp_err_t sampler_sleep_after(int ms)
+{
+    if (image == NULL)
+        return ESP_ERR_INVALID_STATE;
+    if (ms < 0)
+        return ESP_ERR_INVALID_ARG;
+    sleep_blocks = ms > 0 ? (int)((uint64_t)rate_hz * ms / 1000 / SAMPLER_BLOCK) + 1 : 0;
+    return ESP_OK;
+}
+
+// silent long enough and the output at 0 V: DAC off until a command (then back on, and this
+// block is rendered as usual)
+static void park(void)
+{
+    pump_task = xTaskGetCurrentTaskHandle();
+    portENTER_CRITICAL(&lock);
+    parked = command == CMD_NONE && click_frames == 0;
+    bool wait = parked;
+    portEXIT_CRITICAL(&lock);
+    if (!wait)
+        return;
+
+    dac_continuous_disable(dac);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    dac_continuous_enable(dac);
+    silent_blocks = 0;
+    zero_blocks = 0;
+}
+
+void sampler_pump(void)
+{
+    static int16_t mix[SAMPLER_BLOCK];
+    static uint8_t out[SAMPLER_BLOCK];
+
+    if (sleep_blocks > 0 && zero_blocks > SAMPLER_DMA_BUFFERS)
+        park();
+
+    portENTER_CRITICAL(&lock);
+    command_t cmd = command;
+    int key = command_key;
+    uint32_t freq_hz = command_freq;
+    uint32_t period = click_period;
+    uint32_t clicking = click_frames < SAMPLER_BLOCK ? click_frames : SAMPLER_BLOCK;
+    click_frames -= clicking;
+    command = CMD_NONE;
+    portEXIT_CRITICAL(&lock);
+
+    if (cmd == CMD_PLAY)
+    {
+        const sample_pack_entry_t *entry = sample_pack_find(image, key);
+        if (entry != NULL)
+            sample_voice_start(&voice, image, entry, freq_hz, rate_hz * SAMPLER_ATTACK_MS / 1000);
+        else
+            sample_voice_release(&voice, rate_hz * SAMPLER_RELEASE_MS / 1000);   // no sample for this key
+    }
+    else if (cmd == CMD_PITCH)
+    {
+        sample_voice_pitch(&voice, freq_hz);
+    }
+    else if (cmd == CMD_STOP)
+    {
+        sample_voice_release(&voice, rate_hz * SAMPLER_RELEASE_MS / 1000);
+    }
+
+    bool sounding = sample_voice_render(&voice, mix, SAMPLER_BLOCK) || clicking > 0;
+    silent_blocks = sounding ? 0 : silent_blocks + 1;
+
+    // the resting level: down to 0 V once the DAC is about to go off, back up as soon as it's on
+    int32_t bias_target = sleep_blocks > 0 && silent_blocks >= sleep_blocks ? 0 : 128 << 8;
+    int32_t bias_step = (128 << 8) / (int32_t)(rate_hz * SAMPLER_BIAS_RAMP_MS / 1000 + 1) + 1;
+
+    for (int i = 0; i < SAMPLER_BLOCK; i++)
+    {
+        if (bias < bias_target)
+            bias = bias + bias_step < bias_target ? bias + bias_step : bias_target;
+        else if (bias > bias_target)
+            bias = bias - bias_step > bias_target ? bias - bias_step : bias_target;
+
+        int32_t s = mix[i];
+        if ((uint32_t)i < clicking)
+        {
+            s += click_phase < period / 2 ? CLICK_LEVEL : -CLICK_LEVEL;
+            if (++click_phase >= period)
+                click_phase = 0;
+        }
+        s = (s >> 8) + (bias >> 8);   // 8 bit unsigned DAC
+        out[i] = (uint8_t)(s < 0 ? 0 : s > 255 ? 255 : s);
+    }
+    zero_blocks = bias == 0 && !sounding ? zero_blocks + 1 : 0;
+
+    size_t loaded;
+    dac_continuous_write(dac, out, sizeof(out), &loaded, -1);
+}
+
+const sample_pack_header_t *sampler_pack(void)
+{
+    return image;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include "esp_err.h"
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// per-task CPU needs CONFIG_FREERTOS_USE_TRACE_FACILITY and CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS,
+// without them only the watched tasks are listed (stack only)
+#define SYS_STATS_MAX_TASKS     32   // IDF + app tasks in one report
+#define SYS_STATS_MAX_WATCHED   12   // app tasks with a known stack size
+#define SYS_STATS_MAX_COMMANDS  8    // console commands besides "stats"
+#define SYS_STATS_LINE_MAX      512  // one JSON piece (and all the app fields), on the caller's stack
+
+// receives the JSON report piece by piece (HTTP chunk, console...)
+typedef esp_err_t (*sys_stats_sink_t)(void *ctx, const char *data, size_t len);
+
+// app fields appended to the report as "key":value pairs (no braces), returns the length
+typedef int (*sys_stats_extra_t)(char *buf, size_t size);
+
+// extra may be NULL
+void sys_stats_init(sys_stats_extra_t extra);
+
+// report stack size and peak use of an app task
+void sys_stats_watch_stack(TaskHandle_t task, const char *name, uint32_t stack_size);
+
+// JSON report: uptime, heap, per-task CPU (since the previous report) and stack, app fields
+esp_err_t sys_stats_write(sys_stats_sink_t sink, void *ctx);
+
+// print the report on the console
+void sys_stats_print(void);
+
+// serial console on UART0: "stats" + Enter prints the report
+esp_err_t sys_stats_console_start(UBaseType_t priority, BaseType_t core);
+
+// another console command, e.g. "metrics" (call before sys_stats_console_start)
+esp_err_t sys_stats_console_add(const char *command, void (*handler)(void));
+
+// a command with an argument, "mute 2" calls handler("2"), plain "mute" handler("")
+esp_err_t sys_stats_console_add_arg(const char *command, void (*handler)(const char *arg));
@@ -0,0 +1,267 @@
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#if CONFIG_PIANO_TRACE
+
+#define RING_SIZE        CONFIG_PIANO_TRACE_EVENTS
+#define RING_MASK        (RING_SIZE - 1)
+#define MAX_NAMES        64    // distinct trace point names in one dump
+#define MAX_TASKS        32
+#define SELF_TEST_EVENTS 256
+
+_Static_assert((RING_SIZE & RING_MASK) == 0, "PIANO_TRACE_EVENTS must be a power of two");
+
+typedef struct {
+    atomic_uint head;   // records ever written, the next one goes to head & RING_MASK
+    trace_record_t records[RING_SIZE];
+} trace_ring_t;
+
+// dump header, little endian
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint16_t cores;
+    uint16_t ring_size;
+    uint32_t overhead_ns;
+    uint32_t now_us;     // esp_timer at the dump, low 32 bits
+} trace_header_t;
+
+static trace_ring_t rings[portNUM_PROCESSORS];
+static atomic_bool recording = false;
+static atomic_bool dumping = false;
+static uint32_t overhead_ns = 0;
+
+// tables built while dumping (one dump at a time)
+static uint32_t names[MAX_NAMES];
+static uint32_t tasks[MAX_TASKS];
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY
+static TaskStatus_t task_status[MAX_TASKS];
+#endif
+
+void trace_record(uint8_t type, const char *name, uint16_t arg)
+{
+    if (!atomic_load_explicit(&recording, memory_order_relaxed))
+        return;
+
+    uint32_t ts_us = (uint32_t)esp_timer_get_time();
+    uint8_t core = xPortGetCoreID();
+    trace_ring_t *ring = &rings[core];
+    // a task preempting this one takes the next slot, so the slots are not always in time
+    // order; the converter sorts by timestamp
+    trace_record_t *r = &ring->records[atomic_fetch_add_explicit(&ring->head, 1, memory_order_relaxed) & RING_MASK];
+    r->ts_us = ts_us;
+    r->name = (uint32_t)(uintptr_t)name;
+    r->task = (uint32_t)(uintptr_t)xTaskGetCurrentTaskHandle();
+    r->type = type;
+    r->core = core;
+    r->arg = arg;
+}
+
+void trace_init(void)
+{
+    atomic_store(&recording, true);
+
+    int64_t t0 = esp_timer_get_time();
+    for (int i = 0; i < SELF_TEST_EVENTS; i++)
+        trace_record(TRACE_EVENT_INSTANT, "trace self-test", i);
+    overhead_ns = (uint32_t)((esp_timer_get_time() - t0) * 1000 / SELF_TEST_EVENTS);
+
+    // the self-test records are not part of the timeline
+    atomic_store(&rings[xPortGetCoreID()].head, 0);
+    printf("Trace: %d events per core, %luns per event\n", RING_SIZE, (unsigned long)overhead_ns);
+}
+
+uint32_t trace_overhead_ns(void)
+{
+    return overhead_ns;
+}
+
+// index of value in table, added if missing; -1 when the table is full
+static int table_add(uint32_t *table, int *count, int max, uint32_t value)
+{
+    for (int i = 0; i < *count; i++)
+    {
+        if (table[i] == value)
+            return i;
+    }
+    if (*count >= max)
+        return -1;
+    table[*count] = value;
+    return (*count)++;
+}
+
+// u32 address/handle, u8 length, the characters
+static esp_err_t write_string(trace_sink_t sink, void *ctx, uint32_t key, const char *text)
+{
+    uint8_t entry[5 + 255];
+    size_t len = text ? strnlen(text, 255) : 0;
+    memcpy(entry, &key, 4);
+    entry[4] = len;
+    memcpy(entry + 5, text, len);
+    return sink(ctx, entry, 5 + len);
+}
+
+static const char *task_name(uint32_t handle, int task_count)
+{
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY
+    // only tasks that still exist, a deleted task's name is gone
+    for (int i = 0; i < task_count; i++)
+    {
+        if ((uint32_t)(uintptr_t)task_status[i].xHandle == handle)
+            return task_status[i].pcTaskName;
+    }
+#endif
+    return NULL;
+}
+
+esp_err_t trace_dump(trace_sink_t sink, void *ctx)
+{
+    if (atomic_exchange(&dumping, true))
+        return ESP_ERR_INVALID_STATE;
+
+    // let a record that is being written finish before the rings are read
+    atomic_store(&recording, false);
+    vTaskDelay(1);
+
+    trace_header_t header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .record_size = sizeof(trace_record_t),
+        .cores = portNUM_PROCESSORS,
+        .ring_size = RING_SIZE,
+        .overhead_ns = overhead_ns,
+        .now_us = (uint32_t)esp_timer_get_time(),
+    };
+    esp_err_t err = sink(ctx, &header, sizeof(header));
+
+    int name_count = 0;
+    int task_count = 0;
+    for (int core = 0; core < portNUM_PROCESSORS && err == ESP_OK; core++)
+    {
+        trace_ring_t *ring = &rings[core];
+        uint32_t head = atomic_load(&ring->head);
+        uint32_t count = head < RING_SIZE ? head : RING_SIZE;
+        err = sink(ctx, &count, sizeof(count));
+
+        // oldest first: the part after head, then the part before it
+        uint32_t first = (head - count) & RING_MASK;
+        uint32_t tail = count < RING_SIZE - first ? count : RING_SIZE - first;
+        if (err == ESP_OK && tail > 0)
+            err = sink(ctx, &ring->records[first], tail * sizeof(trace_record_t));
+        if (err == ESP_OK && count > tail)
+            err = sink(ctx, &ring->records[0], (count - tail) * sizeof(trace_record_t));
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            table_add(names, &name_count, MAX_NAMES, ring->records[(first + i) & RING_MASK].name);
+            table_add(tasks, &task_count, MAX_TASKS, ring->records[(first + i) & RING_MASK].task);
+        }
+    }
+
+    // names of the trace points, then of the tasks
+    uint32_t count = name_count;
+    if (err == ESP_OK)
+        err = sink(ctx, &count, sizeof(count));
+    for (int i = 0; i < name_count && err == ESP_OK; i++)
+        err = write_string(sink, ctx, names[i], (const char *)(uintptr_t)names[i]);
+
+    int alive = 0;
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY
+    alive = uxTaskGetSystemState(task_status, MAX_TASKS, NULL);
+#endif
+    count = task_count;
+    if (err == ESP_OK)
+        err = sink(ctx, &count, sizeof(count));
+    for (int i = 0; i < task_count && err == ESP_OK; i++)
+        err = write_string(sink, ctx, tasks[i], task_name(tasks[i], alive));
+
+    atomic_store(&recording, true);
+    atomic_store(&dumping, false);
+    return err;
+}
+
+typedef struct {
+    uint8_t carry[3];
+    int carried;
+    char line[80];
+    int len;
+} base64_out_t;
+
+static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void base64_group(base64_out_t *out, const uint8_t *in, int n)
+{
+    uint32_t v = in[0] << 16 | (n > 1 ? in[1] << 8 : 0) | (n > 2 ? in[2] : 0);
+    out->line[out->len++] = base64_chars[(v >> 18) & 63];
+    out->line[out->len++] = base64_chars[(v >> 12) & 63];
+    out->line[out->len++] = n > 1 ? base64_chars[(v >> 6) & 63] : '=';
+    out->line[out->len++] = n > 2 ? base64_chars[v & 63] : '=';
+    if (out->len >= 76)
+    {
+        printf("%.*s\n", out->len, out->line);
+        out->len = 0;
+    }
+}
+
+static esp_err_t base64_sink(void *ctx, const void *data, size_t len)
+{
+    base64_out_t *out = ctx;
+    const uint8_t *in = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        out->carry[out->carried++] = in[i];
+        if (out->carried == 3)
+        {
+            base64_group(out, out->carry, 3);
+            out->carried = 0;
+        }
+    }
+    return ESP_OK;
+}
+
+void trace_print(void)
+{
+    static base64_out_t out;
+    memset(&out, 0, sizeof(out));
+
+    printf("TRACE BEGIN\n");
+    esp_err_t err = trace_dump(base64_sink, &out);
+    if (out.carried > 0)
+        base64_group(&out, out.carry, out.carried);
+    if (out.len > 0)
+        printf("%.*s\n", out.len, out.line);
+    printf("TRACE END%s\n", err != ESP_OK ? " (incomplete)" : "");
+}
+
+#else  // CONFIG_PIANO_TRACE
+
+void trace_init(void)
+{
+}
+
+void trace_record(uint8_t type, const char *name, uint16_t arg)
+{
+}
+
+uint32_t trace_overhead_ns(void)
+{
+    return 0;
+}
+
+esp_err_t trace_dump(trace_sink_t sink, void *ctx)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+void trace_print(void)
+{
+    printf("Tracing is off (menuconfig: PIANO_TRACE)\n");
+}
+
+#endif
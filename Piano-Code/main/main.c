@@ -1,8 +1,12 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
+#include "freertos/queue.h"
 #include "driver/i2c.h"
 #include "driver/ledc.h"
 #include "esp_http_server.h"  // for HTTP server and SSE
@@ -12,34 +16,159 @@
 #include "nvs_flash.h"        // for NVS flash
 #include "esp_mac.h"          // for MAC address
 #include "lwip/ip4_addr.h"    // for IP address conversion
+#include "esp_timer.h"        // for latency timestamps
+#include "esp_app_desc.h"     // firmware version for /metrics
+#include "esp_system.h"       // for free heap
+#include "mdns.h"             // piano.local
 
 #include "lcd.h"
 #include "buzzer.h"
 #include "potentiometer.h"
 #include "buttons.h"
+#include "debounce.h"
+#include "sys_stats.h"
+#include "latency_hist.h"
+#include "trace.h"
+#include "block_pool.h"
+#include "ar_link.h"
+#include "midi_out.h"
+#include "chord.h"
+#include "melody_guide.h"
+#include "metronome.h"
+#include "sampler.h"
+#include "power.h"
+#include "osc_out.h"
+#include "ensemble.h"
 
 #define MAX_CLIENTS 4
+#define SSE_QUEUE_LENGTH 16
+#define SSE_HEARTBEAT_MS 3000
+
+// Buffers for frames and responses come from fixed pools, no malloc and a known size per use
+#define SSE_FRAME_SIZE   32    // "data: note_off:11\n\n\n\n", "data: chord:C#m7b5\n\n\n\n"
+#define SSE_FRAMES       2     // SSE_task formats one at a time, +1 spare
+#define HTTP_BUFFER_SIZE 256   // one /metrics or /stats text piece
+#define HTTP_BUFFERS     2     // httpd and the console can write at the same time
 
 typedef struct {
-    httpd_req_t *req;
+    httpd_req_t *req;   // async copy, kept open after the handler returned
     bool active;
 } sse_client_t;
 
+typedef enum {
+    SSE_NOTE_ON,
+    SSE_NOTE_OFF,
+    SSE_CHORD,          // note = chord_lookup() of the held keys, CHORD_NONE when they aren't one
+    SSE_MELODY,         // note = melody loaded, MELODY_GUIDE_NONE for free play
+    SSE_NEXT,           // note = key to play next, -1 when no melody is loaded
+    SSE_WRONG,          // note = the wrong key
+    SSE_DONE,           // note = melody just completed
+    SSE_BEAT,           // note = metronome beat number since it started
+    SSE_TEMPO,          // note = metronome bpm, 0 when it stops
+} sse_event_t;
+
+// event names on the wire, "data: <name>:<note>"
+static const char *sse_event_names[] = {
+    [SSE_NOTE_ON] = "note_on", [SSE_NOTE_OFF] = "note_off", [SSE_CHORD] = "chord",
+    [SSE_MELODY] = "melody", [SSE_NEXT] = "next", [SSE_WRONG] = "wrong", [SSE_DONE] = "done",
+    [SSE_BEAT] = "beat", [SSE_TEMPO] = "tempo",
+};
+
+typedef struct {
+    sse_event_t event;
+    int note;
+    int64_t key_us;     // scan that saw the key change
+} sse_note_t;
+
 static sse_client_t sse_clients[MAX_CLIENTS] = {0};
 static SemaphoreHandle_t sse_mutex;
 static SemaphoreHandle_t synth_mutex;
+static QueueHandle_t sse_queue;    // sse_note_t for the web page, sent by SSE_task
+
+BLOCK_POOL_DEFINE(sse_frame_pool, "sse_frames", SSE_FRAME_SIZE, SSE_FRAMES);
+BLOCK_POOL_DEFINE(http_buffer_pool, "http_buffers", HTTP_BUFFER_SIZE, HTTP_BUFFERS);
+
+// Task layout: keys and sound own APP_CPU at high priority, so WiFi, lwIP, httpd and the
+// SSE writes (all on PRO_CPU) never get between a key press and the buzzer.
+// Display and potentiometer are low priority, a late redraw or pitch bend is not audible.
+#define INPUT_CORE             1  // APP_CPU
+#define NET_CORE               0  // PRO_CPU, WiFi (prio 23) and lwIP (18) are pinned here too
+
+// Stacks are static (START_TASK). Size = worst case from tools/stack_estimate.py (the "est." next
+// to each define) + 25%, at least 512 bytes of margin, rounded up to 256. Once a soak has run
+// (tools/soak_monitor.py, stack_used_max in /stats), keep the larger of the two suggestions.
+
+#define LCD_TASK_STACK_SIZE    3328  // est. 2560 B
+#define LCD_TASK_PRIORITY      2
+#define LCD_TASK_CORE          NET_CORE
+
+#define BUZZER_TASK_STACK_SIZE 3072  // est. 2432 B
+#define BUZZER_TASK_PRIORITY   12    // above Buttons, starts the tone as soon as it is woken
+#define BUZZER_TASK_CORE       INPUT_CORE
 
-#define LCD_TASK_STACK_SIZE    2048
-#define LCD_TASK_PRIORITY      3
+#define POT_TASK_STACK_SIZE    3072  // est. 2400 B
+#define POT_TASK_PRIORITY      5
+#define POT_TASK_CORE          INPUT_CORE
 
-#define BUZZER_TASK_STACK_SIZE 2048
-#define BUZZER_TASK_PRIORITY   3
+#define BUTTONS_TASK_STACK_SIZE    3328  // est. 2496 B
+#define BUTTONS_TASK_PRIORITY      11
+#define BUTTONS_TASK_CORE          INPUT_CORE
 
-#define POT_TASK_STACK_SIZE    2048
-#define POT_TASK_PRIORITY      2
+#define METRONOME_TASK_STACK_SIZE 3072  // est. 2336 B
+#define METRONOME_TASK_PRIORITY   13    // above Buzzer, only marks the click and wakes it
+#define METRONOME_TASK_CORE       INPUT_CORE
 
-#define BUTTONS_TASK_STACK_SIZE    2048
-#define BUTTONS_TASK_PRIORITY      2
+#define SAMPLER_TASK_STACK_SIZE   3072  // est. 2368 B, PIANO_SAMPLES only
+#define SAMPLER_TASK_PRIORITY     14    // above everything on APP_CPU: the DAC's DMA must never run dry
+#define SAMPLER_TASK_CORE         INPUT_CORE
+
+#define SSE_TASK_STACK_SIZE    3328  // est. 2576 B
+#define SSE_TASK_PRIORITY      5     // same as the httpd task
+#define SSE_TASK_CORE          NET_CORE
+
+#define ENSEMBLE_TASK_PRIORITY 6     // above SSE: a ping answered late skews the clock offset
+#define ENSEMBLE_TASK_CORE     NET_CORE
+
+#define CONSOLE_TASK_PRIORITY  1     // "stats" on the serial console
+
+#define LATENCY_TASK_STACK_SIZE 2816  // est. 2224 B, PIANO_LATENCY_TEST only
+#define POWER_TASK_STACK_SIZE   2816  // est. 2160 B, PIANO_POWER_TEST only
+
+static TaskHandle_t buzzer_task_handle;
+static TaskHandle_t lcd_task_handle;
+static TaskHandle_t pot_task_handle;
+
+// Stage latencies, all measured from the scan that saw the key change (GET /metrics)
+static latency_hist_t key_scan_hist = LATENCY_HIST_INIT("piano_key_scan_seconds", "Time to read all 12 keys");
+static latency_hist_t key_to_tone_hist = LATENCY_HIST_INIT("piano_key_to_tone_seconds", "Key change to buzzer_play()/buzzer_stop() returning");
+static latency_hist_t key_to_sse_hist = LATENCY_HIST_INIT("piano_key_to_sse_seconds", "Key change to the SSE frame written to every client");
+#if CONFIG_PIANO_OSC_OUT
+static latency_hist_t key_to_osc_hist = LATENCY_HIST_INIT("piano_key_to_osc_seconds", "Key change to the OSC datagram handed to lwIP");
+#endif
+static latency_hist_t key_to_lcd_hist = LATENCY_HIST_INIT("piano_key_to_lcd_seconds", "Key change to the LCD showing the note");
+static latency_hist_t beat_to_click_hist = LATENCY_HIST_INIT("piano_beat_to_click_seconds", "Metronome beat to the buzzer clicking");
+static int64_t key_event_us = 0;   // last key change, with held_keys under synth_mutex
+
+#if CONFIG_PIANO_LATENCY_TEST
+#define LATENCY_TEST_KEY_MS    300   // simulated keys: one key down for half of this, then the next one
+#endif
+
+#if CONFIG_PIANO_POWER_SAVE
+// A key that wakes the chip sounds within a scan period of its interrupt, like a key pressed
+// right after a scan when awake; the interrupt is taken after the chip's own wake-up
+#define POWER_WAKE_BUDGET_US   (CONFIG_PIANO_KEY_SCAN_MS * 1000)
+#define POWER_IDLE_SCAN_MS     50     // idle key scans when the expander's INT isn't wired
+#define POWER_POT_IDLE_MS      1000   // pot reads while no note sounds, a key reads it at once
+#define POWER_SAMPLES_OFF_MS   2000   // silence before the DAC goes off
+#define POWER_TEST_PERIOD_MS   10000
+static latency_hist_t wake_to_tone_hist = LATENCY_HIST_INIT("piano_wake_to_tone_seconds", "Key interrupt out of sleep to the tone starting");
+static int64_t wake_event_us = 0;       // interrupt of the key that woke Buttons_task, under synth_mutex
+static uint32_t key_wakes = 0;          // presses that woke it
+static uint32_t wake_to_tone_max_us = 0;
+static uint32_t wakes_over_budget = 0;
+#endif
+
+static volatile uint32_t sse_dropped_notes = 0;
 
 static const char *note_names[12] = {
     "C4","C#4","D4","D#4","E4","F4","F#4","G4","G#4","A4","A#4","B4"
@@ -57,34 +186,198 @@ static const uint32_t note_upper[12] = {
     269, 285, 302, 320, 339, 359, 380, 403, 428, 453, 480, 523      
 };
 
-static volatile int current_note = -1;  
+static volatile uint16_t held_keys = 0;   // bit i = key i down
+static volatile int current_note = -1;    // the buzzer is monophonic: the last pressed of the held keys
 static volatile uint16_t pot_offset = 0;
 static volatile bool note_changed = false;
 
-// send message to all clients 
-static void sse_send_all(const char *msg) 
+// guided melody: Buttons_task owns the follower and publishes its state here for the LCD and new
+// SSE clients; /melody and the console only ask for a melody, the next scan loads it
+#define MELODY_REQUEST_NONE (-2)
+static volatile int melody_loaded = MELODY_GUIDE_NONE;
+static volatile int melody_hint = -1;     // key to play next
+static volatile int melody_step = 0;
+static atomic_int melody_request = MELODY_REQUEST_NONE;
+
+// metronome click, mixed over the note by Buzzer_task
+#define METRONOME_CLICK_MS    15
+#define METRONOME_ACCENT_HZ   2000   // first beat of the bar
+#define METRONOME_CLICK_HZ    1500
+static volatile bool click_pending = false;
+static volatile uint32_t click_freq = 0;
+static int64_t click_beat_us = 0;
+static volatile int beat_in_bar = 0;     // 1..beats per bar for the LCD, 0 = metronome stopped
+
+// the note on GPIO25: the key's piano sample through the DAC when the samples partition holds a
+// pack (PIANO_SAMPLES), the buzzer's square wave otherwise
+static bool use_samples = false;
+
+// synth_mutex, with the wait and the hold on the trace timeline
+static BaseType_t synth_lock(void)
+{
+    TRACE_BEGIN("synth_mutex wait");
+    BaseType_t taken = xSemaphoreTake(synth_mutex, portMAX_DELAY);
+    TRACE_END("synth_mutex wait");
+    TRACE_BEGIN("synth_mutex held");
+    return taken;
+}
+
+static void synth_unlock(void)
+{
+    TRACE_END("synth_mutex held");
+    xSemaphoreGive(synth_mutex);
+}
+
+// Wake Buzzer_task, it only runs when woken or to end a click (call after giving synth_mutex)
+static void wake_buzzer(void)
+{
+    if (buzzer_task_handle != NULL)
+        xTaskNotifyGive(buzzer_task_handle);
+}
+
+// Power save: LCD_task only runs when something it shows changed (call after giving synth_mutex)
+static void wake_lcd(void)
+{
+#if CONFIG_PIANO_POWER_SAVE
+    if (lcd_task_handle != NULL)
+        xTaskNotifyGive(lcd_task_handle);
+#endif
+}
+
+#if CONFIG_PIANO_POWER_SAVE
+// Pot_task reads rarely while no note sounds, a key press has it read at once
+static void wake_pot(void)
+{
+    if (pot_task_handle != NULL)
+        xTaskNotifyGive(pot_task_handle);
+}
+#endif
+
+// Event for the web page, never waits: a full queue only loses a page update
+static void sse_post(sse_event_t event, int note, int64_t key_us)
+{
+    sse_note_t item = { .event = event, .note = note, .key_us = key_us };
+    if (xQueueSend(sse_queue, &item, 0) != pdTRUE)
+        sse_dropped_notes++;
+}
+
+// send a complete SSE frame to all clients; a client that can't be written is dropped
+// key_us is the key change behind the frame (0 = none), accounted once the frame went out
+static void sse_send_all(const char *frame, int len, int64_t key_us) 
 {
+    int sent = 0;
+
     xSemaphoreTake(sse_mutex, portMAX_DELAY);
 
     for (int i = 0; i < MAX_CLIENTS; i++) 
     {
         if (sse_clients[i].active && sse_clients[i].req) 
         {
-            char buf[128];
-            int len = snprintf(buf, sizeof(buf), "data: %s\n\n", msg);
-            httpd_resp_send_chunk(sse_clients[i].req, buf, len);
+            TRACE_BEGIN("sse send");
+            esp_err_t res = httpd_resp_send_chunk(sse_clients[i].req, frame, len);
+            TRACE_END("sse send");
+            if (res != ESP_OK)
+            {
+                printf("SSE client %d disconnected, error: %d\n", i, res);
+                httpd_req_async_handler_complete(sse_clients[i].req);
+                sse_clients[i].req = NULL;
+                sse_clients[i].active = false;
+            }
+            else
+            {
+                sent++;
+            }
         }
     }
 
     xSemaphoreGive(sse_mutex);
+
+    if (sent > 0)
+        latency_hist_since(&key_to_sse_hist, key_us);
+}
+
+// the event as one OSC datagram, before the SSE writes: it never waits on a client
+static void osc_post(const sse_note_t *item)
+{
+#if CONFIG_PIANO_OSC_OUT
+    if (item->event == SSE_CHORD)
+    {
+        char name[CHORD_NAME_MAX];
+        chord_format(item->note, name, sizeof(name));
+        osc_out_send_str(sse_event_names[item->event], name, item->key_us);
+#if CONFIG_PIANO_ENSEMBLE
+        ensemble_post(sse_event_names[item->event], name, 0, item->key_us);
+#endif
+    }
+    else
+    {
+        osc_out_send(sse_event_names[item->event], item->note, item->key_us);
+#if CONFIG_PIANO_ENSEMBLE
+        ensemble_post(sse_event_names[item->event], NULL, item->note, item->key_us);
+#endif
+    }
+    if (item->key_us != 0)
+        latency_hist_since(&key_to_osc_hist, item->key_us);
+#endif
+}
+
+// Owns the SSE connections and the OSC out: notes from Buttons_task and the heartbeat, on PRO_CPU
+void SSE_task(void *pvParameters)
+{
+    static const char heartbeat[] = ":\n\n"; // valid comm in SSE
+
+    while (1)
+    {
+        sse_note_t item;
+        if (xQueueReceive(sse_queue, &item, pdMS_TO_TICKS(SSE_HEARTBEAT_MS)) == pdTRUE)
+        {
+            osc_post(&item);
+
+            // formatted once for every client
+            char *frame = block_pool_alloc(&sse_frame_pool);
+            if (frame == NULL)
+            {
+                sse_dropped_notes++;
+                continue;
+            }
+            int len;
+            if (item.event == SSE_CHORD)
+            {
+                char name[CHORD_NAME_MAX];
+                chord_format(item.note, name, sizeof(name));
+                len = snprintf(frame, SSE_FRAME_SIZE, "data: chord:%s\n\n\n\n", name);
+            }
+            else
+            {
+                len = snprintf(frame, SSE_FRAME_SIZE, "data: %s:%d\n\n\n\n", sse_event_names[item.event], item.note);
+            }
+            sse_send_all(frame, len, item.key_us);
+            block_pool_free(&sse_frame_pool, frame);
+        }
+        else
+        {
+            sse_send_all(heartbeat, sizeof(heartbeat) - 1, 0);
+#if CONFIG_PIANO_OSC_OUT
+            // keeps the sequence going while nobody plays, a listener sees losses when idle too
+            osc_out_send("alive", 0, 0);
+#endif
+        }
+    }
 }
 
 esp_err_t sse_handler(httpd_req_t *req) 
 {
-  httpd_resp_set_type(req, "text/event-stream");
-    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
-    httpd_resp_set_hdr(req, "Connection", "keep-alive");
-    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    // the request stays open after the handler returns, so the httpd task is free for other clients
+    httpd_req_t *async_req = NULL;
+    if (httpd_req_async_handler_begin(req, &async_req) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    httpd_resp_set_type(async_req, "text/event-stream");
+    httpd_resp_set_hdr(async_req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(async_req, "Connection", "keep-alive");
+    httpd_resp_set_hdr(async_req, "Access-Control-Allow-Origin", "*");
 
     // add client in list
     xSemaphoreTake(sse_mutex, portMAX_DELAY);
@@ -93,52 +386,286 @@ esp_err_t sse_handler(httpd_req_t *req)
     {
         if (!sse_clients[i].active) 
         {
-            sse_clients[i].req = req;
+            sse_clients[i].req = async_req;
             sse_clients[i].active = true;
             slot = i;
             break;
         }
     }
-    xSemaphoreGive(sse_mutex);
 
     if (slot == -1) 
     {
+        xSemaphoreGive(sse_mutex);
+        httpd_req_async_handler_complete(async_req);
         return ESP_FAIL;
     }
 
-    // send init message
-    const char *init_msg = "data: connected\n\n";
-    httpd_resp_send_chunk(req, init_msg, strlen(init_msg));
+    // send init message (under the mutex so it goes out before any note), with the melody and
+    // metronome state for a page that joins mid-melody
+    char init_msg[96];
+    int melody = MELODY_GUIDE_NONE, next = -1;
+    if (synth_lock())
+    {
+        melody = melody_loaded;
+        next = melody_hint;
+        synth_unlock();
+    }
+    int len = snprintf(init_msg, sizeof(init_msg), "data: connected\n\ndata: melody:%d\n\ndata: next:%d\n\ndata: tempo:%d\n\n",
+                       melody, next, metronome_bpm());
+    httpd_resp_send_chunk(async_req, init_msg, len);
+    xSemaphoreGive(sse_mutex);
 
     printf("SSE client connected on slot %d\n", slot);
 
-    while (1) 
+    // SSE_task keeps writing to it and drops it when the client goes away
+    return ESP_OK;
+}
+
+// SSE fields of the /stats report
+static int stats_extra(char *buf, size_t size)
+{
+    int clients = 0;
+    xSemaphoreTake(sse_mutex, portMAX_DELAY);
+    for (int i = 0; i < MAX_CLIENTS; i++)
     {
-        vTaskDelay(pdMS_TO_TICKS(3000));
-        const char *hb = ":\n\n"; // valid comm in SSE
-        esp_err_t res = httpd_resp_send_chunk(req, hb, strlen(hb));
-        if (res != ESP_OK) 
+        if (sse_clients[i].active)
+            clients++;
+    }
+    xSemaphoreGive(sse_mutex);
+
+    // cost of a buzzer control tick (all zero while the samples play)
+    buzzer_stats_t tone;
+    buzzer_get_stats(&tone);
+
+    int len = snprintf(buf, size, "\"sse\":{\"clients\":%d,\"max_clients\":%d,\"queued_notes\":%u,\"dropped_notes\":%lu},"
+                    "\"buzzer\":{\"ticks\":%lu,\"tick_cycles_mean\":%lu,\"tick_cycles_max\":%lu,\"late_us_max\":%lu,"
+                    "\"freq_writes\":%lu,\"duty_writes\":%lu}",
+                    clients, MAX_CLIENTS, (unsigned)uxQueueMessagesWaiting(sse_queue), (unsigned long)sse_dropped_notes,
+                    (unsigned long)tone.ticks, (unsigned long)(tone.ticks ? tone.cycles_total / tone.ticks : 0),
+                    (unsigned long)tone.cycles_max, (unsigned long)tone.late_us_max,
+                    (unsigned long)tone.freq_writes, (unsigned long)tone.duty_writes);
+#if CONFIG_PIANO_POWER_SAVE
+    if (len > 0 && len < (int)size)
+        len += snprintf(buf + len, size - len, ",\"power\":{\"key_wakes\":%lu,\"wake_to_tone_max_us\":%lu,\"wakes_over_budget\":%lu}",
+                        (unsigned long)key_wakes, (unsigned long)wake_to_tone_max_us, (unsigned long)wakes_over_budget);
+#endif
+#if CONFIG_PIANO_ENSEMBLE
+    if (len > 0 && len + 1 < (int)size)
+    {
+        int more = ensemble_stats_json(buf + len + 1, size - len - 1);
+        if (more > 0 && len + 1 + more < (int)size)
         {
-            printf("SSE client %d disconnected, error: %d\n", slot, res);
-            break;
+            buf[len] = ',';
+            len += 1 + more;
         }
     }
+#endif
+    return len;
+}
 
-    // delete client when disconnected
-    xSemaphoreTake(sse_mutex, portMAX_DELAY);
-    sse_clients[slot].active = false;
-    sse_clients[slot].req = NULL;
-    xSemaphoreGive(sse_mutex);
+static esp_err_t stats_send_chunk(void *ctx, const char *data, size_t len)
+{
+    return httpd_resp_send_chunk((httpd_req_t *)ctx, data, len);
+}
 
+// GET /stats: per-task CPU and stack, heap, SSE clients as JSON
+esp_err_t stats_handler(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+
+    esp_err_t err = sys_stats_write(stats_send_chunk, req);
+    if (err != ESP_OK)
+        return err;
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+// Stage latency histograms and a few gauges, Prometheus text format
+static esp_err_t write_metrics(prom_sink_t sink, void *ctx)
+{
+    char *buf = block_pool_alloc(&http_buffer_pool);
+    if (buf == NULL)
+        return ESP_ERR_NO_MEM;
+
+    // the version label lets a scraper compare firmware builds
+    const esp_app_desc_t *app = esp_app_get_description();
+    int len = snprintf(buf, HTTP_BUFFER_SIZE,
+                       "# TYPE piano_build_info gauge\npiano_build_info{version=\"%s\",idf=\"%s\"} 1\n",
+                       app->version, app->idf_ver);
+    esp_err_t err = sink(ctx, buf, len < HTTP_BUFFER_SIZE ? len : HTTP_BUFFER_SIZE - 1);
+    if (err == ESP_OK)
+    {
+        len = snprintf(buf, HTTP_BUFFER_SIZE,
+                       "# TYPE piano_heap_free_bytes gauge\npiano_heap_free_bytes %u\n"
+                       "# TYPE piano_sse_dropped_notes_total counter\npiano_sse_dropped_notes_total %lu\n",
+                       (unsigned)esp_get_free_heap_size(), (unsigned long)sse_dropped_notes);
+        err = sink(ctx, buf, len);
+    }
+    block_pool_free(&http_buffer_pool, buf);
+    if (err == ESP_OK)
+        err = latency_hist_write_prometheus(sink, ctx);
+    if (err == ESP_OK)
+        err = block_pool_write_prometheus(sink, ctx);
+    if (err == ESP_OK)
+        err = ar_link_write_prometheus(sink, ctx);
+    if (err == ESP_OK)
+        err = midi_out_write_prometheus(sink, ctx);
+    if (err == ESP_OK)
+        err = osc_out_write_prometheus(sink, ctx);
+#if CONFIG_PIANO_ENSEMBLE
+    if (err == ESP_OK)
+        err = ensemble_write_prometheus(sink, ctx);
+#endif
+    return err;
+}
+
+// GET /metrics, for a Prometheus scraper or tools/metrics_scrape.py
+esp_err_t metrics_handler(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+
+    esp_err_t err = write_metrics(stats_send_chunk, req);
+    if (err != ESP_OK)
+        return err;
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static esp_err_t stdout_sink(void *ctx, const char *data, size_t len)
+{
+    fwrite(data, 1, len, stdout);
     return ESP_OK;
 }
 
-void start_sse_server(void) 
+// "metrics" on the serial console, same text as GET /metrics
+static void print_metrics(void)
+{
+    write_metrics(stdout_sink, NULL);
+}
+
+// GET /melody: the built-in melodies as JSON, ?index=N loads one at the next key scan (-1 = free play)
+esp_err_t melody_handler(httpd_req_t *req)
+{
+    char query[32], value[8];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "index", value, sizeof(value)) == ESP_OK)
+    {
+        char *end;
+        long index = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || (index != MELODY_GUIDE_NONE && (index < 0 || index >= melody_guide_count())))
+        {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "index must be -1 or a melody");
+            return ESP_FAIL;
+        }
+        atomic_store(&melody_request, (int)index);
+        buttons_wake();
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+
+    char *buf = block_pool_alloc(&http_buffer_pool);
+    if (buf == NULL)
+    {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "busy");
+        return ESP_ERR_NO_MEM;
+    }
+    int len = snprintf(buf, HTTP_BUFFER_SIZE, "{\"melodies\":[");
+    for (int i = 0; i < melody_guide_count() && len < HTTP_BUFFER_SIZE; i++)
+        len += snprintf(buf + len, HTTP_BUFFER_SIZE - len, "%s\"%s\"", i > 0 ? "," : "", melody_guide_name(i));
+    if (len < HTTP_BUFFER_SIZE)
+        len += snprintf(buf + len, HTTP_BUFFER_SIZE - len, "]}");
+    esp_err_t err = httpd_resp_send(req, buf, len < HTTP_BUFFER_SIZE ? len : HTTP_BUFFER_SIZE - 1);
+    block_pool_free(&http_buffer_pool, buf);
+    return err;
+}
+
+// "melody" on the serial console: the next melody of the list, free play after the last one
+static void melody_console(void)
 {
-    sse_mutex = xSemaphoreCreateMutex();
+    int next = melody_loaded + 1;
+    atomic_store(&melody_request, next < melody_guide_count() ? next : MELODY_GUIDE_NONE);
+    buttons_wake();
+}
 
+// start the metronome at bpm, stop it for 0; the page hears the tempo before the first beat
+static esp_err_t metronome_set(int bpm)
+{
+    if (bpm != 0 && (bpm < METRONOME_MIN_BPM || bpm > METRONOME_MAX_BPM))
+        return ESP_ERR_INVALID_ARG;
+
+    sse_post(SSE_TEMPO, bpm, 0);
+    if (bpm == 0)
+    {
+        esp_err_t err = metronome_stop();
+        if (synth_lock())
+        {
+            beat_in_bar = 0;
+            synth_unlock();
+        }
+        wake_lcd();
+        printf("Metronome off\n");
+        return err;
+    }
+    return metronome_start(bpm);
+}
+
+// GET /metronome?bpm=N starts the metronome (0 stops it), returns the tempo as JSON
+esp_err_t metronome_handler(httpd_req_t *req)
+{
+    char query[32], value[8];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "bpm", value, sizeof(value)) == ESP_OK)
+    {
+        char *end;
+        long bpm = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || metronome_set((int)bpm) != ESP_OK)
+        {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "bpm must be 0 or 30-300");
+            return ESP_FAIL;
+        }
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    char body[48];
+    int len = snprintf(body, sizeof(body), "{\"bpm\":%d,\"beats_per_bar\":%d}", metronome_bpm(), CONFIG_PIANO_METRONOME_BEATS);
+    return httpd_resp_send(req, body, len);
+}
+
+// "metro" on the serial console: metronome on at PIANO_METRONOME_BPM, or off
+static void metronome_console(void)
+{
+    metronome_set(metronome_bpm() == 0 ? CONFIG_PIANO_METRONOME_BPM : 0);
+}
+
+#if CONFIG_PIANO_TRACE
+static esp_err_t trace_send_chunk(void *ctx, const void *data, size_t len)
+{
+    return httpd_resp_send_chunk((httpd_req_t *)ctx, data, len);
+}
+
+// GET /trace: binary dump of the trace rings, tools/trace_to_chrome.py makes a Perfetto trace of it
+esp_err_t trace_handler(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"piano.trace\"");
+
+    esp_err_t err = trace_dump(trace_send_chunk, req);
+    if (err != ESP_OK)
+        return err;
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+#endif
+
+void start_sse_server(void) 
+{
     httpd_handle_t server = NULL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.core_id = NET_CORE;
     httpd_start(&server, &config);
     
     httpd_uri_t sse_uri = 
@@ -150,7 +677,77 @@ void start_sse_server(void)
     };
     httpd_register_uri_handler(server, &sse_uri);
 
-    printf("SSE server started at /sse\n");
+    httpd_uri_t stats_uri =
+    {
+        .uri = "/stats",
+        .method = HTTP_GET,
+        .handler = stats_handler,
+        .user_ctx = NULL
+    };
+    httpd_register_uri_handler(server, &stats_uri);
+
+    httpd_uri_t metrics_uri =
+    {
+        .uri = "/metrics",
+        .method = HTTP_GET,
+        .handler = metrics_handler,
+        .user_ctx = NULL
+    };
+    httpd_register_uri_handler(server, &metrics_uri);
+
+    httpd_uri_t melody_uri =
+    {
+        .uri = "/melody",
+        .method = HTTP_GET,
+        .handler = melody_handler,
+        .user_ctx = NULL
+    };
+    httpd_register_uri_handler(server, &melody_uri);
+
+    httpd_uri_t metronome_uri =
+    {
+        .uri = "/metronome",
+        .method = HTTP_GET,
+        .handler = metronome_handler,
+        .user_ctx = NULL
+    };
+    httpd_register_uri_handler(server, &metronome_uri);
+
+#if CONFIG_PIANO_TRACE
+    httpd_uri_t trace_uri =
+    {
+        .uri = "/trace",
+        .method = HTTP_GET,
+        .handler = trace_handler,
+        .user_ctx = NULL
+    };
+    httpd_register_uri_handler(server, &trace_uri);
+#endif
+
+    printf("SSE server started at /sse, stats at /stats and /metrics, melodies at /melody, tempo at /metronome\n");
+}
+
+// <PIANO_HOSTNAME>.local and its services, for the web page and the tools
+static void start_mdns(void)
+{
+    esp_err_t err = mdns_init();
+    if (err == ESP_OK)
+        err = mdns_hostname_set(CONFIG_PIANO_HOSTNAME);
+    if (err != ESP_OK)
+    {
+        printf("mDNS failed: %d\n", err);
+        return;
+    }
+    mdns_instance_name_set("HCI Piano");
+
+    mdns_txt_item_t http_txt[] = { { "sse", "/sse" }, { "metrics", "/metrics" } };
+    mdns_service_add(NULL, "_http", "_tcp", 80, http_txt, sizeof(http_txt) / sizeof(http_txt[0]));
+#if CONFIG_PIANO_OSC_OUT
+    // listeners join the group in the TXT record on this port
+    mdns_txt_item_t osc_txt[] = { { "addr", CONFIG_PIANO_OSC_ADDR } };
+    mdns_service_add(NULL, "_osc", "_udp", CONFIG_PIANO_OSC_PORT, osc_txt, sizeof(osc_txt) / sizeof(osc_txt[0]));
+#endif
+    printf("mDNS: http://%s.local\n", CONFIG_PIANO_HOSTNAME);
 }
 
 void wifi_init_sta(void)
@@ -174,6 +771,10 @@ void wifi_init_sta(void)
     };
     esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
     esp_wifi_start();
+#if CONFIG_PIANO_ENSEMBLE
+    // the default modem sleep holds a ping until the next beacon, the clock sync wants it now
+    esp_wifi_set_ps(WIFI_PS_NONE);
+#endif
     esp_wifi_connect();
 }
 
@@ -188,165 +789,618 @@ void wait_for_ip(void)
     }
 }
 
+// pinned task with its stack and TCB in .bss, whose stack shows up in /stats
+static void start_task(TaskFunction_t fn, const char *name, StackType_t *stack, uint32_t stack_size,
+                       StaticTask_t *tcb, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+    TaskHandle_t task = xTaskCreateStaticPinnedToCore(fn, name, stack_size, NULL, priority, stack, tcb, core);
+    if (task == NULL)
+    {
+        printf("Failed to create %s\n", name);
+        return;
+    }
+    sys_stats_watch_stack(task, name, stack_size);
+    if (handle != NULL)
+        *handle = task;
+}
+
+// every task gets its own static stack, sized in bytes (ESP-IDF StackType_t is a byte)
+#define START_TASK(fn, name, stack_size, priority, handle, core) do { \
+        static StackType_t stack[stack_size]; \
+        static StaticTask_t tcb; \
+        start_task(fn, name, stack, stack_size, &tcb, priority, handle, core); \
+    } while (0)
+
+#if CONFIG_PIANO_LATENCY_TEST
+// Simulated key presses, the same every run so measurements are comparable
+static bool latency_test_key(int key)
+{
+    uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+    return (now / LATENCY_TEST_KEY_MS) % 12 == (uint32_t)key && now % LATENCY_TEST_KEY_MS < LATENCY_TEST_KEY_MS / 2;
+}
+
+// Prints the stage latencies every 5 s while the load test runs
+void Latency_task(void *pvParameters)
+{
+    while (1)
+    {
+        vTaskDelay(pdMS_TO_TICKS(5000));
+        latency_hist_print();
+    }
+}
+#endif
+
+#if CONFIG_PIANO_POWER_TEST
+// Sleep residency and the key wakes every 10 s
+void Power_task(void *pvParameters)
+{
+    while (1)
+    {
+        vTaskDelay(pdMS_TO_TICKS(POWER_TEST_PERIOD_MS));
+        power_print(stdout);
+        printf("Key wakes: %lu, wake to tone p99 %luus max %luus, %lu over the %dus budget\n",
+               (unsigned long)key_wakes, (unsigned long)latency_hist_percentile(&wake_to_tone_hist, 99),
+               (unsigned long)wake_to_tone_max_us, (unsigned long)wakes_over_budget, POWER_WAKE_BUDGET_US);
+    }
+}
+#endif
+
+// debouncer with the hold-offs from menuconfig, in scans
+static void keys_init(debounce_t *keys)
+{
+    debounce_init(keys, (CONFIG_PIANO_DEBOUNCE_RELEASE_MS + CONFIG_PIANO_KEY_SCAN_MS - 1) / CONFIG_PIANO_KEY_SCAN_MS);
+    if (debounce_parse_holdoffs(keys, CONFIG_PIANO_DEBOUNCE_KEY_MS, CONFIG_PIANO_KEY_SCAN_MS) < 0)
+        printf("PIANO_DEBOUNCE_KEY_MS \"%s\" is not key:ms,key:ms\n", CONFIG_PIANO_DEBOUNCE_KEY_MS);
+}
+
+// the most recently pressed of the held keys, -1 if none: the buzzer goes back to it on a release
+static int last_pressed(uint16_t held, const int64_t *down_us)
+{
+    int note = -1;
+    for (int i = 0; i < 12; i++)
+        if ((held & (1 << i)) && (note < 0 || down_us[i] > down_us[note]))
+            note = i;
+    return note;
+}
+
+// follower state to the LCD (synth state) and the next-note hint to the web page and the AR app
+static void melody_publish(const melody_guide_t *m, int64_t key_us)
+{
+    int next = melody_guide_next(m);
+    if (synth_lock())
+    {
+        melody_loaded = m->melody;
+        melody_hint = next;
+        melody_step = m->step;
+        synth_unlock();
+    }
+    wake_lcd();
+    sse_post(SSE_NEXT, next, key_us);
+    ar_link_send(AR_LINK_MELODY_NEXT, next, key_us);
+}
+
+// a melody asked for by /melody or the console
+static void melody_start(melody_guide_t *m, int index, int64_t now_us)
+{
+    if (melody_guide_load(m, index) != 0)
+        return;
+    sse_post(SSE_MELODY, index, now_us);
+    melody_publish(m, now_us);
+    if (index == MELODY_GUIDE_NONE)
+        printf("Free play\n");
+    else
+        printf("Melody: %s, first note %s\n", melody_guide_name(index), note_names[melody_guide_next(m)]);
+}
+
+// a key press against the melody, in the scan that saw it
+static void melody_press(melody_guide_t *m, int key, int64_t key_us)
+{
+    int played = m->melody;
+    melody_guide_result_t result = melody_guide_key(m, key);
+
+    switch (result)
+    {
+    case MELODY_GUIDE_IGNORED:
+        return;
+    case MELODY_GUIDE_WRONG:
+    case MELODY_GUIDE_RESTART:
+        sse_post(SSE_WRONG, key, key_us);
+        ar_link_send(AR_LINK_MELODY_WRONG, key, key_us);
+        printf("Wrong: %s, play %s%s\n", note_names[key], note_names[melody_guide_next(m)],
+               result == MELODY_GUIDE_RESTART ? " (from the start)" : "");
+        if (result == MELODY_GUIDE_WRONG)
+            return;   // the hint stays the same
+        break;
+    case MELODY_GUIDE_DONE:
+        sse_post(SSE_DONE, played, key_us);
+        printf("Melody done: %s\n", melody_guide_name(played));
+        break;
+    case MELODY_GUIDE_STEP:
+        printf("Next: %s (%d/%d)\n", note_names[melody_guide_next(m)], m->step + 1, melody_guide_length(played));
+        break;
+    }
+    melody_publish(m, key_us);
+}
+
 void Buttons_task(void *pvParameters)
 {
+    static debounce_t keys;
+    static int64_t down_us[12];
+    static melody_guide_t melody;
+    uint8_t last_chord = CHORD_NONE;
     buttons_init();
-    static bool prev_button_state[12] = {0};
+#if CONFIG_PIANO_POWER_SAVE
+    buttons_wake_init(CONFIG_PIANO_PCF_INT_GPIO);
+    int64_t woke_us = 0;   // the interrupt that ended the last idle wait
+#endif
+    keys_init(&keys);
+    melody_guide_init(&melody, CONFIG_PIANO_MELODY_TOLERANCE);
+    TickType_t last_wake = xTaskGetTickCount();
 
     while (1)
     {
-        bool any_pressed = false;
-
+        TRACE_BEGIN("key scan");
+        int64_t read_us = esp_timer_get_time();
+        uint16_t raw = buttons_read();
+        int64_t now_us = esp_timer_get_time();
+        latency_hist_record(&key_scan_hist, now_us - read_us);
+#if CONFIG_PIANO_LATENCY_TEST
         for (int i = 0; i < 12; i++)
-        {
-            bool cur = button_pressed(i);
+            if (latency_test_key(i))
+                raw |= 1 << i;
+#endif
+        uint16_t changed = debounce_update(&keys, raw);
 
-            if (cur && !prev_button_state[i])
+        if (changed)
+        {
+            // the whole scan's changes in one go: the buzzer sees the final state, not each key
+            for (int i = 0; i < 12; i++)
+                if (changed & keys.state & (1 << i))
+                    down_us[i] = now_us;
+            int note = last_pressed(keys.state, down_us);
+            if (synth_lock())
             {
-                if (xSemaphoreTake(synth_mutex, portMAX_DELAY))
+                held_keys = keys.state;
+                if (note != current_note)
                 {
-                    current_note = i;
+                    current_note = note;
                     note_changed = true;
-                    printf("%s\n", note_names[i]);
-        char msg[64];
-        sprintf(msg, "note_on:%d\n\n", current_note);
-        sse_send_all(msg);
-                    xSemaphoreGive(synth_mutex);
                 }
+                key_event_us = now_us;
+#if CONFIG_PIANO_POWER_SAVE
+                wake_event_us = woke_us;
+#endif
+                synth_unlock();
             }
-            prev_button_state[i] = cur;
-            if (cur) any_pressed = true;
+            wake_buzzer();
+            wake_lcd();
+#if CONFIG_PIANO_POWER_SAVE
+            if (changed & keys.state)
+                wake_pot();
+#endif
         }
 
-        if (!any_pressed && current_note != -1)
+        // the web page, the AR app, MIDI and the console after the buzzer, they don't delay the tone
+        for (int i = 0; i < 12; i++)
         {
-            if (xSemaphoreTake(synth_mutex, portMAX_DELAY))
+            if (!(changed & (1 << i)))
+                continue;
+
+            if (keys.state & (1 << i))
             {
-                current_note = -1;
-                note_changed = true;
-        char msg[64];
-        sprintf(msg, "note_on:%d\n\n", current_note);
-        sse_send_all(msg);
-                xSemaphoreGive(synth_mutex);
+                TRACE_INSTANT("key down", i);
+                sse_post(SSE_NOTE_ON, i, now_us);
+                ar_link_send(AR_LINK_NOTE_ON, i, now_us);
+                midi_out_note(i, true);
+#if !CONFIG_PIANO_LATENCY_TEST
+                printf("%s\n", note_names[i]);
+#endif
+                melody_press(&melody, i, now_us);
+            }
+            else
+            {
+                TRACE_INSTANT("key up", i);
+                sse_post(SSE_NOTE_OFF, i, now_us);
+                ar_link_send(AR_LINK_NOTE_OFF, i, now_us);
+                midi_out_note(i, false);
             }
         }
 
-        vTaskDelay(pdMS_TO_TICKS(50));
+        uint8_t chord = chord_lookup(keys.state);
+        if (changed && chord != last_chord)
+        {
+            sse_post(SSE_CHORD, chord, now_us);
+#if !CONFIG_PIANO_LATENCY_TEST
+            if (chord != CHORD_NONE)
+            {
+                char name[CHORD_NAME_MAX];
+                chord_format(chord, name, sizeof(name));
+                printf("Chord: %s\n", name);
+            }
+#endif
+            last_chord = chord;
+        }
+
+        int request = atomic_exchange(&melody_request, MELODY_REQUEST_NONE);
+        if (request != MELODY_REQUEST_NONE)
+            melody_start(&melody, request, now_us);
+        TRACE_END("key scan");
+
+#if CONFIG_PIANO_POWER_SAVE
+        // nothing held or settling: no scans until a key's interrupt, the chip can sleep meanwhile
+        woke_us = 0;
+        if (keys.state == 0 && keys.locked == 0)
+        {
+            TickType_t idle = CONFIG_PIANO_PCF_INT_GPIO >= 0 ? portMAX_DELAY : pdMS_TO_TICKS(POWER_IDLE_SCAN_MS);
+            woke_us = buttons_wait(idle);
+            last_wake = xTaskGetTickCount();
+            continue;
+        }
+#endif
+        // a fixed period, the hold-offs are counted in scans
+        xTaskDelayUntil(&last_wake, pdMS_TO_TICKS(CONFIG_PIANO_KEY_SCAN_MS));
     }
 }
 
+// Every beat of the hardware timer: the click for Buzzer_task, the beat for the LCD and the web page
+void Metronome_task(void *pvParameters)
+{
+    metronome_init(xTaskGetCurrentTaskHandle());
+
+    while (1)
+    {
+        uint32_t beat;
+        xTaskNotifyWait(0, 0, &beat, portMAX_DELAY);
+        if (metronome_bpm() == 0)
+            continue;   // a beat notified just before the stop
+        int64_t beat_us = metronome_beat_time(beat);
+        TRACE_INSTANT("beat", beat);
+
+        if (synth_lock())
+        {
+#if CONFIG_PIANO_METRONOME_CLICK
+            click_freq = beat % CONFIG_PIANO_METRONOME_BEATS == 0 ? METRONOME_ACCENT_HZ : METRONOME_CLICK_HZ;
+            click_beat_us = beat_us;
+            click_pending = true;
+#endif
+            beat_in_bar = beat % CONFIG_PIANO_METRONOME_BEATS + 1;
+            synth_unlock();
+        }
+        wake_buzzer();
+        wake_lcd();
+        sse_post(SSE_BEAT, beat, 0);
+    }
+}
+
+// the pot sweeps a key up to the next semitone; with the receiver's default +-2 semitone bend range
+// one semitone is a quarter of the 14 bit span
+#define MIDI_BEND_PER_SEMITONE 4096
+
 void Pot_task(void *pvParameters)
 {
+#if !CONFIG_PIANO_POT_VIBRATO
+    uint16_t last_bend_offset = 0;   // the receiver starts unbent
+#endif
+
     pot_init();
 
     while (1)
     {
+        TRACE_BEGIN("pot read");
         uint16_t new_offset = pot_read_mapped(); // 0 - 200
+        TRACE_END("pot read");
 
-        if (xSemaphoreTake(synth_mutex, portMAX_DELAY))
+        bool moved = false;
+        if (synth_lock())
         {
+            moved = pot_offset != new_offset;
             pot_offset = new_offset;
-            xSemaphoreGive(synth_mutex);
+            synth_unlock();
+        }
+        if (moved)
+        {
+            wake_buzzer();
+            wake_lcd();
+        }
+#if !CONFIG_PIANO_POT_VIBRATO
+        if (new_offset != last_bend_offset)
+        {
+            midi_out_bend(MIDI_OUT_BEND_CENTER + new_offset * MIDI_BEND_PER_SEMITONE / 200);
+            last_bend_offset = new_offset;
         }
+#endif
 
+#if CONFIG_PIANO_POWER_SAVE
+        // no note to bend: rarely, until a key press wakes it
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(current_note == -1 ? POWER_POT_IDLE_MS : 200));
+#else
         vTaskDelay(pdMS_TO_TICKS(200));
+#endif
     }
 }
 
+#if CONFIG_PIANO_SAMPLES
+// Keeps the DAC fed: renders the sample playing a block ahead, paced by the DMA
+void Sampler_task(void *pvParameters)
+{
+    while (1)
+        sampler_pump();
+}
+#endif
+
+static void sound_note(int note, uint32_t freq_hz)
+{
+    if (use_samples)
+        sampler_play(note, freq_hz);
+    else
+        buzzer_play(freq_hz);
+}
+
+// the pot moved: bend the note, a sample keeps playing where it is
+static void sound_bend(uint32_t freq_hz)
+{
+    if (use_samples)
+        sampler_pitch(freq_hz);
+    else
+        buzzer_play(freq_hz);
+}
+
+static void sound_stop(void)
+{
+    if (use_samples)
+        sampler_stop();
+    else
+        buzzer_stop();
+}
+
+// pitch of a key with the pot at offset (0 - 200): up to the next semitone, or its own pitch when
+// the pot is the vibrato depth
+static uint32_t key_freq(int note, uint16_t offset)
+{
+#if CONFIG_PIANO_POT_VIBRATO
+    (void)offset;
+    return note_freqs[note];
+#else
+    float percent = (float)offset / 200.0f * 100.0f;
+    return note_lower[note] + (uint32_t)((note_upper[note] - note_lower[note]) * (percent / 100.0f));
+#endif
+}
+
 void Buzzer_task(void *pvParameters)
 {
-    buzzer_init();
+    if (!use_samples)
+    {
+        buzzer_init();
+        buzzer_shape(CONFIG_PIANO_GLIDE_MS, CONFIG_PIANO_ATTACK_MS, CONFIG_PIANO_RELEASE_MS);
+    }
     uint16_t last_offset = 0;
+    uint32_t note_freq = 0;      // tone of current_note, comes back after a click
+    int64_t click_end_us = 0;    // a metronome click sounds until then, 0 = none
 
     while (1)
     {
-        if (xSemaphoreTake(synth_mutex, portMAX_DELAY))
+        if (synth_lock())
         {
+            if (click_pending)
+            {
+                click_pending = false;
+                if (use_samples)
+                {
+                    sampler_click(click_freq, METRONOME_CLICK_MS);   // mixed over the note, ends by itself
+                }
+                else
+                {
+                    buzzer_tone(click_freq);
+                    click_end_us = esp_timer_get_time() + METRONOME_CLICK_MS * 1000;
+                }
+                latency_hist_since(&beat_to_click_hist, click_beat_us);
+            }
+
             if (note_changed)
             {
                 note_changed = false;
+                click_end_us = 0;   // a key cuts the click short
+                TRACE_BEGIN("tone change");
 
                 if (current_note == -1)
                 {
-                    buzzer_stop();
+                    sound_stop();
                 }
                 else
                 {
-                    float percent = (float)pot_offset / 200.0f * 100.0f;; 
-                    uint32_t freq = note_lower[current_note] + 
-                                (uint32_t)((note_upper[current_note] - note_lower[current_note]) * (percent / 100.0f));
-                    buzzer_play(freq);
+                    note_freq = key_freq(current_note, pot_offset);
+                    sound_note(current_note, note_freq);
+                }
+                TRACE_END("tone change");
+                latency_hist_since(&key_to_tone_hist, key_event_us);
+#if CONFIG_PIANO_POWER_SAVE
+                if (wake_event_us != 0)
+                {
+                    // the first note after sleeping, against its budget
+                    uint32_t us = (uint32_t)(esp_timer_get_time() - wake_event_us);
+                    latency_hist_record(&wake_to_tone_hist, us);
+                    key_wakes++;
+                    if (us > wake_to_tone_max_us)
+                        wake_to_tone_max_us = us;
+                    if (us > POWER_WAKE_BUDGET_US)
+                        wakes_over_budget++;
+                    wake_event_us = 0;
                 }
+#endif
+            }
+            else if (click_end_us != 0 && esp_timer_get_time() >= click_end_us)
+            {
+                // back to the note under the click
+                click_end_us = 0;
+                buzzer_tone(current_note == -1 ? 0 : note_freq);
             }
-            else if (current_note != -1 && pot_offset != last_offset)
+#if CONFIG_PIANO_POT_VIBRATO
+            else if (pot_offset != last_offset && !use_samples)
             {
-                float percent = (float)pot_offset / 200.0f * 100.0f;; 
-                uint32_t freq = note_lower[current_note] + 
-                                (uint32_t)((note_upper[current_note] - note_lower[current_note]) * (percent / 100.0f));
-                buzzer_play(freq);
+                buzzer_vibrato(pot_offset * CONFIG_PIANO_VIBRATO_CENTS / 200, CONFIG_PIANO_VIBRATO_HZ);
             }
+#else
+            else if (current_note != -1 && pot_offset != last_offset && click_end_us == 0)
+            {
+                note_freq = key_freq(current_note, pot_offset);
+                sound_bend(note_freq);
+            }
+#endif
 
-            last_offset = pot_offset;
-            xSemaphoreGive(synth_mutex);
+            if (click_end_us == 0)
+                last_offset = pot_offset;
+            synth_unlock();
         }
 
-        vTaskDelay(pdMS_TO_TICKS(50));
+        // woken right away on a key change, a beat or the potentiometer moving, on its own only to
+        // end a click
+        ulTaskNotifyTake(pdTRUE, click_end_us != 0 ? pdMS_TO_TICKS(METRONOME_CLICK_MS) : portMAX_DELAY);
+    }
+}
+
+// first LCD line for the held keys: the chord name, or the notes themselves (as many as fit)
+static void lcd_keys_line(uint16_t held, char *line, size_t size)
+{
+    uint8_t chord = chord_lookup(held);
+    if (chord != CHORD_NONE)
+    {
+        char name[CHORD_NAME_MAX];
+        chord_format(chord, name, sizeof(name));
+        snprintf(line, size, "Chord: %s", name);
+        return;
+    }
+    if ((held & (held - 1)) == 0)
+    {
+        snprintf(line, size, "Note: %s", note_names[__builtin_ctz(held)]);
+        return;
+    }
+
+    size_t len = 0;
+    line[0] = '\0';
+    for (int i = 0; i < 12; i++)
+    {
+        if (!(held & (1 << i)))
+            continue;
+        size_t need = strlen(note_names[i]) + (len > 0);
+        if (len + need >= size)
+            break;
+        len += snprintf(line + len, size - len, "%s%s", len > 0 ? " " : "", note_names[i]);
     }
 }
 
+// metronome beat in the bar in the top right corner, blank when it is off
+static void lcd_beat_mark(int beat)
+{
+#if CONFIG_PIANO_METRONOME_FLASH
+    char mark[2] = { beat > 0 ? '0' + beat : ' ', '\0' };
+    lcd_set_cursor(15, 0);
+    lcd_print(mark);
+#endif
+}
+
 void LCD_task(void *pvParameters)
 {
     lcd_init();
     lcd_clear();
 
+    uint16_t last_held = 0;
     int last_note = -1;
     uint16_t last_offset = 0;
+    int last_hint = -1;
+    int last_step = 0;
+    int last_beat = 0;
+    int64_t last_key_us = 0;
 
     while (1)
     {
-        if (xSemaphoreTake(synth_mutex, portMAX_DELAY))
+        if (synth_lock())
         {
-            if (current_note != last_note || pot_offset != last_offset)
+            if (held_keys != last_held || current_note != last_note || pot_offset != last_offset ||
+                melody_hint != last_hint || melody_step != last_step)
             {
+                TRACE_BEGIN("lcd update");
                 lcd_clear();
                 lcd_set_cursor(0, 0);
 
-                if (current_note == -1)
+                if (melody_hint != -1)
+                {
+                    // guided melody: what's held (or the melody) on top, the next note below
+                    char line[17];
+                    if (held_keys == 0)
+                        snprintf(line, sizeof(line), "%s", melody_guide_name(melody_loaded));
+                    else
+                        lcd_keys_line(held_keys, line, sizeof(line));
+                    lcd_print(line);
+                    lcd_set_cursor(0, 1);
+                    snprintf(line, sizeof(line), "Next: %s %d/%d", note_names[melody_hint],
+                             melody_step + 1, melody_guide_length(melody_loaded));
+                    lcd_print(line);
+                }
+                else if (held_keys == 0 || current_note == -1)
                 {
                     lcd_print("No key pressed");
                 }
                 else
                 {
-                    float percent = (float)pot_offset / 200.0f * 100.0f;
-                    uint32_t freq = note_lower[current_note] +
-                                    (uint32_t)((note_upper[current_note] - note_lower[current_note]) * (percent / 100.0f));
-                    lcd_print("Note: ");
-                    lcd_print(note_names[current_note]);
+                    uint32_t freq = key_freq(current_note, pot_offset);
+                    char keys_line[17];
+                    lcd_keys_line(held_keys, keys_line, sizeof(keys_line));
+                    lcd_print(keys_line);
                     lcd_set_cursor(0, 1);
                     char buf[16];
                     snprintf(buf, sizeof(buf), "%luHz %+ld", note_freqs[current_note], (long)(freq - note_freqs[current_note]));
                     lcd_print(buf);
                 }
 
+                last_held = held_keys;
                 last_note = current_note;
                 last_offset = pot_offset;
+                last_hint = melody_hint;
+                last_step = melody_step;
+                lcd_beat_mark(beat_in_bar);
+                last_beat = beat_in_bar;
+                TRACE_END("lcd update");
+            }
+            else if (beat_in_bar != last_beat)
+            {
+                lcd_beat_mark(beat_in_bar);
+                last_beat = beat_in_bar;
+            }
+            // one sample per key change, a pot-only redraw isn't one
+            if (key_event_us != last_key_us)
+            {
+                latency_hist_since(&key_to_lcd_hist, key_event_us);
+                last_key_us = key_event_us;
             }
-            xSemaphoreGive(synth_mutex);
+            synth_unlock();
         }
 
+#if CONFIG_PIANO_POWER_SAVE
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);   // asleep until something shown changes
+#else
         vTaskDelay(pdMS_TO_TICKS(100));
+#endif
     }
 }
 
 void app_main(void)
 {
     nvs_flash_init();
+#if CONFIG_PIANO_POWER_SAVE
+    power_init(CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ, CONFIG_PIANO_POWER_MIN_MHZ, true);
+#endif
     wifi_init_sta();
     wait_for_ip();
     vTaskDelay(pdMS_TO_TICKS(5000));
 
-    synth_mutex = xSemaphoreCreateMutex();
-    sse_mutex = xSemaphoreCreateMutex();
+    // long-lived objects are static, the heap is left to WiFi, lwIP and httpd
+    static StaticSemaphore_t synth_mutex_buffer;
+    static StaticSemaphore_t sse_mutex_buffer;
+    static StaticQueue_t sse_queue_buffer;
+    static uint8_t sse_queue_storage[SSE_QUEUE_LENGTH * sizeof(sse_note_t)];
+    synth_mutex = xSemaphoreCreateMutexStatic(&synth_mutex_buffer);
+    sse_mutex = xSemaphoreCreateMutexStatic(&sse_mutex_buffer);
+    sse_queue = xQueueCreateStatic(SSE_QUEUE_LENGTH, sizeof(sse_note_t), sse_queue_storage, &sse_queue_buffer);
 
     esp_netif_ip_info_t ipInfo;
     esp_netif_t *sta_netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
@@ -356,10 +1410,72 @@ void app_main(void)
         printf("ESP32 IP: %s\n", ipStr);
     }
 
+    trace_init();
+    chord_init();
+    sys_stats_init(stats_extra);
+    block_pool_init(&sse_frame_pool);
+    block_pool_init(&http_buffer_pool);
+#if CONFIG_PIANO_AR_LINK
+    ar_link_init(CONFIG_PIANO_AR_LINK_UART, CONFIG_PIANO_AR_LINK_TX_GPIO, CONFIG_PIANO_AR_LINK_BAUD);
+#endif
+#if CONFIG_PIANO_MIDI_OUT
+    midi_out_init(CONFIG_PIANO_MIDI_OUT_UART, CONFIG_PIANO_MIDI_OUT_TX_GPIO, CONFIG_PIANO_MIDI_OUT_BAUD,
+                  CONFIG_PIANO_MIDI_OUT_CHANNEL);
+#endif
+    latency_hist_register(&key_scan_hist);
+    latency_hist_register(&key_to_tone_hist);
+    latency_hist_register(&key_to_sse_hist);
+#if CONFIG_PIANO_OSC_OUT
+    latency_hist_register(&key_to_osc_hist);
+    osc_out_init(CONFIG_PIANO_OSC_ADDR, CONFIG_PIANO_OSC_PORT);
+#endif
+#if CONFIG_PIANO_ENSEMBLE_LEADER
+    ensemble_start(CONFIG_PIANO_ENSEMBLE_NODE, true, CONFIG_PIANO_OSC_ADDR, CONFIG_PIANO_OSC_PORT,
+                   CONFIG_PIANO_ENSEMBLE_WINDOW_MS, ENSEMBLE_TASK_PRIORITY, ENSEMBLE_TASK_CORE);
+#elif CONFIG_PIANO_ENSEMBLE
+    ensemble_start(CONFIG_PIANO_ENSEMBLE_NODE, false, CONFIG_PIANO_OSC_ADDR, CONFIG_PIANO_OSC_PORT,
+                   0, ENSEMBLE_TASK_PRIORITY, ENSEMBLE_TASK_CORE);
+#endif
+    latency_hist_register(&key_to_lcd_hist);
+    latency_hist_register(&beat_to_click_hist);
+#if CONFIG_PIANO_POWER_SAVE
+    latency_hist_register(&wake_to_tone_hist);
+#endif
     start_sse_server();
+    start_mdns();
+
+    START_TASK(SSE_task, "SSE Task", SSE_TASK_STACK_SIZE, SSE_TASK_PRIORITY, NULL, SSE_TASK_CORE);
+
+#if CONFIG_PIANO_SAMPLES
+    // the DAC takes GPIO25 from the buzzer only when there is a pack to play
+    use_samples = sampler_init() == ESP_OK;
+    if (use_samples)
+    {
+#if CONFIG_PIANO_POWER_SAVE
+        sampler_sleep_after(POWER_SAMPLES_OFF_MS);
+#endif
+        START_TASK(Sampler_task, "Sampler Task", SAMPLER_TASK_STACK_SIZE, SAMPLER_TASK_PRIORITY, NULL, SAMPLER_TASK_CORE);
+    }
+#endif
+
+    // buzzer first, Buttons wakes it through its handle
+    START_TASK(Buzzer_task, "Buzzer Task", BUZZER_TASK_STACK_SIZE, BUZZER_TASK_PRIORITY, &buzzer_task_handle, BUZZER_TASK_CORE);
+    START_TASK(Buttons_task, "Buttons Task", BUTTONS_TASK_STACK_SIZE, BUTTONS_TASK_PRIORITY, NULL, BUTTONS_TASK_CORE);
+    START_TASK(Metronome_task, "Metronome Task", METRONOME_TASK_STACK_SIZE, METRONOME_TASK_PRIORITY, NULL, METRONOME_TASK_CORE);
+    START_TASK(Pot_task, "Potentiometer Task", POT_TASK_STACK_SIZE, POT_TASK_PRIORITY, &pot_task_handle, POT_TASK_CORE);
+    START_TASK(LCD_task, "LCD Task", LCD_TASK_STACK_SIZE, LCD_TASK_PRIORITY, &lcd_task_handle, LCD_TASK_CORE);
+#if CONFIG_PIANO_LATENCY_TEST
+    START_TASK(Latency_task, "Latency Task", LATENCY_TASK_STACK_SIZE, 1, NULL, NET_CORE);
+#endif
+#if CONFIG_PIANO_POWER_TEST
+    START_TASK(Power_task, "Power Task", POWER_TASK_STACK_SIZE, 1, NULL, NET_CORE);
+#endif
 
-    xTaskCreate(Buttons_task, "Buttons Task", BUTTONS_TASK_STACK_SIZE, NULL, BUTTONS_TASK_PRIORITY, NULL);
-    xTaskCreate(Pot_task, "Potentiometer Task", POT_TASK_STACK_SIZE, NULL, POT_TASK_PRIORITY, NULL);
-    xTaskCreate(Buzzer_task, "Buzzer Task", BUZZER_TASK_STACK_SIZE, NULL, BUZZER_TASK_PRIORITY, NULL);
-    xTaskCreate(LCD_task, "LCD Task", LCD_TASK_STACK_SIZE, NULL, LCD_TASK_PRIORITY, NULL);
+    sys_stats_console_add("metrics", print_metrics);
+    sys_stats_console_add("trace", trace_print);
+    sys_stats_console_add("midi", midi_out_test);
+    sys_stats_console_add("keytrace", buttons_trace);
+    sys_stats_console_add("melody", melody_console);
+    sys_stats_console_add("metro", metronome_console);
+    sys_stats_console_start(CONSOLE_TASK_PRIORITY, NET_CORE);
 }
\ No newline at end of file
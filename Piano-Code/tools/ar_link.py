@@ -0,0 +1,228 @@
+#!/usr/bin/env python3
+"""Decoder for the piano's AR link (components/ar_link): COBS frames with CRC-16 on a second UART.
+
+Frame: COBS(type u8 | note u8 | seq u16 | time_us u32 | crc16 u16) 0x00, little endian,
+CRC-16/CCITT-FALSE over the first 8 bytes. Types: 1 note on, 2 note off, 3 hello (note = version),
+4 guided melody's next key (0xFF = none), 5 wrong key.
+
+As a library:
+
+  decoder = ArLinkDecoder()
+  for event in decoder.feed(port.read(4096)):
+      print(event.type, event.note, event.seq)
+
+From the command line:
+
+  python3 ar_link.py --serial /dev/ttyUSB1 --baud 921600      # print events and link stats
+  python3 ar_link.py --selftest 200000                          # decoder throughput, no hardware
+
+--serial prints every event with the time since the previous one and, every --report seconds,
+frames/s, CRC errors, sequence gaps (frames the firmware dropped or the line lost) and resyncs.
+With most USB-serial adapters the delay to the host is the adapter's latency timer (FTDI: 16 ms by
+default, set it to 1 ms), not the 130 us a frame takes on the wire at 921600 baud.
+--selftest encodes random events, corrupts some frames and inserts line noise, then checks that
+every intact frame comes out and no damaged one does.
+"""
+
+import argparse
+import collections
+import random
+import struct
+import sys
+import time
+
+NOTE_ON, NOTE_OFF, HELLO, MELODY_NEXT, MELODY_WRONG = 1, 2, 3, 4, 5
+TYPE_NAMES = {NOTE_ON: "on", NOTE_OFF: "off", HELLO: "hello", MELODY_NEXT: "next", MELODY_WRONG: "wrong"}
+NOTE_NAMES = ["C4", "C#4", "D4", "D#4", "E4", "F4", "F#4", "G4", "G#4", "A4", "A#4", "B4"]
+PAYLOAD = struct.Struct("<BBHI")
+FRAME_MAX = PAYLOAD.size + 2 + 2
+
+Event = collections.namedtuple("Event", "type note seq time_us")
+
+
+def crc16(data):
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+        crc &= 0xFFFF
+    return crc
+
+
+def cobs_encode(data):
+    out = bytearray([0])
+    code_at, code = 0, 1
+    for byte in data:
+        if byte == 0:
+            out[code_at] = code
+            code_at, code = len(out), 1
+            out.append(0)
+            continue
+        out.append(byte)
+        code += 1
+        if code == 0xFF:
+            out[code_at] = code
+            code_at, code = len(out), 1
+            out.append(0)
+    out[code_at] = code
+    return bytes(out)
+
+
+def cobs_decode(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            return None
+        out += data[i + 1:i + code]
+        i += code
+        if code < 0xFF and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def encode(type_, note, seq, time_us):
+    payload = PAYLOAD.pack(type_, note & 0xFF, seq & 0xFFFF, time_us & 0xFFFFFFFF)
+    return cobs_encode(payload + struct.pack("<H", crc16(payload))) + b"\x00"
+
+
+class ArLinkDecoder:
+    """Feed it bytes as they arrive, get the events of every complete, intact frame."""
+
+    def __init__(self):
+        self.buffer = bytearray()
+        self.frames = 0
+        self.crc_errors = 0
+        self.bad_frames = 0     # wrong length or broken COBS
+        self.gaps = 0           # frames missing between two received ones
+        self.resets = 0         # hello frames: the board restarted
+        self.last_seq = None
+
+    def feed(self, data):
+        events = []
+        self.buffer += data
+        while True:
+            end = self.buffer.find(0)
+            if end < 0:
+                # noise without a delimiter can't grow the buffer forever
+                if len(self.buffer) > 4 * FRAME_MAX:
+                    del self.buffer[:-FRAME_MAX]
+                return events
+            raw = bytes(self.buffer[:end])
+            del self.buffer[:end + 1]
+            if not raw:
+                continue
+            event = self.decode_frame(raw)
+            if event:
+                events.append(event)
+
+    def decode_frame(self, raw):
+        data = cobs_decode(raw) if len(raw) <= FRAME_MAX else None
+        if data is None or len(data) != PAYLOAD.size + 2:
+            self.bad_frames += 1
+            return None
+        if crc16(data[:PAYLOAD.size]) != struct.unpack_from("<H", data, PAYLOAD.size)[0]:
+            self.crc_errors += 1
+            return None
+        event = Event(*PAYLOAD.unpack_from(data))
+        self.frames += 1
+        if event.type == HELLO:
+            self.resets += 1
+        elif self.last_seq is not None:
+            self.gaps += (event.seq - self.last_seq - 1) & 0xFFFF
+        self.last_seq = event.seq
+        return event
+
+
+def describe(event):
+    if event.type == HELLO:
+        return "hello, protocol %d" % event.note
+    if event.type == MELODY_NEXT and event.note == 0xFF:
+        return "free play"
+    name = NOTE_NAMES[event.note] if event.note < len(NOTE_NAMES) else str(event.note)
+    return "%-5s %-3s" % (name, TYPE_NAMES.get(event.type, "type %d" % event.type))
+
+
+def selftest(count, seed):
+    rng = random.Random(seed)
+    stream = bytearray()
+    sent = []
+    damaged = 0
+    for seq in range(count):
+        event = Event(rng.choice((NOTE_ON, NOTE_OFF)), rng.randrange(12), seq & 0xFFFF, rng.getrandbits(32))
+        frame = bytearray(encode(*event))
+        roll = rng.random()
+        if roll < 0.01:
+            # flipped bit inside the frame (never the delimiter)
+            i = rng.randrange(len(frame) - 1)
+            frame[i] ^= 1 << rng.randrange(8)
+            if frame[i] == 0:
+                frame[i] = 0x55
+            damaged += 1
+        elif roll < 0.02:
+            # line noise before the frame, ends with a stray delimiter like a glitch would
+            stream += bytes(rng.randrange(1, 256) for _ in range(rng.randrange(1, 20))) + b"\x00"
+            sent.append(event)
+        else:
+            sent.append(event)
+        stream += frame
+
+    decoder = ArLinkDecoder()
+    start = time.perf_counter()
+    received = []
+    for i in range(0, len(stream), 4096):   # the way a serial port hands data over
+        received += decoder.feed(stream[i:i + 4096])
+    elapsed = time.perf_counter() - start
+
+    missing = len(set(sent) - set(received))
+    bogus = len(set(received) - set(sent))
+    print("%d frames, %d damaged on purpose, %d bytes (%.2f per event)" % (count, damaged, len(stream), len(stream) / count))
+    print("decoded %d, missing %d, accepted bad %d, crc errors %d, bad frames %d" %
+          (len(received), missing, bogus, decoder.crc_errors, decoder.bad_frames))
+    print("decoder: %.0f frames/s, %.1f MB/s (921600 baud carries %d frames/s)" %
+          (len(received) / elapsed, len(stream) / elapsed / 1e6, 92160 // FRAME_MAX))
+    return 0 if missing == 0 and bogus == 0 else 1
+
+
+def monitor(port, baud, report):
+    import serial  # pyserial, only needed for --serial
+
+    decoder = ArLinkDecoder()
+    with serial.Serial(port, baud, timeout=0.01) as tty:
+        last_event = last_report = time.monotonic()
+        frames_at_report = 0
+        while True:
+            data = tty.read(4096)
+            now = time.monotonic()
+            for event in decoder.feed(data):
+                print("%8.1f ms  #%-5d %s  t=%dus" % ((now - last_event) * 1000, event.seq, describe(event), event.time_us))
+                last_event = now
+            if now - last_report >= report:
+                print("-- %.0f frames/s, %d frames, %d crc errors, %d bad frames, %d gaps, %d resets" %
+                      ((decoder.frames - frames_at_report) / (now - last_report), decoder.frames,
+                       decoder.crc_errors, decoder.bad_frames, decoder.gaps, decoder.resets))
+                last_report, frames_at_report = now, decoder.frames
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    mode = parser.add_mutually_exclusive_group(required=True)
+    mode.add_argument("--serial", help="port of the USB-serial adapter on the AR link TX pin")
+    mode.add_argument("--selftest", type=int, metavar="FRAMES", help="encode/decode FRAMES events on the host")
+    parser.add_argument("--baud", type=int, default=921600)
+    parser.add_argument("--report", type=float, default=5, help="seconds between link stats")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    if args.selftest:
+        sys.exit(selftest(args.selftest, args.seed))
+    try:
+        monitor(args.serial, args.baud, args.report)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
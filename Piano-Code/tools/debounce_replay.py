@@ -0,0 +1,377 @@
+#!/usr/bin/env python3
+"""Replays recorded key bounce through the firmware's debouncer (components/buttons/debounce.c).
+
+The debouncer is compiled from the firmware source with the host C compiler and driven through
+ctypes, so what runs here is the code that runs on the board. A trace is the output of the
+"keytrace" console command: raw key states every 1 ms for 5 s, one line per change.
+
+  python3 debounce_replay.py --serial /dev/ttyUSB0 --save keys.txt   # record (play while it runs)
+  python3 debounce_replay.py keys.txt monitor.log                    # replay saved traces
+  python3 debounce_replay.py keys.txt --scan-ms 5 --holdoff-ms 20 --key-ms 3:30
+  python3 debounce_replay.py --selftest 500                          # synthetic bounce, no hardware
+
+For every key it prints the presses the debouncer reports against the presses a plain
+"changed since the last scan" check would report at the same scan rate, the press latency
+(first scan that read the key closed to note on: 0 unless a re-press came inside the lockout
+after a release) and the longest bounce seen, and suggests a
+PIANO_DEBOUNCE_KEY_MS value for keys that need a longer hold-off than the default.
+"""
+
+import argparse
+import ctypes
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SOURCE = os.path.join(HERE, "..", "components", "buttons", "debounce.c")
+INCLUDE = os.path.join(HERE, "..", "components", "buttons", "include")
+KEYS = 12
+TRACE_LINE = re.compile(r"keytrace (\d+) ([0-9a-fA-F]+)")
+MAX_BOUNCE_MS = 40      # open longer than this is the player lifting the key, not bounce
+
+
+class Debounce(ctypes.Structure):
+    _fields_ = [("state", ctypes.c_uint16), ("locked", ctypes.c_uint16),
+                ("count", ctypes.c_uint16 * 4), ("limit", ctypes.c_uint16 * 4)]
+
+
+def load_library():
+    """Builds debounce.c into a shared library in a temp dir."""
+    cc = os.environ.get("CC", "cc")
+    out = os.path.join(tempfile.mkdtemp(prefix="debounce"), "libdebounce.so")
+    subprocess.run([cc, "-O2", "-shared", "-fPIC", "-I", INCLUDE, SOURCE, "-o", out], check=True)
+    lib = ctypes.CDLL(out)
+    lib.debounce_init.argtypes = [ctypes.POINTER(Debounce), ctypes.c_int]
+    lib.debounce_set_holdoff.argtypes = [ctypes.POINTER(Debounce), ctypes.c_int, ctypes.c_int]
+    lib.debounce_parse_holdoffs.argtypes = [ctypes.POINTER(Debounce), ctypes.c_char_p, ctypes.c_int]
+    lib.debounce_update.argtypes = [ctypes.POINTER(Debounce), ctypes.c_uint16]
+    lib.debounce_update.restype = ctypes.c_uint16
+    return lib
+
+
+def new_debouncer(lib, scan_ms, holdoff_ms, key_ms):
+    d = Debounce()
+    lib.debounce_init(ctypes.byref(d), (holdoff_ms + scan_ms - 1) // scan_ms)
+    if key_ms and lib.debounce_parse_holdoffs(ctypes.byref(d), key_ms.encode(), scan_ms) < 0:
+        sys.exit("bad --key-ms %r, expected key:ms,key:ms" % key_ms)
+    return d
+
+
+def read_traces(paths):
+    """Every keytrace run in the files: lists of (time_us, mask), a new run at each time 0."""
+    traces = []
+    for path in paths:
+        with open(path, errors="replace") as f:
+            for line in f:
+                m = TRACE_LINE.search(line)
+                if not m:
+                    continue
+                t, mask = int(m.group(1)), int(m.group(2), 16)
+                if t == 0 or not traces:
+                    traces.append([])
+                traces[-1].append((t, mask))
+    return [t for t in traces if len(t) > 1]
+
+
+def sample(trace, scan_us, phase_us=0, tail_us=200000):
+    """The raw masks a scan every scan_us would have read."""
+    out = []
+    i = 0
+    t = phase_us
+    end = trace[-1][0] + tail_us
+    while t <= end:
+        while i + 1 < len(trace) and trace[i + 1][0] <= t:
+            i += 1
+        out.append((t, trace[i][1]))
+        t += scan_us
+    return out
+
+
+def replay(lib, trace, scan_ms, holdoff_ms, key_ms, phase_us=0):
+    """Presses per key from the debouncer and from a plain edge check, plus the press latencies
+    (first scan that read the key closed to the note on) of presses that didn't start inside the
+    lockout after a release; those are counted in held."""
+    d = new_debouncer(lib, scan_ms, holdoff_ms, key_ms)
+    presses = [0] * KEYS
+    naive = [0] * KEYS
+    latency = [[] for _ in range(KEYS)]
+    first_closed = [None] * KEYS
+    in_lockout = [False] * KEYS
+    held = 0
+    previous = 0
+    for t, raw in sample(trace, scan_ms * 1000, phase_us):
+        locked = d.locked
+        changed = lib.debounce_update(ctypes.byref(d), raw)
+        for k in range(KEYS):
+            bit = 1 << k
+            if raw & bit and not previous & bit:
+                naive[k] += 1
+            if not raw & bit:
+                first_closed[k] = None
+            elif first_closed[k] is None:
+                first_closed[k] = t
+                in_lockout[k] = bool(locked & bit)
+            if changed & bit and d.state & bit:
+                presses[k] += 1
+                if in_lockout[k]:
+                    held += 1
+                else:
+                    latency[k].append(t - first_closed[k])
+        previous = raw
+    return presses, naive, latency, held
+
+
+def key_edges(trace, key, min_closed_us=0):
+    """(time, closed) edges of one key, dropping closed blips shorter than min_closed_us."""
+    bit = 1 << key
+    edges = []
+    for t, mask in trace:
+        closed = bool(mask & bit)
+        if edges and edges[-1][1] == closed:
+            continue
+        if not closed and len(edges) > 2 and t - edges[-1][0] < min_closed_us and \
+                edges[-1][0] - edges[-2][0] <= MAX_BOUNCE_MS * 1000:
+            edges.pop()    # a blip inside a burst a scan can miss: the open gap before it goes on
+            continue
+        if edges or closed:
+            edges.append((t, closed))
+    return edges
+
+
+def bounce_stats(trace, scan_us=0):
+    """Per key: start times of the physical presses, the longest open gap inside a bounce burst and
+    the longest release burst (first open to last open edge), in us. Closed blips shorter than a
+    scan count as open for the gaps, a scan may not see them."""
+    starts = [[] for _ in range(KEYS)]
+    gaps = [0] * KEYS
+    spans = [0] * KEYS
+    for k in range(KEYS):
+        for min_closed_us, which in ((0, "starts"), (scan_us, "gaps")):
+            opened = None       # last closed -> open edge
+            released = None     # first open edge of the release burst being played
+            for t, closed in key_edges(trace, k, min_closed_us):
+                if closed:
+                    if opened is None or t - opened > MAX_BOUNCE_MS * 1000:
+                        if which == "starts":
+                            starts[k].append(t)
+                    elif which == "gaps":
+                        gaps[k] = max(gaps[k], t - opened)
+                else:
+                    if released is None or t - opened > MAX_BOUNCE_MS * 1000:
+                        released = t
+                    if which == "starts":    # every blip, any of them can be read
+                        spans[k] = max(spans[k], t - released)
+                    opened = t
+    return starts, gaps, spans
+
+
+def suggest(gaps, spans, scan_ms, holdoff_ms):
+    """PIANO_DEBOUNCE_KEY_MS entries for keys whose bounce needs more than the default hold-off."""
+    out = []
+    for k in range(KEYS):
+        # an open gap as long as the hold-off is a release; a release burst has to end within the
+        # release hold-off plus the lockout after it; one scan of margin for the sampling phase
+        need = (max(gaps[k], (spans[k] + 1) // 2) + 999) // 1000 + scan_ms
+        need = (need + scan_ms - 1) // scan_ms * scan_ms
+        if need > holdoff_ms:
+            out.append("%d:%d" % (k, need))
+    return ",".join(out)
+
+
+def analyze(lib, traces, scan_ms, holdoff_ms, key_ms):
+    worst = 0
+    for n, trace in enumerate(traces):
+        starts, gaps, spans = bounce_stats(trace, scan_ms * 1000)
+        physical = [len(s) for s in starts]
+        presses, naive, latency, held = replay(lib, trace, scan_ms, holdoff_ms, key_ms)
+        print("trace %d: %.1f s, %d changes, scan %d ms, hold-off %d ms%s, %d re-presses held by a lockout" %
+              (n + 1, trace[-1][0] / 1e6, len(trace) - 1, scan_ms, holdoff_ms, ", " + key_ms if key_ms else "", held))
+        print("  key  presses  debounced  plain  latency avg/max ms  bounce gap/release ms")
+        for k in range(KEYS):
+            if not physical[k]:
+                continue
+            lat = latency[k]
+            print("  %3d  %7d  %9d  %5d  %8.2f / %-8.2f  %6.1f / %.1f" %
+                  (k, physical[k], presses[k], naive[k], sum(lat) / len(lat) / 1000 if lat else 0,
+                   max(lat) / 1000 if lat else 0, gaps[k] / 1000, spans[k] / 1000))
+            worst = max(worst, abs(presses[k] - physical[k]))
+        hint = suggest(gaps, spans, scan_ms, holdoff_ms)
+        if hint:
+            print("  suggested PIANO_DEBOUNCE_KEY_MS=\"%s\"" % hint)
+    return worst
+
+
+def synthetic_trace(rng, presses, bouncy_keys):
+    """Random overlapping notes and chords with bounce on both edges, 1 ms steps like keytrace."""
+    events = []             # (time_ms, key, closed)
+    free_at = [0] * KEYS    # a key can be pressed again once its release has settled
+    t = 10
+    for _ in range(presses):
+        ready = [k for k in range(KEYS) if free_at[k] <= t]
+        if not ready:
+            t = min(free_at)
+            continue
+        key = rng.choice(ready)
+        gap_ms = 12 if key in bouncy_keys else 3    # longest open gap inside a burst
+        down = t
+        up = down + rng.randint(60, 400)
+        # press: closed, then open glitches; release: open, then closed glitches
+        for at, dwell, glitch, closed in ((down, (1, 3), (1, gap_ms), True), (up, (1, gap_ms), (1, 3), False)):
+            events.append((at, key, closed))
+            for _ in range(rng.randint(0, 3)):
+                at += rng.randint(*dwell)
+                events.append((at, key, not closed))
+                at += rng.randint(*glitch)
+                events.append((at, key, closed))
+        free_at[key] = at + 60
+        t += rng.choice((0, 0, rng.randint(20, 300)))   # chords: several keys in the same ms
+
+    trace = [(0, 0)]
+    mask = 0
+    for at, key, closed in sorted(events):
+        mask = mask | (1 << key) if closed else mask & ~(1 << key)
+        if at * 1000 == trace[-1][0]:
+            trace[-1] = (at * 1000, mask)
+        elif mask != trace[-1][1]:
+            trace.append((at * 1000, mask))
+    return trace
+
+
+def reference_update(d, raw):
+    """Plain per-key version of debounce_update(), one key at a time."""
+    changed = 0
+    for k in range(16):
+        bit = 1 << k
+        limit = sum(((d.limit[b] >> k) & 1) << b for b in range(4))
+        count = sum(((d.count[b] >> k) & 1) << b for b in range(4))
+        down = bool(d.state & bit)
+        locked = bool(d.locked & bit)
+        if bool(raw & bit) == down and not locked:
+            count = 0
+        else:
+            count = (count + 1) & 15
+            if locked:
+                if count == limit:
+                    d.locked &= ~bit
+                    count = 0
+            elif not down or count == limit:
+                changed |= bit
+                count = 0
+                if down:
+                    d.locked |= bit
+        for b in range(4):
+            d.count[b] = d.count[b] & ~bit | ((count >> b) & 1) << k
+    d.state ^= changed
+    return changed
+
+
+def selftest(lib, runs, seed):
+    rng = random.Random(seed)
+    failures = 0
+
+    # the vertical counters against the plain per-key version, random input and hold-offs
+    c, ref = Debounce(), Debounce()
+    lib.debounce_init(ctypes.byref(c), 3)
+    for k in range(16):
+        lib.debounce_set_holdoff(ctypes.byref(c), k, rng.randint(1, 15))
+    ctypes.memmove(ctypes.byref(ref), ctypes.byref(c), ctypes.sizeof(Debounce))
+    for _ in range(runs * 200):
+        raw = rng.getrandbits(16) if rng.random() < 0.2 else c.state ^ (1 << rng.randrange(16)) * (rng.random() < 0.3)
+        if lib.debounce_update(ctypes.byref(c), raw) != reference_update(ref, raw) or bytes(c) != bytes(ref):
+            failures += 1
+            break
+    print("vertical counters vs per-key reference: %d updates, %s" % (runs * 200, "FAIL" if failures else "same"))
+
+    # hold-off strings
+    d = Debounce()
+    lib.debounce_init(ctypes.byref(d), 4)
+    if lib.debounce_parse_holdoffs(ctypes.byref(d), b"3:30,11:7", 5) != 2 or \
+            lib.debounce_parse_holdoffs(ctypes.byref(d), b"3:", 5) != -1 or \
+            lib.debounce_parse_holdoffs(ctypes.byref(d), b"", 5) != 0:
+        print("debounce_parse_holdoffs: FAIL")
+        failures += 1
+
+    # synthetic bounce at several scan rates: one note per press, none extra
+    bouncy = {3, 7}
+    for scan_ms in (1, 2, 5, 10):
+        wrong = extra_plain = held = 0
+        latencies = []
+        for _ in range(max(1, runs // 20)):
+            trace = synthetic_trace(rng, 20, bouncy)
+            starts, gaps, spans = bounce_stats(trace, scan_ms * 1000)
+            physical = [len(s) for s in starts]
+            key_ms = suggest(gaps, spans, scan_ms, 20)
+            presses, naive, latency, h = replay(lib, trace, scan_ms, 20, key_ms, rng.randrange(scan_ms * 1000))
+            held += h
+            wrong += sum(abs(p - q) for p, q in zip(presses, physical))
+            extra_plain += sum(max(0, n - q) for n, q in zip(naive, physical))
+            latencies += sum(latency, [])
+        late = max(latencies) / 1000 if latencies else 0
+        print("scan %2d ms: %d wrong presses, plain edge check %d extra; added press latency max %.1f ms, "
+              "%d re-presses held by a lockout" % (scan_ms, wrong, extra_plain, late, held))
+        if wrong or late:
+            failures += 1
+
+    # throughput of the C update
+    d = Debounce()
+    lib.debounce_init(ctypes.byref(d), 4)
+    start = time.perf_counter()
+    for i in range(100000):
+        lib.debounce_update(ctypes.byref(d), i & 0xFFF)
+    print("%.2f us per update through ctypes (the call, not the handful of AND/XOR)" %
+          ((time.perf_counter() - start) * 10))
+    return 0 if failures == 0 else 1
+
+
+def record(port, path):
+    import serial  # pyserial, only needed for --serial
+
+    lines = []
+    with serial.Serial(port, 115200, timeout=0.5) as tty:
+        tty.reset_input_buffer()
+        tty.write(b"keytrace\n")
+        print("recording 5 s, play now")
+        deadline = time.monotonic() + 15
+        while time.monotonic() < deadline:
+            line = tty.readline().decode(errors="replace").strip()
+            if line.startswith("keytrace end"):
+                break
+            if TRACE_LINE.search(line):
+                lines.append(line)
+    with open(path, "w") as f:
+        f.write("\n".join(lines) + "\n")
+    print("%d changes saved to %s" % (len(lines) - 1, path))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("traces", nargs="*", help="files with keytrace lines (monitor logs work)")
+    parser.add_argument("--serial", help="board console port, records one keytrace first")
+    parser.add_argument("--save", default="keytrace.txt", help="where --serial writes the trace")
+    parser.add_argument("--selftest", type=int, metavar="RUNS", help="synthetic bounce and a fuzz test, no hardware")
+    parser.add_argument("--scan-ms", type=int, default=5, help="PIANO_KEY_SCAN_MS")
+    parser.add_argument("--holdoff-ms", type=int, default=20, help="PIANO_DEBOUNCE_RELEASE_MS")
+    parser.add_argument("--key-ms", default="", help="PIANO_DEBOUNCE_KEY_MS")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    lib = load_library()
+    if args.selftest:
+        sys.exit(selftest(lib, args.selftest, args.seed))
+    paths = list(args.traces)
+    if args.serial:
+        record(args.serial, args.save)
+        paths.append(args.save)
+    traces = read_traces(paths)
+    if not traces:
+        sys.exit("no keytrace lines found")
+    sys.exit(1 if analyze(lib, traces, args.scan_ms, args.holdoff_ms, args.key_ms) else 0)
+
+
+if __name__ == "__main__":
+    main()
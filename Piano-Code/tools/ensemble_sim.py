@@ -0,0 +1,283 @@
+#!/usr/bin/env python3
+"""Simulates an ensemble of N pianos (components/ensemble) and reports sync error and merge order.
+
+The firmware's clock_est.c and timeline.c are built for this computer and loaded with ctypes, so
+what runs here is the code that runs on the boards. Around them the tool plays the room: every
+piano's crystal off by up to --drift-ppm, every clock started at another time, WiFi delays with
+a floor, a tail and bursts (retries, a busy access point), datagrams lost. Node 1 is the leader.
+
+Followers ping every 500 ms as the firmware does and drop answers later than 100 ms. The true
+error is each follower's shared clock minus the leader's at the same instant, sampled every 50 ms
+once --warmup has passed; the firmware only sees its fit error and rtt/2, printed next to it.
+Every piano plays keys at random; their events reach the leader over the same network and go
+through the merge window. The merged timeline is checked against the order they were played in.
+
+  python3 ensemble_sim.py --nodes 6 --duration 600
+  python3 ensemble_sim.py --nodes 4 --burst 0.2 --loss 0.1      # a bad access point
+  python3 ensemble_sim.py --selftest                            # pass/fail, for CI
+"""
+
+import argparse
+import ctypes
+import heapq
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+COMPONENT = os.path.join(HERE, "..", "components", "ensemble")
+INCLUDE = os.path.join(COMPONENT, "include")
+SOURCES = [os.path.join(COMPONENT, "clock_est.c"), os.path.join(COMPONENT, "timeline.c")]
+
+# must match components/ensemble/include/ensemble.h and clock_est.h
+PERIOD_US = 500000
+PONG_WAIT_US = 100000
+CLOCK_EST_SAMPLES = 32
+CLOCK_EST_BLOCKS = 16
+TIMELINE_NAME_MAX = 12
+
+
+class ClockSample(ctypes.Structure):
+    _fields_ = [("local_us", ctypes.c_int64), ("offset_us", ctypes.c_int64), ("rtt_us", ctypes.c_int32)]
+
+
+class ClockEst(ctypes.Structure):
+    _fields_ = [("samples", ClockSample * CLOCK_EST_SAMPLES), ("count", ctypes.c_int), ("next", ctypes.c_int),
+                ("blocks", ClockSample * CLOCK_EST_BLOCKS), ("block_count", ctypes.c_int),
+                ("block_next", ctypes.c_int), ("block_start_us", ctypes.c_int64),
+                ("ref_us", ctypes.c_int64), ("offset_us", ctypes.c_double), ("drift", ctypes.c_double),
+                ("rtt_min_us", ctypes.c_int32), ("error_us", ctypes.c_int32), ("used", ctypes.c_int),
+                ("steps", ctypes.c_uint32), ("valid", ctypes.c_bool)]
+
+
+class TimelineEvent(ctypes.Structure):
+    _fields_ = [("shared_us", ctypes.c_int64), ("value", ctypes.c_int32), ("node", ctypes.c_uint8),
+                ("is_str", ctypes.c_bool), ("event", ctypes.c_char * TIMELINE_NAME_MAX),
+                ("str", ctypes.c_char * TIMELINE_NAME_MAX)]
+
+
+class Timeline(ctypes.Structure):
+    _fields_ = [("events", TimelineEvent * 32), ("count", ctypes.c_int), ("window_us", ctypes.c_int64),
+                ("released_us", ctypes.c_int64), ("merged", ctypes.c_uint32), ("late", ctypes.c_uint32),
+                ("dropped", ctypes.c_uint32)]
+
+
+def build():
+    out = os.path.join(tempfile.mkdtemp(), "ensemble.so")
+    cc = os.environ.get("CC", "cc")
+    subprocess.run([cc, "-O2", "-shared", "-fPIC", "-I", INCLUDE] + SOURCES + ["-lm", "-o", out], check=True)
+    lib = ctypes.CDLL(out)
+    lib.clock_est_init.argtypes = [ctypes.POINTER(ClockEst)]
+    lib.clock_est_add.argtypes = [ctypes.POINTER(ClockEst)] + [ctypes.c_int64] * 4
+    lib.clock_est_add.restype = ctypes.c_bool
+    lib.clock_est_to_shared.argtypes = [ctypes.POINTER(ClockEst), ctypes.c_int64]
+    lib.clock_est_to_shared.restype = ctypes.c_int64
+    lib.timeline_init.argtypes = [ctypes.POINTER(Timeline), ctypes.c_int64]
+    lib.timeline_add.argtypes = [ctypes.POINTER(Timeline), ctypes.POINTER(TimelineEvent)]
+    lib.timeline_add.restype = ctypes.c_bool
+    lib.timeline_pop.argtypes = [ctypes.POINTER(Timeline), ctypes.c_int64, ctypes.POINTER(TimelineEvent)]
+    lib.timeline_pop.restype = ctypes.c_bool
+    return lib
+
+
+class Clock:
+    """a board's esp_timer: started at its own moment, running off by its crystal"""
+
+    def __init__(self, rng, drift_ppm):
+        self.start = rng.uniform(1e6, 60e6)
+        self.drift = rng.uniform(-drift_ppm, drift_ppm) * 1e-6
+
+    def at(self, t):
+        return int(self.start + t * (1 + self.drift))
+
+
+class Network:
+    def __init__(self, rng, args):
+        self.rng = rng
+        self.args = args
+
+    def delay(self):
+        """one way in us, None when lost"""
+        a = self.args
+        if self.rng.random() < a.loss:
+            return None
+        d = a.floor_ms * 1000 + self.rng.expovariate(1.0 / (a.jitter_ms * 1000))
+        if self.rng.random() < a.burst:
+            d += self.rng.uniform(10000, a.burst_ms * 1000)
+        return d
+
+
+def percentile(values, p):
+    if not values:
+        return 0
+    s = sorted(values)
+    return s[min(len(s) - 1, int(p / 100.0 * len(s)))]
+
+
+PING, PONG, SAMPLE, KEY, ARRIVE, RESTART = range(6)
+
+
+def simulate(lib, args, out=sys.stdout):
+    rng = random.Random(args.seed)
+    net = Network(rng, args)
+    n = args.nodes
+    clocks = [None] + [Clock(rng, args.drift_ppm) for _ in range(n)]
+    leader = clocks[1]
+    ests = [None] + [ClockEst() for _ in range(n)]
+    for i in range(2, n + 1):
+        lib.clock_est_init(ctypes.byref(ests[i]))
+
+    end = int(args.duration * 1e6)
+    warmup = int(args.warmup * 1e6)
+    errors = {i: [] for i in range(2, n + 1)}
+    pongs = {i: 0 for i in range(2, n + 1)}
+
+    window = args.window_ms * 1000
+    timeline = Timeline()
+    lib.timeline_init(ctypes.byref(timeline), window)
+    merged = []
+    played_at = []
+    lost_events = 0
+    ev = TimelineEvent()
+
+    def release(now_true):
+        while lib.timeline_pop(ctypes.byref(timeline), leader.at(now_true), ctypes.byref(ev)):
+            merged.append(ev.value)
+
+    # one queue of everything that happens, in true time
+    queue = [(0, SAMPLE, 0, None)]
+    for i in range(2, n + 1):
+        queue.append((rng.uniform(0, PERIOD_US), PING, i, None))
+    for i in range(1, n + 1):
+        queue.append((warmup + rng.expovariate(args.rate) * 1e6, KEY, i, None))
+    if args.restart_at:
+        queue.append((args.restart_at * 1e6, RESTART, 1, None))
+    heapq.heapify(queue)
+
+    while queue:
+        t, kind, i, data = heapq.heappop(queue)
+        if t >= end and kind != ARRIVE:
+            continue
+        if kind == PING:
+            heapq.heappush(queue, (t + PERIOD_US, PING, i, None))
+            d1, d2 = net.delay(), net.delay()
+            if d1 is None or d2 is None:
+                continue
+            # the leader reads the ping when its task runs and answers right away
+            t2 = t + d1 + rng.expovariate(1 / 200.0)
+            t3 = t2 + 50
+            t4 = t3 + d2
+            if t4 - t > PONG_WAIT_US:
+                continue
+            heapq.heappush(queue, (t4, PONG, i, (clocks[i].at(t), leader.at(t2), leader.at(t3))))
+        elif kind == PONG:
+            t1, t2, t3 = data
+            lib.clock_est_add(ctypes.byref(ests[i]), t1, t2, t3, clocks[i].at(t))
+            pongs[i] += 1
+        elif kind == SAMPLE:
+            heapq.heappush(queue, (t + 50000, SAMPLE, 0, None))
+            if t >= warmup:
+                for j in range(2, n + 1):
+                    if ests[j].valid:
+                        errors[j].append(lib.clock_est_to_shared(ctypes.byref(ests[j]), clocks[j].at(t)) - leader.at(t))
+        elif kind == RESTART:
+            leader.start -= 5e6             # the leader rebooted: its esp_timer starts over
+        elif kind == KEY:
+            heapq.heappush(queue, (t + rng.expovariate(args.rate) * 1e6, KEY, i, None))
+            shared = clocks[i].at(t) if i == 1 else lib.clock_est_to_shared(ctypes.byref(ests[i]), clocks[i].at(t))
+            # SSE_task picks it up, then WiFi; the leader's own events skip the network
+            d = 0 if i == 1 else net.delay()
+            played_at.append(t)
+            if d is None:
+                lost_events += 1
+            else:
+                heapq.heappush(queue, (t + rng.uniform(100, 1500) + d, ARRIVE, i, (len(played_at) - 1, shared)))
+        elif kind == ARRIVE:
+            release(t)
+            index, shared = data
+            e = TimelineEvent(shared_us=shared, value=index, node=i, is_str=False, event=b"note_on")
+            lib.timeline_add(ctypes.byref(timeline), ctypes.byref(e))
+    release(float(end) * 10)
+
+    print("sync, %d pianos, %.0f s, crystals within %d ppm, delay %.1f ms + %.1f ms mean tail, "
+          "%.0f%% bursts to %d ms, %.0f%% lost each way"
+          % (n, args.duration, args.drift_ppm, args.floor_ms, args.jitter_ms, 100 * args.burst, args.burst_ms,
+             100 * args.loss), file=out)
+    print("  node  drift ppm  est ppm  |error| p50     p99     max us  fit error us  rtt/2 us  pongs  steps", file=out)
+    worst_p99 = 0
+    for i in range(2, n + 1):
+        e = ests[i]
+        abs_err = [abs(x) for x in errors[i]]
+        p99 = percentile(abs_err, 99)
+        worst_p99 = max(worst_p99, p99)
+        print("  %4d  %9.2f  %7.2f  %11d  %6d  %9d  %12d  %8d  %5d  %5d"
+              % (i, ((1 + leader.drift) / (1 + clocks[i].drift) - 1) * 1e6, e.drift * 1e6,
+                 percentile(abs_err, 50), p99, max(abs_err, default=0), e.error_us, e.rtt_min_us // 2,
+                 pongs[i], e.steps), file=out)
+
+    times = [played_at[v] for v in merged]
+    swaps = [a - b for a, b in zip(times, times[1:]) if b < a]
+    print("merge, %d ms window, %.1f keys/s per piano: %d played, %d lost on the way, %d merged, %d late, "
+          "%d dropped" % (args.window_ms, args.rate, len(played_at), lost_events, timeline.merged, timeline.late,
+                          timeline.dropped), file=out)
+    print("  next to each other out of the order played: %d, the farthest apart %.2f ms"
+          % (len(swaps), max(swaps, default=0) / 1000.0), file=out)
+    return worst_p99, timeline, len(swaps), max(swaps, default=0)
+
+
+def selftest(lib):
+    failures = []
+    base = dict(nodes=6, duration=300, warmup=10, drift_ppm=40, floor_ms=1.5, jitter_ms=2, burst=0.05,
+                burst_ms=80, loss=0.02, rate=3, window_ms=150, seed=1, restart_at=0)
+
+    p99, timeline, swaps, gap = simulate(lib, argparse.Namespace(**base))
+    if p99 > 1000:
+        failures.append("sync p99 %d us over 1 ms" % p99)
+    if timeline.dropped:
+        failures.append("%d events dropped by the timeline" % timeline.dropped)
+    if timeline.late > timeline.merged // 100:
+        failures.append("%d late of %d merged" % (timeline.late, timeline.merged))
+    if gap > 2 * 1000 + 2 * p99:
+        failures.append("events %.2f ms apart swapped" % (gap / 1000.0))
+
+    # the leader reboots halfway: the followers must notice the step and converge again within 20 s
+    print()
+    restarted = argparse.Namespace(**dict(base, nodes=3, restart_at=150, warmup=170))
+    p99_after, _, _, _ = simulate(lib, restarted)
+    if p99_after > 1000:
+        failures.append("after the leader restarted, sync p99 %d us" % p99_after)
+
+    for f in failures:
+        print("FAIL:", f)
+    print("OK" if not failures else "FAILED")
+    return 1 if failures else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--nodes", type=int, default=4, help="pianos, node 1 leads")
+    parser.add_argument("--duration", type=float, default=300, help="seconds")
+    parser.add_argument("--warmup", type=float, default=10, help="seconds before errors count")
+    parser.add_argument("--drift-ppm", type=float, default=40)
+    parser.add_argument("--floor-ms", type=float, default=1.5, help="fastest one-way WiFi delay")
+    parser.add_argument("--jitter-ms", type=float, default=2, help="mean of the exponential tail")
+    parser.add_argument("--burst", type=float, default=0.05, help="share of datagrams held up")
+    parser.add_argument("--burst-ms", type=int, default=80, help="longest hold-up")
+    parser.add_argument("--loss", type=float, default=0.02, help="share lost, each way")
+    parser.add_argument("--rate", type=float, default=3, help="keys per second per piano")
+    parser.add_argument("--window-ms", type=int, default=150, help="PIANO_ENSEMBLE_WINDOW_MS")
+    parser.add_argument("--restart-at", type=float, default=0, help="leader reboots at this second")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--selftest", action="store_true")
+    args = parser.parse_args()
+
+    lib = build()
+    if args.selftest:
+        sys.exit(selftest(lib))
+    simulate(lib, args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+"""Scrapes the piano's latency histograms and prints p50/p90/p99 per stage.
+
+Reads the Prometheus text from GET /metrics (Piano-Code) or from the "metrics" console command
+(both firmwares, needs pyserial). Percentiles are interpolated inside the buckets like
+Prometheus' histogram_quantile(). With --csv every scrape appends one row per histogram,
+labelled with the firmware version from piano_build_info, to compare builds over time.
+
+  python3 metrics_scrape.py --url http://192.168.1.42/metrics --every 10 --csv latency.csv
+  python3 metrics_scrape.py --serial /dev/ttyUSB0
+"""
+
+import argparse
+import csv
+import os
+import re
+import time
+import urllib.request
+
+LINE = re.compile(r'^([a-zA-Z_:][a-zA-Z0-9_:]*)(?:\{(.*)\})?\s+(\S+)$')
+LABEL = re.compile(r'(\w+)="([^"]*)"')
+
+
+def parse(text):
+    """{histogram name: {"buckets": [(le, cumulative)], "sum": s, "count": n}}, build info labels"""
+    histograms = {}
+    build = {}
+    for line in text.splitlines():
+        m = LINE.match(line.strip())
+        if not m or line.startswith("#"):
+            continue
+        name, labels, value = m.group(1), dict(LABEL.findall(m.group(2) or "")), float(m.group(3))
+        if name == "piano_build_info":
+            build = labels
+        elif name.endswith("_bucket"):
+            h = histograms.setdefault(name[:-7], {"buckets": [], "sum": 0.0, "count": 0})
+            le = float("inf") if labels["le"] == "+Inf" else float(labels["le"])
+            h["buckets"].append((le, value))
+        elif name.endswith("_sum") and name[:-4] in histograms:
+            histograms[name[:-4]]["sum"] = value
+        elif name.endswith("_count") and name[:-6] in histograms:
+            histograms[name[:-6]]["count"] = value
+    return histograms, build
+
+
+def quantile(q, buckets):
+    buckets = sorted(buckets)
+    total = buckets[-1][1] if buckets else 0
+    if total == 0:
+        return float("nan")
+    rank = q * total
+    lower, below = 0.0, 0.0
+    for le, cumulative in buckets:
+        if cumulative >= rank:
+            if le == float("inf"):
+                return lower  # Prometheus answers with the highest finite bound
+            return lower + (le - lower) * (rank - below) / max(cumulative - below, 1)
+        lower, below = le, cumulative
+    return lower
+
+
+def delta(now, before):
+    # latencies since the previous scrape; a reboot resets the counters, then take them as they are
+    if before is None or now["count"] < before["count"]:
+        return now
+    old = dict(before["buckets"])
+    return {"buckets": [(le, c - old.get(le, 0)) for le, c in now["buckets"]],
+            "sum": now["sum"] - before["sum"], "count": now["count"] - before["count"]}
+
+
+def scrape_http(url, timeout):
+    with urllib.request.urlopen(url, timeout=timeout) as response:
+        return response.read().decode()
+
+
+def scrape_serial(port, timeout):
+    import serial  # pyserial, only needed for --serial
+
+    with serial.Serial(port, 115200, timeout=0.5) as tty:
+        tty.reset_input_buffer()
+        tty.write(b"metrics\n")
+        text, end = b"", time.monotonic() + timeout
+        while time.monotonic() < end:
+            data = tty.read(4096)
+            text += data
+            # done once the board went quiet after a _count line
+            if not data and re.search(rb"_count \d+", text):
+                break
+        return text.decode(errors="replace")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument("--url", help="e.g. http://192.168.1.42/metrics")
+    source.add_argument("--serial", help="console port, e.g. /dev/ttyUSB0 or COM5")
+    parser.add_argument("--every", type=float, default=0, help="seconds between scrapes, 0 = once")
+    parser.add_argument("--count", type=int, default=0, help="stop after this many scrapes (0 = forever)")
+    parser.add_argument("--timeout", type=float, default=5)
+    parser.add_argument("--csv", help="append one row per histogram and scrape")
+    parser.add_argument("--total", action="store_true", help="percentiles since boot, not since the last scrape")
+    args = parser.parse_args()
+
+    previous = {}
+    scrapes = 0
+    while True:
+        text = scrape_http(args.url, args.timeout) if args.url else scrape_serial(args.serial, args.timeout)
+        histograms, build = parse(text)
+        version = build.get("version", "?")
+        stamp = time.strftime("%Y-%m-%d %H:%M:%S")
+
+        print("%s  firmware %s" % (stamp, version))
+        rows = []
+        for name, h in sorted(histograms.items()):
+            window = h if args.total or not args.every else delta(h, previous.get(name))
+            previous[name] = h
+            n = int(window["count"])
+            p = [quantile(q, window["buckets"]) * 1000 for q in (0.5, 0.9, 0.99)]
+            avg = window["sum"] / n * 1000 if n else float("nan")
+            print("  %-34s n=%-7d avg %8.2f  p50 %8.2f  p90 %8.2f  p99 %8.2f ms" % (name, n, avg, *p))
+            rows.append([stamp, version, name, n, "%.3f" % avg] + ["%.3f" % v for v in p])
+
+        if args.csv:
+            new = not os.path.exists(args.csv)
+            with open(args.csv, "a", newline="") as f:
+                out = csv.writer(f)
+                if new:
+                    out.writerow(["time", "version", "histogram", "count", "avg_ms", "p50_ms", "p90_ms", "p99_ms"])
+                out.writerows(rows)
+
+        scrapes += 1
+        if not args.every or (args.count and scrapes >= args.count):
+            break
+        time.sleep(args.every)
+
+
+if __name__ == "__main__":
+    main()
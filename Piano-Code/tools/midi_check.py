@@ -0,0 +1,234 @@
+#!/usr/bin/env python3
+"""Checks the piano's MIDI out (components/midi_out) byte for byte.
+
+The firmware sends Note On for a key press, Note On with velocity 0 for a release and pitch bend
+for the potentiometer, leaving out the status byte when it repeats the previous one (running
+status). This tool parses such a stream the way a synth does and flags what a synth would get
+wrong: data bytes with no status before them, notes released that were never pressed and notes
+still held at the end.
+
+  python3 midi_check.py --selftest 2000                        # random chord bursts, no hardware
+  python3 midi_check.py --serial /dev/ttyUSB1 --baud 31250 --console /dev/ttyUSB0
+
+--serial needs the MIDI TX pin on a USB-serial adapter that does 31250 baud (FTDI and CP2102 do;
+or set PIANO_MIDI_OUT_BAUD to 115200 for the test). With --console the tool types "midi" on the
+board's console, captures what comes back on the MIDI port and compares it with the 8 bursts the
+command sends: 12 note-ons, bend up, 12 note-offs, bend back. It also reports how long a burst
+took, which should be the byte count at the line rate (56 bytes = 17.9 ms at 31250 baud).
+"""
+
+import argparse
+import collections
+import random
+import sys
+import time
+
+NOTE_OFF, NOTE_ON, POLY_PRESSURE, CONTROL, PROGRAM, PRESSURE, PITCH_BEND = range(0x80, 0xF0, 0x10)
+DATA_BYTES = {NOTE_OFF: 2, NOTE_ON: 2, POLY_PRESSURE: 2, CONTROL: 2, PROGRAM: 1, PRESSURE: 1, PITCH_BEND: 2}
+
+# must match components/midi_out/include/midi_out.h
+FIRST_NOTE = 60
+VELOCITY = 100
+BEND_CENTER = 8192
+TEST_BURSTS = 8
+
+Message = collections.namedtuple("Message", "kind channel data1 data2")
+
+
+class MidiParser:
+    """Feed it bytes, get complete channel messages; running status handled like a receiver does."""
+
+    def __init__(self):
+        self.status = 0
+        self.data = []
+        self.orphans = 0        # data bytes with no status to apply them to
+        self.realtime = 0       # 0xF8-0xFF, allowed anywhere
+
+    def feed(self, data):
+        messages = []
+        for byte in data:
+            if byte >= 0xF8:
+                self.realtime += 1
+            elif byte >= 0xF0:
+                self.status = 0     # system common cancels running status
+                self.data = []
+            elif byte & 0x80:
+                self.status = byte
+                self.data = []
+            elif not self.status:
+                self.orphans += 1
+            else:
+                self.data.append(byte)
+                kind = self.status & 0xF0
+                if len(self.data) == DATA_BYTES[kind]:
+                    messages.append(Message(kind, self.status & 0x0F, self.data[0],
+                                            self.data[1] if len(self.data) > 1 else 0))
+                    self.data = []
+        return messages
+
+
+class NoteChecker:
+    """Tracks held notes: every Note On must be released exactly once."""
+
+    def __init__(self):
+        self.held = set()
+        self.stray_offs = 0
+        self.double_ons = 0
+
+    def apply(self, message):
+        key = (message.channel, message.data1)
+        if message.kind == NOTE_ON and message.data2 > 0:
+            if key in self.held:
+                self.double_ons += 1
+            self.held.add(key)
+        elif message.kind in (NOTE_ON, NOTE_OFF):
+            if key not in self.held:
+                self.stray_offs += 1
+            self.held.discard(key)
+
+
+def encode(messages):
+    """The firmware's encoder: status only when it changes."""
+    out = bytearray()
+    status = 0
+    for m in messages:
+        if m.kind | m.channel != status:
+            status = m.kind | m.channel
+            out.append(status)
+        out.append(m.data1 & 0x7F)
+        if DATA_BYTES[m.kind] == 2:
+            out.append(m.data2 & 0x7F)
+    return bytes(out)
+
+
+def bend(channel, value):
+    return Message(PITCH_BEND, channel, value & 0x7F, value >> 7)
+
+
+def test_messages(channel):
+    """What the "midi" console command sends."""
+    burst = [Message(NOTE_ON, channel, FIRST_NOTE + k, VELOCITY) for k in range(12)]
+    burst.append(bend(channel, 0x3FFF))
+    burst += [Message(NOTE_ON, channel, FIRST_NOTE + k, 0) for k in range(12)]
+    burst.append(bend(channel, BEND_CENTER))
+    return burst * TEST_BURSTS
+
+
+def check(data, expected=None):
+    """Parses data, returns a list of problems (empty when the stream is good)."""
+    parser = MidiParser()
+    notes = NoteChecker()
+    messages = parser.feed(data)
+    for m in messages:
+        notes.apply(m)
+
+    problems = []
+    if parser.orphans:
+        problems.append("%d data bytes without a status" % parser.orphans)
+    if parser.data:
+        problems.append("stream ends inside a message")
+    if notes.stray_offs:
+        problems.append("%d note offs for notes that weren't on" % notes.stray_offs)
+    if notes.double_ons:
+        problems.append("%d note ons for notes already on" % notes.double_ons)
+    if notes.held:
+        problems.append("%d notes still held: %s" % (len(notes.held), sorted(n for _, n in notes.held)))
+    if expected is not None and messages != expected:
+        first = next((i for i, (a, b) in enumerate(zip(messages, expected)) if a != b), min(len(messages), len(expected)))
+        problems.append("message %d differs: got %d messages, expected %d" % (first, len(messages), len(expected)))
+    return problems
+
+
+def selftest(bursts, seed):
+    rng = random.Random(seed)
+    failures = 0
+    sent_bytes = plain_bytes = 0
+    for _ in range(bursts):
+        channel = rng.randrange(16)
+        keys = rng.sample(range(12), rng.randint(1, 12))
+        messages = [Message(NOTE_ON, channel, FIRST_NOTE + k, VELOCITY) for k in keys]
+        if rng.random() < 0.5:
+            messages.append(bend(channel, rng.randrange(0x4000)))
+        rng.shuffle(keys)
+        messages += [Message(NOTE_ON, channel, FIRST_NOTE + k, 0) for k in keys]
+        messages.append(bend(channel, BEND_CENTER))
+
+        data = encode(messages)
+        sent_bytes += len(data)
+        plain_bytes += 3 * len(messages)
+        if check(data, messages):
+            failures += 1
+
+    # the console command's stream, and that the checker catches a broken one
+    expected = test_messages(0)
+    data = encode(expected)
+    if check(data, expected):
+        failures += 1
+    if not check(data[1:], expected) or not check(data[:-10]):
+        print("checker missed a broken stream")
+        failures += 1
+
+    print("%d random chord bursts, %d failed" % (bursts, failures))
+    print("running status: %d bytes instead of %d (%.0f%% less, %.2f ms per 12 key chord at 31250 baud)" %
+          (sent_bytes, plain_bytes, 100 - 100 * sent_bytes / plain_bytes, (1 + 24) * 0.32))
+    print("console test: %d bytes, %d per burst" % (len(data), len(data) // TEST_BURSTS))
+    return 0 if failures == 0 else 1
+
+
+def loopback(port, baud, console, channel, timeout):
+    import serial  # pyserial, only needed for --serial
+
+    expected = test_messages(channel - 1)
+    expected_bytes = encode(expected)
+    with serial.Serial(port, baud, timeout=0.005) as midi:
+        midi.reset_input_buffer()
+        if console:
+            with serial.Serial(console, 115200, timeout=0.1) as tty:
+                tty.write(b"midi\n")
+        else:
+            print("send \"midi\" on the board's console now")
+
+        data = bytearray()
+        arrivals = []           # (time, bytes so far) for the burst timing
+        deadline = time.monotonic() + timeout
+        while len(data) < len(expected_bytes) and time.monotonic() < deadline:
+            chunk = midi.read(256)
+            if chunk:
+                data += chunk
+                arrivals.append((time.monotonic(), len(data)))
+
+    problems = check(bytes(data), expected)
+    if bytes(data) != expected_bytes and not problems:
+        problems.append("same messages but different bytes (running status not used the same way)")
+    print("received %d bytes, expected %d" % (len(data), len(expected_bytes)))
+    if len(arrivals) > 1:
+        elapsed = arrivals[-1][0] - arrivals[0][0]
+        wire = 10.0 / baud * (arrivals[-1][1] - arrivals[0][1])
+        print("%.1f ms from first to last byte, %.1f ms on the wire; the rest is the gap between bursts "
+              "and the adapter's latency timer" % (elapsed * 1000, wire * 1000))
+    for problem in problems:
+        print("FAIL:", problem)
+    if not problems:
+        print("OK")
+    return 0 if not problems else 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    mode = parser.add_mutually_exclusive_group(required=True)
+    mode.add_argument("--serial", help="port of the USB-serial adapter on the MIDI TX pin")
+    mode.add_argument("--selftest", type=int, metavar="BURSTS", help="encode and check BURSTS random chords on the host")
+    parser.add_argument("--baud", type=int, default=31250)
+    parser.add_argument("--console", help="the board's console port, to start the test from here")
+    parser.add_argument("--channel", type=int, default=1, help="PIANO_MIDI_OUT_CHANNEL")
+    parser.add_argument("--timeout", type=float, default=5)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    if args.selftest:
+        sys.exit(selftest(args.selftest, args.seed))
+    sys.exit(loopback(args.serial, args.baud, args.console, args.channel, args.timeout))
+
+
+if __name__ == "__main__":
+    main()
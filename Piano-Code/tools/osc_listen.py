@@ -0,0 +1,368 @@
+#!/usr/bin/env python3
+"""Receives the piano's OSC note events (components/osc_out) and reports loss and latency.
+
+The firmware sends every SSE event again as one UDP datagram, to a multicast group by default:
+"/piano/<event>" with the value, a sequence number, the device time of the key change, the
+device time it was sent and the node. A gap in the sequence is a lost datagram; one that comes
+back after a higher number is reordered. Every piano on the group is counted on its own, and so
+is an ensemble leader's merged timeline ("/ensemble/<event>", PIANO_ENSEMBLE): there the times are
+on the shared clock and an event older than the one before it is out of order. --timeline prints
+the merged events as they come.
+
+Latency without a shared clock: the tool reports
+  - queue: key change to send, both on the device clock (Buttons_task -> SSE_task -> lwIP);
+  - network: arrival minus send time, less the smallest of the run. The constant clock offset
+    and the fastest path cancel out, what is left is the delay above the best case;
+  - with --sse, how much later the same event arrived over SSE than over OSC, both on this
+    computer's clock.
+
+--clients and --requesters add the load of tools/sse_load.py at the same time, so the numbers
+show what the TCP clients cost the datagrams. Run the board with PIANO_LATENCY_TEST for a key
+every 150 ms with no hands.
+
+  python3 osc_listen.py --sse --clients 3 --requesters 2 --duration 120
+  python3 osc_listen.py --timeline --duration 600   # an ensemble's merged performance
+  python3 osc_listen.py --selftest 5000          # loopback with made-up losses, no hardware
+
+The board answers as piano.local (PIANO_HOSTNAME); this needs mDNS in the OS (macOS, Windows 10+,
+Linux with nss-mdns), or give --host the IP address.
+"""
+
+import argparse
+import collections
+import random
+import socket
+import struct
+import sys
+import threading
+import time
+
+# must match components/osc_out/include/osc_out.h and Kconfig
+GROUP = "239.255.42.99"
+PORT = 9000
+TAGS = {b",iihhi": "i", b",sihhi": "s"}
+STREAMS = ("piano", "ensemble")
+
+lock = threading.Lock()
+
+
+def osc_string(data, pos):
+    end = data.index(b"\0", pos)
+    return data[pos:end].decode(), (end + 4) & ~3
+
+
+def parse(data):
+    """(stream, event, value, seq, event_us, sent_us, node) of one datagram, None if it isn't ours"""
+    try:
+        address, pos = osc_string(data, 0)
+        tags, pos = osc_string(data, pos)
+        kind = TAGS.get(tags.encode())
+        stream, _, event = address[1:].partition("/")
+        if stream not in STREAMS or not event or kind is None:
+            return None
+        if kind == "s":
+            value, pos = osc_string(data, pos)
+        else:
+            (value,), pos = struct.unpack_from(">i", data, pos), pos + 4
+        seq, event_us, sent_us, node = struct.unpack_from(">Iqqi", data, pos)
+    except (ValueError, struct.error, UnicodeDecodeError):
+        return None
+    return stream, event, value, seq, event_us, sent_us, node
+
+
+def encode(event, value, seq, event_us, sent_us, node=0, stream="piano"):
+    """the firmware's message, for --selftest"""
+    def pad(s):
+        b = s.encode() + b"\0"
+        return b + b"\0" * (-len(b) % 4)
+    if isinstance(value, str):
+        args = pad(value)
+        tags = ",sihhi"
+    else:
+        args = struct.pack(">i", value)
+        tags = ",iihhi"
+    return pad("/%s/%s" % (stream, event)) + pad(tags) + args + struct.pack(">Iqqi", seq, event_us, sent_us, node)
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    s = sorted(values)
+    return s[min(len(s) - 1, int(p / 100.0 * len(s)))]
+
+
+class Stats:
+    def __init__(self, label=""):
+        self.label = label
+        self.received = 0
+        self.lost = 0
+        self.duplicates = 0
+        self.reordered = 0
+        self.restarts = 0
+        self.events = collections.Counter()
+        self.next_seq = None
+        self.missing = set()        # gaps that may still arrive late
+        self.seen = collections.deque(maxlen=256)
+        self.queue_us = []
+        self.transit_us = []        # arrival minus send, with the clock offset still in
+        self.sse_lag_us = []
+        self.nodes = set()
+        self.last_event_us = None
+        self.out_of_order = 0       # merged timeline: older than the event before it
+
+    def add(self, msg, arrival_us):
+        stream, event, value, seq, event_us, sent_us, node = msg
+        self.received += 1
+        self.nodes.add(node)
+        self.events[event] += 1
+        if self.next_seq is not None and seq + 1000 < self.next_seq:
+            # the board restarted, its sequence too
+            self.restarts += 1
+            self.next_seq = None
+            self.missing.clear()
+            self.seen.clear()
+        if seq in self.seen:
+            self.duplicates += 1
+            return
+        self.seen.append(seq)
+        if self.next_seq is None or seq == self.next_seq:
+            self.next_seq = seq + 1
+        elif seq > self.next_seq:
+            self.missing.update(range(self.next_seq, seq))
+            self.lost += seq - self.next_seq
+            self.next_seq = seq + 1
+        elif seq in self.missing:
+            self.missing.discard(seq)
+            self.lost -= 1
+            self.reordered += 1
+        if event_us:
+            if stream == "ensemble":
+                if self.last_event_us is not None and event_us < self.last_event_us:
+                    self.out_of_order += 1
+                self.last_event_us = event_us
+            self.queue_us.append(sent_us - event_us)
+        self.transit_us.append(arrival_us - sent_us)
+
+    def report(self, elapsed, out=sys.stdout):
+        expected = self.received - self.duplicates + self.lost
+        best = min(self.transit_us) if self.transit_us else 0
+        network = [t - best for t in self.transit_us]
+        if self.label:
+            nodes = sorted(self.nodes - {0})
+            print("  %s%s" % (self.label, "  node %s" % ",".join(map(str, nodes)) if nodes else ""), file=out)
+        line = ("%5.0fs  datagrams %d (%.1f/s)  lost %d (%.2f%%)  reordered %d  duplicates %d"
+                % (elapsed, self.received, self.received / max(elapsed, 1e-9), self.lost,
+                   100.0 * self.lost / max(expected, 1), self.reordered, self.duplicates))
+        if self.restarts:
+            line += "  restarts %d" % self.restarts
+        if self.out_of_order:
+            line += "  out of order %d" % self.out_of_order
+        print(line, file=out)
+        # merged: queue = event to the leader sending it on, the merge window included
+        print("        queue p50 %.2f p99 %.2f max %.2f ms   network above best p50 %.2f p99 %.2f max %.2f ms"
+              % (percentile(self.queue_us, 50) / 1000, percentile(self.queue_us, 99) / 1000,
+                 max(self.queue_us, default=0) / 1000, percentile(network, 50) / 1000,
+                 percentile(network, 99) / 1000, max(network, default=0) / 1000), file=out)
+        if self.sse_lag_us:
+            print("        sse later than osc p50 %.2f p99 %.2f max %.2f ms (%d events)"
+                  % (percentile(self.sse_lag_us, 50) / 1000, percentile(self.sse_lag_us, 99) / 1000,
+                     max(self.sse_lag_us) / 1000, len(self.sse_lag_us)), file=out)
+
+
+def now_us():
+    return time.monotonic_ns() // 1000
+
+
+def open_socket(group, port):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(("", port))
+    if group and 224 <= int(group.split(".")[0]) <= 239:
+        mreq = struct.pack("4s4s", socket.inet_aton(group), socket.inet_aton("0.0.0.0"))
+        sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, mreq)
+    sock.settimeout(0.5)
+    return sock
+
+
+class Matcher:
+    """pairs the OSC and SSE copies of an event by "event:value", in arrival order"""
+
+    def __init__(self, stats):
+        self.stats = stats
+        self.osc = collections.defaultdict(collections.deque)
+        self.sse = collections.defaultdict(collections.deque)
+
+    def arrived(self, key, t, mine, other, sign):
+        if other[key]:
+            self.stats.sse_lag_us.append(sign * (t - other[key].popleft()))
+        else:
+            mine[key].append(t)
+            if len(mine[key]) > 64:     # lost on the other side
+                mine[key].popleft()
+
+    def from_osc(self, event, value, t):
+        self.arrived("%s:%s" % (event, value), t, self.osc, self.sse, -1)
+
+    def from_sse(self, key, t):
+        self.arrived(key, t, self.sse, self.osc, 1)
+
+
+def sse_watch(host, port, end, matcher):
+    while time.monotonic() < end:
+        try:
+            with socket.create_connection((host, port), timeout=10) as sock:
+                sock.sendall(b"GET /sse HTTP/1.1\r\nHost: %s\r\nAccept: text/event-stream\r\n\r\n" % host.encode())
+                stream = sock.makefile("rb")
+                joined = False      # the state sent on connect ends with the tempo, it has no OSC copy
+                while time.monotonic() < end:
+                    line = stream.readline()
+                    if not line:
+                        break
+                    t = now_us()
+                    if not joined:
+                        joined = line.startswith(b"data: tempo:")
+                    elif line.startswith(b"data: ") and b":" in line[6:]:
+                        with lock:
+                            matcher.from_sse(line[6:].strip().decode(errors="replace"), t)
+        except OSError:
+            pass
+        time.sleep(1)
+
+
+def listen(sock, end, streams, matcher, interval, start, timeline, board):
+    """streams: Stats per (sender, "piano" or "ensemble"), made as they show up"""
+    next_report = start + interval
+    bad = 0
+    while time.monotonic() < end:
+        try:
+            data, (sender, _) = sock.recvfrom(2048)
+        except socket.timeout:
+            data = None
+        if data is not None:
+            t = now_us()
+            msg = parse(data)
+            if msg is None:
+                bad += 1
+                continue
+            with lock:
+                key = (sender, msg[0])
+                if key not in streams:
+                    streams[key] = Stats("%s from %s" % (msg[0], sender))
+                streams[key].add(msg, t)
+                if matcher is not None and msg[0] == "piano" and sender == board and msg[1] != "alive":
+                    matcher.from_osc(msg[1], msg[2], t)
+            if timeline and msg[0] == "ensemble":
+                print("%14.6f  node %2d  %s:%s" % (msg[4] / 1e6, msg[6], msg[1], msg[2]))
+        if time.monotonic() >= next_report:
+            with lock:
+                for key in sorted(streams):
+                    streams[key].report(time.monotonic() - start)
+            next_report += interval
+    return bad
+
+
+def selftest(count, port):
+    """loopback: the firmware's format with losses, duplicates and swaps the tool must count"""
+    rx = open_socket("", port)
+    tx = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    rng = random.Random(1)
+    stats = Stats()
+    dropped = dup = swapped = 0
+    held = None
+    offset = 5 * 10**9      # the board's clock is nowhere near this one's
+
+    def deliver(packet):
+        tx.sendto(packet, ("127.0.0.1", port))
+        stats.add(parse(rx.recv(2048)), now_us())
+
+    for seq in range(count):
+        event = rng.choice(["note_on", "note_off", "chord", "beat", "alive"])
+        value = "C#m7b5" if event == "chord" else rng.randrange(12)
+        sent_us = now_us() + offset
+        packet = encode(event, value, seq, sent_us - 250 if event != "alive" else 0, sent_us, 3)
+        r = rng.random()
+        if r < 0.02 and seq + 1 < count:
+            dropped += 1
+            continue
+        if r < 0.03 and held is None and seq + 1 < count:
+            held = packet           # goes out after the next one
+            swapped += 1
+            continue
+        deliver(packet)
+        if r > 0.99:
+            deliver(packet)
+            dup += 1
+        if held is not None:
+            deliver(held)
+            held = None
+    stats.report(1)
+    ok = (stats.lost == dropped and stats.duplicates == dup and stats.reordered == swapped
+          and stats.received == count - dropped + dup and set(stats.queue_us) == {250}
+          and stats.nodes == {3}
+          and parse(encode("note_on", 4, 7, 10, 20, 2, "ensemble")) == ("ensemble", "note_on", 4, 7, 10, 20, 2))
+    print("%s: %d datagrams, sent with %d dropped, %d duplicated, %d swapped"
+          % ("OK" if ok else "FAIL", count, dropped, dup, swapped))
+    return 0 if ok else 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--group", default=GROUP, help="multicast group, '' when the board sends to this computer")
+    parser.add_argument("--port", type=int, default=PORT)
+    parser.add_argument("--host", default="piano.local", help="the board, for --sse and the load")
+    parser.add_argument("--http-port", type=int, default=80)
+    parser.add_argument("--sse", action="store_true", help="compare with the same events over SSE")
+    parser.add_argument("--clients", type=int, default=0, help="extra SSE clients, as tools/sse_load.py")
+    parser.add_argument("--requesters", type=int, default=0, help="HTTP request loops, as tools/sse_load.py")
+    parser.add_argument("--duration", type=float, default=60)
+    parser.add_argument("--interval", type=float, default=5)
+    parser.add_argument("--timeline", action="store_true", help="print the ensemble's merged events")
+    parser.add_argument("--selftest", type=int, metavar="N")
+    args = parser.parse_args()
+
+    if args.selftest:
+        sys.exit(selftest(args.selftest, args.port))
+
+    sock = open_socket(args.group, args.port)
+    streams = {}
+    stats = Stats()         # only the board's SSE comparison
+    matcher = Matcher(stats) if args.sse else None
+    host = None
+    start = time.monotonic()
+    end = start + args.duration
+
+    threads = []
+    if args.sse or args.clients or args.requesters:
+        host = socket.gethostbyname(args.host)     # piano.local through the OS's mDNS
+        print("%s is %s" % (args.host, host))
+        if args.sse:
+            threads.append(threading.Thread(target=sse_watch, args=(host, args.http_port, end, matcher), daemon=True))
+        if args.clients or args.requesters:
+            import sse_load
+            threads += [threading.Thread(target=sse_load.sse_client, args=(host, args.http_port, end), daemon=True)
+                        for _ in range(args.clients)]
+            threads += [threading.Thread(target=sse_load.requester, args=(host, args.http_port, end), daemon=True)
+                        for _ in range(args.requesters)]
+    for t in threads:
+        t.start()
+
+    bad = 0
+    try:
+        bad = listen(sock, end, streams, matcher, args.interval, start, args.timeline, host)
+    except KeyboardInterrupt:
+        pass
+    with lock:
+        print("total")
+        for key in sorted(streams):
+            streams[key].report(time.monotonic() - start)
+            print("        " + "  ".join("%s %d" % item for item in sorted(streams[key].events.items())))
+        if stats.sse_lag_us:
+            print("  sse from %s later than osc p50 %.2f p99 %.2f max %.2f ms (%d events)"
+                  % (host, percentile(stats.sse_lag_us, 50) / 1000, percentile(stats.sse_lag_us, 99) / 1000,
+                     max(stats.sse_lag_us) / 1000, len(stats.sse_lag_us)))
+        if bad:
+            print("  %d datagrams that weren't piano OSC" % bad)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""Static RAM report from the linker map: DRAM .data + .bss per component and the largest objects.
+
+Run it on build/Piano.map after `idf.py build`. Several map files, e.g. one build directory per
+configuration (-B build-trace with PIANO_TRACE=y), are printed side by side:
+
+  python3 ram_report.py build/Piano.map
+  python3 ram_report.py build/Piano.map build-trace/Piano.map --top 20
+
+Task stacks, queues and mutexes are static (START_TASK, xQueueCreateStatic...), so they are
+counted here instead of showing up later as heap use.
+"""
+
+import argparse
+import collections
+import os
+import re
+
+# output sections that end up in internal data RAM
+DRAM_SECTIONS = (".dram0.data", ".dram0.bss", ".noinit", ".dram0.noinit")
+
+INPUT = re.compile(r"^\s+(\S+)?\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)\s+(\S+)\s*$")
+ARCHIVE = re.compile(r"(?:^|[/\\])lib([^/\\]+)\.a\(([^)]+)\)$")
+
+
+def component_of(path):
+    m = ARCHIVE.search(path)
+    if m:
+        return m.group(1)
+    return os.path.basename(path)
+
+
+def parse(path):
+    """(bytes per component, bytes per (component, symbol)) in DRAM"""
+    components = collections.Counter()
+    symbols = collections.Counter()
+    output = None
+    pending = None  # input section name on its own line, address/size/object on the next
+    with open(path, errors="replace") as f:
+        for line in f:
+            if line.startswith("."):
+                output = line.split()[0]
+                pending = None
+                continue
+            if output not in DRAM_SECTIONS:
+                continue
+            stripped = line.strip()
+            if re.fullmatch(r"[.*A-Za-z_][^\s]*", stripped) and not stripped.startswith("*("):
+                pending = stripped
+                continue
+            m = INPUT.match(line)
+            if not m:
+                continue
+            section = m.group(1) or pending
+            pending = None
+            size = int(m.group(3), 16)
+            if size == 0 or section is None or section.startswith("*"):
+                continue
+            component = component_of(m.group(4))
+            # .bss.rings -> rings, COMMON -> the object file
+            name = re.sub(r"^\.(dram1?\.|)(bss|data|sbss|sdata|noinit)\.?", "", section) or os.path.basename(m.group(4))
+            components[component] += size
+            symbols[(component, name)] += size
+    return components, symbols
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("maps", nargs="+", help="linker map files (build/Piano.map)")
+    parser.add_argument("--top", type=int, default=10, help="largest objects to list")
+    args = parser.parse_args()
+
+    reports = [parse(m) for m in args.maps]
+    labels = [os.path.basename(os.path.dirname(os.path.abspath(m))) or m for m in args.maps]
+
+    every = collections.Counter()
+    for components, _ in reports:
+        every.update(components)
+    width = max(10, *(len(l) for l in labels))
+
+    print("Static DRAM (.data + .bss) per component, bytes")
+    print("%-24s" % "component" + "".join(" %*s" % (width, l) for l in labels))
+    for component, _ in every.most_common():
+        print("%-24s" % component + "".join(" %*d" % (width, r[0][component]) for r in reports))
+    print("%-24s" % "total" + "".join(" %*d" % (width, sum(r[0].values())) for r in reports))
+
+    for label, (_, symbols) in zip(labels, reports):
+        print("\nLargest objects (%s)" % label)
+        for (component, name), size in symbols.most_common(args.top):
+            print("  %7d  %-16s %s" % (size, component, name))
+
+
+if __name__ == "__main__":
+    main()
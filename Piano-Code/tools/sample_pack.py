@@ -0,0 +1,360 @@
+#!/usr/bin/env python3
+"""Builds the sample pack the firmware plays from the "samples" flash partition (components/sampler).
+
+Every WAV file is a recording of one key, named by the key it was recorded at (C4 .. B4). The
+other keys play the nearest recording, repitched on the board. The recordings are mixed down to
+mono, resampled to --rate, cut to --seconds, normalized together (their relative levels stay)
+and IMA-ADPCM encoded: 4 bits a sample, a quarter of 16 bit PCM. --loop-ms gives every sample a
+sustain loop over its last milliseconds for keys held longer than the recording; without it a
+sample fades out at its end.
+
+  python3 sample_pack.py C4=c4.wav E4=e4.wav G#4=gs4.wav -o samples.bin
+  parttool.py --port /dev/ttyUSB0 write_partition --partition-name samples --input samples.bin
+  python3 sample_pack.py --info samples.bin
+  python3 sample_pack.py --selftest 3                     # synthetic recordings, no WAV files
+
+The pack is decoded back with the firmware's own decoder (components/sampler/sample_voice.c,
+built with the host C compiler and driven through ctypes) to check it bit for bit, and the tool
+reports per sample its size, the ADPCM error (SNR against the PCM it was made from) and the decode
+cost: host nanoseconds per output sample, rendering every key the sample plays at the key's pitch,
+next to the ESP32's budget of 240 MHz / rate cycles per sample.
+"""
+
+import argparse
+import ctypes
+import math
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+import wave
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SOURCE = os.path.join(HERE, "..", "components", "sampler", "sample_voice.c")
+INCLUDE = os.path.join(HERE, "..", "components", "sampler", "include")
+
+# must match components/sampler/include/sample_voice.h
+MAGIC = 0x504D5350
+VERSION = 1
+MAX_SAMPLES = 12
+HEADER = struct.Struct("<IHHII")
+ENTRY = struct.Struct("<BBBBIIIIhH")
+GAIN_ONE = 32768
+
+NOTE_NAMES = ["C4", "C#4", "D4", "D#4", "E4", "F4", "F#4", "G4", "G#4", "A4", "A#4", "B4"]
+CPU_HZ = 240000000
+
+# what the firmware asks for at the pot's lowest position (note_lower[] in main.c)
+KEY_HZ = [261, 269, 285, 302, 320, 339, 359, 380, 403, 428, 453, 480]
+
+STEP_TABLE = [
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767]
+INDEX_TABLE = [-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8]
+
+
+def key_pitch(key):
+    """Equal tempered pitch of key 0..11 (C4 .. B4), A4 = 440 Hz."""
+    return 440.0 * 2 ** ((key - 9) / 12)
+
+
+def decode_step(nibble, predictor, index):
+    """One IMA-ADPCM sample, the same arithmetic as decode() in sample_voice.c."""
+    step = STEP_TABLE[index]
+    diff = step >> 3
+    if nibble & 4:
+        diff += step
+    if nibble & 2:
+        diff += step >> 1
+    if nibble & 1:
+        diff += step >> 2
+    predictor = predictor - diff if nibble & 8 else predictor + diff
+    predictor = max(-32768, min(32767, predictor))
+    index = max(0, min(88, index + INDEX_TABLE[nibble]))
+    return predictor, index
+
+
+def adpcm_encode(pcm):
+    """Nibbles, the decoded samples and the decoder state before every sample."""
+    predictor, index = 0, 0
+    nibbles, decoded, states = [], [], []
+    for s in pcm:
+        states.append((predictor, index))
+        step = STEP_TABLE[index]
+        diff = s - predictor
+        nibble = 0
+        if diff < 0:
+            nibble = 8
+            diff = -diff
+        if diff >= step:
+            nibble |= 4
+            diff -= step
+        step >>= 1
+        if diff >= step:
+            nibble |= 2
+            diff -= step
+        step >>= 1
+        if diff >= step:
+            nibble |= 1
+        # track what the decoder will have, not the input, so the error doesn't build up
+        predictor, index = decode_step(nibble, predictor, index)
+        nibbles.append(nibble)
+        decoded.append(predictor)
+    return nibbles, decoded, states
+
+
+def pack_nibbles(nibbles):
+    data = bytearray((len(nibbles) + 1) // 2)
+    for i, n in enumerate(nibbles):
+        data[i >> 1] |= n << (4 * (i & 1))
+    return bytes(data)
+
+
+def read_wav(path, rate):
+    """Mono float samples at rate, linear interpolation."""
+    with wave.open(path, "rb") as w:
+        channels, width, src_rate = w.getnchannels(), w.getsampwidth(), w.getframerate()
+        raw = w.readframes(w.getnframes())
+    if width == 1:
+        values = [b - 128 for b in raw]
+        scale = 128.0
+    elif width == 2:
+        values = struct.unpack("<%dh" % (len(raw) // 2), raw)
+        scale = 32768.0
+    else:
+        raise SystemExit("%s: only 8 and 16 bit PCM WAV files" % path)
+    mono = [sum(values[i:i + channels]) / (channels * scale) for i in range(0, len(values), channels)]
+    return resample(mono, src_rate, rate)
+
+
+def resample(samples, src_rate, rate):
+    if src_rate == rate or not samples:
+        return list(samples)
+    out = []
+    for i in range(int(len(samples) * rate / src_rate)):
+        x = i * src_rate / rate
+        k = int(x)
+        nxt = samples[k + 1] if k + 1 < len(samples) else samples[k]
+        out.append(samples[k] + (nxt - samples[k]) * (x - k))
+    return out
+
+
+def synth_recording(key, rate, seconds, rng):
+    """Something like a struck string: decaying harmonics with a little noise on the attack."""
+    f = key_pitch(key)
+    out = []
+    for i in range(int(rate * seconds)):
+        t = i / rate
+        s = sum(math.sin(2 * math.pi * f * h * t) * math.exp(-t * (2 + h)) / h for h in range(1, 6))
+        if t < 0.01:
+            s += rng.uniform(-0.3, 0.3) * (1 - t / 0.01)
+        out.append(s * 0.4)
+    return out
+
+
+def key_ranges(roots):
+    """Every key to the nearest root: {root: (first_key, last_key)}."""
+    roots = sorted(roots)
+    owner = {k: min(roots, key=lambda r: (abs(r - k), r)) for k in range(12)}
+    return {r: (min(k for k in owner if owner[k] == r), max(k for k in owner if owner[k] == r)) for r in roots}
+
+
+def prepare(samples, rate, seconds, loop_ms, fade_ms):
+    """Cut, fade or find the loop point, normalize together; {root: (pcm, loop_start)}."""
+    cut = {root: s[:int(rate * seconds)] for root, s in samples.items()}
+    peak = max(max(abs(x) for x in s) for s in cut.values() if s) or 1.0
+    gain = 0.9 / peak
+    out = {}
+    for root, s in cut.items():
+        s = [x * gain for x in s]
+        loop_start = len(s)
+        if loop_ms:
+            # back to where the signal best continues the last sample, near loop_ms before the end
+            target = max(1, len(s) - int(rate * loop_ms / 1000))
+            window = range(max(1, target - rate // 200), min(len(s) - 1, target + rate // 200))
+            loop_start = min(window, key=lambda i: abs(s[i] - s[-1])) if window else target
+        else:
+            n = min(len(s), int(rate * fade_ms / 1000))
+            for i in range(n):
+                s[len(s) - n + i] *= 1 - (i + 1) / n
+        out[root] = ([max(-32768, min(32767, int(round(x * 32767)))) for x in s], loop_start)
+    return out
+
+
+def build(prepared, rate):
+    """The image and, per root, what the firmware decoder must give back."""
+    roots = sorted(prepared)
+    ranges = key_ranges(roots)
+    offset = HEADER.size + ENTRY.size * len(roots)
+    entries, blobs, expected = [], [], {}
+    for root in roots:
+        pcm, loop_start = prepared[root]
+        nibbles, decoded, states = adpcm_encode(pcm)
+        loop_predictor, loop_index = states[loop_start] if loop_start < len(pcm) else (0, 0)
+        data = pack_nibbles(nibbles)
+        first, last = ranges[root]
+        entries.append(ENTRY.pack(first, last, loop_index, 0, int(round(key_pitch(root) * 1000)), offset,
+                                  len(pcm), loop_start, loop_predictor, 0))
+        blobs.append(data + b"\0" * (-len(data) % 4))
+        expected[root] = (pcm, decoded)
+        offset += len(blobs[-1])
+    image = HEADER.pack(MAGIC, VERSION, len(roots), rate, offset) + b"".join(entries) + b"".join(blobs)
+    return image, expected
+
+
+def parse(image):
+    magic, version, count, rate, size = HEADER.unpack_from(image)
+    if magic != MAGIC or version != VERSION:
+        raise SystemExit("not a sample pack (version %d)" % VERSION)
+    entries = [ENTRY.unpack_from(image, HEADER.size + i * ENTRY.size) for i in range(count)]
+    return rate, size, entries
+
+
+class Voice(ctypes.Structure):
+    _fields_ = [("data", ctypes.c_void_p), ("entry", ctypes.c_void_p), ("frame", ctypes.c_uint32),
+                ("predictor", ctypes.c_int32), ("index", ctypes.c_int32), ("prev", ctypes.c_int32),
+                ("cur", ctypes.c_int32), ("phase", ctypes.c_uint32), ("step", ctypes.c_uint32),
+                ("gain", ctypes.c_int32), ("gain_step", ctypes.c_int32)]
+
+
+def load_library():
+    """Builds sample_voice.c into a shared library in a temp dir."""
+    cc = os.environ.get("CC", "cc")
+    out = os.path.join(tempfile.mkdtemp(prefix="sample_voice"), "libsample_voice.so")
+    subprocess.run([cc, "-O2", "-shared", "-fPIC", "-I", INCLUDE, SOURCE, "-o", out], check=True)
+    lib = ctypes.CDLL(out)
+    lib.sample_pack_check.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+    lib.sample_pack_check.restype = ctypes.c_bool
+    lib.sample_pack_find.argtypes = [ctypes.c_void_p, ctypes.c_int]
+    lib.sample_pack_find.restype = ctypes.c_void_p
+    lib.sample_voice_start.argtypes = [ctypes.POINTER(Voice), ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint32, ctypes.c_int]
+    lib.sample_voice_render.argtypes = [ctypes.POINTER(Voice), ctypes.POINTER(ctypes.c_int16), ctypes.c_int]
+    lib.sample_voice_render.restype = ctypes.c_bool
+    return lib
+
+
+def snr_db(reference, decoded):
+    signal = sum(x * x for x in reference)
+    noise = sum((a - b) ** 2 for a, b in zip(reference, decoded))
+    return 10 * math.log10(signal / noise) if noise else float("inf")
+
+
+def check(image, expected, rate, seconds):
+    """Decodes the image with the firmware's code; prints the report, returns the problems."""
+    lib = load_library()
+    buf = ctypes.create_string_buffer(image, len(image))
+    problems = []
+    if not lib.sample_pack_check(buf, len(image)):
+        return ["the firmware rejects the pack"]
+    blank = ctypes.create_string_buffer(b"\xff" * 4096, 4096)
+    if lib.sample_pack_check(blank, 4096):
+        problems.append("the firmware takes blank flash for a pack")
+
+    _, _, entries = parse(image)
+    print("%d samples at %d Hz, %d bytes (16 bit PCM would be %d)" %
+          (len(entries), rate, len(image), sum(e[6] for e in entries) * 2))
+    print("sample  keys      frames   bytes  loop    SNR     ns/sample  ESP32 budget")
+    total_frames = 0
+    total_ns = 0.0
+    for first, last, _, _, root_mhz, offset, frames, loop_start, _, _ in entries:
+        root = round(12 * math.log2(root_mhz / 1000 / 440.0)) + 9
+        pcm, decoded = expected.get(root, (None, None))
+        entry = lib.sample_pack_find(buf, first)
+
+        # bit for bit at the root pitch: output n + 1 is decoded sample n
+        voice = Voice()
+        lib.sample_voice_start(ctypes.byref(voice), buf, entry, 1, 0)
+        voice.step = 0x10000
+        out = (ctypes.c_int16 * frames)()
+        lib.sample_voice_render(ctypes.byref(voice), out, frames)
+        if decoded is not None and list(out[1:frames]) != decoded[:frames - 1]:
+            problems.append("%s decodes differently on the firmware" % NOTE_NAMES[root])
+
+        # every key it plays at that key's pitch, one render call per key like a held note
+        n = int(rate * seconds)
+        out = (ctypes.c_int16 * n)()
+        start = time.perf_counter()
+        for key in range(first, last + 1):
+            lib.sample_voice_start(ctypes.byref(voice), buf, entry, KEY_HZ[key], rate * 2 // 1000)
+            lib.sample_voice_render(ctypes.byref(voice), out, n)
+        ns = (time.perf_counter() - start) * 1e9 / (n * (last - first + 1))
+        total_frames += n * (last - first + 1)
+        total_ns += ns * n * (last - first + 1)
+
+        print("%-6s  %-4s-%-4s %7d %7d  %-5s %5.1f dB  %8.1f   %d cycles" %
+              (NOTE_NAMES[root], NOTE_NAMES[first], NOTE_NAMES[last], frames, (frames + 1) // 2,
+               "%dms" % ((frames - loop_start) * 1000 // rate) if loop_start < frames else "-",
+               snr_db(pcm, decoded) if pcm else float("nan"), ns, CPU_HZ // rate))
+    if total_frames:
+        print("decode + resample: %.1f ns per output sample on this host, %.2f%% of real time at %d Hz" %
+              (total_ns / total_frames, total_ns / total_frames * rate / 1e7, rate))
+    return problems
+
+
+def info(path):
+    with open(path, "rb") as f:
+        image = f.read()
+    rate, size, entries = parse(image)
+    print("%s: %d samples at %d Hz, %d bytes" % (path, len(entries), rate, size))
+    for first, last, _, _, root_mhz, offset, frames, loop_start, _, _ in entries:
+        print("  %.3f Hz  keys %s-%s  %d frames (%.2f s) at %#x%s" %
+              (root_mhz / 1000, NOTE_NAMES[first], NOTE_NAMES[last], frames, frames / rate, offset,
+               ", loop from %d" % loop_start if loop_start < frames else ""))
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("wavs", nargs="*", metavar="KEY=FILE", help="a recording and the key it was made at, e.g. C4=c4.wav")
+    parser.add_argument("-o", "--output", help="pack to write")
+    parser.add_argument("--rate", type=int, default=22050, help="sample rate of the pack and the DAC")
+    parser.add_argument("--seconds", type=float, default=1.5, help="longest sample kept")
+    parser.add_argument("--loop-ms", type=int, default=0, help="sustain loop over the last ms of every sample, 0 = none")
+    parser.add_argument("--fade-ms", type=int, default=20, help="fade out at the end of a sample without a loop")
+    parser.add_argument("--info", metavar="PACK", help="print a pack's table")
+    parser.add_argument("--selftest", type=int, metavar="SAMPLES", help="pack SAMPLES synthetic recordings and check them")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    if args.info:
+        sys.exit(info(args.info))
+
+    if args.selftest:
+        rng = random.Random(args.seed)
+        roots = sorted(rng.sample(range(12), min(args.selftest, MAX_SAMPLES)))
+        samples = {r: synth_recording(r, args.rate, args.seconds, rng) for r in roots}
+    elif args.wavs:
+        samples = {}
+        for spec in args.wavs:
+            name, _, path = spec.partition("=")
+            if name not in NOTE_NAMES or not path:
+                raise SystemExit("%s: expected KEY=FILE with KEY one of %s" % (spec, " ".join(NOTE_NAMES)))
+            samples[NOTE_NAMES.index(name)] = read_wav(path, args.rate)
+    else:
+        parser.error("give KEY=FILE recordings, --info or --selftest")
+
+    image, expected = build(prepare(samples, args.rate, args.seconds, args.loop_ms, args.fade_ms), args.rate)
+    if args.selftest:
+        # the loop state has to come back too
+        image_loop, expected_loop = build(prepare(samples, args.rate, args.seconds, 100, args.fade_ms), args.rate)
+        problems = check(image_loop, expected_loop, args.rate, args.seconds)
+    else:
+        problems = check(image, expected, args.rate, args.seconds)
+
+    if args.output:
+        with open(args.output, "wb") as f:
+            f.write(image)
+        print("wrote %s, flash it to the \"samples\" partition" % args.output)
+    for problem in problems:
+        print("FAIL:", problem)
+    sys.exit(1 if problems else 0)
+
+
+if __name__ == "__main__":
+    main()
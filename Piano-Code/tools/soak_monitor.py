@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+"""Polls the piano's /stats during a long run and suggests stack sizes from the measured peaks.
+
+Reads the JSON from GET /stats (Piano-Code) or from the "stats" console command (both firmwares,
+needs pyserial). Every poll logs free heap, the low-water mark, the largest free block and the
+fragmentation (1 - largest block / free), plus the stack use of every task main.c registered
+with sys_stats_watch_stack(). At the end (or on Ctrl+C) it prints the peaks and the stack size
+each task should get: peak + 25%, at least 512 bytes of headroom, rounded up to 256.
+
+  python3 soak_monitor.py --url http://192.168.1.42/stats --every 60 --hours 24 --csv soak.csv
+  python3 soak_monitor.py --serial /dev/ttyUSB0 --every 300
+
+Play, record and upload while it runs: the peaks are only as good as the load they saw.
+"""
+
+import argparse
+import csv
+import json
+import os
+import time
+import urllib.request
+
+HEADROOM = 0.25
+HEADROOM_MIN = 512
+ROUND = 256
+
+
+def poll_http(url, timeout):
+    with urllib.request.urlopen(url, timeout=timeout) as response:
+        return json.loads(response.read().decode())
+
+
+def poll_serial(port, timeout):
+    import serial  # pyserial, only needed for --serial
+
+    with serial.Serial(port, 115200, timeout=0.5) as tty:
+        tty.reset_input_buffer()
+        tty.write(b"stats\n")
+        end = time.monotonic() + timeout
+        while time.monotonic() < end:
+            line = tty.readline().decode(errors="replace").strip()
+            # other log lines may come in between
+            if line.startswith('{"uptime_ms"'):
+                return json.loads(line)
+    raise TimeoutError("no stats line on %s" % port)
+
+
+def suggest(used):
+    size = used + max(int(used * HEADROOM), HEADROOM_MIN)
+    return (size + ROUND - 1) // ROUND * ROUND
+
+
+def fragmentation(heap):
+    return 1 - heap["largest_block"] / heap["free"] if heap["free"] else 0.0
+
+
+class Soak:
+    def __init__(self):
+        self.started = time.monotonic()
+        self.polls = 0
+        self.failures = 0
+        self.first = None
+        self.last = None
+        self.min_free = None
+        self.min_largest = None
+        self.max_fragmentation = 0.0
+        self.reboots = 0
+        self.stacks = {}  # name -> {"size", "used"}
+
+    def add(self, stats):
+        heap = stats["heap"]
+        if self.last and stats["uptime_ms"] < self.last["uptime_ms"]:
+            self.reboots += 1
+        self.first = self.first or stats
+        self.last = stats
+        self.polls += 1
+        self.min_free = min(heap["min_free"], self.min_free or heap["min_free"])
+        self.min_largest = min(heap["largest_block"], self.min_largest or heap["largest_block"])
+        self.max_fragmentation = max(self.max_fragmentation, fragmentation(heap))
+        for task in stats["tasks"]:
+            if "stack_used_max" not in task:
+                continue
+            peak = self.stacks.setdefault(task["name"], {"size": task["stack_size"], "used": 0})
+            peak["used"] = max(peak["used"], task["stack_used_max"])
+
+    def report(self):
+        if not self.polls:
+            print("no stats received")
+            return
+        hours = (time.monotonic() - self.started) / 3600
+        print("\n%d polls over %.1f h, %d failed, %d reboots seen" % (self.polls, hours, self.failures, self.reboots))
+        print("heap: free %d -> %d bytes, lowest %d, smallest largest block %d, fragmentation max %.0f%%"
+              % (self.first["heap"]["free"], self.last["heap"]["free"], self.min_free, self.min_largest,
+                 self.max_fragmentation * 100))
+        print("%-14s %8s %8s %6s %10s" % ("task", "size", "peak", "used", "suggested"))
+        for name, s in sorted(self.stacks.items()):
+            print("%-14s %8d %8d %5.0f%% %10d" % (name, s["size"], s["used"], s["used"] * 100 / s["size"],
+                                                 suggest(s["used"])))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument("--url", help="e.g. http://192.168.1.42/stats")
+    source.add_argument("--serial", help="console port, e.g. /dev/ttyUSB0 or COM5")
+    parser.add_argument("--every", type=float, default=60, help="seconds between polls")
+    parser.add_argument("--hours", type=float, default=24, help="length of the run, 0 = until Ctrl+C")
+    parser.add_argument("--timeout", type=float, default=5)
+    parser.add_argument("--csv", help="append one row per poll")
+    args = parser.parse_args()
+
+    soak = Soak()
+    end = soak.started + args.hours * 3600
+    try:
+        while not args.hours or time.monotonic() < end:
+            try:
+                stats = poll_http(args.url, args.timeout) if args.url else poll_serial(args.serial, args.timeout)
+            except (OSError, ValueError) as e:
+                # the board rebooting or the WiFi dropping is part of what a soak should show
+                soak.failures += 1
+                print("%s  poll failed: %s" % (time.strftime("%H:%M:%S"), e))
+                time.sleep(args.every)
+                continue
+            soak.add(stats)
+            heap = stats["heap"]
+            watched = [t for t in stats["tasks"] if "stack_used_max" in t]
+            print("%s  up %6.1f h  free %7d  min %7d  largest %7d  frag %3.0f%%  %s"
+                  % (time.strftime("%H:%M:%S"), stats["uptime_ms"] / 3.6e6, heap["free"], heap["min_free"],
+                     heap["largest_block"], fragmentation(heap) * 100,
+                     " ".join("%s=%d" % (t["name"], t["stack_used_max"]) for t in watched)))
+            if args.csv:
+                new = not os.path.exists(args.csv)
+                with open(args.csv, "a", newline="") as f:
+                    out = csv.writer(f)
+                    if new:
+                        out.writerow(["time", "uptime_ms", "free", "min_free", "largest_block", "fragmentation",
+                                      "task", "stack_size", "stack_used_max"])
+                    for t in watched or [{}]:
+                        out.writerow([time.strftime("%Y-%m-%d %H:%M:%S"), stats["uptime_ms"], heap["free"],
+                                      heap["min_free"], heap["largest_block"], "%.3f" % fragmentation(heap),
+                                      t.get("name", ""), t.get("stack_size", ""), t.get("stack_used_max", "")])
+            time.sleep(args.every)
+    except KeyboardInterrupt:
+        pass
+    soak.report()
+
+
+if __name__ == "__main__":
+    main()
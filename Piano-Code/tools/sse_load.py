@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""SSE / HTTP load on the piano's web server, for the key -> tone latency test (PIANO_LATENCY_TEST).
+
+Keeps --clients SSE connections on /sse (the firmware accepts 4) reading every event, and
+--requesters threads sending plain HTTP requests as fast as the board answers them.
+
+  python3 sse_load.py 192.168.1.42 --clients 4 --requesters 4 --duration 120
+"""
+
+import argparse
+import http.client
+import socket
+import threading
+import time
+
+lock = threading.Lock()
+counts = {"events": 0, "heartbeats": 0, "sse_drops": 0, "requests": 0, "request_errors": 0}
+
+
+def count(name, n=1):
+    with lock:
+        counts[name] += n
+
+
+def sse_client(host, port, end):
+    while time.monotonic() < end:
+        try:
+            with socket.create_connection((host, port), timeout=10) as sock:
+                sock.sendall(b"GET /sse HTTP/1.1\r\nHost: %s\r\nAccept: text/event-stream\r\n\r\n" % host.encode())
+                stream = sock.makefile("rb")
+                while time.monotonic() < end:
+                    line = stream.readline()
+                    if not line:
+                        break
+                    if line.startswith(b"data: "):     # note_on, note_off, chord
+                        count("events")
+                    elif line.startswith(b":"):
+                        count("heartbeats")
+        except OSError:
+            pass
+        count("sse_drops")
+        time.sleep(1)
+
+
+def requester(host, port, end):
+    conn = None
+    while time.monotonic() < end:
+        try:
+            if conn is None:
+                conn = http.client.HTTPConnection(host, port, timeout=10)
+            conn.request("GET", "/load-test")  # 404, only the round trip matters
+            conn.getresponse().read()
+            count("requests")
+        except (OSError, http.client.HTTPException):
+            count("request_errors")
+            conn = None
+            time.sleep(0.2)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("host")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--clients", type=int, default=4)
+    parser.add_argument("--requesters", type=int, default=2)
+    parser.add_argument("--duration", type=float, default=60)
+    args = parser.parse_args()
+
+    end = time.monotonic() + args.duration
+    threads = [threading.Thread(target=sse_client, args=(args.host, args.port, end), daemon=True)
+               for _ in range(args.clients)]
+    threads += [threading.Thread(target=requester, args=(args.host, args.port, end), daemon=True)
+                for _ in range(args.requesters)]
+    for t in threads:
+        t.start()
+
+    start = time.monotonic()
+    while time.monotonic() < end:
+        time.sleep(5)
+        with lock:
+            snapshot = dict(counts)
+        elapsed = time.monotonic() - start
+        print("%5.0fs  note events %d (%.1f/s)  heartbeats %d  sse reconnects %d  requests %d (%.1f/s) errors %d"
+              % (elapsed, snapshot["events"], snapshot["events"] / elapsed, snapshot["heartbeats"],
+                 snapshot["sse_drops"], snapshot["requests"], snapshot["requests"] / elapsed,
+                 snapshot["request_errors"]))
+
+
+if __name__ == "__main__":
+    main()
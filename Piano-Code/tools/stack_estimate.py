@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+"""Static worst-case stack use per task from gcc's call graph, and the stack size it needs.
+
+Build once with the stack usage and call graph dumps, then name the task functions:
+
+  idf.py -B build-su build -DCMAKE_C_FLAGS="-fstack-usage -fcallgraph-info=su"
+  python3 stack_estimate.py build-su LCD_task Buttons_task SSE_task Azure_task
+
+For each task it follows the deepest call chain through the .ci files and adds an allowance for
+every call it can't see into: prebuilt newlib (the printf family is the big one) and anything
+given with --allow. It adds the frame FreeRTOS saves on the task stack when the task is
+interrupted, then prints the same suggestion as soak_monitor.py: + 25%, at least 512 bytes,
+rounded up to 256.
+
+Calls through function pointers (httpd handlers, json_scan and cloud_client callbacks) are not
+followed, their callers are listed. A soak only sees the paths that ran and this only sees the
+paths it can follow: use the larger of the two.
+"""
+
+import argparse
+import collections
+import glob
+import os
+import re
+
+from soak_monitor import suggest
+
+# calls into code that isn't in the build's call graph (newlib is prebuilt)
+ALLOWANCES = [
+    (r"^(printf|puts|putchar|fputs|fwrite|fprintf|v?s?n?printf|esp_log_write|esp_log_writev)$", 1536),
+]
+UNKNOWN = 256       # any other call the graph doesn't reach into
+CONTEXT = 512       # interrupt frame + register windows spilled onto the task stack
+
+NODE = re.compile(r'node: \{ title: "([^"]+)" label: "([^"]*)"')
+EDGE = re.compile(r'edge: \{ sourcename: "([^"]+)" targetname: "([^"]+)"')
+BYTES = re.compile(r"\\n(\d+) bytes")
+
+
+class Graph:
+    def __init__(self):
+        self.size = {}                          # "file:function" -> frame bytes
+        self.calls = collections.defaultdict(set)
+        self.by_name = collections.defaultdict(set)
+
+    def load(self, path):
+        with open(path, errors="replace") as f:
+            for line in f:
+                m = NODE.match(line)
+                if m:
+                    b = BYTES.search(m.group(2))
+                    if b:
+                        title = m.group(1)
+                        self.size[title] = max(self.size.get(title, 0), int(b.group(1)))
+                        self.by_name[title.rsplit(":", 1)[-1]].add(title)
+                    continue
+                m = EDGE.match(line)
+                if m:
+                    self.calls[m.group(1)].add(m.group(2))
+
+    def resolve(self, name):
+        if name in self.size:
+            return [name]
+        return sorted(self.by_name.get(name, ())) or [name]
+
+
+class Estimate:
+    def __init__(self, graph, allowances, frame_extra):
+        self.graph = graph
+        self.allowances = allowances
+        self.frame_extra = frame_extra
+        self.memo = {}
+
+    def allowance(self, name):
+        for pattern, size in self.allowances:
+            if pattern.search(name):
+                return size
+        return UNKNOWN
+
+    def worst(self, title, stack=()):
+        """(bytes, chain) of the deepest path from title, allowances included"""
+        g = self.graph
+        if title in stack:
+            return 0, [title.rsplit(":", 1)[-1] + " (recursion, not bounded)"]
+        if title not in g.size:
+            if title == "__indirect_call":
+                return 0, ["(function pointer)"]
+            return self.allowance(title), ["%s [%d]" % (title, self.allowance(title))]
+        if title in self.memo:
+            return self.memo[title]
+        best = (0, [])
+        for callee in g.calls.get(title, ()):
+            for target in g.resolve(callee):
+                found = self.worst(target, stack + (title,))
+                if found[0] > best[0] or not best[1]:
+                    best = found
+        own = g.size[title] + self.frame_extra
+        result = (own + best[0], ["%s(%d)" % (title.rsplit(":", 1)[-1], own)] + best[1])
+        self.memo[title] = result
+        return result
+
+    def indirect(self, title, seen=None):
+        """functions on the task's paths that call through a pointer"""
+        seen = set() if seen is None else seen
+        if title in seen or title not in self.graph.size:
+            return []
+        seen.add(title)
+        found = []
+        for callee in sorted(self.graph.calls.get(title, ())):
+            if callee == "__indirect_call":
+                found.append(title.rsplit(":", 1)[-1])
+            for target in self.graph.resolve(callee):
+                found += self.indirect(target, seen)
+        return found
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("build", help="build directory (or any directory) with the .ci files")
+    parser.add_argument("tasks", nargs="+", help="task functions")
+    parser.add_argument("--allow", action="append", default=[], metavar="REGEX=BYTES",
+                        help="allowance for calls the graph can't follow, e.g. '^esp_tls_=6144'")
+    parser.add_argument("--frame-extra", type=int, default=0,
+                        help="bytes added to every frame, for a graph built by another compiler")
+    args = parser.parse_args()
+
+    graph = Graph()
+    files = glob.glob(os.path.join(args.build, "**", "*.ci"), recursive=True)
+    for path in files:
+        graph.load(path)
+    if not graph.size:
+        parser.error("no .ci files with stack sizes under %s (build with -fcallgraph-info=su)" % args.build)
+
+    allowances = []
+    for item in args.allow:
+        pattern, _, size = item.rpartition("=")
+        allowances.append((re.compile(pattern), int(size)))
+    allowances += [(re.compile(p), s) for p, s in ALLOWANCES]
+    estimate = Estimate(graph, allowances, args.frame_extra)
+
+    print("%-16s %7s %9s  deepest chain" % ("task", "worst", "suggested"))
+    for task in args.tasks:
+        titles = [t for t in graph.resolve(task) if t in graph.size]
+        if not titles:
+            print("%-16s not in the call graph" % task)
+            continue
+        used, chain = max(estimate.worst(t) for t in titles)
+        used += CONTEXT
+        print("%-16s %7d %9d  %s" % (task, used, suggest(used), " > ".join(chain)))
+        pointers = sorted(set(sum((estimate.indirect(t) for t in titles), [])))
+        if pointers:
+            print("%-16s %7s %9s  not followed: function pointers in %s" % ("", "", "", ", ".join(pointers)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+"""Converts a piano trace dump (PIANO_TRACE) to Chrome trace JSON for Perfetto / chrome://tracing.
+
+Input is either the binary dump from GET /trace (Piano-Code) or a console log that contains the
+base64 dump printed by the "trace" command (both firmwares) between "TRACE BEGIN" and "TRACE END".
+
+  curl -o piano.trace http://192.168.1.42/trace
+  python3 trace_to_chrome.py piano.trace -o piano.json --summary
+
+Open piano.json in https://ui.perfetto.dev: one process per core, one track per task, slices for
+the key scan, synth_mutex wait / held, I2C reads, tone changes, SSE sends and HTTPS uploads.
+--summary prints count, average and max duration of every slice per task.
+"""
+
+import argparse
+import base64
+import collections
+import json
+import re
+import struct
+import sys
+
+MAGIC = 0x43525450
+HEADER = struct.Struct("<IHHHHII")   # magic, version, record size, cores, ring size, overhead ns, now us
+RECORD = struct.Struct("<IIIBBH")    # ts us, name, task, type, core, arg
+CORE_NAMES = ["PRO_CPU", "APP_CPU"]
+
+
+def load(path):
+    data = open(path, "rb").read()
+    if len(data) >= 4 and struct.unpack_from("<I", data)[0] == MAGIC:
+        return data
+    # console log: the base64 lines between the markers, other output may be mixed in before/after
+    text = data.decode(errors="replace")
+    m = re.search(r"TRACE BEGIN\s*\n(.*?)\n\s*TRACE END", text, re.S)
+    if not m:
+        sys.exit("%s: neither a binary dump nor a log with TRACE BEGIN/END" % path)
+    lines = [l.strip() for l in m.group(1).splitlines()]
+    return base64.b64decode("".join(l for l in lines if re.fullmatch(r"[A-Za-z0-9+/=]+", l)))
+
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def take(self, fmt):
+        values = fmt.unpack_from(self.data, self.pos)
+        self.pos += fmt.size
+        return values
+
+    def u32(self):
+        return self.take(struct.Struct("<I"))[0]
+
+    def strings(self):
+        table = {}
+        for _ in range(self.u32()):
+            key, length = self.take(struct.Struct("<IB"))
+            table[key] = self.data[self.pos:self.pos + length].decode(errors="replace")
+            self.pos += length
+        return table
+
+
+def parse(data):
+    r = Reader(data)
+    magic, version, record_size, cores, ring_size, overhead_ns, now_us = r.take(HEADER)
+    if magic != MAGIC or version != 1 or record_size != RECORD.size:
+        sys.exit("unsupported dump (magic %08x, version %d, record size %d)" % (magic, version, record_size))
+    records = []
+    for _ in range(cores):
+        for _ in range(r.u32()):
+            records.append(r.take(RECORD))
+    names = r.strings()
+    tasks = r.strings()
+    return {"cores": cores, "ring_size": ring_size, "overhead_ns": overhead_ns, "now_us": now_us,
+            "records": records, "names": names, "tasks": tasks}
+
+
+def convert(dump):
+    now = dump["now_us"]
+    # timestamps are the low 32 bits of esp_timer, taken relative to the dump they unwrap
+    # correctly as long as the rings hold less than 71 minutes
+    timed = sorted((-((now - rec[0]) & 0xFFFFFFFF), i, rec) for i, rec in enumerate(dump["records"]))
+    start = timed[0][0] if timed else 0
+
+    events = []
+    for core in range(dump["cores"]):
+        events.append({"ph": "M", "name": "process_name", "pid": core,
+                       "args": {"name": "%s (core %d)" % (CORE_NAMES[core] if core < 2 else "CPU", core)}})
+    seen_threads = set()
+    open_slices = collections.defaultdict(list)   # (core, task) -> [(name, ts)]
+    slices = collections.defaultdict(list)        # (task name, slice name) -> durations us
+    dropped = 0
+
+    for t, _, (ts, name_addr, task, kind, core, arg) in timed:
+        ts_us = t - start
+        name = dump["names"].get(name_addr, "0x%08x" % name_addr)
+        task_name = dump["tasks"].get(task) or "task 0x%08x" % task
+        if (core, task) not in seen_threads:
+            seen_threads.add((core, task))
+            events.append({"ph": "M", "name": "thread_name", "pid": core, "tid": task, "args": {"name": task_name}})
+
+        key = (core, task)
+        if kind == ord("B"):
+            open_slices[key].append((name, ts_us))
+            events.append({"ph": "B", "name": name, "ts": ts_us, "pid": core, "tid": task})
+        elif kind == ord("E"):
+            # the ring overwrote the begin: drop the end instead of closing an unrelated slice
+            if not open_slices[key] or open_slices[key][-1][0] != name:
+                dropped += 1
+                continue
+            _, begin = open_slices[key].pop()
+            slices[(task_name, name)].append(ts_us - begin)
+            events.append({"ph": "E", "name": name, "ts": ts_us, "pid": core, "tid": task})
+        else:
+            events.append({"ph": "i", "s": "t", "name": name, "ts": ts_us, "pid": core, "tid": task,
+                           "args": {"arg": arg}})
+    return events, slices, dropped
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("dump", help="binary dump or console log")
+    parser.add_argument("-o", "--output", default="piano_trace.json")
+    parser.add_argument("--summary", action="store_true", help="print slice durations per task")
+    args = parser.parse_args()
+
+    dump = parse(load(args.dump))
+    events, slices, dropped = convert(dump)
+    with open(args.output, "w") as f:
+        json.dump({"traceEvents": events, "displayTimeUnit": "ms",
+                   "otherData": {"overhead_ns_per_event": dump["overhead_ns"]}}, f)
+
+    print("%d records (%d per core max), %d ns per trace point, %d unmatched ends dropped -> %s"
+          % (len(dump["records"]), dump["ring_size"], dump["overhead_ns"], dropped, args.output))
+    if args.summary:
+        print("%-20s %-24s %7s %10s %10s" % ("task", "slice", "count", "avg us", "max us"))
+        for (task, name), durations in sorted(slices.items(), key=lambda kv: -max(kv[1])):
+            print("%-20s %-24s %7d %10.1f %10d" % (task, name, len(durations),
+                                                  sum(durations) / len(durations), max(durations)))
+
+
+if __name__ == "__main__":
+    main()
@@ -26,9 +26,15 @@ export class Piano implements OnInit {
   ];
 
   activeNotes: number[] = [];
-  highlightedNote: number | null = null; // next note to press in melody
+  chordName = ''; // from the ESP32's chord table, empty when the held keys aren't a chord
+  highlightedNote: number | null = null; // next note to press in melody, sent by the ESP32
+  wrongNote: number | null = null; // flashed red for a moment
   mode: 'free' | 'melody' = 'free';
+  bpm = 0; // ESP32 metronome tempo, 0 = off
+  beat = -1; // last metronome beat number, the dot flashes on each one
+  beatOn = false;
 
+  // the ESP32 follows the melody (components/melody_guide), same list in the same order
   melodies: Melody[] = [
     { name: 'Twinkle Twinkle', notes: [0, 0, 7, 7, 9, 9, 7] },
     { name: 'Mary Had a Little Lamb', notes: [4, 2, 0, 2, 4, 4, 4] },
@@ -37,13 +43,14 @@ export class Piano implements OnInit {
     { name: 'Jingle Bells', notes: [4, 4, 4, 4, 4, 4, 4, 0, 2, 4, 5, 4] }
   ];
 
-  currentMelody: number[] = [];
-  currentStep: number = 0;
+  private readonly espUrl = 'http://piano.local'; // mDNS, PIANO_HOSTNAME
+  private wrongTimer?: ReturnType<typeof setTimeout>;
+  private beatTimer?: ReturnType<typeof setTimeout>;
 
   constructor(private zone: NgZone) { }
 
   ngOnInit(): void {
-    const evtSource = new EventSource('http://172.17.38.226/sse');
+    const evtSource = new EventSource(`${this.espUrl}/sse`);
 
     evtSource.onopen = () => console.log('SSE connected');
 
@@ -54,6 +61,23 @@ export class Piano implements OnInit {
       this.zone.run(() => {
         if (type === 'note_on') {
           this.handleNote(value);
+        } else if (type === 'note_off') {
+          this.activeNotes = this.activeNotes.filter(n => n !== value);
+        } else if (type === 'chord') {
+          this.chordName = valueStr ?? '';
+        } else if (type === 'melody') {
+          this.mode = value >= 0 ? 'melody' : 'free';
+        } else if (type === 'next') {
+          this.highlightedNote = value >= 0 ? value : null;
+        } else if (type === 'wrong') {
+          this.flashWrong(value);
+        } else if (type === 'tempo') {
+          this.bpm = value;
+        } else if (type === 'beat') {
+          this.flashBeat(value);
+        } else if (type === 'done') {
+          const name = this.melodies[value]?.name ?? 'Melody';
+          setTimeout(() => alert(`${name} completed! Congrats!`), 500);
         }
       });
     };
@@ -63,71 +87,53 @@ export class Piano implements OnInit {
 
   handleNote(noteIndex: number) {
     if (noteIndex === -1) {
-      // eliberezi tasta
+      // eliberezi tasta (older firmware: all keys up)
       this.activeNotes = [];
+      this.chordName = '';
       return;
     }
 
-    this.activeNotes = [noteIndex]; // galben cât ții apăsat
-
-    if (this.mode === 'melody') {
-      const expectedNote = this.currentMelody[this.currentStep];
-      if (noteIndex === expectedNote) {
-        this.currentStep++;
-        this.updateHighlightedNote();
-
-        if (this.currentStep >= this.currentMelody.length) {
-          setTimeout(() => {
-            alert('Melody completed! Congrats!');
-            this.resetMelody();
-          }, 500);
-        }
-      } else {
-        setTimeout(() => {
-          alert('Wrong note! Start again.');
-          this.resetMelody();
-        }, 200);
-      }
+    // galben cât ții apăsat, every held key
+    if (!this.activeNotes.includes(noteIndex)) {
+      this.activeNotes = [...this.activeNotes, noteIndex];
     }
   }
 
-  updateHighlightedNote() {
-    this.highlightedNote = this.currentStep < this.currentMelody.length
-      ? this.currentMelody[this.currentStep]
-      : null;
+  flashWrong(noteIndex: number) {
+    this.wrongNote = noteIndex;
+    clearTimeout(this.wrongTimer);
+    this.wrongTimer = setTimeout(() => this.zone.run(() => this.wrongNote = null), 600);
   }
 
-  resetMelody() {
-    this.activeNotes = [];
-    this.currentStep = 0;
-    if (this.mode === 'melody' && this.currentMelody.length > 0) {
-      this.activeNotes = [];
-      this.updateHighlightedNote();
-    }
-    else {
-      this.highlightedNote = null;
-    }
+  flashBeat(beat: number) {
+    this.beat = beat;
+    this.beatOn = true;
+    clearTimeout(this.beatTimer);
+    this.beatTimer = setTimeout(() => this.zone.run(() => this.beatOn = false), 100);
+  }
+
+  // the ESP32 keeps the clock (hardware timer), the page only follows its beat: events
+  toggleMetronome() {
+    fetch(`${this.espUrl}/metronome?bpm=${this.bpm ? 0 : 100}`)
+      .catch(err => console.error('Metronome request failed', err));
   }
 
-  startMelody(notes: number[]) {
-    this.mode = 'melody';
-    this.currentMelody = notes;
-    this.currentStep = 0;
-    this.activeNotes = [];
-    this.updateHighlightedNote();
+  // the ESP32 loads it and answers on /sse with melody: and next:
+  loadMelody(index: number) {
+    fetch(`${this.espUrl}/melody?index=${index}`)
+      .catch(err => console.error('Melody request failed', err));
   }
 
   selectMelody(event: Event) {
     const select = event.target as HTMLSelectElement;
     const index = select.selectedIndex - 1; // first option is placeholder
     if (index >= 0) {
-      this.startMelody(this.melodies[index].notes);
+      this.loadMelody(index);
     }
   }
 
   switchToFreeMode() {
-    this.mode = 'free';
-    this.resetMelody();
+    this.loadMelody(-1);
     const selectEl = document.querySelector('select') as HTMLSelectElement | null;
     if (selectEl) {
       selectEl.selectedIndex = 0;
@@ -141,4 +147,8 @@ export class Piano implements OnInit {
   isHighlighted(index: number): boolean {
     return this.highlightedNote === index;
   }
+
+  isWrong(index: number): boolean {
+    return this.wrongNote === index;
+  }
 }